@@ -1,4 +1,5 @@
 ﻿#include "auto_focus2.h"
+#include <climits>
 
 auto_focus2::auto_focus2(motion_control* motion_control, const std::vector<interface_camera*>& cameras) :
 	m_motion_control(motion_control), m_cameras(cameras)
@@ -7,6 +8,12 @@ auto_focus2::auto_focus2(motion_control* motion_control, const std::vector<inter
 	work_thread->start();
 }
 
+auto_focus2::~auto_focus2()
+{
+	delete work_thread;			//停止并等待清晰度计算线程退出
+	work_thread = nullptr;
+}
+
 std::vector<st_focus_image> auto_focus2::get_focus_images(const QString& save_dir, int index, int fiber_end_count, bool save_cache)
 {
 	std::vector<st_focus_image> ret_images;
@@ -19,18 +26,10 @@ std::vector<st_focus_image> auto_focus2::get_focus_images(const QString& save_di
 		}
 		camera_ids.emplace_back(m_cameras[i]->m_unique_id);
 	}
-	if (!work_thread->reset_auto_focus(camera_ids, fiber_end_count, save_dir, index, save_cache))
-	{
-		return ret_images;
-	}
-	write_log(l(QString("auto focus start_position_z = %1, end_position_z = %2").arg(m_start_position).arg(m_end_position)).c_str());
+	write_log(l(QString("auto focus start_position_z = %1, end_position_z = %2, search mode = %3")
+		.arg(m_start_position).arg(m_end_position).arg(m_search_mode)).c_str());
+	std::chrono::steady_clock::time_point focus_start = std::chrono::high_resolution_clock::now();
 	std::chrono::steady_clock::time_point start = std::chrono::high_resolution_clock::now();
-	m_motion_control->move_position(0, m_start_position, 5000);
-	std::chrono::steady_clock::time_point end = std::chrono::high_resolution_clock::now();
-	auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-	write_log(l(QString("preparing use time %1  ms").arg(duration_ms.count())).c_str());
-	
-	start = std::chrono::high_resolution_clock::now();
 	//设置硬触发
 	for (int i = 0; i < m_cameras.size(); i++)
 	{
@@ -41,44 +40,38 @@ std::vector<st_focus_image> auto_focus2::get_focus_images(const QString& save_di
 		m_cameras[i]->set_trigger_mode(global_trigger_mode_once);
 		m_cameras[i]->set_trigger_source(global_trigger_source_line1);
 	}
-	m_capture.store(true);
-	end = std::chrono::high_resolution_clock::now();
-	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::chrono::steady_clock::time_point end = std::chrono::high_resolution_clock::now();
+	auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 	write_log(l(QString("set camera use time %1  ms").arg(duration_ms.count())).c_str());
 
-	start = std::chrono::high_resolution_clock::now();
-	m_motion_control->move_position(0, m_end_position, m_move_speed, m_move_step);
-	end = std::chrono::high_resolution_clock::now();
-	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-	write_log(l(QString("move_position use time %1  ms").arg(duration_ms.count())).c_str());
-	start = std::chrono::high_resolution_clock::now();
-	bool is_finish = work_thread->m_finished.load();
-	bool is_calculating_finished = work_thread->m_calculate_finish.load();
-	int task_image_count = work_thread->task_image_count();
-	bool is_detect_fail = work_thread->m_object_detect_fail.load();
-	while (true)
+	bool is_swept(false);
+	QPair<int, int> location_key(m_location_x, m_process_position);
+	if (m_focus_map != nullptr && m_predict_window > 0 && !is_cancelled())
+	{
+		is_swept = predicted_sweep(camera_ids, save_dir, index, fiber_end_count, save_cache);
+	}
+	if (!is_swept && m_search_mode == FOCUS_SEARCH_COARSE_FINE && !is_cancelled())
 	{
-		is_finish = work_thread->m_finished.load();
-		is_calculating_finished = work_thread->m_calculate_finish.load();
-		task_image_count = work_thread->task_image_count();
-		is_detect_fail = work_thread->m_object_detect_fail.load();
-		if (is_calculating_finished && (task_image_count < 1 || is_detect_fail))
+		if (m_reference_claritys.contains(location_key))
 		{
-			break;
+			is_swept = coarse_fine_sweep(camera_ids, save_dir, index, fiber_end_count, save_cache);
 		}
 		else
 		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(2));
-			continue;
+			write_log(l(QString("no full sweep reference at location %1 (%2, %3), run a full sweep first")
+				.arg(index).arg(m_location_x).arg(m_process_position)).c_str());
 		}
 	}
-	end = std::chrono::high_resolution_clock::now();
-	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-	write_log(l(QString("wait for result use time %1  ms").arg(duration_ms.count())).c_str());
-	QString info = QString("parameter status:   is_finish: %1 -- is_calculating_finished: %2 -- task_image_count: %3 -- is_detect_fail: %4")
-		.arg(is_finish).arg(is_calculating_finished).arg(task_image_count).arg(is_detect_fail);
-	write_log(l(info).c_str());
-	m_capture.store(false);
+	//全范围扫描，粗扫描失败时也回退到全范围扫描. 已取消时不再回退
+	if (!is_swept && !is_cancelled() && work_thread->reset_auto_focus(camera_ids, fiber_end_count, save_dir, index, save_cache))
+	{
+		sweep(m_start_position, m_end_position, m_move_speed, m_move_step);
+		if (!work_thread->m_object_detect_fail.load())
+		{
+			m_reference_claritys[location_key] = work_thread->focus_image_claritys();		//全范围扫描的结果作为其他搜索方式的参照
+		}
+	}
+
 	//恢复软触发
 	start = std::chrono::high_resolution_clock::now();
 	for (int i = 0; i < m_cameras.size(); i++)
@@ -93,7 +86,22 @@ std::vector<st_focus_image> auto_focus2::get_focus_images(const QString& save_di
 	end = std::chrono::high_resolution_clock::now();
 	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 	write_log(l(QString("reset camera use time %1  ms").arg(duration_ms.count())).c_str());
-	work_thread->save_images();
+	if (is_cancelled())
+	{
+		write_log(l(QString("auto focus cancelled at location %1").arg(index)).c_str());
+	}
+	else if (!work_thread->m_object_detect_fail.load())
+	{
+		refine_at_peak();
+		update_focus_map(index);
+	}
+	end = std::chrono::high_resolution_clock::now();
+	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - focus_start);
+	write_log(l(QString("auto focus total use time %1  ms").arg(duration_ms.count())).c_str());
+	if (!save_dir.isEmpty())
+	{
+		work_thread->save_images();
+	}
 	if (1)			// 调试功能，打印对焦结果清晰度，同时便于检测队列中影像是否处理完毕
 	{
 		// 每个端面的最清晰值
@@ -116,10 +124,234 @@ std::vector<st_focus_image> auto_focus2::get_focus_images(const QString& save_di
 		//result = title + oss2.str();
 		//write_log(result.c_str());
 	}
-	ret_images = work_thread->focus_images();
+	if (!is_cancelled())
+	{
+		ret_images = work_thread->focus_images();
+	}
 	return ret_images;
 }
 
+void auto_focus2::sweep(int start_position, int end_position, int move_speed, int move_step)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::high_resolution_clock::now();
+	m_motion_control->move_position(0, start_position, 5000);
+	std::chrono::steady_clock::time_point end = std::chrono::high_resolution_clock::now();
+	auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	write_log(l(QString("preparing use time %1  ms").arg(duration_ms.count())).c_str());
+
+	m_capture.store(true);
+	m_sweep_start_position = start_position;
+	m_sweep_step = move_step;
+	start = std::chrono::high_resolution_clock::now();
+	m_motion_control->move_position(0, end_position, move_speed, move_step);
+	end = std::chrono::high_resolution_clock::now();
+	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	write_log(l(QString("move_position %1 --> %2 (speed %3, step %4) use time %5  ms")
+		.arg(start_position).arg(end_position).arg(move_speed).arg(move_step).arg(duration_ms.count())).c_str());
+	start = std::chrono::high_resolution_clock::now();
+	//等待清晰度计算线程给出结果: 队列处理完毕，或者对焦完成/粗定位失败时立即返回，不再轮询
+	int dropped_count(0);
+	work_thread->wait_for_result(-1, dropped_count);
+	bool is_finish = work_thread->m_finished.load();
+	bool is_calculating_finished = work_thread->m_calculate_finish.load();
+	int task_image_count = work_thread->task_image_count();
+	bool is_detect_fail = work_thread->m_object_detect_fail.load();
+	end = std::chrono::high_resolution_clock::now();
+	duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	write_log(l(QString("wait for result use time %1  ms").arg(duration_ms.count())).c_str());
+	//结果确定之后队列中剩余的影像不再处理，节省的时间按单帧平均处理耗时估算
+	write_log(l(QString("result ready with %1 queued frames skipped, saved about %2 ms (%3 ms per frame)")
+		.arg(dropped_count).arg(dropped_count * work_thread->average_process_ms(), 0, 'f', 1)
+		.arg(work_thread->average_process_ms(), 0, 'f', 2)).c_str());
+	QString info = QString("parameter status:   is_finish: %1 -- is_calculating_finished: %2 -- task_image_count: %3 -- is_detect_fail: %4")
+		.arg(is_finish).arg(is_calculating_finished).arg(task_image_count).arg(is_detect_fail);
+	write_log(l(info).c_str());
+	m_capture.store(false);
+}
+
+std::vector<double> auto_focus2::focus_peak_positions() const
+{
+	std::vector<double> positions = work_thread->focus_peak_frame_indexes();
+	for (size_t i = 0; i < positions.size(); i++)
+	{
+		positions[i] = m_sweep_start_position + positions[i] * m_sweep_step;
+	}
+	return positions;
+}
+
+void auto_focus2::refine_at_peak()
+{
+	std::vector<double> positions = focus_peak_positions();
+	if (positions.empty())
+	{
+		return;
+	}
+	std::vector<int> frame_indexes = work_thread->focus_frame_indexes();
+	std::ostringstream oss;
+	for (size_t i = 0; i < positions.size() && i < frame_indexes.size(); i++)
+	{
+		oss << m_sweep_start_position + frame_indexes[i] * m_sweep_step << "->" << positions[i] << " ";
+	}
+	write_log(("focus peak positions (frame -> interpolated) : " + oss.str()).c_str());
+	if (!m_capture_at_peak)
+	{
+		return;
+	}
+	//所有端面共用一个对焦轴，在峰值位置的中位数处单独拍摄一次
+	std::vector<double> sorted_positions = positions;
+	std::sort(sorted_positions.begin(), sorted_positions.end());
+	int peak_position = static_cast<int>(std::lround(sorted_positions[sorted_positions.size() / 2]));
+	std::chrono::steady_clock::time_point start = std::chrono::high_resolution_clock::now();
+	m_motion_control->move_position(0, peak_position, 5000);
+	int refined_count(0);
+	for (size_t i = 0; i < m_cameras.size(); i++)
+	{
+		if (m_cameras[i] == nullptr)
+		{
+			continue;
+		}
+		refined_count += work_thread->refine_focus_images(m_cameras[i]->m_unique_id, m_cameras[i]->trigger_once());
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::high_resolution_clock::now();
+	auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	write_log(l(QString("capture at peak position %1: %2 of %3 focus images improved, use time %4  ms")
+		.arg(peak_position).arg(refined_count).arg(positions.size()).arg(duration_ms.count())).c_str());
+}
+
+bool auto_focus2::predicted_sweep(const std::vector<QString>& camera_ids, const QString& save_dir, int index, int fiber_end_count, bool save_cache)
+{
+	double predicted_z(0.0), spread(0.0);
+	if (!m_focus_map->predict(index, m_location_x, m_process_position, predicted_z, spread))
+	{
+		return false;
+	}
+	//扫描范围不小于设置值，同时覆盖历史峰值位置 3 倍标准差，前后各留出一个触发间隔用于插值
+	int predicted_position = static_cast<int>(std::lround(predicted_z));
+	int window = std::max(m_predict_window, static_cast<int>(std::ceil(3.0 * spread)) + 2 * m_move_step);
+	while (!is_cancelled())
+	{
+		int start_position = std::max(m_start_position, predicted_position - window);
+		int end_position = std::min(m_end_position, predicted_position + window);
+		if (start_position >= end_position)		//预测位置不在当前搜索范围内
+		{
+			return false;
+		}
+		bool is_full_range = start_position == m_start_position && end_position == m_end_position;
+		if (!work_thread->reset_auto_focus(camera_ids, fiber_end_count, save_dir, index, save_cache))
+		{
+			return false;
+		}
+		sweep(start_position, end_position, m_move_speed, m_move_step);
+		//峰值距离扫描范围边缘不足一个触发间隔时(搜索范围的边缘除外)，说明真正的峰值可能在范围之外
+		bool is_peak_found = !work_thread->m_object_detect_fail.load();
+		std::vector<double> peak_positions = focus_peak_positions();
+		is_peak_found = is_peak_found && !peak_positions.empty();
+		for (size_t i = 0; is_peak_found && i < peak_positions.size(); i++)
+		{
+			if ((start_position > m_start_position && peak_positions[i] < start_position + m_move_step) ||
+				(end_position < m_end_position && peak_positions[i] > end_position - m_move_step))
+			{
+				is_peak_found = false;
+			}
+		}
+		double range_ratio = m_end_position > m_start_position ?
+			static_cast<double>(end_position - start_position) / (m_end_position - m_start_position) : 1.0;
+		write_log(l(QString("predicted focus: location %1, predicted %2 (stddev %3), range %4 - %5 (%6% of full range), peak %7")
+			.arg(index).arg(predicted_z, 0, 'f', 1).arg(spread, 0, 'f', 1).arg(start_position).arg(end_position)
+			.arg(range_ratio * 100.0, 0, 'f', 1).arg(is_peak_found ? "found" : "not found")).c_str());
+		if (is_peak_found || is_full_range)
+		{
+			//扩大到全范围之后不再回退到其他搜索方式，避免重复扫描
+			return true;
+		}
+		m_focus_map->record_miss(index);
+		window *= 2;
+	}
+	return false;
+}
+
+void auto_focus2::update_focus_map(int index)
+{
+	if (m_focus_map == nullptr)
+	{
+		return;
+	}
+	std::vector<double> positions = focus_peak_positions();
+	if (positions.empty())
+	{
+		return;
+	}
+	//所有端面共用一个对焦轴，记录峰值位置的中位数
+	std::sort(positions.begin(), positions.end());
+	m_focus_map->update(index, m_location_x, m_process_position, positions[positions.size() / 2]);
+}
+
+bool auto_focus2::coarse_fine_sweep(const std::vector<QString>& camera_ids, const QString& save_dir, int index, int fiber_end_count, bool save_cache)
+{
+	/****************1.粗扫描: 以 m_coarse_factor 倍的速度和触发间隔扫描整个范围，得到每个端面清晰度最大的帧**********************/
+	int coarse_speed = m_move_speed * m_coarse_factor;
+	int coarse_step = m_move_step * m_coarse_factor;
+	if (!work_thread->reset_auto_focus(camera_ids, fiber_end_count, save_dir, index, false))
+	{
+		return false;
+	}
+	sweep(m_start_position, m_end_position, coarse_speed, coarse_step);
+	std::vector<double> peak_positions = focus_peak_positions();		//粗扫描间隔较大，使用插值得到的峰值位置
+	std::vector<double> coarse_claritys = work_thread->focus_image_claritys();
+	if (work_thread->m_object_detect_fail.load() || peak_positions.empty())
+	{
+		write_log("coarse focus sweep failed, fall back to full sweep");
+		return false;
+	}
+	if (is_cancelled())
+	{
+		return false;
+	}
+	//触发间隔固定，第 k 帧对应的位置为 start + k * step
+	int peak_min(INT_MAX), peak_max(INT_MIN);
+	for (size_t i = 0; i < peak_positions.size(); i++)
+	{
+		int peak_position = static_cast<int>(std::lround(peak_positions[i]));
+		peak_min = std::min(peak_min, peak_position);
+		peak_max = std::max(peak_max, peak_position);
+	}
+	/****************2.精扫描: 在所有端面峰值附近(前后各 m_fine_margin 个粗扫描间隔)以原始参数扫描**********************/
+	int fine_start = std::max(m_start_position, peak_min - m_fine_margin * coarse_step);
+	int fine_end = std::min(m_end_position, peak_max + m_fine_margin * coarse_step);
+	if (!work_thread->reset_auto_focus(camera_ids, fiber_end_count, save_dir, index, save_cache))
+	{
+		return false;
+	}
+	sweep(fine_start, fine_end, m_move_speed, m_move_step);
+	if (work_thread->m_object_detect_fail.load())
+	{
+		return false;
+	}
+	double range_ratio = m_end_position > m_start_position ? 
+		static_cast<double>(fine_end - fine_start) / (m_end_position - m_start_position) : 1.0;
+	write_log(l(QString("coarse-fine focus: peak range %1 - %2, fine range %3 - %4 (%5% of full range)")
+		.arg(peak_min).arg(peak_max).arg(fine_start).arg(fine_end).arg(range_ratio * 100.0, 0, 'f', 1)).c_str());
+	//与同一拍照位置最近一次全范围扫描的清晰度比较，用于验证搜索结果
+	std::vector<double> reference_claritys = m_reference_claritys.value(QPair<int, int>(m_location_x, m_process_position));
+	std::vector<double> fine_claritys = work_thread->focus_image_claritys();
+	std::ostringstream oss;
+	for (size_t i = 0; i < fine_claritys.size(); i++)
+	{
+		oss << fine_claritys[i];
+		if (i < coarse_claritys.size())
+		{
+			oss << " (coarse " << coarse_claritys[i];
+			if (i < reference_claritys.size() && reference_claritys[i] > 0.0)
+			{
+				oss << ", full sweep " << reference_claritys[i] << ", " << 100.0 * fine_claritys[i] / reference_claritys[i] << "%";
+			}
+			oss << ") ";
+		}
+	}
+	write_log(("coarse-fine claritys : " + oss.str()).c_str());
+	return true;
+}
+
 void auto_focus2::clarity_calibration()
 {
 	//设置硬触发
@@ -157,10 +389,8 @@ void auto_focus2::clarity_calibration()
 		m_motion_control->move_position(0, m_start_position, 5000);
 		m_capture.store(true);
 		m_motion_control->move_position(0, m_end_position, m_move_speed, m_move_step);
-		while (work_thread->task_image_count() > 0)
-		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(2));
-		}
+		int dropped_count(0);
+		work_thread->wait_for_result(-1, dropped_count);
 		m_capture.store(false);
 		//根据产品类型决定设置的参数
 		//验证结果
@@ -185,10 +415,8 @@ void auto_focus2::clarity_calibration()
 		m_motion_control->move_position(0, m_start_position, 5000);
 		m_capture.store(true);
 		m_motion_control->move_position(0, m_end_position, m_move_speed, m_move_step);
-		while (work_thread->task_image_count() > 0)
-		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(2));
-		}
+		int dropped_count(0);
+		work_thread->wait_for_result(-1, dropped_count);
 		m_capture.store(false);
 		//得到最大清晰度最小值，取其一半作为清晰度差值阈值
 		double clarity_diff_thresh(DBL_MAX);
@@ -249,10 +477,8 @@ void auto_focus2::get_pixel_adjustment(int fiber_end_count, int position, int se
 	m_capture.store(true);
 	m_motion_control->move_position(0, end_position, move_speed, move_step);
 	//write_log(l(QString("end_position = %1,move_speed = %2").arg(end_position).arg(move_speed)).c_str());
-	while (work_thread->task_image_count() > 0)
-	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(2));
-	}
+	int dropped_count(0);
+	work_thread->wait_for_result(-1, dropped_count);
 	m_capture.store(false);
 	precision_position = start_position + move_step * work_thread->max_clarity_frame_index();
 	//得到最清晰影像，进行粗定位并计算x-y方向偏移
@@ -346,6 +572,7 @@ void auto_focus2::set_motion_parameters(int search_distance, int move_speed, int
 
 void auto_focus2::set_process_position(int position)
 {
+	m_process_position = position;
 	m_start_position = position - m_search_distance;
 	m_end_position = position + m_search_distance;
 }
@@ -6,21 +6,35 @@
  * (3) 将每一张影像 frame 加入任务队列 task_queue,子线程从中获取数据，并使用 openmp 并行计算每张影像各个子区域的清晰度
  * (4) 每个目标对应一个局部区域.得到清晰度最大的局部影像作为每个目标的对焦结果，各个局部影像单独处理(不考虑约束)，或者依次处理(考虑约束) 
  * (5) 对于某个局部区域，如果其清晰度连续若干次下降(例如3或5)，或者遍历到列表末尾，表示已经找到最清晰的影像
+ * (6) 可选粗扫描+精扫描(FOCUS_SEARCH_COARSE_FINE): 先快速扫描定位峰值，只在峰值附近慢速扫描，减少对焦时间
+ * (7) 根据清晰度曲线插值得到亚触发间隔的峰值位置，可选在该位置单独拍摄一次，允许以更大的触发间隔扫描
+ * (8) 可选对焦位置表(focus_map): 同一拍照位置只在历史峰值附近的小范围内扫描，峰值落在范围边缘时逐步扩大范围
  *********************************************************/
 #pragma once
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <QPair>
 
 #include "thread_calc_image_clarity.h"
+#include "focus_map.h"
 #include "../device_camera/interface_camera.h"
 #include "../motion_control/motion_control.h"
 #include "../basic_algorithm/object_detector.h"
 
+//自动对焦搜索方式
+enum focus_search_mode
+{
+	FOCUS_SEARCH_SWEEP = 0,			//以对焦参数慢速扫描整个范围(默认)
+	FOCUS_SEARCH_COARSE_FINE = 1,	//先快速粗扫描整个范围定位峰值，再在峰值附近的小范围内以对焦参数精扫描
+};
+
 class AUTO_FOCUS_EXPORT auto_focus2: public QObject
 {
 	Q_OBJECT
 public:
-	//执行自动对焦,需要设置起始位置和忽略标记，某些端面可能无效，并不需要检测
+	//执行自动对焦,需要设置起始位置和忽略标记，某些端面可能无效，并不需要检测. save_dir 为空时不保存大图
 	std::vector<st_focus_image> get_focus_images(const QString& save_dir, int index, int fiber_end_count, bool save_cache = false);
 	//执行位置调整，使端面居中，获取使端面居中时需要偏移的像素
 	void get_pixel_adjustment(int fiber_end_count, int position, int search_range, int move_speed, int move_step, 
@@ -34,6 +48,7 @@ public:
 	int max_position() const { return work_thread->max_position(); }
 	int object_offset() const { return m_object_offset; }
 	auto_focus2(motion_control* motion_control = nullptr, const std::vector<interface_camera*>& cameras = std::vector<interface_camera*>());
+	~auto_focus2();
 
 	void set_motion_control(motion_control* motion_control) { m_motion_control = motion_control; }
 
@@ -42,6 +57,41 @@ public:
 	void set_motion_parameters(int search_distance,int move_speed, int move_step);			//设置对焦参数，搜索距离，移动速度，和帧率
 
 	void set_process_position(int position);
+	//设置拍照位置，y 为对焦轴的标称位置(等同于 set_process_position)，x 用于判断对焦位置表中的记录是否有效
+	void set_photo_location(int x, int y)
+	{
+		m_location_x = x;
+		set_process_position(y);
+	}
+
+	/***************************************
+	 * 设置对焦位置表(不负责资源管理)，nullptr 表示不使用
+	 * predict_window -- 预测位置前后的最小扫描范围，实际范围不小于历史峰值位置标准差的 3 倍. 为 0 时只记录不预测
+	 ***************************************/
+	void set_focus_map(focus_map* map, int predict_window)
+	{
+		m_focus_map = map;
+		m_predict_window = std::max(0, predict_window);
+	}
+
+	/***************************************
+	 * 设置搜索方式. coarse_factor -- 粗扫描的速度和触发间隔相对于对焦参数的倍数; fine_margin -- 精扫描在峰值前后各外扩的粗扫描间隔数
+	 * 粗扫描+精扫描时，拍照位置第一次对焦仍然全范围扫描，作为之后验证清晰度的参照
+	 ***************************************/
+	void set_search_mode(focus_search_mode mode, int coarse_factor = 4, int fine_margin = 2)
+	{
+		m_search_mode = mode;
+		m_coarse_factor = std::max(2, coarse_factor);
+		m_fine_margin = std::max(1, fine_margin);
+	}
+	focus_search_mode search_mode() const { return m_search_mode; }
+	//对焦结束之后是否在插值得到的峰值位置单独拍摄一次，清晰度更高时替换对焦结果
+	void set_capture_at_peak(bool capture_at_peak) { m_capture_at_peak = capture_at_peak; }
+	//取消标识(不负责资源管理)，在每次扫描之前检查，置为 true 之后不再开始新的扫描，已完成的扫描结果不写入对焦位置表
+	void set_cancel_flag(const std::atomic<bool>* cancel_flag) { m_cancel_flag = cancel_flag; }
+	bool is_cancelled() const { return m_cancel_flag != nullptr && m_cancel_flag->load(); }
+	//最近一次对焦每个端面的峰值位置(Z 轴)，由清晰度曲线插值得到，精度高于触发间隔
+	std::vector<double> focus_peak_positions() const;
 
 	double clarity_diff_thresh() { return work_thread->clarity_diff_thresh(); }
 	void set_clarity_diff_thresh(double clarity_diff_thresh) { work_thread->set_clarity_diff_thresh(clarity_diff_thresh); }
@@ -65,4 +115,29 @@ private:
 	int m_search_distance{ 330 };
 	int m_move_speed{ 300 };
 	int m_move_step{ 5 };
+
+	// 搜索方式
+	focus_search_mode m_search_mode{ FOCUS_SEARCH_SWEEP };
+	int m_coarse_factor{ 4 };
+	int m_fine_margin{ 2 };
+	QMap<QPair<int, int>, std::vector<double>> m_reference_claritys;	//每个拍照位置(x, y)最近一次全范围扫描得到的每个端面最大清晰度，用于验证其他搜索方式的结果
+	bool m_capture_at_peak{ false };
+	int m_sweep_start_position{ 0 };					//最近一次扫描的起始位置和触发间隔，用于将帧序号换算为位置
+	int m_sweep_step{ 1 };
+	focus_map* m_focus_map{ nullptr };					//对焦位置表，不负责资源管理
+	int m_predict_window{ 0 };
+	int m_location_x{ 0 };								//当前拍照位置，m_process_position 为对焦轴的标称位置
+	int m_process_position{ 0 };
+	const std::atomic<bool>* m_cancel_flag{ nullptr };
+
+	//从 start_position 扫描到 end_position，等待清晰度计算完成. 调用之前需要重置清晰度计算线程并设置硬触发
+	void sweep(int start_position, int end_position, int move_speed, int move_step);
+	//粗扫描+精扫描，失败时返回 false，由调用者回退到全范围扫描
+	bool coarse_fine_sweep(const std::vector<QString>& camera_ids, const QString& save_dir, int index, int fiber_end_count, bool save_cache);
+	//在对焦位置表预测的位置附近扫描，峰值落在范围边缘时加倍范围重新扫描. 没有记录或者扩大到全范围仍失败时返回 false
+	bool predicted_sweep(const std::vector<QString>& camera_ids, const QString& save_dir, int index, int fiber_end_count, bool save_cache);
+	//将本次对焦的峰值位置(所有端面的中位数)记录到对焦位置表
+	void update_focus_map(int index);
+	//记录插值得到的峰值位置，需要时在峰值位置拍摄一次. 在恢复软触发之后调用
+	void refine_at_peak();
 };
@@ -0,0 +1,220 @@
+﻿#include "focus_map.h"
+#include <QFile>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <algorithm>
+
+#include "../common/common.h"
+
+void st_focus_map_entry::add_sample(double z)
+{
+	//偏差相对于更新之前的均值(即本次对焦使用的预测位置)计算
+	if (m_count > 0)
+	{
+		m_max_drift = std::max(m_max_drift, std::abs(z - m_mean_z));
+	}
+	m_best_z = z;
+	m_count++;
+	double delta = z - m_mean_z;
+	m_mean_z += delta / m_count;
+	m_m2 += delta * (z - m_mean_z);
+}
+
+QJsonObject st_focus_map_entry::to_json() const
+{
+	QJsonObject obj;
+	obj["x"] = m_x;
+	obj["y"] = m_y;
+	obj["best_z"] = m_best_z;
+	obj["mean_z"] = m_mean_z;
+	obj["m2"] = m_m2;
+	obj["count"] = m_count;
+	obj["stddev"] = stddev();
+	obj["max_drift"] = m_max_drift;
+	obj["miss_count"] = m_miss_count;
+	return obj;
+}
+
+st_focus_map_entry st_focus_map_entry::from_json(const QJsonObject& obj)
+{
+	st_focus_map_entry entry;
+	entry.m_x = obj["x"].toInt();
+	entry.m_y = obj["y"].toInt();
+	entry.m_best_z = obj["best_z"].toDouble();
+	entry.m_mean_z = obj["mean_z"].toDouble(entry.m_best_z);
+	entry.m_m2 = obj["m2"].toDouble();
+	entry.m_count = obj["count"].toInt();
+	entry.m_max_drift = obj["max_drift"].toDouble();
+	entry.m_miss_count = obj["miss_count"].toInt();
+	return entry;
+}
+
+bool focus_map::load_from_file(const QString& file_path)
+{
+	QMutexLocker locker(&m_mutex);
+	m_file_path = file_path;
+	m_maps.clear();
+	m_dirty = false;
+	QFile file(file_path);
+	if (!file.exists())
+	{
+		return true;			//首次运行没有记录
+	}
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		write_log(l(QString("Failed to open focus map file: %1").arg(file_path)).c_str());
+		return false;
+	}
+	QJsonParseError error;
+	QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &error);
+	if (error.error != QJsonParseError::NoError || !doc.isObject())
+	{
+		write_log(l(QString("Failed to parse focus map file: %1 (%2)").arg(file_path).arg(error.errorString())).c_str());
+		return false;
+	}
+	QJsonObject root = doc.object();
+	m_recipe = root["recipe"].toString("default");
+	QJsonObject recipes = root["recipes"].toObject();
+	for (auto iter = recipes.begin(); iter != recipes.end(); ++iter)
+	{
+		QMap<int, st_focus_map_entry>& entries = m_maps[iter.key()];
+		QJsonArray locations = iter.value().toArray();
+		for (int i = 0; i < locations.size(); i++)
+		{
+			QJsonObject obj = locations[i].toObject();
+			entries[obj["index"].toInt()] = st_focus_map_entry::from_json(obj);
+		}
+	}
+	return true;
+}
+
+bool focus_map::save_to_file()
+{
+	QMutexLocker locker(&m_mutex);
+	if (!m_dirty || m_file_path.isEmpty())
+	{
+		return true;
+	}
+	QJsonObject recipes;
+	for (auto iter = m_maps.begin(); iter != m_maps.end(); ++iter)
+	{
+		QJsonArray locations;
+		for (auto entry = iter.value().begin(); entry != iter.value().end(); ++entry)
+		{
+			QJsonObject obj = entry.value().to_json();
+			obj["index"] = entry.key();
+			locations.append(obj);
+		}
+		recipes[iter.key()] = locations;
+	}
+	QJsonObject root;
+	root["recipe"] = m_recipe;
+	root["recipes"] = recipes;
+	QSaveFile file(m_file_path);
+	if (!file.open(QIODevice::WriteOnly))
+	{
+		write_log(l(QString("Failed to save focus map file: %1").arg(m_file_path)).c_str());
+		return false;
+	}
+	file.write(QJsonDocument(root).toJson(QJsonDocument::Indented));
+	if (!file.commit())
+	{
+		write_log(l(QString("Failed to save focus map file: %1").arg(m_file_path)).c_str());
+		return false;
+	}
+	m_dirty = false;
+	return true;
+}
+
+void focus_map::set_recipe(const QString& recipe)
+{
+	QMutexLocker locker(&m_mutex);
+	QString name = recipe.isEmpty() ? QString("default") : recipe;
+	if (m_recipe != name)
+	{
+		m_recipe = name;
+		m_dirty = true;
+	}
+}
+
+QString focus_map::recipe() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_recipe;
+}
+
+bool focus_map::predict(int index, int x, int y, double& predicted_z, double& spread) const
+{
+	QMutexLocker locker(&m_mutex);
+	auto recipe_iter = m_maps.find(m_recipe);
+	if (recipe_iter == m_maps.end())
+	{
+		return false;
+	}
+	auto iter = recipe_iter.value().find(index);
+	if (iter == recipe_iter.value().end() || iter.value().m_count < 1 || iter.value().m_x != x || iter.value().m_y != y)
+	{
+		return false;
+	}
+	predicted_z = iter.value().m_mean_z;
+	spread = iter.value().stddev();
+	return true;
+}
+
+void focus_map::update(int index, int x, int y, double z)
+{
+	QMutexLocker locker(&m_mutex);
+	st_focus_map_entry& entry = m_maps[m_recipe][index];
+	if (entry.m_x != x || entry.m_y != y)
+	{
+		//拍照位置已修改，重新统计
+		entry = st_focus_map_entry();
+		entry.m_x = x;
+		entry.m_y = y;
+	}
+	entry.add_sample(z);
+	m_dirty = true;
+}
+
+void focus_map::record_miss(int index)
+{
+	QMutexLocker locker(&m_mutex);
+	auto recipe_iter = m_maps.find(m_recipe);
+	if (recipe_iter == m_maps.end() || !recipe_iter.value().contains(index))
+	{
+		return;
+	}
+	recipe_iter.value()[index].m_miss_count++;
+	m_dirty = true;
+}
+
+void focus_map::clear(const QString& recipe)
+{
+	QMutexLocker locker(&m_mutex);
+	if (m_maps.remove(recipe.isEmpty() ? m_recipe : recipe) > 0)
+	{
+		m_dirty = true;
+	}
+}
+
+QJsonObject focus_map::to_json(const QString& recipe) const
+{
+	QMutexLocker locker(&m_mutex);
+	QString name = recipe.isEmpty() ? m_recipe : recipe;
+	QJsonArray locations;
+	auto recipe_iter = m_maps.find(name);
+	if (recipe_iter != m_maps.end())
+	{
+		for (auto entry = recipe_iter.value().begin(); entry != recipe_iter.value().end(); ++entry)
+		{
+			QJsonObject obj = entry.value().to_json();
+			obj["index"] = entry.key();
+			locations.append(obj);
+		}
+	}
+	QJsonObject root;
+	root["recipe"] = name;
+	root["locations"] = locations;
+	return root;
+}
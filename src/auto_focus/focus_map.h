@@ -0,0 +1,63 @@
+﻿/*********************************************************
+ * 对焦位置表
+ * 同一夹具(配方)上同一拍照位置的最佳对焦位置在不同工件之间变化很小，记录每个拍照位置历次对焦的峰值位置(Z 轴)
+ * 之后对焦时只在预测位置附近的小范围内扫描，未找到峰值时再逐步扩大范围(见 auto_focus2)
+ * (1) 按配方区分，配方名称由服务端指定(用户配置文件名)，每个配方下按拍照位置序号记录
+ * (2) 记录拍照位置坐标，坐标变化之后原记录失效
+ * (3) 使用 Welford 算法在线统计均值和标准差，记录最大漂移量和预测失败次数，用于评估夹具稳定性
+ * (4) 以 JSON 文件保存，写入临时文件之后替换，避免中途断电损坏原文件
+ *********************************************************/
+#pragma once
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QJsonObject>
+#include <cmath>
+
+#include "auto_focus_global.h"
+
+//单个拍照位置的对焦统计
+struct st_focus_map_entry
+{
+	int m_x{ 0 };					//记录时的拍照位置，位置变化之后该记录失效
+	int m_y{ 0 };
+	double m_best_z{ 0.0 };			//最近一次对焦的峰值位置
+	double m_mean_z{ 0.0 };			//历次峰值位置的均值，作为预测位置
+	double m_m2{ 0.0 };				//Welford 算法的二阶中心矩累计值
+	int m_count{ 0 };				//对焦次数
+	double m_max_drift{ 0.0 };		//峰值位置相对于预测位置的最大偏差
+	int m_miss_count{ 0 };			//预测范围内未找到峰值、需要扩大范围的次数
+
+	void add_sample(double z);
+	double stddev() const { return m_count > 1 ? std::sqrt(m_m2 / (m_count - 1)) : 0.0; }
+	QJsonObject to_json() const;
+	static st_focus_map_entry from_json(const QJsonObject& obj);
+};
+
+class AUTO_FOCUS_EXPORT focus_map
+{
+public:
+	bool load_from_file(const QString& file_path);
+	bool save_to_file();							//只在数据变化之后写入文件
+
+	void set_recipe(const QString& recipe);			//切换配方，空字符串使用 "default"
+	QString recipe() const;
+
+	/***************************************
+	 * 预测拍照位置的对焦位置
+	 * int index -- 拍照位置序号; int x, int y -- 拍照位置坐标，与记录不一致时预测失败
+	 * double& predicted_z -- 预测的峰值位置; double& spread -- 历次峰值位置的标准差，用于确定扫描范围
+	 ***************************************/
+	bool predict(int index, int x, int y, double& predicted_z, double& spread) const;
+	void update(int index, int x, int y, double z);		//记录一次对焦结果
+	void record_miss(int index);						//预测范围内未找到峰值
+	void clear(const QString& recipe = QString());		//清除指定配方的记录，空字符串表示当前配方
+
+	QJsonObject to_json(const QString& recipe = QString()) const;		//指定配方的统计信息，发送给前端查看
+private:
+	mutable QMutex m_mutex;							//对焦在运行线程中更新，查询和清除由命令触发
+	QString m_file_path{ "" };
+	QString m_recipe{ "default" };
+	QMap<QString, QMap<int, st_focus_map_entry>> m_maps;		//配方 --> 拍照位置序号 --> 对焦统计
+	bool m_dirty{ false };
+};
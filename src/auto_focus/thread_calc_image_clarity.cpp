@@ -4,6 +4,7 @@
 #include <QDir>
 #include <QDateTime>
 #include <QCoreApplication>
+#include <cmath>
 
 #include "../common/common.h"
 
@@ -52,6 +53,39 @@ void thread_calc_image_clarity::stop()
         m_running = false;
     }
     m_wait_condition.notify_all();
+    m_result_condition.notify_all();
+}
+
+bool thread_calc_image_clarity::is_result_ready() const
+{
+    if (m_task_type == TASK_AUTO_FOCUS)
+    {
+        return m_finished.load() || m_object_detect_fail.load();
+    }
+    if (m_task_type == TASK_CALCULATE_IMAGE_CLARITY || m_task_type == TASK_CLARITY_CALIBRATION)
+    {
+        return m_processed_max_frame_count.load();
+    }
+    return false;       //位置调整需要处理所有影像
+}
+
+bool thread_calc_image_clarity::wait_for_result(int timeout_ms, int& dropped_count)
+{
+    dropped_count = 0;
+    std::unique_lock<std::mutex> locker(m_mutex);
+    //正在处理的一帧必须处理完毕，之后才能读取结果
+    auto predicate = [this]() { return !m_running || (m_calculate_finish.load() && (m_task_images.empty() || is_result_ready())); };
+    if (timeout_ms < 0)
+    {
+        m_result_condition.wait(locker, predicate);
+    }
+    else if (!m_result_condition.wait_for(locker, std::chrono::milliseconds(timeout_ms), predicate))
+    {
+        return false;
+    }
+    dropped_count = static_cast<int>(m_task_images.size());
+    while (!m_task_images.empty()) m_task_images.pop();
+    return m_running;
 }
 
 void thread_calc_image_clarity::run()
@@ -78,7 +112,16 @@ void thread_calc_image_clarity::run()
                 continue;
             }
         }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
         process_task(task_image);
+        double process_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        double average_ms = m_average_process_ms.load();
+        m_average_process_ms.store(average_ms <= 0.0 ? process_ms : average_ms * 0.9 + process_ms * 0.1);
+        {
+            //加锁之后再通知，保证 wait_for_result 不会错过本次通知
+            std::lock_guard<std::mutex> locker(m_mutex);
+        }
+        m_result_condition.notify_all();
     }
 }
 
@@ -168,7 +211,7 @@ void thread_calc_image_clarity::process_calc_image_clarity_task(const st_task_im
             return;
         }
     }
-    cv::Mat image = convert_qimage_to_cvmat(image_data.m_image, 1);
+    cv::Mat image = qimage_to_gray_cvmat(image_data.m_image);      //灰度影像直接包装，不拷贝
     cv::Mat image_ovr;
     cv::resize(image, image_ovr, cv::Size(), m_frame_scale_size, m_frame_scale_size, cv::INTER_AREA);
     double clarity = calc_image_clarity_multiscale(image_ovr);
@@ -238,7 +281,7 @@ void thread_calc_image_clarity::process_clarity_calibration_task(const st_task_i
             return;
         }
     }
-    cv::Mat image = convert_qimage_to_cvmat(image_data.m_image, 1);
+    cv::Mat image = qimage_to_gray_cvmat(image_data.m_image);      //灰度影像直接包装，不拷贝
     cv::Mat image_ovr;
     cv::resize(image, image_ovr, cv::Size(), m_frame_scale_size, m_frame_scale_size, cv::INTER_AREA);
     double clarity = calc_image_clarity_multiscale(image_ovr);
@@ -342,7 +385,7 @@ void thread_calc_image_clarity::process_auto_focus_task(const st_task_image_data
         QString dir = current_directory + L("/Temp");
         make_path(dir);
         static std::vector<int> image_indexs(m_camera_ids.size(), 0);
-        cv::Mat image0 = convert_qimage_to_cvmat(image_data.m_image, 1);
+        cv::Mat image0 = qimage_to_gray_cvmat(image_data.m_image);
         int pos = get_camera_index(image_data.m_camera_id);
         if (pos != -1)
         {
@@ -352,6 +395,7 @@ void thread_calc_image_clarity::process_auto_focus_task(const st_task_image_data
         }
     }
 
+    int frame_index = m_calc_frame_count[image_data.m_camera_id]++;       //硬触发间隔固定，帧序号对应对焦位置
     cv::Mat image = convert_qimage_to_cvmat(image_data.m_image, 1);
     cv::Rect rect;
     rect.x = image.cols * 0.375;
@@ -455,6 +499,8 @@ void thread_calc_image_clarity::process_auto_focus_task(const st_task_image_data
         m_focus_images.assign(m_total_fiber_end_count, st_focus_image());
         m_finished_flags.assign(m_total_fiber_end_count, false);
         m_focus_image_claritys.assign(m_total_fiber_end_count, 0.0);
+        m_focus_frame_indexes.assign(m_total_fiber_end_count, 0);
+        m_clarity_curves.assign(m_total_fiber_end_count, std::vector<st_clarity_sample>());
         m_attenuation_times.assign(m_total_fiber_end_count, 0);
         m_cache_images.initialize(m_total_fiber_end_count, 15);
     }
@@ -495,9 +541,11 @@ void thread_calc_image_clarity::process_auto_focus_task(const st_task_image_data
         }
         st_focus_image focus_image = generate_focus_image_from_detect_box(image, fiber_ends[i]);
         double value = clarity_values[i];
+        m_clarity_curves[start_index + i].emplace_back(frame_index, value);
         if (value > m_focus_image_claritys[start_index + i])
         {
             m_focus_image_claritys[start_index + i] = value;
+            m_focus_frame_indexes[start_index + i] = frame_index;
             m_attenuation_times[start_index + i] = 0;
             m_focus_images[start_index + i] = focus_image;
             m_cache_images.add_cache_image(start_index + i, focus_image.m_focus_image, false);
@@ -581,6 +629,104 @@ bool thread_calc_image_clarity::all_finished()
     return true;
 }
 
+std::vector<double> thread_calc_image_clarity::focus_peak_frame_indexes() const
+{
+    std::vector<double> peak_indexes(m_focus_frame_indexes.begin(), m_focus_frame_indexes.end());
+    for (size_t i = 0; i < m_clarity_curves.size() && i < peak_indexes.size(); i++)
+    {
+        if (m_clarity_curves[i].size() >= 3)
+        {
+            peak_indexes[i] = interpolate_peak(m_clarity_curves[i]);
+        }
+    }
+    return peak_indexes;
+}
+
+double thread_calc_image_clarity::interpolate_peak(const std::vector<st_clarity_sample>& samples)
+{
+    if (samples.empty())
+    {
+        return 0.0;
+    }
+    size_t max_pos(0);
+    for (size_t i = 1; i < samples.size(); i++)
+    {
+        if (samples[i].m_clarity > samples[max_pos].m_clarity)
+        {
+            max_pos = i;
+        }
+    }
+    //峰值在曲线两端时不插值
+    if (max_pos == 0 || max_pos + 1 >= samples.size())
+    {
+        return samples[max_pos].m_frame_index;
+    }
+    const st_clarity_sample& s0 = samples[max_pos - 1];
+    const st_clarity_sample& s1 = samples[max_pos];
+    const st_clarity_sample& s2 = samples[max_pos + 1];
+    //前后采样不连续(中间帧被跳过)时不插值
+    if (s1.m_frame_index - s0.m_frame_index != 1 || s2.m_frame_index - s1.m_frame_index != 1)
+    {
+        return s1.m_frame_index;
+    }
+    double y0 = s0.m_clarity, y1 = s1.m_clarity, y2 = s2.m_clarity;
+    if (y0 > 0.0 && y1 > 0.0 && y2 > 0.0)
+    {
+        //高斯曲线取对数之后为抛物线，清晰度曲线在峰值附近更接近高斯形状
+        y0 = std::log(y0);
+        y1 = std::log(y1);
+        y2 = std::log(y2);
+    }
+    //三点抛物线顶点: x = x1 + (y0 - y2) / (2 * (y0 - 2 * y1 + y2))
+    double denominator = y0 - 2.0 * y1 + y2;
+    if (denominator >= -1e-12)
+    {
+        return s1.m_frame_index;        //不是上凸曲线
+    }
+    double offset = 0.5 * (y0 - y2) / denominator;
+    offset = std::max(-0.5, std::min(0.5, offset));
+    return s1.m_frame_index + offset;
+}
+
+int thread_calc_image_clarity::refine_focus_images(const QString& camera_id, const QImage& image)
+{
+    if (image.isNull() || !m_camera_fiber_end.contains(camera_id))
+    {
+        return 0;
+    }
+    cv::Mat gray = qimage_to_gray_cvmat(image);
+    std::vector<st_detect_box>& fiber_ends = m_camera_fiber_end[camera_id];
+    int start_index = get_start_index(camera_id);
+    int refined_count(0);
+    for (size_t i = 0; i < fiber_ends.size(); i++)
+    {
+        size_t index = start_index + i;
+        if (start_index < 0 || index >= m_focus_images.size())
+        {
+            break;
+        }
+        int x0 = static_cast<int>(fiber_ends[i].m_x0);
+        int y0 = static_cast<int>(fiber_ends[i].m_y0);
+        int x1 = static_cast<int>(fiber_ends[i].m_x1);
+        int y1 = static_cast<int>(fiber_ends[i].m_y1);
+        cv::Rect roi(x0, y0, x1 - x0, y1 - y0);
+        if ((roi & cv::Rect(0, 0, gray.cols, gray.rows)) != roi)
+        {
+            continue;
+        }
+        cv::Mat sub_img;
+        cv::resize(gray(roi), sub_img, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+        double value = calc_image_clarity_bandpass(sub_img, cv::Mat(), 0.3, 0.4, 2.0);       //与扫描时使用相同的清晰度计算方法
+        if (value >= m_focus_image_claritys[index])
+        {
+            m_focus_image_claritys[index] = value;
+            m_focus_images[index] = generate_focus_image_from_detect_box(gray, fiber_ends[i]);
+            refined_count++;
+        }
+    }
+    return refined_count;
+}
+
 int thread_calc_image_clarity::get_camera_index(const QString& camera_id)
 {
     for (int i = 0;i < m_camera_ids.size();i++)
@@ -666,6 +812,8 @@ bool thread_calc_image_clarity::reset_auto_focus(const std::vector<QString>& cam
     }
     m_focus_images.clear();
     m_focus_image_claritys.clear();
+    m_focus_frame_indexes.clear();
+    m_clarity_curves.clear();
     m_attenuation_times.clear();
     m_finished_flags.clear();
     m_save_images.clear();
@@ -3,6 +3,8 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <atomic>
+#include <chrono>
 
 // QMap/QImage/QString remain: they are part of the external API and acceptable
 // in fuguang-server (a Qt-based layer).  Threading primitives are now std::.
@@ -34,6 +36,15 @@ struct st_focus_image
     st_focus_image(){}
 };
 
+//清晰度曲线上的一个采样点: 帧序号(硬触发间隔固定，可换算为对焦位置)和对应的清晰度
+struct st_clarity_sample
+{
+    int m_frame_index{ 0 };
+    double m_clarity{ 0.0 };
+
+    st_clarity_sample(int frame_index = 0, double clarity = 0.0) :m_frame_index(frame_index), m_clarity(clarity) {}
+};
+
 //缓存影像.由于端面和背景可能不在一个平面，因此最清晰的端面和最清晰的背景可能不在同一帧影像中
 //每个端面找到最清晰的局部影像的过程中，缓存足够数量的影像用于背景分离，以找到最清晰的背景和最清晰的端面
 //缓存最清晰的局部影响前后 m_cache_size 帧，共 2*m_cache_size+1帧.
@@ -115,6 +126,14 @@ public:
 
     void add_image(const QString& camera_id, const QImage& image_data);
     int task_image_count();
+    /***************************************
+     * 等待当前任务的结果，替代轮询 m_calculate_finish/task_image_count. 以下情况立即返回:
+     * (1) 队列中的影像全部处理完毕; (2) 结果已经确定(对焦完成、粗定位失败、达到最大帧数)，此时丢弃队列中剩余的影像
+     * int timeout_ms -- 超时时间，小于 0 表示一直等待; int& dropped_count -- 结果确定时丢弃的影像数量
+     * 返回 false 表示超时或者线程已停止
+     ***************************************/
+    bool wait_for_result(int timeout_ms, int& dropped_count);
+    double average_process_ms() const { return m_average_process_ms.load(); }     //单帧平均处理耗时
     void set_max_frame_count(int frame_count) { m_max_frame_count = frame_count; }
     void stop();
 
@@ -128,6 +147,15 @@ public:
     void set_clarity_diff_thresh(double clarity_diff_thresh) { m_clarity_diff_thresh = clarity_diff_thresh; }
     void set_adjustment_x_range(int x_min, int x_max) { m_adjustment_x_min = x_min; m_adjustment_x_max = x_max; }
     std::vector<double> focus_image_claritys() const { return m_focus_image_claritys; }
+    std::vector<int> focus_frame_indexes() const { return m_focus_frame_indexes; }    //每个端面最清晰影像的帧序号(每个相机从 0 开始计数)
+    /***************************************
+     * 每个端面的清晰度峰值位置(帧序号，可以是小数). 对最大值及其前后采样拟合抛物线(清晰度都大于 0 时对 ln(清晰度) 拟合，即高斯曲线)
+     * 得到亚帧间隔的峰值. 前后采样不足时返回最大值所在帧序号. 在 wait_for_result 之后调用
+     ***************************************/
+    std::vector<double> focus_peak_frame_indexes() const;
+    static double interpolate_peak(const std::vector<st_clarity_sample>& samples);
+    //使用在峰值位置单独拍摄的影像更新对焦结果: 只有局部影像的清晰度不低于已有结果时才替换. 清晰度计算线程空闲时调用
+    int refine_focus_images(const QString& camera_id, const QImage& image);
     std::vector<int> calc_frame_count() const
     {
         std::vector<int> frame_counts;
@@ -175,6 +203,7 @@ public:
 
 private:
     void run();
+    bool is_result_ready() const;                       //当前任务的结果是否已经确定，后续影像不再影响结果
 	void process_task(const st_task_image_data& image_data);
     void process_calc_image_clarity_task(const st_task_image_data& image_data);
     void process_clarity_calibration_task(const st_task_image_data& image_data);
@@ -198,6 +227,8 @@ private:
     std::vector<QString> m_camera_ids;                  //所有的相机
 	int m_fiber_end_count{ 0 };                         //每个相机拍摄的端面数量
     std::vector<double> m_focus_image_claritys;         //最清晰的局部影像的清晰度，与 m_focus_images 一一对应
+    std::vector<int> m_focus_frame_indexes;             //最清晰的局部影像所在的帧序号，与 m_focus_images 一一对应. 触发间隔固定，可换算为对焦位置
+    std::vector<std::vector<st_clarity_sample>> m_clarity_curves;  //每个端面的清晰度曲线，用于插值得到亚帧间隔的峰值位置
     std::vector<bool> m_finished_flags;                 //每个区域的完成标识，如果计算完成后续不再计算
     int m_max_frame_count{ 120 };                       //每个端面参与计算的最大帧数，包含跳过帧，防止极端情况下陷入无限循环
     QMap<QString, int> m_calc_frame_count;              //每个相机拍摄的影像参与计算的帧数，最大不超过 m_max_frame_count
@@ -222,6 +253,8 @@ private:
     std::queue<st_task_image_data> m_task_images;       //任务影像队列 (std::queue, protected by m_mutex)
     std::mutex m_mutex;
     std::condition_variable m_wait_condition;
+    std::condition_variable m_result_condition;         //每处理完一帧通知 wait_for_result
+    std::atomic<double> m_average_process_ms{ 0.0 };    //单帧平均处理耗时(指数滑动平均)
     bool m_running{ false };                            //运行标识
     QString m_name;                                     //线程名称
 	thread_task_type m_task_type{ TASK_AUTO_FOCUS };    //当前任务类型
@@ -3,11 +3,13 @@
 #include <QDir>
 #include <QFileInfo>
 #include <QCoreApplication>
+#include <QImage>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/rotating_file_sink.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <mutex>
+#include <atomic>
 
 common::common()
 {
@@ -231,6 +233,26 @@ ENCODE_TYPE check_utf8_encode(const char* data, size_t size)
     return ENCODE_TYPE::UTF8;
 }
 
+static std::atomic<long long> g_converted_bytes{ 0 };
 
+void add_converted_bytes(long long bytes)
+{
+    g_converted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
 
+long long converted_bytes_total()
+{
+    return g_converted_bytes.load(std::memory_order_relaxed);
+}
 
+void set_image_bit_depth(QImage& image, int bit_depth)
+{
+    image.setText("bit_depth", QString::number(bit_depth));
+}
+
+int image_bit_depth(const QImage& image)
+{
+    bool ok(false);
+    int bit_depth = image.text("bit_depth").toInt(&ok);
+    return ok && bit_depth > 8 && bit_depth <= 16 ? bit_depth : 16;
+}
@@ -8,6 +8,8 @@
 
 #include <string>
 #include <fstream>
+
+class QImage;
 const int OUTPUT_LOG = 1;
 
 enum ENCODE_TYPE  //字符串编码类型
@@ -60,3 +62,11 @@ std::string COMMON_EXPORT utf8_to_ansi(const std::string& str);
 bool COMMON_EXPORT is_utf8(const char* str, int len);
 
 ENCODE_TYPE COMMON_EXPORT check_utf8_encode(const char* data, size_t size);
+
+//影像格式转换统计: 每次发生通道数或位深转换时累加输入影像的字节数，用于发现不必要的格式转换(线程安全)
+void COMMON_EXPORT add_converted_bytes(long long bytes);
+long long COMMON_EXPORT converted_bytes_total();
+
+//Grayscale16 影像的有效位数(10/12/16，低位对齐). 相机取帧时写入 QImage 的文本属性，随影像拷贝; 未设置时返回 16
+void COMMON_EXPORT set_image_bit_depth(QImage& image, int bit_depth);
+int COMMON_EXPORT image_bit_depth(const QImage& image);
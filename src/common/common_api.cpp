@@ -18,6 +18,7 @@ QImage convert_cvmat_to_qimage(const cv::Mat& image, int output_channels)
         }
         else            // 输出三通道
         {
+            add_converted_bytes(static_cast<long long>(image.total() * image.elemSize()));
             cv::Mat converted;
             cv::cvtColor(image, converted, cv::COLOR_GRAY2RGB);
             return QImage(converted.data, converted.cols, converted.rows, converted.step, QImage::Format_RGB888).copy();
@@ -27,6 +28,7 @@ QImage convert_cvmat_to_qimage(const cv::Mat& image, int output_channels)
     {
         if (output_channels == 1)         // 输出单通道
         {
+            add_converted_bytes(static_cast<long long>(image.total() * image.elemSize()));
             cv::Mat converted;
             cv::cvtColor(image, converted, cv::COLOR_BGR2GRAY); // 或 COLOR_RGB2GRAY
             return QImage(converted.data, converted.cols, converted.rows, converted.step, QImage::Format_Grayscale8).copy();
@@ -34,6 +36,7 @@ QImage convert_cvmat_to_qimage(const cv::Mat& image, int output_channels)
         else             // 输出也是三通道
         {
             // OpenCV 默认是 BGR，需要转换成 RGB
+            add_converted_bytes(static_cast<long long>(image.total() * image.elemSize()));
             cv::Mat converted;
             cv::cvtColor(image, converted, cv::COLOR_BGR2RGB);
             return QImage(converted.data, converted.cols, converted.rows, converted.step, QImage::Format_RGB888).copy();
@@ -49,6 +52,11 @@ cv::Mat convert_qimage_to_cvmat(const QImage& image, int output_channels)
     {
         return cv::Mat();
     }
+    //只有单通道直接拷贝不属于格式转换，其余情况都需要逐像素转换
+    if (!(image.format() == QImage::Format_Grayscale8 && output_channels == 1))
+    {
+        add_converted_bytes(static_cast<long long>(image.sizeInBytes()));
+    }
     switch (image.format())
     {
     case QImage::Format_Grayscale8:   // 单通道灰度
@@ -65,6 +73,21 @@ cv::Mat convert_qimage_to_cvmat(const QImage& image, int output_channels)
             return converted;
         }
     }
+    case QImage::Format_Grayscale16:   // 单通道 10/12/16 位(低位对齐)，按相机给出的位深缩放到 8 位
+    {
+        cv::Mat mat(image.height(), image.width(), CV_16UC1, const_cast<uchar*>(image.bits()), image.bytesPerLine());
+        //位深固定，同一相机的所有帧使用相同的增益，清晰度和对比度可以相互比较
+        int bit_depth = image_bit_depth(image);
+        cv::Mat gray;
+        mat.convertTo(gray, CV_8U, 255.0 / ((1 << bit_depth) - 1));
+        if (output_channels == 1)
+        {
+            return gray;
+        }
+        cv::Mat converted;
+        cv::cvtColor(gray, converted, cv::COLOR_GRAY2BGR);
+        return converted;
+    }
     case QImage::Format_RGB888:   // 3 通道 RGB
     {
         cv::Mat mat(image.height(), image.width(), CV_8UC3,const_cast<uchar*>(image.bits()), image.bytesPerLine());
@@ -108,3 +131,27 @@ cv::Mat convert_qimage_to_cvmat(const QImage& image, int output_channels)
     }
     }
 }
+
+cv::Mat qimage_to_cvmat_view(const QImage& image)
+{
+    switch (image.format())
+    {
+    case QImage::Format_Grayscale8:
+        return cv::Mat(image.height(), image.width(), CV_8UC1, const_cast<uchar*>(image.constBits()), image.bytesPerLine());
+    case QImage::Format_Grayscale16:
+        return cv::Mat(image.height(), image.width(), CV_16UC1, const_cast<uchar*>(image.constBits()), image.bytesPerLine());
+    case QImage::Format_RGB888:
+        return cv::Mat(image.height(), image.width(), CV_8UC3, const_cast<uchar*>(image.constBits()), image.bytesPerLine());
+    default:
+        return cv::Mat();
+    }
+}
+
+cv::Mat qimage_to_gray_cvmat(const QImage& image)
+{
+    if (image.format() == QImage::Format_Grayscale8)
+    {
+        return qimage_to_cvmat_view(image);
+    }
+    return convert_qimage_to_cvmat(image, 1);
+}
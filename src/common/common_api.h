@@ -12,3 +12,9 @@ QImage COMMON_EXPORT convert_cvmat_to_qimage(const cv::Mat& image, int output_ch
 //将QImage转换成cv::Mat
 cv::Mat COMMON_EXPORT convert_qimage_to_cvmat(const QImage& image, int output_channels);
 
+//QImage 数据直接包装为 cv::Mat，不拷贝也不转换格式(RGB888 保持 RGB 顺序). 不支持的格式返回空 Mat
+//返回的 Mat 引用 QImage 的数据，使用期间 QImage 必须有效
+cv::Mat COMMON_EXPORT qimage_to_cvmat_view(const QImage& image);
+
+//获取 8 位灰度 cv::Mat: Grayscale8 直接包装(不拷贝，QImage 必须有效)，其余格式转换为 8 位灰度
+cv::Mat COMMON_EXPORT qimage_to_gray_cvmat(const QImage& image);
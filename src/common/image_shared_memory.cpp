@@ -1,148 +1,337 @@
 ﻿#include "image_shared_memory.h"
 #include <QBuffer>
 #include <QDebug>
+#include <new>
 
 #include "../common/common.h"
 
-image_shared_memory::image_shared_memory(const QString & key)
-    : m_key_prefix(key)
+image_shared_memory::image_shared_memory(const QString & key, int slot_count)
+    : m_key_prefix(key), m_slot_count(slot_count > 1 ? slot_count : 2)
 {
 
 }
 
-void image_shared_memory::detach()
+image_shared_memory::~image_shared_memory()
 {
-    
+    detach();
 }
 
-bool image_shared_memory::write_image(const QImage& img, st_image_meta& meta)
+void image_shared_memory::detach()
 {
-    int width = img.width();
-    int height = img.height();
-    int channels(0);
-    if (img.format() == QImage::Format_Grayscale8)
+    if (m_segment != nullptr)
     {
-        channels = 1;
+        m_segment->detach();
+        delete m_segment;
+        m_segment = nullptr;
     }
-    else if(img.format() == QImage::Format_RGB888)
+    for (QSharedMemory* shared_memory : m_attached_segments)
     {
-        channels = 3;
+        shared_memory->detach();
+        delete shared_memory;
     }
-    if(channels != 1 && channels != 3)
+    m_attached_segments.clear();
+}
+
+qsizetype image_shared_memory::slot_stride(quint32 slot_capacity)
+{
+    qsizetype stride = static_cast<qsizetype>(sizeof(st_shared_slot_header)) + slot_capacity;
+    return (stride + shared_ring_alignment - 1) / shared_ring_alignment * shared_ring_alignment;
+}
+
+st_shared_ring_header* image_shared_memory::ring_header(QSharedMemory* shared_memory)
+{
+    return static_cast<st_shared_ring_header*>(shared_memory->data());
+}
+
+st_shared_slot_header* image_shared_memory::slot_header(QSharedMemory* shared_memory, int index)
+{
+    st_shared_ring_header* header = ring_header(shared_memory);
+    uchar* base = static_cast<uchar*>(shared_memory->data()) + shared_ring_alignment;
+    return reinterpret_cast<st_shared_slot_header*>(base + slot_stride(header->m_slot_capacity) * index);
+}
+
+uchar* image_shared_memory::slot_data(QSharedMemory* shared_memory, int index)
+{
+    return reinterpret_cast<uchar*>(slot_header(shared_memory, index)) + sizeof(st_shared_slot_header);
+}
+
+bool image_shared_memory::create_segment(quint32 slot_capacity)
+{
+    if (m_segment != nullptr)
     {
-        std::string info = std::string("image format error: only support 1 channel or 3 channel!");
-        write_log(info.c_str());
-        return false;
+        m_segment->detach();
+        delete m_segment;
+        m_segment = nullptr;
     }
-    quint64 data_size = static_cast<quint64>(width * height * channels);
-    int write_index = m_index;
-    m_index = (m_index + 1) % buffer_size;      // 下一次写入的缓冲区索引
-    //生成 key,根据 key 得到可供写入的共享内存
-    QString key = QString("%1_buffer%2_%3x%4x%5").arg(m_key_prefix).arg(write_index).arg(width).arg(height).arg(channels);
+    //每次重建使用新的 key，读端根据消息中的 key 绑定，不会读到旧段中的数据
+    qsizetype total_size = shared_ring_alignment + slot_stride(slot_capacity) * m_slot_count;
     QSharedMemory* shared_memory{ nullptr };
-    QMap<QString, QSharedMemory*>::iterator iter = m_shared_memories.find(key);
-    if(iter == m_shared_memories.end())
+    for (int retry = 0; retry < 8 && shared_memory == nullptr; retry++)
     {
-	    //创建共享内存
+        QString key = QString("%1_ring%2_%3").arg(m_key_prefix).arg(m_generation++).arg(slot_capacity);
         shared_memory = new QSharedMemory(key);
-        if(!shared_memory->create(static_cast<qsizetype>(data_size)))
+        if (!shared_memory->create(total_size))
         {
+            //异常退出的进程可能遗留同名共享内存，换一个 key 重试
+            QSharedMemory::SharedMemoryError error = shared_memory->error();
             std::string info = std::string("Shared memory create failed: ") + l(shared_memory->errorString());
             write_log(info.c_str());
             delete shared_memory;
             shared_memory = nullptr;
+            if (error != QSharedMemory::AlreadyExists)
+            {
+                return false;
+            }
         }
-        else
+    }
+    if (shared_memory == nullptr)
+    {
+        return false;
+    }
+    st_shared_ring_header* header = new (shared_memory->data()) st_shared_ring_header();
+    header->m_slot_count = static_cast<quint32>(m_slot_count);
+    header->m_slot_capacity = slot_capacity;
+    for (int i = 0; i < m_slot_count; i++)
+    {
+        new (slot_header(shared_memory, i)) st_shared_slot_header();
+    }
+    m_segment = shared_memory;
+    return true;
+}
+
+bool image_shared_memory::write_image(const QImage& img, st_image_meta& meta)
+{
+    int channels(0);
+    int bit_depth(8);
+    if (img.format() == QImage::Format_Grayscale8)
+    {
+        channels = 1;
+    }
+    else if (img.format() == QImage::Format_Grayscale16)
+    {
+        channels = 1;
+        bit_depth = meta.bit_depth > 8 ? meta.bit_depth : image_bit_depth(img);
+    }
+    else if(img.format() == QImage::Format_RGB888)
+    {
+        channels = 3;
+    }
+    uchar* dst = begin_write(img.width(), img.height(), channels, meta, bit_depth);
+    if (dst == nullptr)
+    {
+        return false;
+    }
+    qsizetype line_size = static_cast<qsizetype>(img.width()) * channels * bytes_per_sample(bit_depth);
+    if (img.bytesPerLine() == line_size)
+    {
+        memcpy(dst, img.constBits(), static_cast<size_t>(line_size * img.height()));
+    }
+    else
+    {
+        //QImage 每行按 4 字节对齐，逐行拷贝去掉填充字节
+        for (int y = 0; y < img.height(); y++)
         {
-            m_shared_memories.insert(key, shared_memory);
+            memcpy(dst + line_size * y, img.constScanLine(y), static_cast<size_t>(line_size));
         }
     }
-    else
+    commit_write(meta);
+    return true;
+}
+
+uchar* image_shared_memory::begin_write(int width, int height, int channels, st_image_meta& meta, int bit_depth)
+{
+    if(channels != 1 && channels != 3)
     {
-        shared_memory = iter.value();
+        std::string info = std::string("image format error: only support 1 channel or 3 channel!");
+        write_log(info.c_str());
+        return nullptr;
     }
-    if(shared_memory == nullptr)
+    if (bit_depth < 8 || bit_depth > 16 || (bit_depth > 8 && channels != 1))
     {
-	    return false;
+        write_log("image format error: bit depth above 8 only support 1 channel!");
+        return nullptr;
     }
-    // 上一次写入的缓冲区索引是 m_index，这里切换缓冲区写入
-    if (!shared_memory->lock())
+    if (width <= 0 || height <= 0)
     {
-        std::string info = std::string("Shared memory lock failed: ") + l(shared_memory->errorString());
-        write_log(info.c_str());
-        //qDebug() << "Shared memory lock failed:" << m_buffers[write_index].errorString();
-        return false;
+        return nullptr;
     }
-    memcpy(shared_memory->data(), img.constBits(), static_cast<size_t>(data_size));
-    shared_memory->unlock();
-    // 更新元数据
+    quint32 data_size = static_cast<quint32>(static_cast<qsizetype>(width) * channels * bytes_per_sample(bit_depth) * height);
+    bool is_new_memory(false);
+    if (m_segment == nullptr || ring_header(m_segment)->m_slot_capacity < data_size)
+    {
+        if (!create_segment(data_size))
+        {
+            return nullptr;
+        }
+        is_new_memory = true;
+    }
+    st_shared_ring_header* header = ring_header(m_segment);
+    quint64 write_count = header->m_write_count.load(std::memory_order_relaxed);
+    int write_index = static_cast<int>(write_count % header->m_slot_count);
+    st_shared_slot_header* slot = slot_header(m_segment, write_index);
+    // 开始写入: sequence 变为奇数，读端看到奇数或者前后不一致时丢弃数据
+    quint64 sequence = slot->m_sequence.load(std::memory_order_relaxed) + 1;
+    slot->m_sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
     m_frame_counter++;
+    slot->m_frame_id = m_frame_counter;
+    slot->m_width = width;
+    slot->m_height = height;
+    slot->m_channels = channels;
+    slot->m_data_size = static_cast<qint32>(data_size);
+    slot->m_bit_depth = bit_depth;
+    m_writing_index = write_index;
+    // 更新元数据
     meta.width = width;
     meta.height = height;
     meta.channels = channels;
-    meta.index = write_index;       //当前写入的缓冲区索引，读的时候使用该索引对应的缓冲区
-    meta.shared_memory_key = shared_memory->key();
+    meta.bit_depth = bit_depth;
+    meta.index = write_index;       //当前写入的槽位索引，读的时候使用该索引对应的槽位
+    meta.shared_memory_key = m_segment->key();
     meta.frame_id = m_frame_counter;
+    meta.is_new_memory = is_new_memory;
+    return slot_data(m_segment, write_index);
+}
 
-    return true;
+void image_shared_memory::commit_write(st_image_meta& meta)
+{
+    if (m_segment == nullptr || m_writing_index < 0)
+    {
+        return;
+    }
+    st_shared_ring_header* header = ring_header(m_segment);
+    st_shared_slot_header* slot = slot_header(m_segment, m_writing_index);
+    // 写入完毕: sequence 变为偶数
+    quint64 sequence = slot->m_sequence.load(std::memory_order_relaxed) + 1;
+    slot->m_sequence.store(sequence, std::memory_order_release);
+    header->m_write_count.store(header->m_write_count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    meta.sequence = sequence;
+    m_writing_index = -1;
 }
 
-QImage image_shared_memory::read_image(const st_image_meta& meta)
+QSharedMemory* image_shared_memory::attach_segment(const QString& key)
 {
-    QString key = meta.shared_memory_key; // 读取的缓冲区标识
-    QSharedMemory* shared_memory{ nullptr };    //绑定到 key 的共享内存
-    QMap<QString, QSharedMemory*>::iterator iter = m_shared_memories.find(key);
-    if(iter == m_shared_memories.end())
+    QMap<QString, QSharedMemory*>::iterator iter = m_attached_segments.find(key);
+    if (iter != m_attached_segments.end())
     {
-        shared_memory = new QSharedMemory(key);
-        //如果绑定失败，释放内存并移除
-        if (!shared_memory->attach(QSharedMemory::ReadOnly))
-        {
-            std::string info = std::string("Shared memory attach failed:") + l(shared_memory->errorString());
-            write_log(info.c_str());
-            delete shared_memory;
-            shared_memory = nullptr;
-            return QImage();
-        }
-        else
-        {
-            m_shared_memories.insert(key, shared_memory);
-        }
+        return iter.value();
     }
-    else
+    QSharedMemory* shared_memory = new QSharedMemory(key);
+    //如果绑定失败，释放内存并移除
+    if (!shared_memory->attach(QSharedMemory::ReadOnly))
+    {
+        std::string info = std::string("Shared memory attach failed:") + l(shared_memory->errorString());
+        write_log(info.c_str());
+        delete shared_memory;
+        return nullptr;
+    }
+    st_shared_ring_header* header = ring_header(shared_memory);
+    if (header->m_magic != shared_ring_magic || header->m_version != shared_ring_version)
+    {
+        write_log("Shared memory ring header mismatch!");
+        shared_memory->detach();
+        delete shared_memory;
+        return nullptr;
+    }
+    //写端重建共享内存之后旧的 key 不再使用，读端只保留最新绑定的段
+    for (QSharedMemory* old_memory : m_attached_segments)
     {
-        shared_memory = iter.value();
+        old_memory->detach();
+        delete old_memory;
     }
-    int width = meta.width;
-    int height = meta.height;
-    int channels = meta.channels;
+    m_attached_segments.clear();
+    m_attached_segments.insert(key, shared_memory);
+    return shared_memory;
+}
+
+bool image_shared_memory::map_image(const st_image_meta& meta, st_image_view& view)
+{
     // 只支持单通道和三通道
-    if (channels != 1 && channels != 3)
+    if (meta.channels != 1 && meta.channels != 3)
     {
         std::string info = std::string("image format error: only support 1 channel or 3 channel!");
         write_log(info.c_str());
-        return QImage();
+        return false;
     }
-    // 如果宽高数据异常，直接返回空图像
-    if (width == 0 || height == 0)
+    // 如果宽高数据异常，直接返回
+    if (meta.width == 0 || meta.height == 0)
     {
         write_log("Shared memory info error...");
-        return QImage();
+        return false;
     }
-    if (!shared_memory->lock())
+    QSharedMemory* shared_memory = attach_segment(meta.shared_memory_key);
+    if (shared_memory == nullptr)
+    {
+        return false;
+    }
+    st_shared_ring_header* header = ring_header(shared_memory);
+    if (meta.index < 0 || meta.index >= static_cast<int>(header->m_slot_count))
+    {
+        return false;
+    }
+    st_shared_slot_header* slot = slot_header(shared_memory, meta.index);
+    quint64 sequence = slot->m_sequence.load(std::memory_order_acquire);
+    //奇数表示正在写入，与消息中的 sequence 不一致表示该槽位已写入更新的帧
+    if ((sequence & 1) != 0 || (meta.sequence != 0 && sequence != meta.sequence))
+    {
+        return false;
+    }
+    if (slot->m_width != meta.width || slot->m_height != meta.height || slot->m_channels != meta.channels || slot->m_bit_depth != meta.bit_depth)
+    {
+        return false;
+    }
+    view.m_data = slot_data(shared_memory, meta.index);
+    view.m_width = meta.width;
+    view.m_height = meta.height;
+    view.m_channels = meta.channels;
+    view.m_bit_depth = meta.bit_depth;
+    view.m_index = meta.index;
+    view.m_sequence = sequence;
+    return true;
+}
+
+bool image_shared_memory::validate(const st_image_view& view)
+{
+    if (view.m_data == nullptr)
+    {
+        return false;
+    }
+    const st_shared_slot_header* slot = reinterpret_cast<const st_shared_slot_header*>(view.m_data - sizeof(st_shared_slot_header));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot->m_sequence.load(std::memory_order_relaxed) == view.m_sequence;
+}
+
+QImage image_shared_memory::read_image(const st_image_meta& meta)
+{
+    st_image_view view;
+    if (!map_image(meta, view))
     {
-        std::string info = std::string("Shared memory lock failed:") + l(shared_memory->errorString());
-        write_log(info.c_str());
         return QImage();
     }
     QImage::Format format = QImage::Format_Grayscale8;
-    if(channels == 3)
+    if(view.m_channels == 3)
     {
         format = QImage::Format_RGB888;
     }
-    QImage img(width, height, format);
-    memcpy(img.bits(), shared_memory->constData(), static_cast<size_t>(width * height * channels));
-    shared_memory->unlock();
+    else if (view.m_bit_depth > 8)
+    {
+        format = QImage::Format_Grayscale16;
+    }
+    QImage img(view.m_width, view.m_height, format);
+    if (view.m_bit_depth > 8)
+    {
+        set_image_bit_depth(img, view.m_bit_depth);
+    }
+    qsizetype line_size = static_cast<qsizetype>(view.m_width) * view.m_channels * bytes_per_sample(view.m_bit_depth);
+    for (int y = 0; y < view.m_height; y++)
+    {
+        memcpy(img.scanLine(y), view.m_data + line_size * y, static_cast<size_t>(line_size));
+    }
+    //拷贝期间写端可能已经覆盖该槽位(读端落后 slot_count 帧以上)，此时数据不完整，丢弃
+    if (!validate(view))
+    {
+        return QImage();
+    }
     return img;
 }
 
@@ -153,9 +342,11 @@ QJsonObject image_shared_memory::meta_to_json(const st_image_meta& meta)
     json["width"] = meta.width;
     json["height"] = meta.height;
     json["channels"] = meta.channels;
+    json["bit_depth"] = meta.bit_depth;
     json["index"] = meta.index;
     json["is_new_memory"] = meta.is_new_memory;
     json["frame_id"] = static_cast<long long>(meta.frame_id);
+    json["sequence"] = static_cast<long long>(meta.sequence);
     return json;
 }
 
@@ -166,8 +357,10 @@ st_image_meta image_shared_memory::json_to_meta(const QJsonObject& json)
     meta.width = json["width"].toInt();
     meta.height = json["height"].toInt();
     meta.channels = json["channels"].toInt();
+    meta.bit_depth = json["bit_depth"].toInt(8);
     meta.index = json["index"].toInt();
     meta.is_new_memory = static_cast<quint64>(json["is_new_memory"].toBool());
     meta.frame_id = static_cast<quint64>(json["frame_id"].toDouble());
+    meta.sequence = static_cast<quint64>(json["sequence"].toDouble());
     return meta;
-}
\ No newline at end of file
+}
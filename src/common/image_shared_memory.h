@@ -3,8 +3,43 @@
 #include <QSharedMemory>
 #include <QImage>
 #include <QJsonObject>
+#include <QMetaType>
+#include <atomic>
 
-constexpr int buffer_size = 3;      //三缓冲
+constexpr int buffer_size = 4;      //环形缓冲区默认槽位数量
+
+/*************************************************************
+ * 共享内存布局(单个共享内存段):
+ * [st_shared_ring_header][st_shared_slot_header + 影像数据] x slot_count
+ * 每个槽位使用顺序锁(seqlock): 写入前 sequence 加 1 (奇数表示正在写入)，写入完毕再加 1 (偶数表示数据稳定)
+ * 写端(单写者)从不等待读端; 读端在读取前后比较 sequence，不一致说明读取期间数据被覆盖(撕裂读)，由读端丢弃或重试
+ * 影像数据按行紧密排列(bytes_per_line = width * channels * bytes_per_sample)，位深大于 8 时每个采样占 2 字节(小端，低位对齐)
+ *************************************************************/
+constexpr quint32 shared_ring_magic = 0x46475352;      //'FGSR'
+constexpr quint32 shared_ring_version = 2;             //2: 槽位增加位深
+constexpr int shared_ring_alignment = 64;               //槽位按缓存行对齐
+
+struct st_shared_ring_header
+{
+    quint32 m_magic{ shared_ring_magic };
+    quint32 m_version{ shared_ring_version };
+    quint32 m_slot_count{ 0 };
+    quint32 m_slot_capacity{ 0 };               //每个槽位可容纳的影像字节数
+    std::atomic<quint64> m_write_count{ 0 };    //累计写入帧数，最新一帧位于槽位 (m_write_count - 1) % m_slot_count
+};
+
+struct alignas(shared_ring_alignment) st_shared_slot_header
+{
+    std::atomic<quint64> m_sequence{ 0 };       //顺序锁计数，奇数表示正在写入
+    quint64 m_frame_id{ 0 };
+    qint32 m_width{ 0 };
+    qint32 m_height{ 0 };
+    qint32 m_channels{ 0 };
+    qint32 m_data_size{ 0 };
+    qint32 m_bit_depth{ 8 };                    //每个采样的有效位数: 8/10/12/16
+};
+static_assert(std::atomic<quint64>::is_always_lock_free, "shared memory ring requires lock-free 64-bit atomics");
+static_assert(sizeof(st_shared_ring_header) <= shared_ring_alignment, "ring header must fit in the first cache line");
 
 // 影像元数据结构
 struct st_image_meta
@@ -13,22 +48,53 @@ struct st_image_meta
     int width{ 0 };
     int height{ 0 };
     int channels{ 0 };
-    int index{ 0 };
-    bool is_new_memory{ false }; // 是否是新创建的共享内存
+    int index{ 0 };                 // 槽位索引
+    bool is_new_memory{ false };    // 是否是新创建的共享内存
     quint64 frame_id{ 0 };
+    quint64 sequence{ 0 };          // 写入完成时槽位的顺序锁计数，读端据此判断数据是否已被覆盖
+    int bit_depth{ 8 };             // 位深，大于 8 时只支持单通道，每个采样占 2 字节
+};
+Q_DECLARE_METATYPE(st_image_meta)
+
+//读端直接映射的影像，不拷贝数据. 使用完毕之后调用 image_shared_memory::validate 确认数据在使用期间没有被覆盖
+struct st_image_view
+{
+    const uchar* m_data{ nullptr };
+    int m_width{ 0 };
+    int m_height{ 0 };
+    int m_channels{ 0 };
+    int m_bit_depth{ 8 };
+    int m_index{ 0 };
+    quint64 m_sequence{ 0 };
 };
 
 class COMMON_EXPORT image_shared_memory
 {
 public:
-    explicit image_shared_memory(const QString& key);
+    explicit image_shared_memory(const QString& key, int slot_count = buffer_size);
+    ~image_shared_memory();
 
-    // 写入图像，如果宽高/bytesPerLine变化会自动重建
+    // 写入图像，影像大小超过槽位容量时重建共享内存(meta.is_new_memory = true)
+    // 支持 Grayscale8/Grayscale16/RGB888，保持原格式写入. Grayscale16 的位深取 meta.bit_depth(大于 8 时)，否则为 16
     bool write_image(const QImage& img, st_image_meta& meta);
 
-    // 读端：读取图像，失败时返回空 QImage
+    /***************************************
+     * 写端零拷贝接口: begin_write 返回下一个槽位的数据地址(按行紧密排列)，生产者直接在其中写入或转换像素，
+     * 然后调用 commit_write 发布. 两次调用之间读端看到该槽位正在写入. 返回 nullptr 表示参数错误或者创建共享内存失败
+     * 与 write_image 一样只允许单个线程写入. bit_depth 大于 8 时只支持单通道
+     ***************************************/
+    uchar* begin_write(int width, int height, int channels, st_image_meta& meta, int bit_depth = 8);
+    static int bytes_per_sample(int bit_depth) { return bit_depth > 8 ? 2 : 1; }
+    void commit_write(st_image_meta& meta);
+
+    // 读端：拷贝读取图像，数据已被覆盖或者读取期间被改写时返回空 QImage
     QImage read_image(const st_image_meta& meta);
 
+    // 读端：直接映射槽位数据，不拷贝. 返回 false 表示数据已被覆盖或正在写入
+    bool map_image(const st_image_meta& meta, st_image_view& view);
+    // 读端：检查映射的数据在使用期间是否保持不变
+    bool validate(const st_image_view& view);
+
     // 将元数据打包成 JSON（用于 TCP 发送）
     static QJsonObject meta_to_json(const st_image_meta& meta);
 
@@ -37,11 +103,18 @@ public:
 
     void detach();
 private:
+    bool create_segment(quint32 slot_capacity);                 //写端创建共享内存段
+    QSharedMemory* attach_segment(const QString& key);          //读端绑定共享内存段
+    static st_shared_ring_header* ring_header(QSharedMemory* shared_memory);
+    static st_shared_slot_header* slot_header(QSharedMemory* shared_memory, int index);
+    static uchar* slot_data(QSharedMemory* shared_memory, int index);
+    static qsizetype slot_stride(quint32 slot_capacity);
+
     QString m_key_prefix{ "" };             //key前缀,不同的模块使用不同的共享内存，通过key区分。这里只需要为不同的模块指定不同的前缀即可
-    QMap<QString, QSharedMemory*> m_shared_memories;
-    int m_width{ 0 };
-    int m_height{ 0 };
-    int m_channels{ 0 };
+    int m_slot_count{ buffer_size };
+    QSharedMemory* m_segment{ nullptr };    //写端使用的共享内存段
+    int m_generation{ 0 };                  //共享内存重建次数，用于生成新的 key
+    QMap<QString, QSharedMemory*> m_attached_segments;         //读端已绑定的共享内存段
     quint64 m_frame_counter{ 0 };
-    int m_index{ 0 };  // 0 --> buffer_size-1
-};
\ No newline at end of file
+    int m_writing_index{ -1 };              //begin_write 之后尚未 commit_write 的槽位
+};
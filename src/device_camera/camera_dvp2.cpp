@@ -1,6 +1,7 @@
 ﻿#include "camera_dvp2.h"
 
 #include <QFile>
+#include <QMetaMethod>
 
 #include "dvpParam.h"
 
@@ -951,39 +952,8 @@ QImage dvp2_camera::get_image(int millisecond)
     {
         dvpSavePicture(&frame, p, "D:/Temp/test.png", 100);
     }
-    //将数据保存到 QImage
-    QImage img;
-    int stride(0);
-    switch (frame.format)
-    {
-    case FORMAT_MONO:
-    {
-        stride = frame.iWidth; // 灰度图像的 stride 等于宽度
-        img = QImage(static_cast<const uchar*>(p), frame.iWidth, frame.iHeight, stride, QImage::Format_Grayscale8).convertToFormat(QImage::Format_RGB888);
-        if(0)   //将数据保存到图像
-        {
-            QString path = QString("D:/Temp/%1.png").arg(frame.uTimestamp);
-            img.save(path);  // 保存为 PNG 文件
-        }
-        break;
-    }
-    case FORMAT_BGR24:
-    {
-        stride = frame.iWidth * 3; // 三通道图像的 stride 等于 宽度*3
-        img = QImage(static_cast<uchar*>(p), frame.iWidth, frame.iHeight, stride, QImage::Format_BGR888).convertToFormat(QImage::Format_RGB888);
-        if (0)   //将数据保存到图像
-        {
-            QString path = QString("D:/Temp/%1.png").arg(frame.uTimestamp);
-            img.save(path);  // 保存为 PNG 文件
-        }
-        break;
-    }
-    default:
-        // 不支持的格式
-        qWarning("Unsupported image format: %d", frame.format);
-        break;
-    }
-    return img;
+    //将数据保存到 QImage，保持相机输出的格式(灰度图像不再扩展为 RGB888)
+    return frame_to_image(&frame, p);
 }
 
 QImage dvp2_camera::trigger_once()
@@ -1022,58 +992,140 @@ int dvp2_camera::stream_callback(dvpHandle handle, dvpStreamEvent event, void* l
     {
         return 0;   //返回 0 表示影像数据从设备中移除
 	}
-    QImage img;
-    if(lp_frame != nullptr && lp_buf != nullptr)
+    bool has_frame = lp_frame != nullptr && lp_buf != nullptr;
+    //触发模式下发送采集命令之前会置为 false，这里取图成功之后会置为 true
+    if(!lp_camera->is_frame_ready())
+    {
+        lp_camera->set_current_image(has_frame ? frame_to_image(lp_frame, lp_buf) : QImage());
+        lp_camera->set_frame_ready(true);
+        return 0;
+    }
+    //连续模式下直接传输给外部线程. 设置了环形缓冲区时直接写入共享内存槽位，只发送槽位元数据
+    image_shared_memory* ring = lp_camera->m_stream_ring.load();
+    if (ring != nullptr && has_frame)
     {
-        int stride(0);
-        switch (lp_frame->format)
+        st_image_meta meta;
+        if (lp_camera->write_stream_frame(ring, lp_frame, lp_buf, meta))
         {
-        case FORMAT_MONO:
+            emit lp_camera->post_stream_frame_ready(lp_camera->m_unique_id, meta);
+        }
+    }
+    //没有环形缓冲区，或者有模块(例如自动对焦)需要 QImage 时才构造 QImage
+    static const QMetaMethod image_signal = QMetaMethod::fromSignal(&interface_camera::post_stream_image_ready);
+    if (ring == nullptr || lp_camera->isSignalConnected(image_signal))
+    {
+        //write_log("lp_camera->post_stream_image_ready......");
+        emit lp_camera->post_stream_image_ready(lp_camera->m_unique_id, has_frame ? frame_to_image(lp_frame, lp_buf) : QImage());
+    }
+    return 0;   //返回 0 表示影像数据从设备中移除
+}
+
+bool dvp2_camera::write_stream_frame(image_shared_memory* ring, const dvpFrame* lp_frame, const void* lp_buf, st_image_meta& meta)
+{
+    int width = lp_frame->iWidth;
+    int height = lp_frame->iHeight;
+    const uchar* src = static_cast<const uchar*>(lp_buf);
+    switch (lp_frame->format)
+    {
+    case FORMAT_MONO:
+    {
+        int bit_depth = frame_bit_depth(lp_frame);
+        uchar* dst = ring->begin_write(width, height, 1, meta, bit_depth);
+        if (dst == nullptr)
         {
-            stride = lp_frame->iWidth; // 灰度图像的 stride 等于宽度
-            img = QImage(static_cast<const uchar*>(lp_buf), lp_frame->iWidth, lp_frame->iHeight, stride, QImage::Format_Grayscale8).copy();
-        	if (0)   //将数据保存到图像
-            {
-                QString path = QString("C:/Temp/%1.png").arg(lp_frame->uTimestamp);
-                img.save(path);  // 保存为 PNG 文件
-            }
-            break;
+            return false;
         }
-        case FORMAT_BGR24:
+        // 灰度图像的 stride 等于宽度 * 每个采样的字节数，原样拷贝
+        memcpy(dst, src, static_cast<size_t>(width) * height * image_shared_memory::bytes_per_sample(bit_depth));
+        break;
+    }
+    case FORMAT_BGR24:
+    {
+        uchar* dst = ring->begin_write(width, height, 3, meta);
+        if (dst == nullptr)
         {
-            stride = lp_frame->iWidth * 3; // 三通道图像的 stride 等于 宽度*3
-            img = QImage(static_cast<uchar*>(lp_buf), lp_frame->iWidth, lp_frame->iHeight, stride, QImage::Format_BGR888).convertToFormat(QImage::Format_RGB888);
-            //img = QImage(static_cast<uchar*>(lp_buf), lp_frame->iWidth, lp_frame->iHeight, stride, QImage::Format_BGR888).copy();
-            if (0)   //将数据保存到图像
-            {
-                QString path = QString("D:/Temp/%1.png").arg(lp_frame->uTimestamp);
-                img.save(path);  // 保存为 PNG 文件
-            }
-            break;
+            return false;
         }
-        default:
-            // 不支持的格式
-            qWarning("Unsupported image format: %d", lp_frame->format);
-            break;
+        //拷贝的同时将 BGR 转换为 RGB，与 QImage::Format_RGB888 保持一致
+        size_t pixel_count = static_cast<size_t>(width) * height;
+        add_converted_bytes(static_cast<long long>(pixel_count * 3));
+        for (size_t i = 0; i < pixel_count; i++, src += 3, dst += 3)
+        {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
         }
+        break;
     }
-    
-    if(lp_camera != nullptr)
+    default:
+        // 不支持的格式
+        qWarning("Unsupported image format: %d", lp_frame->format);
+        return false;
+    }
+    ring->commit_write(meta);
+    return true;
+}
+
+int dvp2_camera::frame_bit_depth(const dvpFrame* lp_frame)
+{
+    switch (lp_frame->bits)
+    {
+    case BITS_10:
+        return 10;
+    case BITS_12:
+        return 12;
+    case BITS_14:
+        return 14;
+    case BITS_16:
+        return 16;
+    default:
+        return 8;
+    }
+}
+
+QImage dvp2_camera::frame_to_image(const dvpFrame* lp_frame, const void* lp_buf)
+{
+    QImage img;
+    int stride(0);
+    switch (lp_frame->format)
+    {
+    case FORMAT_MONO:
     {
-        //触发模式下发送采集命令之前会置为 false，这里取图成功之后会置为 true
-        if(!lp_camera->is_frame_ready())
+        //灰度图像保持单通道; 10/12 位数据每个像素占 2 字节，使用 Grayscale16
+        if (frame_bit_depth(lp_frame) > 8)
         {
-            lp_camera->set_current_image(img);
-            lp_camera->set_frame_ready(true);
+            stride = lp_frame->iWidth * 2;
+            img = QImage(static_cast<const uchar*>(lp_buf), lp_frame->iWidth, lp_frame->iHeight, stride, QImage::Format_Grayscale16).copy();
+            set_image_bit_depth(img, frame_bit_depth(lp_frame));       //转换为 8 位时按实际位深缩放
+            break;
         }
-        //连续模式下直接传输给外部线程
-        else
+        stride = lp_frame->iWidth; // 灰度图像的 stride 等于宽度
+        img = QImage(static_cast<const uchar*>(lp_buf), lp_frame->iWidth, lp_frame->iHeight, stride, QImage::Format_Grayscale8).copy();
+        if (0)   //将数据保存到图像
         {
-            //write_log("lp_camera->post_stream_image_ready......");
-            emit lp_camera->post_stream_image_ready(lp_camera->m_unique_id,img);
+            QString path = QString("C:/Temp/%1.png").arg(lp_frame->uTimestamp);
+            img.save(path);  // 保存为 PNG 文件
         }
+        break;
     }
-    return 0;   //返回 0 表示影像数据从设备中移除
+    case FORMAT_BGR24:
+    {
+        stride = lp_frame->iWidth * 3; // 三通道图像的 stride 等于 宽度*3
+        add_converted_bytes(static_cast<long long>(stride) * lp_frame->iHeight);
+        img = QImage(static_cast<const uchar*>(lp_buf), lp_frame->iWidth, lp_frame->iHeight, stride, QImage::Format_BGR888).convertToFormat(QImage::Format_RGB888);
+        if (0)   //将数据保存到图像
+        {
+            QString path = QString("D:/Temp/%1.png").arg(lp_frame->uTimestamp);
+            img.save(path);  // 保存为 PNG 文件
+        }
+        break;
+    }
+    default:
+        // 不支持的格式
+        qWarning("Unsupported image format: %d", lp_frame->format);
+        break;
+    }
+    return img;
 }
 
 int dvp2_camera::set_ip_address(unsigned int ip, unsigned int subnet_mask, unsigned int default_gateway)
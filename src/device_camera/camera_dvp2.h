@@ -109,8 +109,13 @@ public:
     void set_current_image(const QImage& img) { m_image = img; }
 	// 回调函数，在其他线程中执行(注册时指定类型为 STREAM_EVENT_FRAME_THREAD ). 获取视频流
 	static int stream_callback(dvpHandle handle, dvpStreamEvent event, void* lp_context, dvpFrame* lp_frame, void* lp_buf);
+    //连续模式下将帧数据直接写入环形缓冲区槽位(唯一的一次拷贝或格式转换)，成功返回 true
+    bool write_stream_frame(image_shared_memory* ring, const dvpFrame* lp_frame, const void* lp_buf, st_image_meta& meta);
+    static QImage frame_to_image(const dvpFrame* lp_frame, const void* lp_buf);       //帧数据拷贝到 QImage，灰度图像保持单通道
+    static int frame_bit_depth(const dvpFrame* lp_frame);                              //帧数据的位深(8/10/12/14/16)
 
     virtual QImage trigger_once() override;                                            //触发一次
+    virtual bool supports_stream_ring() const override { return true; }
 
     //判断设备是否可达
     bool is_device_accessible(unsigned int nAccessMode) const;
@@ -6,6 +6,9 @@
 #include <string>
 #include <QMap>
 #include <QObject>
+#include <atomic>
+
+#include "../common/image_shared_memory.h"
 
 struct st_range
 {
@@ -182,8 +185,19 @@ public:
 
     virtual bool import_config(const st_camera_config& camera_config) = 0;  //导入参数并设置到相机
     virtual st_camera_config export_config() = 0;                           //导出相机参数
+
+    /***********************************零拷贝采集*************************************
+     * 设置环形缓冲区之后，连续采集的影像在 SDK 回调中直接写入(或转换格式写入)共享内存槽位，
+     * 然后通过 post_stream_frame_ready 发送槽位元数据，不再构造 QImage.
+     * 只有在 post_stream_image_ready 有接收者时(例如自动对焦)才额外构造 QImage. 环形缓冲区只能由相机回调线程写入
+     *********************************************************************************/
+    virtual bool supports_stream_ring() const { return false; }            //是否支持直接写入环形缓冲区
+    void set_stream_ring(image_shared_memory* ring) { m_stream_ring.store(ring); }
 signals:
     void post_stream_image_ready(const QString& camera_id, const QImage& image);
+    void post_stream_frame_ready(const QString& camera_id, const st_image_meta& meta);     //影像已写入环形缓冲区
+protected:
+    std::atomic<image_shared_memory*> m_stream_ring{ nullptr };     //连续采集影像输出的环形缓冲区，不负责资源释放
 public:
     QMap<int, int> m_map_ret_status;                                //返回值映射，不同的相机对于某一状态的返回值很可能不一样，因此需要对所有相机进行统一映射
     int map_ret_status(int ret) const
@@ -4,15 +4,17 @@
  * 使用方法:
  * (1) 启动后端时构建对象并加载该文件
  * (2) 打开相机时根据 unique_id 查找对应参数，如果没有找到则使用相机默认参数，否则使用查找结果设置相机参数
- * (3) 用户修改相机参数时，首先将相机参数保存到结构体，然后更新或添加到管理对象，最后保存到文件
+ * (3) 用户修改相机参数时，首先将相机参数保存到结构体，然后更新或添加到管理对象，最后保存到文件(后台合并写入)
  ****************************************************************/
 #pragma once
 
 #include <QMap>
 #include <QString>
 #include <pugixml.hpp>
+#include <sstream>
 
 #include "../device_camera/interface_camera.h"
+#include "persistence_service.h"
 
 struct st_camera_config_mgr
 {
@@ -38,6 +40,7 @@ struct st_camera_config_mgr
 		return true;
 	}
 
+	//在内存中序列化，由 persistence_service 合并之后在后台原子写入
 	void save_to_file()
 	{
 		pugi::xml_document doc;
@@ -46,7 +49,10 @@ struct st_camera_config_mgr
 		{
 			save_camera_config_to_node(root, it.value());
 		}
-		doc.save_file(m_config_file_path.toStdString().c_str(), "    ");
+		std::ostringstream stream;
+		doc.save(stream, "    ");
+		std::string content = stream.str();
+		persistence_service::instance().submit(m_config_file_path, QByteArray(content.data(), static_cast<qsizetype>(content.size())));
 	}
 
 	// 将相机配置写入 parent，返回新建的 Camera 子节点
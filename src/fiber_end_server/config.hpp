@@ -9,8 +9,10 @@
 #include <pugixml.hpp>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <sstream>
 
 #include "../common/common.h"
+#include "persistence_service.h"
 
  // 端面检测配置参数
 struct st_config_data
@@ -28,6 +30,22 @@ struct st_config_data
 	double m_fiber_end_physical_size{ 100.0 };			//端面物理直径尺寸，单位微米. 该参数用于计算像素尺寸以及在前端缩略图中显示端面的像素尺寸
 	double m_field_of_view{ 1.0 };						//每张检测结果的视野大小，默认与精定位结果一致，可以调整外扩系数
 	int m_auto_detect{ 1 };								//对焦完成之后是否自动执行检测 0 -- 否    1 -- 是
+	int m_focus_search_distance{ 330 };					//运行时自动对焦在拍照位置前后的扫描距离
+	int m_focus_move_speed{ 300 };						//运行时自动对焦的扫描速度
+	int m_focus_move_step{ 5 };							//运行时自动对焦的硬触发间隔
+	int m_focus_search_mode{ 0 };						//运行时自动对焦搜索方式 0 -- 全范围扫描    1 -- 粗扫描+精扫描
+	int m_focus_coarse_factor{ 4 };						//粗扫描的速度和触发间隔相对于对焦参数的倍数
+	int m_focus_capture_at_peak{ 0 };					//对焦之后是否在插值得到的峰值位置单独拍摄一次 0 -- 否    1 -- 是
+	int m_focus_predict_window{ 0 };					//对焦位置表预测位置前后的最小扫描范围，0 -- 只记录对焦位置，不预测
+	int m_image_codec{ 0 };								//保存目录中检测结果影像的编码方式 0 -- PNG    1 -- TIFF(不压缩)    2 -- RAW    3 -- QOI
+	int m_png_compression{ 1 };							//PNG 压缩级别 0-9，级别越低写入越快
+	int m_archive_mode{ 0 };							//检测结果保存方式 0 -- 逐张保存到保存目录    1 -- 追加到保存目录下 archive 子目录中的分段文件
+	int m_archive_segment_size_mb{ 256 };				//归档分段文件大小(MB)
+	int m_archive_max_size_gb{ 0 };						//归档总大小上限(GB)，超过之后删除最早的分段，0 -- 不限制
+	int m_archive_retention_days{ 0 };					//归档分段保留天数，0 -- 不限制
+	int m_config_save_window_ms{ 1000 };				//配置文件合并写入的窗口(毫秒)，窗口内的多次修改只写入一次，0 -- 立即写入
+	int m_motion_tagged_commands{ 0 };					//串口运控命令是否带序号("#序号 命令") 0 -- 旧协议，按到达顺序匹配回复    1 -- 固件回复时带回序号，可以同时发送多个命令
+	int m_fly_capture{ 0 };								//运行时是否飞拍 0 -- 在每个拍照位置停止并自动对焦    1 -- y 相同的连续位置不停止，经过时拍照(对焦位置已知的夹具)
 	std::string m_save_path{ "./saveimages" };		//指定保存拍照图像的路径
 
 	std::string m_config_file_path{ "./config.xml" };		//配置文件路径,服务刚启动之后会加载配置文件，只在调用 load_from_file 时初始化一次
@@ -84,10 +102,42 @@ struct st_config_data
 			m_auto_detect = n.text().as_int(m_auto_detect);
 		if (auto n = node.child("save_path"))
 			m_save_path = n.text().as_string(m_save_path.c_str());
+		if (auto n = node.child("focus_search_distance"))
+			m_focus_search_distance = n.text().as_int(m_focus_search_distance);
+		if (auto n = node.child("focus_move_speed"))
+			m_focus_move_speed = n.text().as_int(m_focus_move_speed);
+		if (auto n = node.child("focus_move_step"))
+			m_focus_move_step = n.text().as_int(m_focus_move_step);
+		if (auto n = node.child("focus_search_mode"))
+			m_focus_search_mode = n.text().as_int(m_focus_search_mode);
+		if (auto n = node.child("focus_coarse_factor"))
+			m_focus_coarse_factor = n.text().as_int(m_focus_coarse_factor);
+		if (auto n = node.child("focus_capture_at_peak"))
+			m_focus_capture_at_peak = n.text().as_int(m_focus_capture_at_peak);
+		if (auto n = node.child("focus_predict_window"))
+			m_focus_predict_window = n.text().as_int(m_focus_predict_window);
+		if (auto n = node.child("image_codec"))
+			m_image_codec = n.text().as_int(m_image_codec);
+		if (auto n = node.child("png_compression"))
+			m_png_compression = n.text().as_int(m_png_compression);
+		if (auto n = node.child("archive_mode"))
+			m_archive_mode = n.text().as_int(m_archive_mode);
+		if (auto n = node.child("archive_segment_size_mb"))
+			m_archive_segment_size_mb = n.text().as_int(m_archive_segment_size_mb);
+		if (auto n = node.child("archive_max_size_gb"))
+			m_archive_max_size_gb = n.text().as_int(m_archive_max_size_gb);
+		if (auto n = node.child("archive_retention_days"))
+			m_archive_retention_days = n.text().as_int(m_archive_retention_days);
+		if (auto n = node.child("config_save_window_ms"))
+			m_config_save_window_ms = n.text().as_int(m_config_save_window_ms);
+		if (auto n = node.child("motion_tagged_commands"))
+			m_motion_tagged_commands = n.text().as_int(m_motion_tagged_commands);
+		if (auto n = node.child("fly_capture"))
+			m_fly_capture = n.text().as_int(m_fly_capture);
 		return true;
 	}
 
-	//界面上修改相关配置之后更新数据，然后保存到文件
+	//界面上修改相关配置之后更新数据，然后保存到文件. 这里只在内存中序列化，由 persistence_service 合并之后在后台原子写入
 	void save() const
 	{
 		pugi::xml_document doc;
@@ -96,10 +146,10 @@ struct st_config_data
 		decl.append_attribute("encoding") = "UTF-8";
 		pugi::xml_node root = doc.append_child("config");
 		save_to_node(root);
-		if (!doc.save_file(m_config_file_path.c_str(), "    ", pugi::format_default, pugi::encoding_utf8))
-		{
-			write_log("Failed to save config file");
-		}
+		std::ostringstream stream;
+		doc.save(stream, "    ", pugi::format_default, pugi::encoding_utf8);
+		std::string content = stream.str();
+		persistence_service::instance().submit(QString::fromStdString(m_config_file_path), QByteArray(content.data(), static_cast<qsizetype>(content.size())));
 	}
 
 	// 将参数写入已存在的 node
@@ -135,6 +185,22 @@ struct st_config_data
 		append_double("field_of_view", m_field_of_view);
 		append_int("auto_detect", m_auto_detect);
 		append_str("save_path", m_save_path.c_str());
+		append_int("focus_search_distance", m_focus_search_distance);
+		append_int("focus_move_speed", m_focus_move_speed);
+		append_int("focus_move_step", m_focus_move_step);
+		append_int("focus_search_mode", m_focus_search_mode);
+		append_int("focus_coarse_factor", m_focus_coarse_factor);
+		append_int("focus_capture_at_peak", m_focus_capture_at_peak);
+		append_int("focus_predict_window", m_focus_predict_window);
+		append_int("image_codec", m_image_codec);
+		append_int("png_compression", m_png_compression);
+		append_int("archive_mode", m_archive_mode);
+		append_int("archive_segment_size_mb", m_archive_segment_size_mb);
+		append_int("archive_max_size_gb", m_archive_max_size_gb);
+		append_int("archive_retention_days", m_archive_retention_days);
+		append_int("config_save_window_ms", m_config_save_window_ms);
+		append_int("motion_tagged_commands", m_motion_tagged_commands);
+		append_int("fly_capture", m_fly_capture);
 	}
 
 	// 创建命名子节点并写入，返回该节点（供 thread_misc 组合用户配置文件时使用）
@@ -171,6 +237,20 @@ struct st_config_data
 		root["field_of_view"] = m_field_of_view;
 		root["auto_detect"] = m_auto_detect;
 		root["save_path"] = QString::fromStdString(m_save_path);
+		root["focus_search_distance"] = m_focus_search_distance;
+		root["focus_move_speed"] = m_focus_move_speed;
+		root["focus_move_step"] = m_focus_move_step;
+		root["focus_search_mode"] = m_focus_search_mode;
+		root["focus_coarse_factor"] = m_focus_coarse_factor;
+		root["focus_capture_at_peak"] = m_focus_capture_at_peak;
+		root["focus_predict_window"] = m_focus_predict_window;
+		root["image_codec"] = m_image_codec;
+		root["png_compression"] = m_png_compression;
+		root["archive_mode"] = m_archive_mode;
+		root["archive_segment_size_mb"] = m_archive_segment_size_mb;
+		root["archive_max_size_gb"] = m_archive_max_size_gb;
+		root["archive_retention_days"] = m_archive_retention_days;
+		root["fly_capture"] = m_fly_capture;
 
 		return root;
 	}
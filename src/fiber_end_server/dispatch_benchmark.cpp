@@ -0,0 +1,329 @@
+﻿#include "dispatch_benchmark.h"
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QCborMap>
+#include <QCborValue>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QDebug>
+#include <vector>
+#include <algorithm>
+
+#include "task_message.h"
+
+namespace
+{
+    //原来主线程 process_request 中的命令顺序
+    const char* legacy_server_commands[] =
+    {
+        "client_request_server_parameter", "client_request_camera_list", "client_request_open_camera",
+        "client_request_close_camera", "client_request_change_camera_parameter", "client_request_start_grab",
+        "client_request_trigger_once", "client_request_change_algorithm_parameter", "client_request_user_config_set",
+        "client_request_move_camera", "client_request_move_camera_by_index", "client_request_set_motion_parameter",
+        "client_request_auto_focus", "client_request_anomaly_detection", "client_request_auto_calibration",
+        "client_request_update_server_parameter", "client_request_start_process", "client_request_stop_server",
+    };
+
+    //原来子线程 process_task 中的命令顺序
+    const char* legacy_worker_commands[] =
+    {
+        "client_request_open_camera", "client_request_close_camera", "client_request_change_camera_parameter",
+        "client_request_start_grab", "client_request_trigger_once", "client_request_change_algorithm_parameter",
+        "client_request_user_config_set", "client_request_move_camera", "client_request_move_camera_by_index",
+        "client_request_set_motion_parameter", "client_request_auto_focus", "client_request_anomaly_detection",
+        "client_request_auto_calibration", "client_request_update_server_parameter", "client_request_archive_query",
+        "client_request_focus_map", "client_request_start_process", "device_request_start_process",
+    };
+
+    //逐个比较命令字符串，返回命中的序号
+    template <size_t N>
+    int legacy_match(const QString& command, const char* (&commands)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+        {
+            if (command == commands[i])
+            {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    //原来的分发: 主线程查找命令 -> QJsonObject 入队 -> 子线程再次查找命令
+    int legacy_dispatch(const QJsonObject& request)
+    {
+        QString command = request["command"].toString();
+        int route = legacy_match(command, legacy_server_commands);
+        QVariant task_data(request);
+        QJsonObject obj = task_data.toJsonObject();
+        QString worker_command = obj["command"].toString();
+        return route + legacy_match(worker_command, legacy_worker_commands);
+    }
+
+    //操作码分发: 接收时解析一次 -> 消息移动入队 -> 子线程比较操作码
+    int opcode_dispatch(const QJsonObject& request)
+    {
+        st_task_message message = st_task_message::from_json(request);
+        int route = static_cast<int>(opcode_target(message.m_opcode));
+        QVariant task_data = QVariant::fromValue(std::move(message));
+        st_task_message task = st_task_message::from_variant(task_data);
+        return route + static_cast<int>(task.m_opcode);
+    }
+
+    //原来的广播: 每个客户端单独序列化
+    qint64 legacy_broadcast(const QJsonObject& obj, std::vector<QByteArray>& clients)
+    {
+        qint64 bytes(0);
+        for (QByteArray& client : clients)
+        {
+            QByteArray payload = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+            qint32 size = payload.size();
+            QByteArray block;
+            QDataStream out(&block, QIODevice::WriteOnly);
+            out.setByteOrder(QDataStream::BigEndian);
+            out << size;
+            block.append(payload);
+            client = block;
+            bytes += block.size();
+        }
+        return bytes;
+    }
+
+    //只序列化一次，所有客户端共用同一个数据块
+    qint64 shared_broadcast(const QJsonObject& obj, std::vector<QByteArray>& clients)
+    {
+        qint64 bytes(0);
+        QByteArray block = encode_frame(obj);
+        for (QByteArray& client : clients)
+        {
+            client = block;
+            bytes += block.size();
+        }
+        return bytes;
+    }
+
+    std::vector<QJsonObject> make_requests()
+    {
+        std::vector<QJsonObject> requests;
+        for (int i = OPCODE_UNKNOWN + 1; i < OPCODE_COUNT; i++)
+        {
+            QJsonObject obj;
+            obj["command"] = command_from_opcode(static_cast<TASK_OPCODE>(i));
+            obj["request_id"] = QString("benchmark_%1").arg(i);
+            QJsonObject param;
+            param["x"] = 1000 + i;
+            param["y"] = 2000 + i;
+            param["speed"] = 50;
+            obj["param"] = param;
+            requests.push_back(obj);
+        }
+        return requests;
+    }
+
+    QJsonObject make_reply()
+    {
+        //检测过程中广播的状态消息
+        QJsonObject obj;
+        obj["request_id"] = "";
+        obj["command"] = "server_anomaly_detection_finish";
+        obj["task_finish"] = false;
+        QJsonArray fibers;
+        for (int i = 0; i < 8; i++)
+        {
+            QJsonObject fiber;
+            fiber["fiber_index"] = i;
+            fiber["located"] = true;
+            fiber["defect_count"] = i % 3;
+            fiber["image"] = QString("detect_image");
+            fibers.append(fiber);
+        }
+        obj["images"] = fibers;
+        return obj;
+    }
+
+    QJsonObject make_range(double min, double max)
+    {
+        QJsonObject range;
+        range["min"] = min;
+        range["max"] = max;
+        return range;
+    }
+
+    QJsonObject make_image_meta(int index)
+    {
+        QJsonObject meta;
+        meta["shm_key"] = QString("stream_image");
+        meta["width"] = 2448;
+        meta["height"] = 2048;
+        meta["channels"] = 1;
+        meta["bit_depth"] = 8;
+        meta["index"] = index % 4;
+        meta["is_new_memory"] = false;
+        meta["frame_id"] = 1000000 + index;
+        meta["sequence"] = 2 * (1000000 + index);
+        return meta;
+    }
+
+    //运行和连续采集期间最常见的五种回复消息
+    std::vector<std::pair<QString, QJsonObject>> make_frequent_messages()
+    {
+        std::vector<std::pair<QString, QJsonObject>> messages;
+        QJsonObject stream;
+        stream["request_id"] = "stream_0";
+        stream["task_finish"] = false;
+        stream["command"] = "server_camera_stream_image_ready";
+        stream["param"] = make_image_meta(7);
+        messages.emplace_back("stream_image_ready", stream);
+
+        messages.emplace_back("anomaly_detection_finish", make_reply());
+
+        QJsonObject move;
+        move["request_id"] = "process_0";
+        move["command"] = "server_move_camera_success";
+        move["task_finish"] = false;
+        move["position_x"] = 123456;
+        move["position_y"] = -65432;
+        move["clarity"] = 0.8734512345;
+        move["image"] = make_image_meta(3);
+        messages.emplace_back("move_camera_success", move);
+
+        QJsonObject status;
+        status["request_id"] = "process_0";
+        status["command"] = "server_process_status";
+        status["task_finish"] = true;
+        status["param"] = 0;
+        status["use_time"] = 12.3456789;
+        messages.emplace_back("process_status", status);
+
+        //server_all_parameters 中的相机参数: 数十个取值范围和枚举列表
+        QJsonObject camera;
+        camera["unique_id"] = "DVP2-0001";
+        const char* range_names[] = { "frame_rate", "start_x", "start_y", "width", "height", "auto_exposure_time_floor",
+            "auto_exposure_time_upper", "exposure_time", "auto_gain_floor", "auto_gain_upper", "gain", "gamma",
+            "contrast", "brightness", "sharpness", "saturation", "hue", "white_balance_red", "white_balance_green",
+            "white_balance_blue", "black_level", "trigger_delay", "trigger_filter", "strobe_delay" };
+        int i(0);
+        for (const char* name : range_names)
+        {
+            camera[name] = 12.5 + i * 3.75;
+            camera[QString("%1_range").arg(name)] = make_range(0.015625 * i, 1000.0 + i * 0.333);
+            i++;
+        }
+        const char* enum_names[] = { "pixel_formats", "auto_exposure_modes", "auto_gain_modes", "trigger_modes", "trigger_sources" };
+        for (const char* name : enum_names)
+        {
+            QJsonArray modes;
+            for (int j = 0; j < 6; j++)
+            {
+                QJsonObject mode;
+                mode["name"] = QString("%1_%2").arg(name).arg(j);
+                mode["value"] = j;
+                modes.append(mode);
+            }
+            camera[name] = modes;
+        }
+        QJsonObject parameters;
+        parameters["request_id"] = "";
+        parameters["command"] = "server_all_parameters";
+        parameters["camera"] = camera;
+        messages.emplace_back("all_parameters", parameters);
+        return messages;
+    }
+
+    QJsonObject decode_frame(const QByteArray& block, WIRE_ENCODING encoding)
+    {
+        QByteArray payload = QByteArray::fromRawData(block.constData() + 4, block.size() - 4);
+        if (encoding == WIRE_ENCODING_CBOR)
+        {
+            return QCborValue::fromCbor(payload).toMap().toJsonObject();
+        }
+        return QJsonDocument::fromJson(payload).object();
+    }
+
+    double per_call_ns(const QElapsedTimer& timer, int count)
+    {
+        return count > 0 ? static_cast<double>(timer.nsecsElapsed()) / count : 0.0;
+    }
+}
+
+int run_dispatch_benchmark(int iterations, int client_count)
+{
+    iterations = std::max(iterations, 1);
+    client_count = std::max(client_count, 1);
+    std::vector<QJsonObject> requests = make_requests();
+    QJsonObject reply = make_reply();
+    std::vector<QByteArray> clients(client_count);
+    volatile qint64 sink(0);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; i++)
+    {
+        sink = sink + legacy_dispatch(requests[i % requests.size()]);
+    }
+    double legacy_dispatch_ns = per_call_ns(timer, iterations);
+
+    timer.restart();
+    for (int i = 0; i < iterations; i++)
+    {
+        sink = sink + opcode_dispatch(requests[i % requests.size()]);
+    }
+    double opcode_dispatch_ns = per_call_ns(timer, iterations);
+
+    int reply_iterations = std::max(iterations / 10, 1);
+    timer.restart();
+    for (int i = 0; i < reply_iterations; i++)
+    {
+        sink = sink + legacy_broadcast(reply, clients);
+    }
+    double legacy_reply_ns = per_call_ns(timer, reply_iterations);
+
+    timer.restart();
+    for (int i = 0; i < reply_iterations; i++)
+    {
+        sink = sink + shared_broadcast(reply, clients);
+    }
+    double shared_reply_ns = per_call_ns(timer, reply_iterations);
+
+    qInfo().noquote() << QString("dispatch: %1 commands, legacy %2 ns/command, opcode %3 ns/command")
+        .arg(iterations).arg(legacy_dispatch_ns, 0, 'f', 1).arg(opcode_dispatch_ns, 0, 'f', 1);
+    qInfo().noquote() << QString("broadcast: %1 replies to %2 clients, legacy %3 ns/reply, serialize once %4 ns/reply")
+        .arg(reply_iterations).arg(client_count).arg(legacy_reply_ns, 0, 'f', 1).arg(shared_reply_ns, 0, 'f', 1);
+    return sink == 0 ? 1 : 0;
+}
+
+int run_encoding_benchmark(int iterations)
+{
+    iterations = std::max(iterations, 1);
+    volatile qint64 sink(0);
+    for (const std::pair<QString, QJsonObject>& message : make_frequent_messages())
+    {
+        double encode_decode_ns[WIRE_ENCODING_COUNT] = { 0.0 };
+        qsizetype block_size[WIRE_ENCODING_COUNT] = { 0 };
+        for (int encoding = 0; encoding < WIRE_ENCODING_COUNT; encoding++)
+        {
+            WIRE_ENCODING wire_encoding = static_cast<WIRE_ENCODING>(encoding);
+            QByteArray block = encode_frame(message.second, wire_encoding);
+            block_size[encoding] = block.size();
+            //往返一次，确认两种编码得到相同的消息
+            if (decode_frame(block, wire_encoding) != message.second)
+            {
+                qWarning().noquote() << QString("%1: %2 round trip mismatch").arg(message.first).arg(wire_encoding_name(wire_encoding));
+            }
+            QElapsedTimer timer;
+            timer.start();
+            for (int i = 0; i < iterations; i++)
+            {
+                block = encode_frame(message.second, wire_encoding);
+                sink = sink + decode_frame(block, wire_encoding).size();
+            }
+            encode_decode_ns[encoding] = per_call_ns(timer, iterations);
+        }
+        qInfo().noquote() << QString("%1: json %2 bytes %3 ns, cbor %4 bytes %5 ns (encode + decode)")
+            .arg(message.first, -26)
+            .arg(block_size[WIRE_ENCODING_JSON]).arg(encode_decode_ns[WIRE_ENCODING_JSON], 0, 'f', 1)
+            .arg(block_size[WIRE_ENCODING_CBOR]).arg(encode_decode_ns[WIRE_ENCODING_CBOR], 0, 'f', 1);
+    }
+    return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+﻿/***************************************************************
+ * 命令分发开销测试，不需要连接设备和客户端
+ * backend.exe --benchmark-dispatch [次数] [客户端数量]
+ * 分别测量原来的方式(逐个比较命令字符串、子线程再次查找命令、广播时为每个客户端序列化)
+ * 和操作码方式(接收时解析一次、按操作码分发、回复只序列化一次)处理每条命令的平均耗时
+ *
+ * 消息编码测试: backend.exe --benchmark-encoding [次数]
+ * 对最常见的五种回复消息分别测量 JSON 和 CBOR 的编码+解码耗时和数据块大小
+ ***************************************************************/
+#pragma once
+
+int run_dispatch_benchmark(int iterations = 200000, int client_count = 4);
+int run_encoding_benchmark(int iterations = 100000);
@@ -0,0 +1,432 @@
+﻿#include "image_transport.h"
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QDebug>
+#include <opencv2/opencv.hpp>
+
+#include "../common/common.h"
+#include "../common/common_api.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+shared_memory_image_transport::shared_memory_image_transport()
+{
+
+}
+
+shared_memory_image_transport::~shared_memory_image_transport()
+{
+    for (image_shared_memory* shared_memory : m_shared_memories)
+    {
+        delete shared_memory;
+    }
+    m_shared_memories.clear();
+}
+
+bool shared_memory_image_transport::send_image(const QImage& img, const QString& type, st_image_meta& meta)
+{
+    //检测结果使用 detect_image，其余(连续采集/触发拍照)沿用 trigger_image，与已有客户端保持一致
+    QString prefix = (type == "annotated") ? QString("detect_image") : QString("trigger_image");
+    QMutexLocker locker(&m_mutex);
+    image_shared_memory* shared_memory = m_shared_memories.value(prefix, nullptr);
+    if (shared_memory == nullptr)
+    {
+        shared_memory = new image_shared_memory(prefix, prefix == "detect_image" ? detect_image_slot_count : buffer_size);
+        m_shared_memories.insert(prefix, shared_memory);
+    }
+    quint64 frame_id = meta.frame_id;
+    if (!shared_memory->write_image(img, meta))
+    {
+        return false;
+    }
+    meta.frame_id = frame_id;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+tcp_image_transport::tcp_image_transport(QObject* parent)
+    : QTcpServer(parent)
+{
+    m_encoder_pool.setMaxThreadCount(2);
+    m_statistics_timer.setInterval(1000);
+    connect(&m_statistics_timer, &QTimer::timeout, this, &tcp_image_transport::on_statistics_timer);
+}
+
+tcp_image_transport::~tcp_image_transport()
+{
+    stop();
+}
+
+bool tcp_image_transport::start(const QString& ip, quint16 port)
+{
+    if (!listen(QHostAddress(ip), port))
+    {
+        write_log(QString("image transport listen on %1:%2 failed: %3").arg(ip).arg(port).arg(errorString()).toStdString().c_str());
+        return false;
+    }
+    m_statistics_timer.start();
+    return true;
+}
+
+void tcp_image_transport::stop()
+{
+    m_statistics_timer.stop();
+    close();
+    m_encoder_pool.clear();
+    m_encoder_pool.waitForDone();
+    for (QMap<QTcpSocket*, st_transport_client>::iterator iter = m_clients.begin(); iter != m_clients.end(); ++iter)
+    {
+        iter.key()->disconnect(this);
+        iter.key()->disconnectFromHost();
+        iter.key()->deleteLater();
+    }
+    m_clients.clear();
+    m_client_count.store(0);
+}
+
+void tcp_image_transport::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket* socket = new QTcpSocket(this);
+    socket->setSocketDescriptor(socketDescriptor);
+    connect(socket, &QTcpSocket::bytesWritten, this, &tcp_image_transport::on_bytes_written);
+    connect(socket, &QTcpSocket::disconnected, this, &tcp_image_transport::on_disconnected);
+    st_transport_client client;
+    client.m_socket = socket;
+    m_clients.insert(socket, client);
+    m_client_count.store(m_clients.size());
+    write_log(QString("image transport client connected: %1").arg(socket->peerAddress().toString()).toStdString().c_str());
+}
+
+bool tcp_image_transport::send_image(const QImage& img, const QString& type, st_image_meta& meta)
+{
+    if (m_client_count.load() == 0 || img.isNull())
+    {
+        return false;
+    }
+    //编码积压时丢弃连续采集帧(属于正常的降帧，不视为失败)，触发拍照和检测结果必须送达
+    if (type == "stream" && m_pending_encode_count.load() >= m_max_pending_encode)
+    {
+        return true;
+    }
+    m_pending_encode_count++;
+    quint64 frame_id = meta.frame_id;
+    int quality = m_jpeg_quality.load();
+    //QImage 隐式共享，这里只增加引用计数. 相机回调输出的影像已经是独立拷贝，不会被后续帧覆盖
+    m_encoder_pool.start([this, img, type, frame_id, quality]()
+    {
+        st_encoded_frame frame;
+        frame.m_type = type;
+        frame.m_frame_id = frame_id;
+        frame.m_packet = encode_frame(img, type, frame_id, quality);
+        m_pending_encode_count--;
+        post_encoded_frame(frame);
+    });
+    return true;
+}
+
+bool tcp_image_transport::send_ring_frame(const st_image_meta& meta)
+{
+    if (m_client_count.load() == 0)
+    {
+        return false;
+    }
+    //与 send_image 一样，编码积压时丢弃连续采集帧
+    if (m_pending_encode_count.load() >= m_max_pending_encode)
+    {
+        return true;
+    }
+    m_pending_encode_count++;
+    int quality = m_jpeg_quality.load();
+    m_encoder_pool.start([this, meta, quality]()
+    {
+        st_encoded_frame frame;
+        frame.m_type = "stream";
+        frame.m_frame_id = meta.frame_id;
+        frame.m_packet = encode_ring_frame(meta, quality);
+        m_pending_encode_count--;
+        post_encoded_frame(frame);
+    });
+    return true;
+}
+
+void tcp_image_transport::post_encoded_frame(const st_encoded_frame& frame)
+{
+    if (frame.m_packet.isEmpty())
+    {
+        return;
+    }
+    //回到主线程分发，socket 只能在所属线程中访问
+    QMetaObject::invokeMethod(this, [this, frame]() { dispatch_frame(frame); }, Qt::QueuedConnection);
+}
+
+QByteArray tcp_image_transport::encode_frame(const QImage& img, const QString& type, quint64 frame_id, int quality)
+{
+    //灰度影像直接编码; 彩色影像转换为 imencode 需要的 BGR 顺序(JPEG 编码唯一需要颜色转换的地方)
+    cv::Mat image = img.format() == QImage::Format_RGB888 ? convert_qimage_to_cvmat(img, 3) : qimage_to_gray_cvmat(img);
+    if (image.empty())
+    {
+        return QByteArray();
+    }
+    std::vector<uchar> buffer;
+    if (!cv::imencode(".jpg", image, buffer, { cv::IMWRITE_JPEG_QUALITY, quality }))
+    {
+        return QByteArray();
+    }
+    return pack_frame(buffer, type, frame_id, img.width(), img.height(), quality);
+}
+
+QByteArray tcp_image_transport::encode_ring_frame(const st_image_meta& meta, int quality)
+{
+    cv::Mat image;
+    int bit_depth = 8;
+    {
+        //绑定共享内存段会修改读端状态，只在拷贝槽位数据期间持有锁，颜色转换和编码不占用读端，编码线程可以并行
+        QMutexLocker locker(&m_ring_reader_mutex);
+        st_image_view view;
+        if (!m_ring_reader.map_image(meta, view))
+        {
+            return QByteArray();        //该槽位已写入更新的帧
+        }
+        //槽位以只读方式映射，拷贝之后再处理
+        int type = view.m_channels == 3 ? CV_8UC3 : (view.m_bit_depth > 8 ? CV_16UC1 : CV_8UC1);
+        image = cv::Mat(view.m_height, view.m_width, type, const_cast<uchar*>(view.m_data)).clone();
+        bit_depth = view.m_bit_depth;
+        //拷贝期间相机回调已覆盖该槽位，数据可能不完整，丢弃
+        if (!m_ring_reader.validate(view))
+        {
+            return QByteArray();
+        }
+    }
+    if (image.channels() == 3)
+    {
+        add_converted_bytes(static_cast<long long>(image.total() * image.elemSize()));
+        cv::Mat bgr;
+        cv::cvtColor(image, bgr, cv::COLOR_RGB2BGR);      //imencode 按照 BGR 顺序编码
+        image = bgr;
+    }
+    else if (bit_depth > 8)
+    {
+        add_converted_bytes(static_cast<long long>(image.total() * image.elemSize()));
+        cv::Mat gray;
+        image.convertTo(gray, CV_8U, 255.0 / ((1 << bit_depth) - 1));     //JPEG 只支持 8 位
+        image = gray;
+    }
+    std::vector<uchar> buffer;
+    if (!cv::imencode(".jpg", image, buffer, { cv::IMWRITE_JPEG_QUALITY, quality }))
+    {
+        return QByteArray();
+    }
+    return pack_frame(buffer, "stream", meta.frame_id, meta.width, meta.height, quality);
+}
+
+QByteArray tcp_image_transport::pack_frame(const std::vector<uchar>& buffer, const QString& type, quint64 frame_id, int width, int height, int quality)
+{
+    QJsonObject header;
+    header["frame_id"] = static_cast<qint64>(frame_id);
+    header["type"] = type;
+    header["width"] = width;
+    header["height"] = height;
+    header["jpeg_quality"] = quality;
+    header["size"] = static_cast<qint64>(buffer.size());
+    QByteArray header_data = QJsonDocument(header).toJson(QJsonDocument::Compact);
+
+    QByteArray packet;
+    packet.reserve(4 + header_data.size() + static_cast<qsizetype>(buffer.size()));
+    QDataStream out(&packet, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian); // 网络字节序
+    out << static_cast<qint32>(header_data.size());
+    packet.append(header_data);
+    packet.append(reinterpret_cast<const char*>(buffer.data()), static_cast<qsizetype>(buffer.size()));
+    return packet;
+}
+
+void tcp_image_transport::dispatch_frame(const st_encoded_frame& frame)
+{
+    for (QMap<QTcpSocket*, st_transport_client>::iterator iter = m_clients.begin(); iter != m_clients.end(); ++iter)
+    {
+        st_transport_client& client = iter.value();
+        if (frame.m_type == "stream")
+        {
+            //连续采集帧只保留最新的一帧，队列中尚未发送的旧帧直接丢弃
+            for (QQueue<st_encoded_frame>::iterator it = client.m_send_queue.begin(); it != client.m_send_queue.end(); )
+            {
+                if (it->m_type == "stream")
+                {
+                    it = client.m_send_queue.erase(it);
+                    client.m_frames_dropped++;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            if (client.m_send_queue.size() >= m_max_queue_size)
+            {
+                client.m_frames_dropped++;
+                continue;
+            }
+        }
+        //QByteArray 隐式共享，多个客户端共用同一份编码数据
+        client.m_send_queue.enqueue(frame);
+        send_pending(client);
+    }
+}
+
+void tcp_image_transport::send_pending(st_transport_client& client)
+{
+    while (!client.m_send_queue.isEmpty() && client.m_socket->bytesToWrite() < m_high_water_mark)
+    {
+        st_encoded_frame frame = client.m_send_queue.dequeue();
+        client.m_socket->write(frame.m_packet);
+        client.m_frames_sent++;
+        client.m_window_frames++;
+    }
+}
+
+void tcp_image_transport::on_bytes_written(qint64 bytes)
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    QMap<QTcpSocket*, st_transport_client>::iterator iter = m_clients.find(socket);
+    if (iter == m_clients.end())
+    {
+        return;
+    }
+    iter->m_bytes_sent += bytes;
+    iter->m_window_bytes += bytes;
+    send_pending(iter.value());
+}
+
+void tcp_image_transport::on_disconnected()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    QMap<QTcpSocket*, st_transport_client>::iterator iter = m_clients.find(socket);
+    if (iter != m_clients.end())
+    {
+        write_log(QString("image transport client disconnected: %1, frames sent %2, bytes sent %3, frames dropped %4")
+            .arg(socket->peerAddress().toString()).arg(iter->m_frames_sent).arg(iter->m_bytes_sent).arg(iter->m_frames_dropped)
+            .toStdString().c_str());
+        m_clients.erase(iter);
+    }
+    m_client_count.store(m_clients.size());
+    socket->deleteLater();
+}
+
+void tcp_image_transport::on_statistics_timer()
+{
+    for (QMap<QTcpSocket*, st_transport_client>::iterator iter = m_clients.begin(); iter != m_clients.end(); ++iter)
+    {
+        st_transport_client& client = iter.value();
+        client.m_frames_per_second = static_cast<double>(client.m_window_frames);
+        client.m_bytes_per_second = static_cast<double>(client.m_window_bytes);
+        client.m_window_frames = 0;
+        client.m_window_bytes = 0;
+    }
+    //格式转换统计: 从无到有时记录日志，便于发现引入了不必要颜色转换的改动
+    long long converted_bytes = converted_bytes_total();
+    double converted_bytes_per_second = static_cast<double>(converted_bytes - m_last_converted_bytes);
+    if (m_converted_bytes_per_second <= 0.0 && converted_bytes_per_second > 0.0)
+    {
+        write_log(QString("image format conversion active: %1 bytes/s").arg(converted_bytes_per_second, 0, 'f', 0).toStdString().c_str());
+    }
+    m_converted_bytes_per_second = converted_bytes_per_second;
+    m_last_converted_bytes = converted_bytes;
+}
+
+QJsonArray tcp_image_transport::get_statistics() const
+{
+    QJsonArray array;
+    for (QMap<QTcpSocket*, st_transport_client>::const_iterator iter = m_clients.begin(); iter != m_clients.end(); ++iter)
+    {
+        const st_transport_client& client = iter.value();
+        QJsonObject obj;
+        obj["address"] = client.m_socket->peerAddress().toString();
+        obj["port"] = client.m_socket->peerPort();
+        obj["frames_per_second"] = client.m_frames_per_second;
+        obj["bytes_per_second"] = client.m_bytes_per_second;
+        obj["frames_sent"] = static_cast<qint64>(client.m_frames_sent);
+        obj["bytes_sent"] = static_cast<qint64>(client.m_bytes_sent);
+        obj["frames_dropped"] = static_cast<qint64>(client.m_frames_dropped);
+        obj["queue_size"] = client.m_send_queue.size();
+        array.append(obj);
+    }
+    return array;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+image_transport_mgr::image_transport_mgr()
+{
+    m_tcp_transport = new tcp_image_transport();
+}
+
+image_transport_mgr::~image_transport_mgr()
+{
+    delete m_tcp_transport;
+    m_tcp_transport = nullptr;
+}
+
+bool image_transport_mgr::start(const QString& ip, quint16 port)
+{
+    return m_tcp_transport->start(ip, port);
+}
+
+void image_transport_mgr::stop()
+{
+    m_tcp_transport->stop();
+}
+
+bool image_transport_mgr::is_local_address(const QHostAddress& address)
+{
+    //IPv4 映射的 IPv6 地址(::ffff:127.0.0.1)也视为本机
+    bool ok(false);
+    quint32 ipv4 = address.toIPv4Address(&ok);
+    if (ok)
+    {
+        return QHostAddress(ipv4).isLoopback();
+    }
+    return address.isLoopback();
+}
+
+bool image_transport_mgr::add_client(const QHostAddress& address)
+{
+    bool is_local = is_local_address(address);
+    if (is_local)
+    {
+        m_local_client_count++;
+    }
+    return is_local;
+}
+
+void image_transport_mgr::remove_client(bool is_local)
+{
+    if (is_local && m_local_client_count.load() > 0)
+    {
+        m_local_client_count--;
+    }
+}
+
+bool image_transport_mgr::send_image(const QImage& img, const QString& type, st_image_meta& meta)
+{
+    meta.frame_id = ++m_frame_counter;
+    bool has_remote = m_tcp_transport->client_count() > 0;
+    bool ret(false);
+    //没有远程客户端时始终写共享内存，与原有行为保持一致
+    if (m_local_client_count.load() > 0 || !has_remote)
+    {
+        ret = m_shared_memory_transport.send_image(img, type, meta);
+    }
+    if (has_remote)
+    {
+        ret = m_tcp_transport->send_image(img, type, meta) || ret;
+    }
+    return ret;
+}
+
+bool image_transport_mgr::publish_stream_frame(st_image_meta& meta)
+{
+    //槽位中的帧编号由环形缓冲区维护，这里替换为全局帧编号，与其他类型的影像保持一致
+    meta.frame_id = ++m_frame_counter;
+    if (m_tcp_transport->client_count() > 0)
+    {
+        m_tcp_transport->send_ring_frame(meta);
+    }
+    return true;
+}
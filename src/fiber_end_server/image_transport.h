@@ -0,0 +1,163 @@
+﻿/***************************************************************
+ * 影像传输模块(见 docs/adr/007-adaptive-image-transport.md)
+ * (1) 本机客户端(127.0.0.1/::1): 影像写入共享内存，TCP 消息中只发送元数据
+ * (2) 远程客户端: 影像在编码线程池中压缩为 JPEG，通过独立端口(默认 5556)发送
+ * thread_misc 只需要调用 image_transport_mgr::send_image，不关心客户端位于何处
+ * (3) 连续采集: 支持的相机在回调中直接写入 stream_ring()，之后只传递槽位元数据(publish_stream_frame)
+ ***************************************************************/
+
+#pragma once
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QThreadPool>
+#include <QTimer>
+#include <QMutex>
+#include <QQueue>
+#include <QMap>
+#include <QImage>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <atomic>
+#include <vector>
+
+#include "../common/image_shared_memory.h"
+
+constexpr int detect_image_slot_count = 16;     //检测结果影像槽位数量，一个拍照位置包含多个端面，并且客户端在收到检测消息之后才读取
+
+//影像传输接口
+class interface_image_transport
+{
+public:
+    virtual ~interface_image_transport() = default;
+
+    /***************************************
+     * 发送影像
+     * const QString& type -- 影像类型 "stream":连续采集 "trigger":触发拍照 "annotated":检测结果
+     * st_image_meta& meta -- 输入时 frame_id 为帧编号，输出客户端读取影像需要的元数据
+     ***************************************/
+    virtual bool send_image(const QImage& img, const QString& type, st_image_meta& meta) = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//共享内存传输，同一台机器上的客户端使用
+class shared_memory_image_transport : public interface_image_transport
+{
+public:
+    shared_memory_image_transport();
+    ~shared_memory_image_transport() override;
+    bool send_image(const QImage& img, const QString& type, st_image_meta& meta) override;
+private:
+    QMutex m_mutex;                                             //连续采集和触发拍照可能在不同线程写入
+    QMap<QString, image_shared_memory*> m_shared_memories;      //共享内存前缀 --> 共享内存对象
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//编码之后的一帧数据，已按照协议打包，可以直接写入 socket
+struct st_encoded_frame
+{
+    QString m_type{ "" };
+    quint64 m_frame_id{ 0 };
+    QByteArray m_packet;            //[4-byte BE 头长度][JSON 头][JPEG 数据]
+};
+
+//每个远程客户端的发送状态
+struct st_transport_client
+{
+    QTcpSocket* m_socket{ nullptr };
+    QQueue<st_encoded_frame> m_send_queue;      //待发送队列
+    quint64 m_frames_sent{ 0 };                 //累计发送帧数
+    quint64 m_bytes_sent{ 0 };                  //累计发送字节数
+    quint64 m_frames_dropped{ 0 };              //累计丢弃帧数(过期的连续采集帧)
+    quint64 m_window_frames{ 0 };               //统计窗口内发送帧数
+    quint64 m_window_bytes{ 0 };                //统计窗口内发送字节数
+    double m_frames_per_second{ 0.0 };          //最近一个统计窗口的帧率
+    double m_bytes_per_second{ 0.0 };           //最近一个统计窗口的码率
+};
+
+//TCP 传输，远程客户端使用
+class tcp_image_transport : public QTcpServer, public interface_image_transport
+{
+    Q_OBJECT
+public:
+    explicit tcp_image_transport(QObject* parent = nullptr);
+    ~tcp_image_transport() override;
+
+    bool start(const QString& ip, quint16 port);
+    void stop();
+
+    //线程安全. 编码在线程池中执行，编码完毕之后在主线程中分发给所有客户端
+    bool send_image(const QImage& img, const QString& type, st_image_meta& meta) override;
+    //线程安全. 连续采集帧已在环形缓冲区中，编码线程直接映射槽位编码，不再拷贝. 编码期间槽位被覆盖时丢弃该帧
+    bool send_ring_frame(const st_image_meta& meta);
+
+    int client_count() const { return m_client_count.load(); }
+    void set_jpeg_quality(int quality) { m_jpeg_quality.store(quality); }
+    QJsonArray get_statistics() const;          //每个客户端的帧率、码率、丢帧数量，主线程调用
+    double converted_bytes_per_second() const { return m_converted_bytes_per_second; }     //最近一秒影像格式转换的字节数(全进程)
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private slots:
+    void on_bytes_written(qint64 bytes);
+    void on_disconnected();
+    void on_statistics_timer();
+
+private:
+    static QByteArray encode_frame(const QImage& img, const QString& type, quint64 frame_id, int quality);
+    QByteArray encode_ring_frame(const st_image_meta& meta, int quality);       //从环形缓冲区槽位编码
+    static QByteArray pack_frame(const std::vector<uchar>& buffer, const QString& type, quint64 frame_id, int width, int height, int quality);   //按协议打包
+    void post_encoded_frame(const st_encoded_frame& frame);     //编码完毕，回到主线程分发
+    void dispatch_frame(const st_encoded_frame& frame);        //编码完毕，加入所有客户端的发送队列
+    void send_pending(st_transport_client& client);            //在 socket 缓冲区低于高水位时发送队列中的数据
+
+    QThreadPool m_encoder_pool;                         //JPEG 编码线程池
+    std::atomic<int> m_pending_encode_count{ 0 };       //正在编码的帧数
+    std::atomic<int> m_client_count{ 0 };               //已连接的客户端数量
+    std::atomic<int> m_jpeg_quality{ 85 };
+    int m_max_pending_encode{ 4 };                      //编码积压超过该值时丢弃新的连续采集帧
+    int m_max_queue_size{ 8 };                          //每个客户端发送队列的最大长度
+    qint64 m_high_water_mark{ 4 * 1024 * 1024 };        //socket 待发送字节数高水位，超过之后暂停写入
+    QMap<QTcpSocket*, st_transport_client> m_clients;   //客户端及其发送状态，只在主线程访问
+    QMutex m_ring_reader_mutex;                         //编码线程共用读端，绑定共享内存段时需要互斥
+    image_shared_memory m_ring_reader{ "" };            //连续采集环形缓冲区的读端
+    QTimer m_statistics_timer;                          //每秒统计一次帧率和码率
+    long long m_last_converted_bytes{ 0 };              //上一次统计时的格式转换累计字节数
+    double m_converted_bytes_per_second{ 0.0 };         //影像格式转换速率，灰度相机正常情况下应为 0
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+//影像传输管理，根据已连接客户端的地址选择传输方式
+class image_transport_mgr
+{
+public:
+    image_transport_mgr();
+    ~image_transport_mgr();
+
+    bool start(const QString& ip, quint16 port);        //启动 TCP 影像端口
+    void stop();
+
+    //命令端口(5555)上有客户端连接/断开时调用，用于决定是否需要写共享内存. add_client 返回是否为本机客户端
+    bool add_client(const QHostAddress& address);
+    void remove_client(bool is_local);
+    static bool is_local_address(const QHostAddress& address);
+
+    //线程安全. 为影像分配帧编号，然后根据客户端类型写入共享内存和/或发送给远程客户端
+    bool send_image(const QImage& img, const QString& type, st_image_meta& meta);
+
+    /***************************************
+     * 连续采集零拷贝路径: 相机回调线程直接写入 stream_ring() 的槽位，然后调用 publish_stream_frame
+     * 为该帧分配帧编号，有远程客户端时编码线程直接从槽位编码. 本机客户端根据元数据读取共享内存
+     ***************************************/
+    image_shared_memory* stream_ring() { return &m_stream_ring; }
+    bool publish_stream_frame(st_image_meta& meta);
+
+    tcp_image_transport* tcp_transport() const { return m_tcp_transport; }
+private:
+    shared_memory_image_transport m_shared_memory_transport;
+    tcp_image_transport* m_tcp_transport{ nullptr };
+    image_shared_memory m_stream_ring{ "stream_image" };       //连续采集环形缓冲区，只由相机回调线程写入
+    std::atomic<int> m_local_client_count{ 0 };         //本机客户端数量
+    std::atomic<quint64> m_frame_counter{ 0 };          //帧编号，共享内存和 TCP 使用相同的编号，客户端据此匹配消息和影像
+};
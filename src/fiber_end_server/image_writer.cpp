@@ -0,0 +1,367 @@
+﻿#include "image_writer.h"
+#include <QFile>
+#include <chrono>
+#include <cstring>
+
+#include "../common/common.h"
+
+void st_write_batch::wait()
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_pending > 0)
+    {
+        m_condition.wait(&m_mutex);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+image_writer::image_writer(int thread_count, int max_queue_size)
+    : m_max_queue_size(std::max(1, max_queue_size))
+{
+    m_pool.setMaxThreadCount(std::max(1, thread_count));
+}
+
+image_writer::~image_writer()
+{
+    flush();
+    m_pool.waitForDone();
+}
+
+void image_writer::set_codec(image_destination destination, const st_image_codec_config& config)
+{
+    QMutexLocker locker(&m_mutex);
+    m_codecs[destination] = config;
+    m_codecs[destination].m_png_compression = std::clamp(config.m_png_compression, 0, 9);
+}
+
+st_image_codec_config image_writer::codec(image_destination destination)
+{
+    QMutexLocker locker(&m_mutex);
+    return m_codecs[destination];
+}
+
+QString image_writer::extension(image_codec codec)
+{
+    switch (codec)
+    {
+    case IMAGE_CODEC_TIFF:
+        return QString(".tif");
+    case IMAGE_CODEC_RAW:
+        return QString(".raw");
+    case IMAGE_CODEC_QOI:
+        return QString(".qoi");
+    default:
+        return QString(".png");
+    }
+}
+
+image_codec image_writer::codec_from_string(const QString& name, image_codec default_codec)
+{
+    QString codec = name.toLower();
+    if (codec == "png")
+    {
+        return IMAGE_CODEC_PNG;
+    }
+    if (codec == "tiff" || codec == "tif")
+    {
+        return IMAGE_CODEC_TIFF;
+    }
+    if (codec == "raw")
+    {
+        return IMAGE_CODEC_RAW;
+    }
+    if (codec == "qoi")
+    {
+        return IMAGE_CODEC_QOI;
+    }
+    return default_codec;
+}
+
+QString image_writer::write(image_destination destination, const QString& base_path, const cv::Mat& image,
+    const std::shared_ptr<st_write_batch>& batch)
+{
+    st_image_codec_config config = codec_for(destination, image);
+    QString path = base_path + extension(config.m_codec);
+    enqueue([path, image, config](qint64& bytes)
+        {
+            std::vector<uchar> buffer;
+            if (!encode(image, config, buffer) ||
+                !write_file(path, reinterpret_cast<const char*>(buffer.data()), static_cast<qint64>(buffer.size())))
+            {
+                write_log(l(QString("image writer: failed to write %1").arg(path)).c_str());
+                return false;
+            }
+            bytes = static_cast<qint64>(buffer.size());
+            return true;
+        }, batch);
+    return path;
+}
+
+void image_writer::write_archive(result_archive* archive, const st_archive_index_record& entry, const cv::Mat& image)
+{
+    st_image_codec_config config = codec_for(IMAGE_DESTINATION_ARCHIVE, image);
+    st_archive_index_record record = entry;
+    record.m_codec = static_cast<qint16>(config.m_codec);
+    enqueue([archive, record, image, config](qint64& bytes)
+        {
+            std::vector<uchar> buffer;
+            if (!encode(image, config, buffer) ||
+                !archive->append(record, reinterpret_cast<const char*>(buffer.data()), static_cast<qint64>(buffer.size())))
+            {
+                write_log(l(QString("image writer: failed to archive position %1 fiber %2")
+                    .arg(record.m_position_index).arg(record.m_fiber_index)).c_str());
+                return false;
+            }
+            bytes = static_cast<qint64>(buffer.size());
+            return true;
+        }, nullptr);
+}
+
+st_image_codec_config image_writer::codec_for(image_destination destination, const cv::Mat& image)
+{
+    QMutexLocker locker(&m_mutex);
+    st_image_codec_config config = m_codecs[destination];
+    //QOI 只支持 8 位单通道/三通道影像
+    if (config.m_codec == IMAGE_CODEC_QOI && image.type() != CV_8UC1 && image.type() != CV_8UC3)
+    {
+        config.m_codec = IMAGE_CODEC_PNG;
+    }
+    return config;
+}
+
+void image_writer::enqueue(const std::function<bool(qint64&)>& job, const std::shared_ptr<st_write_batch>& batch)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        //背压: 队列已满时等待，写盘速度跟不上时提交者变慢，而不是无限堆积影像
+        if (m_pending >= m_max_queue_size)
+        {
+            m_blocked_count++;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            while (m_pending >= m_max_queue_size)
+            {
+                m_not_full_condition.wait(&m_mutex);
+            }
+            m_blocked_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        m_pending++;
+        m_max_pending = std::max(m_max_pending, m_pending);
+    }
+    if (batch != nullptr)
+    {
+        QMutexLocker locker(&batch->m_mutex);
+        batch->m_pending++;
+    }
+    m_pool.start([this, job, batch]()
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            qint64 bytes(0);
+            bool ret = job(bytes);
+            double use_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (batch != nullptr)
+            {
+                QMutexLocker locker(&batch->m_mutex);
+                batch->m_pending--;
+                batch->m_failed += ret ? 0 : 1;
+                if (batch->m_pending == 0)
+                {
+                    batch->m_condition.wakeAll();
+                }
+            }
+            QMutexLocker locker(&m_mutex);
+            m_written_count += ret ? 1 : 0;
+            m_failed_count += ret ? 0 : 1;
+            m_written_bytes += bytes;
+            m_encode_ms += use_ms;
+            m_pending--;
+            m_not_full_condition.wakeOne();
+            if (m_pending == 0)
+            {
+                m_idle_condition.wakeAll();
+            }
+        });
+}
+
+void image_writer::flush()
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_pending > 0)
+    {
+        m_idle_condition.wait(&m_mutex);
+    }
+}
+
+QJsonObject image_writer::statistics()
+{
+    QMutexLocker locker(&m_mutex);
+    QJsonObject obj;
+    obj["written_count"] = static_cast<qint64>(m_written_count);
+    obj["failed_count"] = static_cast<qint64>(m_failed_count);
+    obj["written_bytes"] = m_written_bytes;
+    obj["average_write_ms"] = m_written_count + m_failed_count > 0 ? m_encode_ms / (m_written_count + m_failed_count) : 0.0;
+    obj["pending"] = m_pending;
+    obj["max_pending"] = m_max_pending;
+    obj["max_queue_size"] = m_max_queue_size;
+    obj["blocked_count"] = static_cast<qint64>(m_blocked_count);
+    obj["blocked_ms"] = m_blocked_ms;
+    return obj;
+}
+
+void image_writer::reset_statistics()
+{
+    QMutexLocker locker(&m_mutex);
+    m_written_count = m_failed_count = 0;
+    m_written_bytes = 0;
+    m_encode_ms = 0.0;
+    m_max_pending = m_pending;
+    m_blocked_count = 0;
+    m_blocked_ms = 0.0;
+}
+
+bool image_writer::encode(const cv::Mat& image, const st_image_codec_config& config, std::vector<uchar>& buffer)
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    try
+    {
+        switch (config.m_codec)
+        {
+        case IMAGE_CODEC_TIFF:
+            //1 -- 不压缩
+            return cv::imencode(".tif", image, buffer, { cv::IMWRITE_TIFF_COMPRESSION, 1 });
+        case IMAGE_CODEC_RAW:
+            return encode_raw(image, buffer);
+        case IMAGE_CODEC_QOI:
+            return encode_qoi(image, buffer);
+        default:
+            return cv::imencode(".png", image, buffer, { cv::IMWRITE_PNG_COMPRESSION, config.m_png_compression });
+        }
+    }
+    catch (const cv::Exception& e)
+    {
+        write_log(e.what());
+    }
+    return false;
+}
+
+bool image_writer::write_file(const QString& path, const char* data, qint64 size)
+{
+    //通过 QFile 写入，路径中包含中文时 cv::imwrite 在 Windows 上会失败
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+    return file.write(data, size) == size;
+}
+
+bool image_writer::encode_raw(const cv::Mat& image, std::vector<uchar>& buffer)
+{
+    qint32 header[4] = { 0x57524746, image.cols, image.rows, image.type() };     //'FGRW'
+    size_t row_bytes = image.cols * image.elemSize();
+    buffer.resize(sizeof(header) + row_bytes * image.rows);
+    memcpy(buffer.data(), header, sizeof(header));
+    uchar* dst = buffer.data() + sizeof(header);
+    for (int row = 0; row < image.rows; row++)
+    {
+        memcpy(dst + row * row_bytes, image.ptr(row), row_bytes);
+    }
+    return true;
+}
+
+bool image_writer::encode_qoi(const cv::Mat& image, std::vector<uchar>& buffer)
+{
+    /***************************************
+     * QOI 编码: 文件头 14 字节('qoif' + 宽 + 高(大端) + 通道数 + 色彩空间)，之后逐像素选择以下操作之一
+     * RUN(与前一像素相同的连续像素) / INDEX(与最近出现的 64 种颜色之一相同) / DIFF / LUMA(与前一像素的差值较小) / RGB
+     * 最后以 7 个 0x00 和 1 个 0x01 结束
+     ***************************************/
+    const int channels = image.channels();
+    const size_t pixel_count = static_cast<size_t>(image.cols) * image.rows;
+    buffer.clear();
+    buffer.reserve(14 + pixel_count * 4 + 8);
+    auto push_u32 = [&buffer](quint32 value)
+    {
+        buffer.push_back(static_cast<uchar>(value >> 24));
+        buffer.push_back(static_cast<uchar>(value >> 16));
+        buffer.push_back(static_cast<uchar>(value >> 8));
+        buffer.push_back(static_cast<uchar>(value));
+    };
+    buffer.insert(buffer.end(), { 'q', 'o', 'i', 'f' });
+    push_u32(static_cast<quint32>(image.cols));
+    push_u32(static_cast<quint32>(image.rows));
+    buffer.push_back(3);        //RGB
+    buffer.push_back(0);        //sRGB
+
+    uchar index[64][3];
+    memset(index, 0, sizeof(index));
+    uchar prev[3] = { 0, 0, 0 };
+    int run(0);
+    size_t position(0);
+    for (int row = 0; row < image.rows; row++)
+    {
+        const uchar* src = image.ptr(row);
+        for (int col = 0; col < image.cols; col++, position++)
+        {
+            uchar px[3];
+            if (channels == 1)
+            {
+                px[0] = px[1] = px[2] = src[col];
+            }
+            else
+            {
+                px[0] = src[col * 3 + 2];       //BGR --> RGB
+                px[1] = src[col * 3 + 1];
+                px[2] = src[col * 3];
+            }
+            if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2])
+            {
+                run++;
+                if (run == 62 || position == pixel_count - 1)
+                {
+                    buffer.push_back(static_cast<uchar>(0xc0 | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0)
+            {
+                buffer.push_back(static_cast<uchar>(0xc0 | (run - 1)));
+                run = 0;
+            }
+            int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+            if (index[hash][0] == px[0] && index[hash][1] == px[1] && index[hash][2] == px[2])
+            {
+                buffer.push_back(static_cast<uchar>(hash));
+            }
+            else
+            {
+                memcpy(index[hash], px, 3);
+                signed char vr = static_cast<signed char>(px[0] - prev[0]);
+                signed char vg = static_cast<signed char>(px[1] - prev[1]);
+                signed char vb = static_cast<signed char>(px[2] - prev[2]);
+                signed char vg_r = static_cast<signed char>(vr - vg);
+                signed char vg_b = static_cast<signed char>(vb - vg);
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+                {
+                    buffer.push_back(static_cast<uchar>(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+                {
+                    buffer.push_back(static_cast<uchar>(0x80 | (vg + 32)));
+                    buffer.push_back(static_cast<uchar>((vg_r + 8) << 4 | (vg_b + 8)));
+                }
+                else
+                {
+                    buffer.push_back(0xfe);
+                    buffer.insert(buffer.end(), px, px + 3);
+                }
+            }
+            memcpy(prev, px, 3);
+        }
+    }
+    buffer.insert(buffer.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+    return true;
+}
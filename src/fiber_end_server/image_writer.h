@@ -0,0 +1,114 @@
+﻿/***************************************************************
+ * 异步影像写入模块
+ * 检测结果影像的编码和写盘不在检测/运动线程中执行:
+ * (1) 调用者提交影像之后立即返回，由线程池编码并写入文件. 队列已满时阻塞提交者(背压)，并统计阻塞次数和时间
+ * (2) 每个目标(归档目录/调试目录)可以单独指定编码方式，文件扩展名由编码方式决定
+ *     PNG   -- 可设置压缩级别(0-9)，级别越低越快
+ *     TIFF  -- 不压缩
+ *     RAW   -- 16 字节文件头 + 按行紧密排列的像素数据，文件头: 'FGRW' + width + height + cv 类型(int32，小端)
+ *     QOI   -- 快速无损压缩(https://qoiformat.org)，只支持 8 位单通道/三通道影像，单通道按 RGB 写入. 其他格式回退到 PNG
+ * (3) st_write_batch 用于等待一组影像写入完毕，flush 等待所有已提交的影像写入完毕
+ * (4) 开启结果归档时，归档影像编码之后追加到 result_archive 的分段文件中，不再逐张写文件
+ ***************************************************************/
+#pragma once
+#include <QThreadPool>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QJsonObject>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <opencv2/opencv.hpp>
+
+#include "result_archive.h"
+
+//影像编码方式
+enum image_codec
+{
+    IMAGE_CODEC_PNG = 0,
+    IMAGE_CODEC_TIFF = 1,
+    IMAGE_CODEC_RAW = 2,
+    IMAGE_CODEC_QOI = 3,
+};
+
+//写入目标，每个目标单独指定编码方式
+enum image_destination
+{
+    IMAGE_DESTINATION_ARCHIVE = 0,      //用户指定的保存目录
+    IMAGE_DESTINATION_DEBUG = 1,        //内部调试影像
+    IMAGE_DESTINATION_COUNT
+};
+
+struct st_image_codec_config
+{
+    image_codec m_codec{ IMAGE_CODEC_PNG };
+    int m_png_compression{ 1 };         //PNG 压缩级别 0-9
+};
+
+//一组写入请求，用于等待这一组影像全部写入完毕
+struct st_write_batch
+{
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    int m_pending{ 0 };
+    int m_failed{ 0 };
+
+    void wait();                        //等待所有影像写入完毕
+};
+
+class image_writer
+{
+public:
+    explicit image_writer(int thread_count = 2, int max_queue_size = 32);
+    ~image_writer();
+
+    void set_codec(image_destination destination, const st_image_codec_config& config);
+    st_image_codec_config codec(image_destination destination);
+    static QString extension(image_codec codec);
+    static image_codec codec_from_string(const QString& name, image_codec default_codec = IMAGE_CODEC_PNG);
+
+    /***************************************
+     * 提交写入请求，立即返回(队列已满时等待)
+     * image_destination destination -- 写入目标，决定编码方式
+     * const QString& base_path -- 不带扩展名的文件路径，扩展名由编码方式决定
+     * const cv::Mat& image -- 影像数据，只增加引用计数不拷贝，提交之后调用者不能再修改其中的数据
+     * std::shared_ptr<st_write_batch> batch -- 可选，写入完毕之后通知
+     * 返回值: 实际写入的文件路径
+     ***************************************/
+    QString write(image_destination destination, const QString& base_path, const cv::Mat& image,
+        const std::shared_ptr<st_write_batch>& batch = nullptr);
+
+    //以归档目标的编码方式编码之后追加到归档文件，entry 中的编码方式由这里填写. archive 在写入完毕(flush)之前必须有效
+    void write_archive(result_archive* archive, const st_archive_index_record& entry, const cv::Mat& image);
+
+    //写入屏障: 等待所有已提交的影像写入完毕
+    void flush();
+
+    QJsonObject statistics();           //写入数量、字节数、编码耗时、队列深度和背压统计
+    void reset_statistics();
+
+private:
+    st_image_codec_config codec_for(image_destination destination, const cv::Mat& image);      //目标的编码方式，影像格式不支持时回退到 PNG
+    void enqueue(const std::function<bool(qint64&)>& job, const std::shared_ptr<st_write_batch>& batch);  //背压等待之后交给线程池执行
+    static bool encode(const cv::Mat& image, const st_image_codec_config& config, std::vector<uchar>& buffer);
+    static bool write_file(const QString& path, const char* data, qint64 size);
+    static bool encode_raw(const cv::Mat& image, std::vector<uchar>& buffer);
+    static bool encode_qoi(const cv::Mat& image, std::vector<uchar>& buffer);
+
+    QThreadPool m_pool;
+    QMutex m_mutex;
+    QWaitCondition m_not_full_condition;        //队列出现空位时唤醒提交者
+    QWaitCondition m_idle_condition;            //所有影像写入完毕时唤醒 flush
+    int m_max_queue_size{ 32 };
+    int m_pending{ 0 };                         //已提交尚未写入完毕的影像数量
+    st_image_codec_config m_codecs[IMAGE_DESTINATION_COUNT];
+
+    //统计信息，受 m_mutex 保护
+    quint64 m_written_count{ 0 };
+    quint64 m_failed_count{ 0 };
+    qint64 m_written_bytes{ 0 };
+    double m_encode_ms{ 0.0 };                  //累计编码+写盘耗时
+    int m_max_pending{ 0 };                     //最大队列深度
+    quint64 m_blocked_count{ 0 };               //提交时队列已满的次数
+    double m_blocked_ms{ 0.0 };                 //提交者累计等待时间
+};
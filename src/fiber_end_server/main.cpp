@@ -3,9 +3,23 @@
 #include <QtCore/QCoreApplication>
 
 #include "server.h"
+#include "dispatch_benchmark.h"
 int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
+    //命令分发开销测试: backend.exe --benchmark-dispatch [次数] [客户端数量]
+    if (argc >= 2 && QString(argv[1]) == "--benchmark-dispatch")
+    {
+        int iterations = argc >= 3 ? QString(argv[2]).toInt() : 200000;
+        int client_count = argc >= 4 ? QString(argv[3]).toInt() : 4;
+        return run_dispatch_benchmark(iterations, client_count);
+    }
+    //消息编码测试: backend.exe --benchmark-encoding [次数]
+    if (argc >= 2 && QString(argv[1]) == "--benchmark-encoding")
+    {
+        int iterations = argc >= 3 ? QString(argv[2]).toInt() : 100000;
+        return run_encoding_benchmark(iterations);
+    }
     QString lockFilePath = QDir::temp().absoluteFilePath("fiber_end_server.lock");
     QLockFile lockFile(lockFilePath);
     if (!lockFile.tryLock())
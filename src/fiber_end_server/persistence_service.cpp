@@ -0,0 +1,167 @@
+﻿#include "persistence_service.h"
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDir>
+
+#include "../common/common.h"
+
+persistence_service& persistence_service::instance()
+{
+    static persistence_service service;
+    return service;
+}
+
+persistence_service::~persistence_service()
+{
+    stop();
+}
+
+void persistence_service::set_batch_window(int window_ms)
+{
+    QMutexLocker locker(&m_mutex);
+    m_batch_window_ms = window_ms;
+    m_condition.wakeAll();
+}
+
+void persistence_service::submit(const QString& file_path, const QByteArray& content)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_running)
+    {
+        //服务已停止(程序退出过程中)，直接写入
+        locker.unlock();
+        write_file(file_path, content);
+        return;
+    }
+    if (m_pending.isEmpty())
+    {
+        m_first_pending = std::chrono::steady_clock::now();
+    }
+    QMap<QString, QByteArray>::iterator iter = m_pending.find(file_path);
+    if (iter != m_pending.end())
+    {
+        iter.value() = content;
+        m_coalesced_count++;
+    }
+    else
+    {
+        m_pending.insert(file_path, content);
+    }
+    m_submit_count++;
+    if (!isRunning())
+    {
+        start(QThread::LowPriority);
+    }
+    m_condition.wakeAll();
+}
+
+void persistence_service::flush()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!isRunning())
+    {
+        return;
+    }
+    m_flush_requested = true;
+    m_condition.wakeAll();
+    while ((!m_pending.isEmpty() || m_writing) && isRunning())
+    {
+        m_idle_condition.wait(&m_mutex, 100);
+    }
+}
+
+void persistence_service::stop()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_running = false;
+        m_flush_requested = true;
+        m_condition.wakeAll();
+    }
+    wait();
+}
+
+QJsonObject persistence_service::statistics()
+{
+    QMutexLocker locker(&m_mutex);
+    QJsonObject obj;
+    obj["submit_count"] = static_cast<qint64>(m_submit_count);
+    obj["coalesced_count"] = static_cast<qint64>(m_coalesced_count);
+    obj["written_count"] = static_cast<qint64>(m_written_count);
+    obj["failed_count"] = static_cast<qint64>(m_failed_count);
+    obj["average_write_ms"] = m_written_count + m_failed_count > 0 ? m_write_ms / (m_written_count + m_failed_count) : 0.0;
+    obj["pending_files"] = static_cast<int>(m_pending.size());
+    obj["batch_window_ms"] = m_batch_window_ms;
+    return obj;
+}
+
+void persistence_service::run()
+{
+    QMutexLocker locker(&m_mutex);
+    while (true)
+    {
+        if (m_pending.isEmpty())
+        {
+            m_flush_requested = false;
+            m_idle_condition.wakeAll();
+            if (!m_running)
+            {
+                break;
+            }
+            m_condition.wait(&m_mutex);
+            continue;
+        }
+        //批处理窗口内继续等待后续提交
+        if (!m_flush_requested && m_batch_window_ms > 0)
+        {
+            auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - m_first_pending).count();
+            if (elapsed_ms < m_batch_window_ms)
+            {
+                m_condition.wait(&m_mutex, static_cast<unsigned long>(m_batch_window_ms - elapsed_ms));
+                continue;
+            }
+        }
+        QMap<QString, QByteArray> batch;
+        batch.swap(m_pending);
+        m_writing = true;
+        locker.unlock();
+        for (QMap<QString, QByteArray>::const_iterator iter = batch.constBegin(); iter != batch.constEnd(); ++iter)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            bool ret = write_file(iter.key(), iter.value());
+            double write_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            QMutexLocker stats_locker(&m_mutex);
+            if (ret)
+            {
+                m_written_count++;
+            }
+            else
+            {
+                m_failed_count++;
+            }
+            m_write_ms += write_ms;
+        }
+        locker.relock();
+        m_writing = false;
+    }
+}
+
+bool persistence_service::write_file(const QString& file_path, const QByteArray& content)
+{
+    QDir().mkpath(QFileInfo(file_path).absolutePath());
+    //先写入临时文件，commit 时原子替换目标文件
+    QSaveFile file(file_path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        write_log(QString("persistence: open %1 failed: %2").arg(file_path).arg(file.errorString()).toStdString().c_str());
+        return false;
+    }
+    if (file.write(content) != content.size() || !file.commit())
+    {
+        write_log(QString("persistence: write %1 failed: %2").arg(file_path).arg(file.errorString()).toStdString().c_str());
+        file.cancelWriting();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+﻿/***************************************************************
+ * 配置文件持久化服务
+ * config.xml、camera_configs.xml 等配置文件不在工作线程中同步写入:
+ * (1) 调用者在内存中序列化之后提交文件内容，立即返回. 同一文件尚未写入时只保留最新的内容
+ * (2) 第一次提交之后等待一个批处理窗口(默认 1000 ms)，窗口内的多次修改合并为一次写入
+ * (3) 写入使用 QSaveFile: 先写临时文件，完成之后原子替换目标文件，进程崩溃不会留下不完整的配置文件
+ * (4) 在独立的低优先级线程中执行，stop 之前写入所有尚未写入的内容
+ ***************************************************************/
+#pragma once
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QMap>
+#include <QString>
+#include <QByteArray>
+#include <QJsonObject>
+#include <chrono>
+
+class persistence_service : public QThread
+{
+public:
+    static persistence_service& instance();
+    ~persistence_service() override;
+
+    void set_batch_window(int window_ms);                               //批处理窗口，<=0 时提交之后立即写入
+    void submit(const QString& file_path, const QByteArray& content);  //线程安全，提交文件的完整内容
+    void flush();                                                       //写入屏障: 等待所有已提交的内容写入完毕
+    void stop();                                                        //写入尚未写入的内容，然后结束线程
+    QJsonObject statistics();
+
+protected:
+    void run() override;
+
+private:
+    persistence_service() = default;
+    static bool write_file(const QString& file_path, const QByteArray& content);
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;                 //提交、flush 和 stop 时唤醒写入线程
+    QWaitCondition m_idle_condition;            //所有内容写入完毕时唤醒 flush
+    QMap<QString, QByteArray> m_pending;        //文件路径 -> 最新的内容
+    std::chrono::steady_clock::time_point m_first_pending;     //当前批次第一次提交的时间
+    int m_batch_window_ms{ 1000 };
+    bool m_running{ true };
+    bool m_writing{ false };                    //正在写入，此时 m_pending 中的内容属于下一个批次
+    bool m_flush_requested{ false };            //flush/stop 时不再等待批处理窗口
+
+    //统计信息，受 m_mutex 保护
+    quint64 m_submit_count{ 0 };
+    quint64 m_coalesced_count{ 0 };             //被同一文件更新的内容取代的提交次数
+    quint64 m_written_count{ 0 };
+    quint64 m_failed_count{ 0 };
+    double m_write_ms{ 0.0 };                   //累计写入耗时
+};
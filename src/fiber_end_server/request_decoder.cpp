@@ -0,0 +1,187 @@
+﻿#include "request_decoder.h"
+#include <QJsonDocument>
+#include <QJsonParseError>
+#include <QCborMap>
+#include <QCborValue>
+#include <QtEndian>
+
+void request_decoder::append(const QByteArray& data)
+{
+    m_buffer.append(data);
+}
+
+void request_decoder::reset()
+{
+    m_buffer.clear();
+    m_read_offset = 0;
+    m_scan_offset = 0;
+    m_depth = 0;
+    m_in_string = false;
+    m_escape = false;
+}
+
+request_decoder::DECODE_STATUS request_decoder::next_request(QJsonObject& request, QString& error)
+{
+    QByteArray payload;
+    DECODE_STATUS status = next_frame(payload, error);
+    if (status != DECODE_OK)
+    {
+        compact();
+        return status;
+    }
+    //payload 直接引用接收缓冲区中的数据，解析完毕之前缓冲区不能修改
+    //CBOR map 的首字节为 0xA0~0xBF(主类型 5)，不会与 JSON 文本的首字符冲突
+    uchar first = static_cast<uchar>(payload.at(0));
+    if (first >= 0xA0 && first <= 0xBF)
+    {
+        QCborParserError cbor_error;
+        QCborValue value = QCborValue::fromCbor(payload, &cbor_error);
+        if (cbor_error.error != QCborError::NoError || !value.isMap())
+        {
+            error = QString("cbor request parse error: %1").arg(cbor_error.errorString());
+            return DECODE_ERROR;
+        }
+        request = value.toMap().toJsonObject();
+        return DECODE_OK;
+    }
+    QJsonParseError parse_error;
+    QJsonDocument doc = QJsonDocument::fromJson(payload, &parse_error);
+    if (parse_error.error != QJsonParseError::NoError || !doc.isObject())
+    {
+        error = QString("request parse error: %1").arg(parse_error.errorString());
+        return DECODE_ERROR;
+    }
+    request = doc.object();
+    return DECODE_OK;
+}
+
+request_decoder::DECODE_STATUS request_decoder::next_frame(QByteArray& payload, QString& error)
+{
+    //跳过请求之间的空白字符(旧版客户端可能在 JSON 之后追加换行)
+    while (m_read_offset < m_buffer.size())
+    {
+        char c = m_buffer.at(m_read_offset);
+        if (c != ' ' && c != '\r' && c != '\n' && c != '\t')
+        {
+            break;
+        }
+        m_read_offset++;
+    }
+    if (m_read_offset >= m_buffer.size())
+    {
+        return DECODE_NEED_MORE;
+    }
+    //长度前缀的首字节是长度的最高字节，合法长度不会达到 0x7B000000，因此首字节为 '{' 时一定是原始 JSON
+    if (m_buffer.at(m_read_offset) == '{')
+    {
+        return next_raw_json_frame(payload, error);
+    }
+    return next_length_prefixed_frame(payload, error);
+}
+
+request_decoder::DECODE_STATUS request_decoder::next_length_prefixed_frame(QByteArray& payload, QString& error)
+{
+    if (m_buffer.size() - m_read_offset < 4)
+    {
+        return DECODE_NEED_MORE;
+    }
+    quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(m_buffer.constData() + m_read_offset));
+    if (length == 0 || static_cast<qsizetype>(length) > m_max_frame_size)
+    {
+        //长度异常说明帧边界已经丢失，无法恢复，丢弃缓冲区中的全部数据
+        error = QString("invalid request frame length: %1").arg(length);
+        reset();
+        return DECODE_ERROR;
+    }
+    if (m_buffer.size() - m_read_offset - 4 < static_cast<qsizetype>(length))
+    {
+        return DECODE_NEED_MORE;
+    }
+    payload = QByteArray::fromRawData(m_buffer.constData() + m_read_offset + 4, static_cast<qsizetype>(length));
+    m_read_offset += 4 + static_cast<qsizetype>(length);
+    m_scan_offset = m_read_offset;
+    return DECODE_OK;
+}
+
+request_decoder::DECODE_STATUS request_decoder::next_raw_json_frame(QByteArray& payload, QString& error)
+{
+    if (m_scan_offset < m_read_offset)
+    {
+        m_scan_offset = m_read_offset;
+        m_depth = 0;
+        m_in_string = false;
+        m_escape = false;
+    }
+    const char* data = m_buffer.constData();
+    qsizetype size = m_buffer.size();
+    for (; m_scan_offset < size; m_scan_offset++)
+    {
+        char c = data[m_scan_offset];
+        if (m_in_string)
+        {
+            if (m_escape)
+            {
+                m_escape = false;
+            }
+            else if (c == '\\')
+            {
+                m_escape = true;
+            }
+            else if (c == '"')
+            {
+                m_in_string = false;
+            }
+            continue;
+        }
+        if (c == '"')
+        {
+            m_in_string = true;
+        }
+        else if (c == '{')
+        {
+            m_depth++;
+        }
+        else if (c == '}')
+        {
+            m_depth--;
+            if (m_depth == 0)
+            {
+                qsizetype length = m_scan_offset + 1 - m_read_offset;
+                payload = QByteArray::fromRawData(data + m_read_offset, length);
+                m_read_offset = m_scan_offset + 1;
+                m_scan_offset = m_read_offset;
+                return DECODE_OK;
+            }
+        }
+    }
+    if (m_scan_offset - m_read_offset > m_max_frame_size)
+    {
+        error = QString("raw json request exceeds %1 bytes").arg(m_max_frame_size);
+        reset();
+        return DECODE_ERROR;
+    }
+    return DECODE_NEED_MORE;
+}
+
+void request_decoder::compact()
+{
+    if (m_read_offset == 0)
+    {
+        return;
+    }
+    if (m_read_offset >= m_buffer.size())
+    {
+        //全部处理完毕，保留已分配的空间供下次接收使用
+        m_buffer.resize(0);
+        m_scan_offset = 0;
+        m_read_offset = 0;
+        return;
+    }
+    //未处理的数据较少时才移动，避免大请求分多次到达时反复拷贝
+    if (m_read_offset >= m_buffer.size() / 2)
+    {
+        m_buffer.remove(0, m_read_offset);
+        m_scan_offset -= m_read_offset;
+        m_read_offset = 0;
+    }
+}
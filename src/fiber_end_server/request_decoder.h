@@ -0,0 +1,45 @@
+﻿/***************************************************************
+ * 命令端口请求解码器，每个客户端连接一个实例
+ * 请求格式与回复相同: [4-byte BE 长度][UTF-8 JSON 或 CBOR]. 为兼容旧版客户端，也接受不带长度前缀的原始 JSON 对象
+ * (首个非空白字符为 '{' 时按原始 JSON 处理，通过括号匹配确定请求边界)
+ * 带长度前缀的数据按首字节区分编码: CBOR map 的首字节为 0xA0~0xBF，否则按 JSON 解析，因此每个请求都可以使用任一编码
+ * 一次 readyRead 中可能包含多个请求，也可能只包含半个请求，解码器负责拼接并逐个取出完整请求
+ ***************************************************************/
+
+#pragma once
+#include <QByteArray>
+#include <QJsonObject>
+#include <QString>
+
+class request_decoder
+{
+public:
+    enum DECODE_STATUS
+    {
+        DECODE_NEED_MORE = 0,           //数据不完整，等待后续数据
+        DECODE_OK = 1,                  //取出一个完整请求
+        DECODE_ERROR = 2,               //数据格式错误，已丢弃缓冲区中的数据
+    };
+
+    void append(const QByteArray& data);                        //追加接收到的数据
+    //取出下一个完整请求. 返回 DECODE_ERROR 时 error 记录错误信息，调用者可以继续调用以处理后续数据
+    DECODE_STATUS next_request(QJsonObject& request, QString& error);
+    void set_max_frame_size(qsizetype size) { m_max_frame_size = size; }
+    qsizetype buffered_size() const { return m_buffer.size() - m_read_offset; }
+    void reset();
+
+private:
+    DECODE_STATUS next_frame(QByteArray& payload, QString& error);     //取出下一帧的原始数据(不拷贝)
+    DECODE_STATUS next_length_prefixed_frame(QByteArray& payload, QString& error);
+    DECODE_STATUS next_raw_json_frame(QByteArray& payload, QString& error);
+    void compact();                                             //丢弃已经处理的数据
+
+    QByteArray m_buffer;                        //接收缓冲区
+    qsizetype m_read_offset{ 0 };               //下一个请求在缓冲区中的起始位置，已处理的数据在 compact 时统一移除
+    qsizetype m_max_frame_size{ 16 * 1024 * 1024 };     //单个请求的最大长度，超过时认为数据错误
+    //原始 JSON 括号匹配状态，数据不完整时保留，下次从 m_scan_offset 继续扫描，避免重复扫描
+    qsizetype m_scan_offset{ 0 };
+    int m_depth{ 0 };
+    bool m_in_string{ false };
+    bool m_escape{ false };
+};
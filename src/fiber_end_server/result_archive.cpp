@@ -0,0 +1,317 @@
+﻿#include "result_archive.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
+#include <algorithm>
+
+#include "../common/common.h"
+
+result_archive::~result_archive()
+{
+    close();
+}
+
+bool result_archive::open(const QString& dir, qint64 segment_size, qint64 max_total_size, int retention_days)
+{
+    QMutexLocker locker(&m_mutex);
+    close_segment();
+    if (!make_path(dir))
+    {
+        write_log(l(QString("result archive: failed to create directory %1").arg(dir)).c_str());
+        return false;
+    }
+    m_dir = dir;
+    m_segment_size = std::max<qint64>(segment_size, 1024 * 1024);
+    m_max_total_size = max_total_size;
+    m_retention_days = retention_days;
+    std::vector<int> ids = segment_ids();
+    if (!open_segment(ids.empty() ? 1 : ids.back()))
+    {
+        m_dir.clear();
+        return false;
+    }
+    apply_retention_locked();
+    return true;
+}
+
+void result_archive::close()
+{
+    QMutexLocker locker(&m_mutex);
+    close_segment();
+    m_dir.clear();
+}
+
+bool result_archive::is_open()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_data_file.isOpen() && m_index_file.isOpen();
+}
+
+QString result_archive::directory()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_dir;
+}
+
+QString result_archive::segment_path(int segment_id, const QString& suffix) const
+{
+    return QString("%1/segment_%2%3").arg(m_dir).arg(segment_id, 6, 10, QChar('0')).arg(suffix);
+}
+
+std::vector<int> result_archive::segment_ids() const
+{
+    std::vector<int> ids;
+    QStringList files = QDir(m_dir).entryList({ "segment_*.dat" }, QDir::Files);
+    for (const QString& file : files)
+    {
+        bool ok(false);
+        int id = file.mid(8, file.length() - 12).toInt(&ok);        //segment_ + id + .dat
+        if (ok)
+        {
+            ids.push_back(id);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+bool result_archive::open_segment(int segment_id)
+{
+    m_data_file.setFileName(segment_path(segment_id, ".dat"));
+    m_index_file.setFileName(segment_path(segment_id, ".idx"));
+    if (!m_data_file.open(QIODevice::ReadWrite) || !m_index_file.open(QIODevice::ReadWrite))
+    {
+        write_log(l(QString("result archive: failed to open segment %1").arg(m_data_file.fileName())).c_str());
+        close_segment();
+        return false;
+    }
+    //异常退出时可能留下不完整的索引记录或者没有索引的数据，截掉这部分
+    qint64 record_count = m_index_file.size() / static_cast<qint64>(sizeof(st_archive_index_record));
+    m_index_file.resize(record_count * static_cast<qint64>(sizeof(st_archive_index_record)));
+    qint64 valid_size(0);
+    if (record_count > 0)
+    {
+        st_archive_index_record last;
+        m_index_file.seek((record_count - 1) * static_cast<qint64>(sizeof(st_archive_index_record)));
+        m_index_file.read(reinterpret_cast<char*>(&last), sizeof(last));
+        valid_size = last.m_offset + static_cast<qint64>(sizeof(st_archive_record_header)) + last.m_size;
+        m_last_timestamp = std::max(m_last_timestamp, last.m_timestamp);
+    }
+    if (m_data_file.size() > valid_size)
+    {
+        write_log(l(QString("result archive: truncate %1 unindexed bytes in %2")
+            .arg(m_data_file.size() - valid_size).arg(m_data_file.fileName())).c_str());
+        m_data_file.resize(valid_size);
+    }
+    m_data_file.seek(m_data_file.size());
+    m_index_file.seek(m_index_file.size());
+    m_segment_id = segment_id;
+    return true;
+}
+
+void result_archive::close_segment()
+{
+    if (m_data_file.isOpen())
+    {
+        m_data_file.close();
+    }
+    if (m_index_file.isOpen())
+    {
+        m_index_file.close();
+    }
+}
+
+bool result_archive::append(const st_archive_index_record& entry, const char* data, qint64 size)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_data_file.isOpen() || !m_index_file.isOpen())
+    {
+        return false;
+    }
+    qint64 record_size = static_cast<qint64>(sizeof(st_archive_record_header)) + size;
+    if (m_data_file.size() > 0 && m_data_file.size() + record_size > m_segment_size)
+    {
+        //当前分段已满，切换到新的分段，并按保留策略删除最早的分段
+        close_segment();
+        if (!open_segment(m_segment_id + 1))
+        {
+            return false;
+        }
+        apply_retention_locked();
+    }
+    st_archive_record_header header;
+    header.m_size = static_cast<qint32>(size);
+    header.m_timestamp = entry.m_timestamp;
+    header.m_position_index = entry.m_position_index;
+    header.m_fiber_index = entry.m_fiber_index;
+    header.m_kind = entry.m_kind;
+    header.m_codec = entry.m_codec;
+    //写入线程池中编码完成的顺序与提交顺序可能不同，索引中的时间戳不早于上一条记录，保证可以二分查找. 头部保留原始时间戳
+    st_archive_index_record record = entry;
+    record.m_timestamp = std::max(entry.m_timestamp, m_last_timestamp);
+    record.m_offset = m_data_file.pos();
+    record.m_size = static_cast<qint32>(size);
+    if (m_data_file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header) ||
+        m_data_file.write(data, size) != size || !m_data_file.flush())
+    {
+        write_log(l(QString("result archive: failed to write %1").arg(m_data_file.fileName())).c_str());
+        m_data_file.resize(record.m_offset);
+        m_data_file.seek(record.m_offset);
+        return false;
+    }
+    //数据写入之后再写索引，索引中的记录总是指向完整的数据
+    if (m_index_file.write(reinterpret_cast<const char*>(&record), sizeof(record)) != sizeof(record) || !m_index_file.flush())
+    {
+        write_log(l(QString("result archive: failed to write %1").arg(m_index_file.fileName())).c_str());
+        return false;
+    }
+    m_last_timestamp = record.m_timestamp;
+    m_append_count++;
+    m_append_bytes += record_size;
+    return true;
+}
+
+std::vector<st_archive_hit> result_archive::find(qint64 from, qint64 to, int position_index, int fiber_index)
+{
+    QMutexLocker locker(&m_mutex);          //查询期间不删除分段
+    std::vector<st_archive_hit> hits;
+    if (m_dir.isEmpty())
+    {
+        return hits;
+    }
+    std::vector<int> ids = segment_ids();
+    for (int segment_id : ids)
+    {
+        QFile index_file(segment_path(segment_id, ".idx"));
+        qint64 record_count = index_file.size() / static_cast<qint64>(sizeof(st_archive_index_record));
+        if (record_count == 0 || !index_file.open(QIODevice::ReadOnly))
+        {
+            continue;
+        }
+        uchar* mapped = index_file.map(0, record_count * static_cast<qint64>(sizeof(st_archive_index_record)));
+        if (mapped == nullptr)
+        {
+            continue;
+        }
+        const st_archive_index_record* begin = reinterpret_cast<const st_archive_index_record*>(mapped);
+        const st_archive_index_record* end = begin + record_count;
+        //记录按时间顺序追加，二分查找起始位置
+        if (begin->m_timestamp <= to && (end - 1)->m_timestamp >= from)
+        {
+            const st_archive_index_record* iter = std::lower_bound(begin, end, from,
+                [](const st_archive_index_record& record, qint64 value) { return record.m_timestamp < value; });
+            for (; iter != end && iter->m_timestamp <= to; ++iter)
+            {
+                if ((position_index < 0 || iter->m_position_index == position_index) &&
+                    (fiber_index < 0 || iter->m_fiber_index == fiber_index))
+                {
+                    st_archive_hit hit;
+                    hit.m_segment_id = segment_id;
+                    hit.m_record = *iter;
+                    hits.push_back(hit);
+                }
+            }
+        }
+        index_file.unmap(mapped);
+    }
+    return hits;
+}
+
+QByteArray result_archive::read(const st_archive_hit& hit)
+{
+    QMutexLocker locker(&m_mutex);
+    QFile data_file(segment_path(hit.m_segment_id, ".dat"));
+    if (!data_file.open(QIODevice::ReadOnly) || !data_file.seek(hit.m_record.m_offset))
+    {
+        return QByteArray();
+    }
+    st_archive_record_header header;
+    if (data_file.read(reinterpret_cast<char*>(&header), sizeof(header)) != sizeof(header) ||
+        header.m_magic != archive_record_magic || header.m_size != hit.m_record.m_size)
+    {
+        write_log(l(QString("result archive: corrupted record at %1 in %2").arg(hit.m_record.m_offset).arg(data_file.fileName())).c_str());
+        return QByteArray();
+    }
+    return data_file.read(header.m_size);
+}
+
+void result_archive::apply_retention()
+{
+    QMutexLocker locker(&m_mutex);
+    apply_retention_locked();
+}
+
+void result_archive::apply_retention_locked()
+{
+    if (m_dir.isEmpty())
+    {
+        return;
+    }
+    std::vector<int> ids = segment_ids();
+    qint64 total_size(0);
+    for (int segment_id : ids)
+    {
+        total_size += QFileInfo(segment_path(segment_id, ".dat")).size() + QFileInfo(segment_path(segment_id, ".idx")).size();
+    }
+    QDateTime expire_time = QDateTime::currentDateTime().addDays(-m_retention_days);
+    //从最早的分段开始整段删除，当前写入的分段不删除
+    for (int segment_id : ids)
+    {
+        if (segment_id == m_segment_id)
+        {
+            break;
+        }
+        QFileInfo data_info(segment_path(segment_id, ".dat"));
+        bool is_expired = m_retention_days > 0 && data_info.lastModified() < expire_time;
+        bool is_oversize = m_max_total_size > 0 && total_size > m_max_total_size;
+        if (!is_expired && !is_oversize)
+        {
+            break;
+        }
+        qint64 segment_size = data_info.size() + QFileInfo(segment_path(segment_id, ".idx")).size();
+        if (!QFile::remove(segment_path(segment_id, ".dat")) || !QFile::remove(segment_path(segment_id, ".idx")))
+        {
+            write_log(l(QString("result archive: failed to remove segment %1").arg(segment_id)).c_str());
+            break;
+        }
+        total_size -= segment_size;
+        m_dropped_segments++;
+        write_log(l(QString("result archive: dropped segment %1 (%2 bytes, %3)")
+            .arg(segment_id).arg(segment_size).arg(is_expired ? "expired" : "over size limit")).c_str());
+    }
+}
+
+QJsonObject result_archive::statistics()
+{
+    QMutexLocker locker(&m_mutex);
+    QJsonObject obj;
+    obj["directory"] = m_dir;
+    obj["current_segment"] = m_segment_id;
+    std::vector<int> ids = m_dir.isEmpty() ? std::vector<int>() : segment_ids();
+    qint64 total_size(0);
+    for (int segment_id : ids)
+    {
+        total_size += QFileInfo(segment_path(segment_id, ".dat")).size() + QFileInfo(segment_path(segment_id, ".idx")).size();
+    }
+    obj["segment_count"] = static_cast<int>(ids.size());
+    obj["total_bytes"] = total_size;
+    obj["append_count"] = static_cast<qint64>(m_append_count);
+    obj["append_bytes"] = m_append_bytes;
+    obj["dropped_segments"] = m_dropped_segments;
+    return obj;
+}
+
+QJsonObject result_archive::hit_to_json(const st_archive_hit& hit)
+{
+    QJsonObject obj;
+    obj["segment"] = hit.m_segment_id;
+    obj["offset"] = hit.m_record.m_offset;
+    obj["size"] = hit.m_record.m_size;
+    obj["timestamp"] = hit.m_record.m_timestamp;
+    obj["position_index"] = hit.m_record.m_position_index;
+    obj["fiber_index"] = hit.m_record.m_fiber_index;
+    obj["verdict"] = hit.m_record.m_verdict;
+    obj["kind"] = hit.m_record.m_kind;
+    obj["codec"] = hit.m_record.m_codec;
+    return obj;
+}
@@ -0,0 +1,118 @@
+﻿/***************************************************************
+ * 检测结果归档(可选，替代按文件逐张保存)
+ * 每个端面的影像和检测记录以追加方式写入大的分段文件，避免保存目录中产生大量小文件:
+ * (1) 分段数据文件 segment_<id>.dat: [st_archive_record_header + 数据] x N，数据为编码之后的影像或者检测记录
+ * (2) 分段索引文件 segment_<id>.idx: 定长记录 st_archive_index_record x N，按写入时间排序，查询时直接映射到内存
+ * (3) 分段达到指定大小之后切换到新的分段; 按保留天数和总大小删除最早的整个分段，不需要扫描目录中的文件
+ * (4) 先写数据再写索引，异常退出之后重新打开时截掉数据文件中没有索引的尾部
+ * 线程安全，append 由影像写入线程池调用
+ ***************************************************************/
+#pragma once
+#include <QString>
+#include <QFile>
+#include <QMutex>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <vector>
+
+constexpr quint32 archive_record_magic = 0x52414746;       //'FGAR'
+
+//归档记录类型
+enum archive_record_kind
+{
+    ARCHIVE_KIND_SHAPE_IMAGE = 0,       //精定位结果影像
+    ARCHIVE_KIND_DETECT_IMAGE = 1,      //检测结果影像
+    ARCHIVE_KIND_DETECT_RESULT = 2,     //检测结果记录
+};
+
+//检测结论
+enum archive_verdict
+{
+    ARCHIVE_VERDICT_LOCATED = 0,        //定位成功
+    ARCHIVE_VERDICT_LOCATE_FAILED = 1,  //定位失败，保存的是原始影像
+};
+
+//数据文件中每条记录的头部，可用于在索引损坏时重建索引
+struct st_archive_record_header
+{
+    quint32 m_magic{ archive_record_magic };
+    qint32 m_size{ 0 };                 //数据字节数
+    qint64 m_timestamp{ 0 };            //毫秒时间戳
+    qint32 m_position_index{ 0 };
+    qint32 m_fiber_index{ 0 };
+    qint16 m_kind{ 0 };
+    qint16 m_codec{ 0 };
+    qint32 m_reserved{ 0 };
+};
+static_assert(sizeof(st_archive_record_header) == 32, "archive record header layout changed");
+
+//索引记录，定长
+struct st_archive_index_record
+{
+    qint64 m_timestamp{ 0 };            //毫秒时间戳
+    qint64 m_offset{ 0 };               //记录(含头部)在数据文件中的偏移
+    qint32 m_size{ 0 };                 //数据字节数(不含头部)
+    qint32 m_position_index{ 0 };       //拍照位置序号
+    qint32 m_fiber_index{ 0 };          //端面序号
+    qint16 m_verdict{ 0 };              //archive_verdict
+    qint16 m_kind{ 0 };                 //archive_record_kind
+    qint16 m_codec{ 0 };                //image_codec
+    qint16 m_reserved{ 0 };
+    qint32 m_reserved2{ 0 };
+};
+static_assert(sizeof(st_archive_index_record) == 40, "archive index record layout changed");
+
+//查询结果
+struct st_archive_hit
+{
+    int m_segment_id{ 0 };
+    st_archive_index_record m_record;
+};
+
+class result_archive
+{
+public:
+    result_archive() = default;
+    ~result_archive();
+
+    /***************************************
+     * 打开归档目录，继续写入最后一个分段
+     * qint64 segment_size -- 单个分段数据文件的最大字节数
+     * qint64 max_total_size -- 所有分段的最大字节数，<=0 表示不限制
+     * int retention_days -- 分段保留天数，<=0 表示不限制
+     ***************************************/
+    bool open(const QString& dir, qint64 segment_size, qint64 max_total_size, int retention_days);
+    void close();
+    bool is_open();
+    QString directory();
+
+    bool append(const st_archive_index_record& entry, const char* data, qint64 size);
+
+    //查询 [from, to] 时间范围内的记录，position_index/fiber_index < 0 表示不限制
+    std::vector<st_archive_hit> find(qint64 from, qint64 to, int position_index = -1, int fiber_index = -1);
+    QByteArray read(const st_archive_hit& hit);            //读取记录数据
+
+    void apply_retention();                                 //删除超出保留天数和总大小的分段
+    QJsonObject statistics();
+    static QJsonObject hit_to_json(const st_archive_hit& hit);
+
+private:
+    QString segment_path(int segment_id, const QString& suffix) const;
+    std::vector<int> segment_ids() const;                   //按编号升序
+    bool open_segment(int segment_id);                      //打开分段用于追加，修复没有索引的尾部
+    void close_segment();
+    void apply_retention_locked();                          //调用者持有 m_mutex
+
+    QMutex m_mutex;
+    QString m_dir{ "" };
+    qint64 m_segment_size{ 256ll * 1024 * 1024 };
+    qint64 m_max_total_size{ 0 };
+    int m_retention_days{ 0 };
+    int m_segment_id{ 0 };                  //当前写入的分段
+    qint64 m_last_timestamp{ 0 };           //最后一条记录的时间戳，保证索引按时间有序
+    QFile m_data_file;
+    QFile m_index_file;
+    quint64 m_append_count{ 0 };
+    qint64 m_append_bytes{ 0 };
+    int m_dropped_segments{ 0 };
+};
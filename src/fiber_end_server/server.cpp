@@ -1,6 +1,7 @@
 ﻿#include "server.h"
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QJsonArray>
 #include <QDebug>
 #include <QCoreApplication>
 
@@ -14,8 +15,19 @@ fiber_end_server::fiber_end_server(QString ip, quint16 port, QObject* parent)
     connect(m_thread_device_enum, &thread_base::post_task_finished, this, &fiber_end_server::on_device_enum_task_finished, Qt::QueuedConnection);
 	m_thread_misc = new thread_misc(QString::fromStdString("其他任务子线程"), this);
 	m_thread_misc->set_device_manager(&m_device_manager);
+	m_thread_misc->set_algorithm_thread(m_thread_algorithm);
+	m_thread_misc->set_image_transport(&m_image_transport);         //检测流水线: 运动和对焦由 m_thread_misc 执行，检测和保存由 m_thread_algorithm 执行
+	m_thread_algorithm->set_image_transport(&m_image_transport);    //检测结果影像通过共享内存/影像端口发送，不再经过 detect_images 目录
     connect(m_thread_misc, &thread_base::post_task_finished, this, &fiber_end_server::on_misc_task_finished, Qt::QueuedConnection);
+    m_thread_query = new thread_query(QString::fromStdString("查询子线程"), this);
+    m_thread_query->set_misc_thread(m_thread_misc);                  //只读命令不在设备操作线程中排队
+    connect(m_thread_query, &thread_base::post_task_finished, this, &fiber_end_server::on_query_task_finished, Qt::QueuedConnection);
     m_thread_motion_control = new thread_motion_control(QString::fromStdString("运动控制子线程"), this);
+    m_dispatcher.register_handler(OPCODE_STOP_PROCESS, this, &fiber_end_server::handle_stop_process);
+    m_dispatcher.register_handler(OPCODE_CANCEL_TASK, this, &fiber_end_server::handle_cancel_task);
+    m_dispatcher.register_handler(OPCODE_STOP_SERVER, this, &fiber_end_server::handle_stop_server);
+    m_dispatcher.register_handler(OPCODE_SERVER_STATS, this, &fiber_end_server::handle_server_stats);
+    m_dispatcher.register_handler(OPCODE_HELLO, this, &fiber_end_server::handle_hello);
     connect(m_thread_motion_control, &thread_base::post_task_finished, this, &fiber_end_server::on_motion_control_task_finished, Qt::QueuedConnection);
 }
 
@@ -41,11 +53,17 @@ bool fiber_end_server::start()
     {
         return false;
     }
+    //远程客户端的影像通过独立端口发送，避免大数据量阻塞命令回复. 影像端口启动失败不影响本机客户端
+    if (!m_image_transport.start(m_server_ip, m_server_port + 1))
+    {
+        qWarning() << QString::fromStdString("影像传输端口启动失败:") << m_server_port + 1;
+    }
     qDebug() << QString::fromStdString("后端已启动，监听端口:") << m_server_port;
 	m_thread_algorithm->start();
     m_thread_motion_control->start();
     m_thread_device_enum->start();
     m_thread_misc->start();
+    m_thread_query->start();
 
     //启动线程之后
     return true;
@@ -53,11 +71,22 @@ bool fiber_end_server::start()
 
 bool fiber_end_server::load_config_file(const std::string& config_file_path)
 {
-    return m_config_data.load_from_file(config_file_path);
+    bool ret = m_config_data.load_from_file(config_file_path);
+    persistence_service::instance().set_batch_window(m_config_data.m_config_save_window_ms);
+    return ret;
 }
 
 void fiber_end_server::stop()
 {
+    //运行期间也可以停止服务: 先中断设备操作线程并等待其退出，运行流程不再访问检测线程和设备之后才释放其他线程
+    if (m_thread_misc != nullptr)
+    {
+        m_thread_misc->clear_tasks();
+        m_thread_misc->stop();
+        m_thread_misc->wait();
+    }
+    delete m_thread_query;          //查询线程访问设备操作线程的数据，先释放
+    m_thread_query = nullptr;
     delete m_thread_algorithm;
     m_thread_algorithm = nullptr;
     delete m_thread_motion_control;
@@ -66,12 +95,25 @@ void fiber_end_server::stop()
     m_thread_device_enum = nullptr;
     delete m_thread_misc;
     m_thread_misc = nullptr;
+    m_image_transport.stop();
+    persistence_service::instance().stop();      //子线程退出之后写入尚未写入的配置文件
     for (QTcpSocket* client : m_clients)
     {
+        //队列中尚未写入的消息全部交给 socket，disconnectFromHost 会等待发送完毕再断开
+        auto iter = m_outboxes.find(client);
+        if (iter != m_outboxes.end())
+        {
+            while (!iter->m_send_queue.isEmpty())
+            {
+                client->write(iter->m_send_queue.dequeue().m_block);
+            }
+        }
         client->disconnectFromHost();
         client->deleteLater();
     }
     m_clients.clear();
+    m_outboxes.clear();
+    m_request_decoders.clear();
     m_map_request_id_to_socket.clear();
 }
 
@@ -81,28 +123,55 @@ void fiber_end_server::incomingConnection(qintptr socketDescriptor)
     client->setSocketDescriptor(socketDescriptor);
     connect(client, &QTcpSocket::readyRead, this, &fiber_end_server::onReadyRead);
     connect(client, &QTcpSocket::disconnected, this, &fiber_end_server::onDisconnected);
+    connect(client, &QTcpSocket::bytesWritten, this, &fiber_end_server::onBytesWritten);
+    //根据客户端地址选择影像传输方式，断开时 peerAddress 可能已经无效，因此记录在 socket 属性中
+    client->setProperty("is_local_client", m_image_transport.add_client(client->peerAddress()));
     m_clients << client;
+    st_client_outbox outbox;
+    outbox.m_socket = client;
+    m_outboxes.insert(client, outbox);
     qDebug() << QString::fromStdString("新前端已连接");
 }
 
 void fiber_end_server::onReadyRead()
 {
     auto* client = qobject_cast<QTcpSocket*>(sender());
-    QByteArray data = client->readAll();
-    QJsonDocument doc = QJsonDocument::fromJson(data);
-    QJsonObject obj = doc.object();
-    QString request_id = obj["request_id"].toString();
-	m_map_request_id_to_socket[request_id] = client; // 保存请求 ID 和对应的客户端
-    process_request(obj);
+    request_decoder& decoder = m_request_decoders[client];
+    decoder.append(client->readAll());
+    //一次读取中可能包含多个完整请求(客户端连续下发)，全部取出并依次处理
+    while (true)
+    {
+        QJsonObject obj;
+        QString error;
+        request_decoder::DECODE_STATUS status = decoder.next_request(obj, error);
+        if (status == request_decoder::DECODE_NEED_MORE)
+        {
+            break;
+        }
+        if (status == request_decoder::DECODE_ERROR)
+        {
+            write_log(error.toStdString().c_str());
+            continue;
+        }
+        //命令只在这里解析一次，之后按操作码分发
+        st_task_message message = st_task_message::from_json(std::move(obj));
+        m_map_request_id_to_socket[message.m_request_id] = { client, message.m_opcode }; // 保存请求 ID 和对应的客户端
+        process_request(std::move(message));
+        //处理请求时可能停止服务(client_request_stop_server)，此时客户端和解码器已经释放
+        if (m_stop_server.load())
+        {
+            return;
+        }
+    }
 }
 
 void fiber_end_server::onDisconnected()
 {
     auto* client = qobject_cast<QTcpSocket*>(sender());
-    for (QMap<QString, QTcpSocket*>::iterator iter = m_map_request_id_to_socket.begin();
+    for (QMap<QString, st_pending_request>::iterator iter = m_map_request_id_to_socket.begin();
         iter != m_map_request_id_to_socket.end(); )
     {
-	    if (iter.value() == client)
+	    if (iter.value().m_client == client)
 	    {
             iter = m_map_request_id_to_socket.erase(iter);
 	    }
@@ -111,173 +180,279 @@ void fiber_end_server::onDisconnected()
             ++iter;
 	    }
     }
+    m_image_transport.remove_client(client->property("is_local_client").toBool());
+    m_request_decoders.remove(client);
+    m_outboxes.remove(client);
     m_clients.removeAll(client);
     client->deleteLater();
 }
 
-void fiber_end_server::process_request(const QJsonObject& obj)
+void fiber_end_server::process_request(st_task_message message)
 {
     if(m_stop_server.load())
     {
 	    return;
     }
-    if(m_thread_misc->m_is_processing.load())
+    if(m_thread_misc->m_is_processing.load() && !opcode_allowed_while_processing(message.m_opcode))
     {
-        //如果任务正在处理，主线程直接响应并返回.
+        //运行或标定期间只接受查询和控制命令(中断、取消、停止服务)，其他命令主线程直接响应并返回.
         QJsonObject result_obj;     //返回的消息对象
-        result_obj["request_id"] = obj["request_id"];
+        result_obj["request_id"] = message.m_request_id;
         result_obj["command"] = "server_report_info";
         result_obj["param"] = QString("后端正在进行检测任务, 请待任务执行完毕之后再进行操作!");
-        send_process_result(QVariant::fromValue(result_obj));
+        send_process_result(result_obj);
         return;
     }
-    QString command = obj["command"].toString();
-    qDebug() << L("收到消息:") << command;
-    
-    if (command == "client_request_server_parameter")
-    {
-        m_thread_device_enum->add_task(obj);
-    }
-    else if (command == "client_request_camera_list")
-    {
-        m_thread_device_enum->add_task(obj);
-    }
-    else if (command == "client_request_open_camera")
-    {
-        m_thread_misc->add_task(obj);
-    }
-    else if (command == "client_request_close_camera")
-    {
-        m_thread_misc->add_task(obj);
-    }
-    else if (command == "client_request_change_camera_parameter")
-    {
-        m_thread_misc->add_task(obj);
-    }
-    else if (command == "client_request_start_grab")
-    {
-        m_thread_misc->add_task(obj);
-    }
-    else if (command == "client_request_trigger_once")
+    qDebug() << L("收到消息:") << message.m_body.value("command").toString();
+    //命令在接收时已经转换为操作码，这里按操作码所属线程和优先级分发，消息移动入队
+    TASK_PRIORITY priority = opcode_priority(message.m_opcode);
+    switch (opcode_target(message.m_opcode))
     {
-        m_thread_misc->add_task(obj);
-    }
-    else if (command == "client_request_change_algorithm_parameter")
+    case TASK_TARGET_DEVICE_ENUM:
+        m_thread_device_enum->add_task(QVariant::fromValue(std::move(message)), priority);
+        break;
+    case TASK_TARGET_MISC:
     {
-        m_thread_misc->add_task(obj);
-    }
-    else if (command == "client_request_user_config_set")
-    {
-        m_thread_misc->add_task(obj);
+        QString key = coalesce_key(message);
+        if (key.isEmpty())
+        {
+            m_thread_misc->add_task(QVariant::fromValue(std::move(message)), priority);
+            break;
+        }
+        QJsonValue value = message.m_body.value("param").toObject().value("value");
+        QVariant superseded = m_thread_misc->add_task_coalesced(QVariant::fromValue(std::move(message)), key, priority);
+        if (superseded.isValid())
+        {
+            reply_superseded(st_task_message::from_variant(superseded), value);
+        }
+        break;
     }
-    else if (command == "client_request_move_camera")
-    {
-        m_thread_misc->add_task(obj);
+    case TASK_TARGET_QUERY:
+        m_thread_query->add_task(QVariant::fromValue(std::move(message)), priority);
+        break;
+    case TASK_TARGET_SERVER:
+        m_dispatcher.dispatch(message);
+        break;
+    default:
+        break;
     }
-    else if (command == "client_request_move_camera_by_index")
+}
+
+void fiber_end_server::handle_stop_process(const st_task_message& message, QJsonObject& result_obj)
+{
+    if (m_thread_misc->m_is_processing.load())
     {
-        m_thread_misc->add_task(obj);
+        m_thread_misc->cancel_current_task();
     }
-    else if(command == "client_request_set_motion_parameter")
+}
+
+void fiber_end_server::handle_cancel_task(const st_task_message& message, QJsonObject& result_obj)
+{
+    //不经过队列，直接通知设备操作线程中正在执行的任务(运行、标定、对焦)尽快结束
+    result_obj["command"] = "server_cancel_task";
+    result_obj["param"] = m_thread_misc->cancel_current_task();
+    send_process_result(result_obj);
+}
+
+void fiber_end_server::handle_stop_server(const st_task_message& message, QJsonObject& result_obj)
+{
+    if (m_stop_server.load())
     {
-        m_thread_misc->add_task(obj);
+        return;
     }
-    else if (command == "client_request_auto_focus")
+    m_stop_server.store(true);
+    stop();
+    //停止线程并释放资源之后退出程序
+    QCoreApplication::exit();
+}
+
+void fiber_end_server::handle_server_stats(const st_task_message& message, QJsonObject& result_obj)
+{
+    //每个命令的排队时间、执行时间和回复字节数，以及各线程队列深度和影像写入/归档统计
+    QJsonObject stats = command_statistics::instance().to_json();
+    QJsonObject queues;
+    queues["device_enum"] = m_thread_device_enum->task_count();
+    queues["misc"] = m_thread_misc->task_count();
+    queues["algorithm"] = m_thread_algorithm->task_count();
+    queues["query"] = m_thread_query->task_count();
+    stats["queues"] = queues;
+    QJsonArray clients;
+    for (const st_client_outbox& outbox : m_outboxes)
     {
-        m_thread_misc->add_task(obj);
+        QJsonObject client;
+        client["address"] = outbox.m_socket->peerAddress().toString();
+        client["encoding"] = wire_encoding_name(outbox.m_encoding);
+        client["queued_frames"] = static_cast<int>(outbox.m_send_queue.size());
+        client["queued_bytes"] = outbox.m_queued_bytes;
+        client["socket_bytes_to_write"] = outbox.m_socket->bytesToWrite();
+        client["frames_sent"] = outbox.m_frames_sent;
+        client["frames_coalesced"] = outbox.m_frames_coalesced;
+        clients.append(client);
     }
-    else if (command == "client_request_anomaly_detection")
+    stats["clients"] = clients;
+    stats["is_processing"] = m_thread_misc->m_is_processing.load();
+    stats["image_writer"] = m_thread_algorithm->get_image_writer()->statistics();
+    stats["archive"] = m_thread_algorithm->get_result_archive()->statistics();
+    stats["persistence"] = persistence_service::instance().statistics();
+    motion_control* motion = m_thread_misc->get_motion_control();
+    if (motion != nullptr)
     {
-        m_thread_misc->add_task(obj);
+        stats["motion"] = motion->statistics();
     }
-    else if (command == "client_request_auto_calibration")
+    if (message.m_body.value("param").toObject().value("reset").toBool())
     {
-        m_thread_misc->add_task(obj);
+        command_statistics::instance().reset();
     }
-    else if(command == "client_request_update_server_parameter")
+    result_obj["command"] = "server_stats";
+    result_obj["param"] = stats;
+    send_process_result(result_obj);
+}
+
+void fiber_end_server::reply_superseded(const st_task_message& message, const QJsonValue& value)
+{
+    //被同一参数的新请求取代，不再访问相机，直接回复. value 为取代它的请求中的值，实际结果以新请求的回复为准
+    QJsonObject result_obj;
+    result_obj["request_id"] = message.m_request_id;
+    result_obj["command"] = "server_camera_parameter_changed_success";
+    result_obj["name"] = message.m_body.value("param").toObject().value("name");
+    result_obj["value"] = value;
+    result_obj["superseded"] = true;
+    send_process_result(result_obj);
+}
+
+void fiber_end_server::handle_hello(const st_task_message& message, QJsonObject& result_obj)
+{
+    //客户端列出支持的编码，服务器选择 CBOR 优先. hello 的回复仍使用原来的编码，之后的消息使用协商后的编码
+    auto pending = m_map_request_id_to_socket.find(message.m_request_id);
+    if (pending == m_map_request_id_to_socket.end())
     {
-        m_thread_misc->add_task(obj);
+        return;
     }
-    else if(command == "client_request_start_process")
+    auto outbox = m_outboxes.find(pending.value().m_client);
+    if (outbox == m_outboxes.end())
     {
-        bool start = obj["param"].toBool();
-        if(start)
-        {
-            m_thread_misc->add_task(obj);
-        }
-        else if(m_thread_misc->m_is_processing.load())
-        {
-            m_thread_misc->m_terminate.store(true);
-        }
+        return;
     }
-    else if(command == "client_request_stop_server")
+    WIRE_ENCODING encoding(WIRE_ENCODING_JSON);
+    QJsonArray encodings = message.m_body.value("param").toObject().value("encodings").toArray();
+    for (const QJsonValue& value : encodings)
     {
-        if(m_stop_server.load())
+        if (wire_encoding_from_name(value.toString()) == WIRE_ENCODING_CBOR)
         {
-	        return;
+            encoding = WIRE_ENCODING_CBOR;
         }
-        m_stop_server.store(true);
-        stop();
-        //停止线程并释放资源之后退出程序
-        QCoreApplication::exit();
     }
+    QJsonObject param;
+    param["encoding"] = wire_encoding_name(encoding);
+    result_obj["command"] = "server_hello";
+    result_obj["param"] = param;
+    send_process_result(result_obj);
+    outbox->m_encoding = encoding;
 }
 
-void fiber_end_server::send_process_result(const QVariant& result_data, bool task_finished)
+void fiber_end_server::send_process_result(const QJsonObject& obj, bool task_finished)
 {
-    QJsonObject obj = result_data.toJsonObject();
-    QString request_id = obj["request_id"].toString();
+    QString request_id = obj.value("request_id").toString();
     if(request_id == "")
     {
-	    //通知所有客户端
+        if (m_clients.isEmpty())
+        {
+            return;
+        }
+	    //通知所有客户端，每种编码只在第一次用到时序列化一次，使用相同编码的客户端共用同一个数据块
+        QByteArray blocks[WIRE_ENCODING_COUNT];
+        bool superseded_by_newer = is_superseded_notification(obj);
+        qint64 response_bytes(0);
         for (QTcpSocket* client : m_clients)
         {
-            if (client != nullptr)
+            auto iter = m_outboxes.find(client);
+            if (iter == m_outboxes.end())
             {
-                // 序列化 JSON
-                QByteArray payload = QJsonDocument(obj).toJson(QJsonDocument::Compact);
-
-                // 构造长度前缀
-                qint32 size = payload.size();
-                QByteArray block;
-                QDataStream out(&block, QIODevice::WriteOnly);
-                out.setByteOrder(QDataStream::BigEndian); // 网络字节序
-                out << size;
-                block.append(payload);
-                //写入 socket
-                client->write(block);
-                client->flush();
+                continue;
+            }
+            QByteArray& block = blocks[iter->m_encoding];
+            if (block.isEmpty())
+            {
+                block = encode_frame(obj, iter->m_encoding);
             }
+            response_bytes += block.size();
+            enqueue_frame(iter.value(), block, superseded_by_newer);
         }
+        command_statistics::instance().record_response(OPCODE_UNKNOWN, response_bytes);
     }
     else
     {
         auto iter = m_map_request_id_to_socket.find(request_id);
         if (iter != m_map_request_id_to_socket.end())
         {
-            QTcpSocket* client = iter.value();
+            QTcpSocket* client = iter.value().m_client;
+            TASK_OPCODE opcode = iter.value().m_opcode;
             if (task_finished)
             {
                 m_map_request_id_to_socket.erase(iter);
             }
-            if (client != nullptr)
+            auto outbox = m_outboxes.find(client);
+            if (outbox != m_outboxes.end())
             {
-                // 序列化 JSON
-                QByteArray payload = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+                QByteArray block = encode_frame(obj, outbox->m_encoding);
+                command_statistics::instance().record_response(opcode, block.size());
+                enqueue_frame(outbox.value(), block, is_superseded_notification(obj));
+            }
+        }
+    }
+}
+
+bool fiber_end_server::is_superseded_notification(const QJsonObject& obj)
+{
+    //连续采集通知以帧率发送，对应的环形缓冲区槽位很快会被覆盖，客户端只需要最新的一条
+    return obj.value("command").toString() == QString("server_camera_stream_image_ready");
+}
 
-                // 构造长度前缀
-                qint32 size = payload.size();
-                QByteArray block;
-                QDataStream out(&block, QIODevice::WriteOnly);
-                out.setByteOrder(QDataStream::BigEndian); // 网络字节序
-                out << size;
-                block.append(payload);
-                //写入 socket
-                client->write(block);
-                client->flush();
+void fiber_end_server::enqueue_frame(st_client_outbox& outbox, const QByteArray& block, bool superseded_by_newer)
+{
+    if (superseded_by_newer)
+    {
+        //客户端接收较慢时，队列中尚未发送的旧通知直接丢弃，其他消息必须送达
+        for (QQueue<st_outbound_frame>::iterator it = outbox.m_send_queue.begin(); it != outbox.m_send_queue.end(); )
+        {
+            if (it->m_superseded_by_newer)
+            {
+                outbox.m_queued_bytes -= it->m_block.size();
+                it = outbox.m_send_queue.erase(it);
+                outbox.m_frames_coalesced++;
+            }
+            else
+            {
+                ++it;
             }
         }
     }
+    //QByteArray 隐式共享，广播时只增加引用计数
+    outbox.m_send_queue.enqueue({ block, superseded_by_newer });
+    outbox.m_queued_bytes += block.size();
+    send_pending(outbox);
+}
+
+void fiber_end_server::send_pending(st_client_outbox& outbox)
+{
+    //不调用 flush，由事件循环写入 socket，避免在主线程中同步等待每个客户端
+    while (!outbox.m_send_queue.isEmpty() && outbox.m_socket->bytesToWrite() < m_outbox_high_water_mark)
+    {
+        st_outbound_frame frame = outbox.m_send_queue.dequeue();
+        outbox.m_queued_bytes -= frame.m_block.size();
+        outbox.m_socket->write(frame.m_block);
+        outbox.m_frames_sent++;
+    }
+}
+
+void fiber_end_server::onBytesWritten(qint64 bytes)
+{
+    auto* client = qobject_cast<QTcpSocket*>(sender());
+    auto iter = m_outboxes.find(client);
+    if (iter != m_outboxes.end())
+    {
+        send_pending(iter.value());
+    }
 }
 
 int fiber_end_server::get_task_type(const QJsonObject& obj)
@@ -296,7 +471,9 @@ QJsonObject fiber_end_server::server_parameter_to_json(const st_config_data& con
 
 void fiber_end_server::on_algorithm_task_finished(const QVariant& task_data)
 {
-	
+    //检测线程回复 server_anomaly_detection_finish 等阶段性消息，是否结束由 task_finish 标识决定
+    QJsonObject obj = task_data.toJsonObject();
+    send_process_result(obj, obj.value("task_finish").toBool(true));
 }
 
 void fiber_end_server::on_device_enum_task_finished(const QVariant& task_data)
@@ -327,11 +504,11 @@ void fiber_end_server::on_device_enum_task_finished(const QVariant& task_data)
         }
         obj["algorithm_parameter"] = m_thread_misc->algorithm_parameter()->save_to_json();
         obj["fiber_end_parameter"] = m_config_data.save_to_json();  // 将端面检测参数添加到返回结果中
-		send_process_result(QVariant::fromValue(obj));                      // 将任务结果发送给客户端
+		send_process_result(obj);                           // 将任务结果发送给客户端
     }
     else
     {
-        send_process_result(task_data);                         // 将任务结果发送给客户端
+        send_process_result(obj);                           // 将任务结果发送给客户端
     }
 }
 
@@ -342,23 +519,19 @@ void fiber_end_server::on_misc_task_finished(const QVariant& task_data)
     {
         obj["algorithm_parameter"] = m_thread_misc->algorithm_parameter()->save_to_json();
         obj["fiber_end_parameter"] = m_config_data.save_to_json();  // 将端面检测参数添加到返回结果中
-        send_process_result(QVariant::fromValue(obj));
+        send_process_result(obj);
     }
     else
     {
-        if(obj.contains("task_finish"))
-        {
-            bool finish = obj["task_finish"].toBool();
-            send_process_result(task_data, finish);
-        }
-        else
-        {
-            send_process_result(task_data);                 // 将任务结果发送给客户端
-        }
-        
+        send_process_result(obj, obj.value("task_finish").toBool(true));     // 将任务结果发送给客户端
     }
 }
 
+void fiber_end_server::on_query_task_finished(const QVariant& task_data)
+{
+    send_process_result(task_data.toJsonObject());
+}
+
 void fiber_end_server::on_motion_control_task_finished(const QVariant& task_data)
 {
 	
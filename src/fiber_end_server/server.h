@@ -2,12 +2,43 @@
 
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QQueue>
 #include "thread_algorithm.h"
 #include "thread_motion_control.h"
 #include "thread_device_enum.h"
 #include "thread_misc.h"
+#include "thread_query.h"
+#include "image_transport.h"
+#include "request_decoder.h"
+#include "task_message.h"
+#include "task_dispatcher.h"
 #include "config.hpp"
 
+//等待回复的请求
+struct st_pending_request
+{
+    QTcpSocket* m_client{ nullptr };
+    TASK_OPCODE m_opcode{ OPCODE_UNKNOWN };        //用于按命令统计回复字节数
+};
+
+//待发送给客户端的消息，数据块已序列化，广播时多个客户端共用
+struct st_outbound_frame
+{
+    QByteArray m_block;
+    bool m_superseded_by_newer{ false };        //连续采集通知，被更新的通知取代后不再需要发送
+};
+
+//每个客户端的发送队列. socket 待发送字节数超过高水位时暂停写入，在 bytesWritten 时继续
+struct st_client_outbox
+{
+    QTcpSocket* m_socket{ nullptr };
+    QQueue<st_outbound_frame> m_send_queue;
+    WIRE_ENCODING m_encoding{ WIRE_ENCODING_JSON };     //通过 client_request_hello 协商的消息编码
+    qint64 m_queued_bytes{ 0 };                 //队列中尚未写入 socket 的字节数
+    long long m_frames_sent{ 0 };
+    long long m_frames_coalesced{ 0 };          //被更新的连续采集通知取代而丢弃的数量
+};
+
 class fiber_end_server : public QTcpServer
 {
     Q_OBJECT
@@ -19,8 +50,8 @@ public:
 
     bool load_config_file(const std::string& config_file_path);         //加载配置文件，如果没有则使用默认值
 	
-	void process_request(const QJsonObject& obj);                       //处理外部请求
-    void send_process_result(const QVariant& result_data,bool task_finished = true);              //向客户端发送消息
+	void process_request(st_task_message message);                      //处理外部请求，按操作码分发到子线程
+    void send_process_result(const QJsonObject& obj, bool task_finished = true);              //向客户端发送消息
 
     static int get_task_type(const QJsonObject& obj);                   //后端执行完毕之后根据任务类型设置状态
 
@@ -31,24 +62,44 @@ protected:
 private slots:
     void onReadyRead();
     void onDisconnected();
+    void onBytesWritten(qint64 bytes);
 
     void on_algorithm_task_finished(const QVariant& task_data);   //子线程任务执行完毕之后向主线程发送消息，然后主线程通过TCP/IP转发
     void on_device_enum_task_finished(const QVariant& task_data);
     void on_misc_task_finished(const QVariant& task_data);
     void on_motion_control_task_finished(const QVariant& task_data);
+    void on_query_task_finished(const QVariant& task_data);
+
+private:
+    void handle_stop_process(const st_task_message& message, QJsonObject& result_obj);
+    void handle_cancel_task(const st_task_message& message, QJsonObject& result_obj);
+    void handle_stop_server(const st_task_message& message, QJsonObject& result_obj);
+    void handle_server_stats(const st_task_message& message, QJsonObject& result_obj);
+    void handle_hello(const st_task_message& message, QJsonObject& result_obj);
+    void reply_superseded(const st_task_message& message, const QJsonValue& value);    //回复在队列中被合并的请求
+
+    static bool is_superseded_notification(const QJsonObject& obj);      //是否为可以被更新消息取代的通知(连续采集)
+    void enqueue_frame(st_client_outbox& outbox, const QByteArray& block, bool superseded_by_newer);    //加入客户端发送队列
+    void send_pending(st_client_outbox& outbox);                        //在 socket 缓冲区低于高水位时发送队列中的数据
 
 private:
 	QString m_server_ip{ "127.0.0.1" };                         //服务器 IP 地址
 	quint16 m_server_port{ 5555 };                              //服务器端口号
     std::atomic<bool> m_stop_server{ false };                   //前端发送的终止服务请求，该值置为True，然后退出所有子线程
     QList<QTcpSocket*> m_clients;                               //连接的客户端
-	QMap<QString, QTcpSocket*> m_map_request_id_to_socket;      //请求 id 和对应的客户端socket映射，在连接多个客户端时确保不会回复错误
+    QMap<QTcpSocket*, request_decoder> m_request_decoders;      //每个客户端的请求解码器，拼接分段到达的请求并拆分同一次到达的多个请求
+    QMap<QTcpSocket*, st_client_outbox> m_outboxes;             //每个客户端的发送队列，只在主线程访问
+    qint64 m_outbox_high_water_mark{ 256 * 1024 };              //socket 待发送字节数高水位，超过之后消息在发送队列中等待
+	QMap<QString, st_pending_request> m_map_request_id_to_socket;   //请求 id 和对应的客户端socket映射，在连接多个客户端时确保不会回复错误
 	device_manager m_device_manager;                            //设备管理器，用于存储和管理设备信息
     st_config_data m_config_data;                               //端面检测参数
 	thread_algorithm* m_thread_algorithm{ nullptr };            //四个子线程，分别处理四类任务
     thread_motion_control* m_thread_motion_control{ nullptr };  
     thread_device_enum* m_thread_device_enum{ nullptr };
     thread_misc* m_thread_misc{ nullptr };
+    thread_query* m_thread_query{ nullptr };                    //只读命令，运行期间也可以响应
+    task_dispatcher m_dispatcher;                               //主线程直接处理的命令(运行开关、取消、停止服务、统计)
+    image_transport_mgr m_image_transport;                      //影像传输，本机客户端使用共享内存，远程客户端使用 TCP(端口号 = 命令端口 + 1)
     //interface_camera* m_camera{ nullptr };			            //相机对象
     /***************************线程执行状态变量，防止命令冲突*************************/
     std::atomic<bool> m_is_triggering{ false };       //后端线程是否正在采图
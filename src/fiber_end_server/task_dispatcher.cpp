@@ -0,0 +1,112 @@
+﻿#include "task_dispatcher.h"
+#include <QJsonArray>
+#include <algorithm>
+
+void task_dispatcher::register_handler(TASK_OPCODE opcode, const task_handler& handler)
+{
+    if (opcode > OPCODE_UNKNOWN && opcode < OPCODE_COUNT)
+    {
+        m_handlers[opcode] = handler;
+    }
+}
+
+bool task_dispatcher::is_registered(TASK_OPCODE opcode) const
+{
+    return opcode > OPCODE_UNKNOWN && opcode < OPCODE_COUNT && m_handlers[opcode];
+}
+
+bool task_dispatcher::dispatch(const st_task_message& message)
+{
+    if (!is_registered(message.m_opcode))
+    {
+        return false;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    //内部产生的任务没有接收时间，不统计排队时间
+    double queue_wait_ms = message.m_receive_time.time_since_epoch().count() == 0 ? 0.0 :
+        std::chrono::duration<double, std::milli>(start - message.m_receive_time).count();
+    QJsonObject result_obj;     //返回的消息对象
+    result_obj["request_id"] = message.m_request_id;
+    m_handlers[message.m_opcode](message, result_obj);
+    double execution_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    command_statistics::instance().record_execution(message.m_opcode, queue_wait_ms, execution_ms);
+    return true;
+}
+
+command_statistics& command_statistics::instance()
+{
+    static command_statistics statistics;
+    return statistics;
+}
+
+command_statistics::command_statistics()
+    : m_start_time(std::chrono::steady_clock::now())
+{
+
+}
+
+void command_statistics::record_execution(TASK_OPCODE opcode, double queue_wait_ms, double execution_ms)
+{
+    if (opcode < OPCODE_UNKNOWN || opcode >= OPCODE_COUNT)
+    {
+        return;
+    }
+    QMutexLocker locker(&m_mutex);
+    st_command_statistics& statistics = m_statistics[opcode];
+    statistics.m_count++;
+    statistics.m_queue_wait_ms += queue_wait_ms;
+    statistics.m_max_queue_wait_ms = std::max(statistics.m_max_queue_wait_ms, queue_wait_ms);
+    statistics.m_execution_ms += execution_ms;
+    statistics.m_max_execution_ms = std::max(statistics.m_max_execution_ms, execution_ms);
+}
+
+void command_statistics::record_response(TASK_OPCODE opcode, qint64 bytes)
+{
+    if (opcode < OPCODE_UNKNOWN || opcode >= OPCODE_COUNT)
+    {
+        return;
+    }
+    QMutexLocker locker(&m_mutex);
+    m_statistics[opcode].m_response_count++;
+    m_statistics[opcode].m_response_bytes += bytes;
+}
+
+QJsonObject command_statistics::to_json()
+{
+    QMutexLocker locker(&m_mutex);
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start_time).count();
+    QJsonArray commands;
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        const st_command_statistics& statistics = m_statistics[i];
+        if (statistics.m_count == 0 && statistics.m_response_count == 0)
+        {
+            continue;
+        }
+        QJsonObject obj;
+        obj["command"] = i == OPCODE_UNKNOWN ? QString("broadcast") : command_from_opcode(static_cast<TASK_OPCODE>(i));
+        obj["count"] = static_cast<qint64>(statistics.m_count);
+        obj["average_queue_wait_ms"] = statistics.m_count > 0 ? statistics.m_queue_wait_ms / statistics.m_count : 0.0;
+        obj["max_queue_wait_ms"] = statistics.m_max_queue_wait_ms;
+        obj["average_execution_ms"] = statistics.m_count > 0 ? statistics.m_execution_ms / statistics.m_count : 0.0;
+        obj["max_execution_ms"] = statistics.m_max_execution_ms;
+        obj["response_count"] = static_cast<qint64>(statistics.m_response_count);
+        obj["response_bytes"] = statistics.m_response_bytes;
+        obj["response_bytes_per_second"] = elapsed_s > 0.0 ? statistics.m_response_bytes / elapsed_s : 0.0;
+        commands.append(obj);
+    }
+    QJsonObject obj;
+    obj["elapsed_s"] = elapsed_s;
+    obj["commands"] = commands;
+    return obj;
+}
+
+void command_statistics::reset()
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < OPCODE_COUNT; i++)
+    {
+        m_statistics[i] = st_command_statistics();
+    }
+    m_start_time = std::chrono::steady_clock::now();
+}
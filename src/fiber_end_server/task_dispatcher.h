@@ -0,0 +1,67 @@
+﻿/***************************************************************
+ * 命令分发表和命令统计
+ * (1) 每个线程在构造时按操作码注册处理函数，分发时直接按操作码下标查找，不再比较命令字符串
+ * (2) 分发时统计每个命令的排队时间(接收请求到开始处理)和执行时间，主线程发送回复时统计回复字节数
+ * (3) 统计信息通过 client_request_server_stats 命令查询
+ ***************************************************************/
+#pragma once
+#include <QMutex>
+#include <QJsonObject>
+#include <functional>
+#include <chrono>
+
+#include "task_message.h"
+
+//处理函数，result_obj 中已经填写 request_id
+using task_handler = std::function<void(const st_task_message& message, QJsonObject& result_obj)>;
+
+class task_dispatcher
+{
+public:
+    void register_handler(TASK_OPCODE opcode, const task_handler& handler);
+    template <typename T>
+    void register_handler(TASK_OPCODE opcode, T* object, void (T::*method)(const st_task_message&, QJsonObject&))
+    {
+        register_handler(opcode, [object, method](const st_task_message& message, QJsonObject& result_obj)
+            {
+                (object->*method)(message, result_obj);
+            });
+    }
+    bool is_registered(TASK_OPCODE opcode) const;
+
+    //执行操作码对应的处理函数并记录排队和执行时间. 没有注册处理函数时返回 false
+    bool dispatch(const st_task_message& message);
+
+private:
+    task_handler m_handlers[OPCODE_COUNT];
+};
+
+//单个命令的统计信息
+struct st_command_statistics
+{
+    quint64 m_count{ 0 };                   //执行次数
+    double m_queue_wait_ms{ 0.0 };          //累计排队时间
+    double m_max_queue_wait_ms{ 0.0 };
+    double m_execution_ms{ 0.0 };           //累计执行时间
+    double m_max_execution_ms{ 0.0 };
+    quint64 m_response_count{ 0 };          //回复消息数量(多阶段命令有多条回复)
+    qint64 m_response_bytes{ 0 };           //回复消息字节数(含长度前缀)
+};
+
+class command_statistics
+{
+public:
+    static command_statistics& instance();
+
+    void record_execution(TASK_OPCODE opcode, double queue_wait_ms, double execution_ms);
+    void record_response(TASK_OPCODE opcode, qint64 bytes);    //OPCODE_UNKNOWN 表示广播消息
+    QJsonObject to_json();
+    void reset();
+
+private:
+    command_statistics();
+
+    QMutex m_mutex;
+    st_command_statistics m_statistics[OPCODE_COUNT];
+    std::chrono::steady_clock::time_point m_start_time;
+};
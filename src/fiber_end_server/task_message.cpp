@@ -0,0 +1,175 @@
+﻿#include "task_message.h"
+#include <QHash>
+#include <QJsonDocument>
+#include <QCborMap>
+#include <QCborValue>
+#include <QtEndian>
+#include <cstring>
+
+namespace
+{
+    struct st_command_entry
+    {
+        TASK_OPCODE m_opcode;
+        const char* m_command;
+        TASK_TARGET m_target;
+        TASK_PRIORITY m_priority;
+        bool m_read_only;           //只读命令，不修改设备、参数和检测状态，运行期间也可以执行
+    };
+
+    //按 TASK_OPCODE 顺序排列
+    const st_command_entry command_table[] =
+    {
+        { OPCODE_UNKNOWN,                       "",                                             TASK_TARGET_NONE,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_SERVER_PARAMETER,              "client_request_server_parameter",              TASK_TARGET_DEVICE_ENUM, TASK_PRIORITY_INTERACTIVE, true  },
+        { OPCODE_CAMERA_LIST,                   "client_request_camera_list",                   TASK_TARGET_DEVICE_ENUM, TASK_PRIORITY_INTERACTIVE, true  },
+        { OPCODE_OPEN_CAMERA,                   "client_request_open_camera",                   TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_CLOSE_CAMERA,                  "client_request_close_camera",                  TASK_TARGET_MISC,       TASK_PRIORITY_CONTROL,     false },
+        { OPCODE_CHANGE_CAMERA_PARAMETER,       "client_request_change_camera_parameter",       TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_START_GRAB,                    "client_request_start_grab",                    TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_TRIGGER_ONCE,                  "client_request_trigger_once",                  TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_CHANGE_ALGORITHM_PARAMETER,    "client_request_change_algorithm_parameter",    TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_USER_CONFIG_SET,               "client_request_user_config_set",               TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_MOVE_CAMERA,                   "client_request_move_camera",                   TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_MOVE_CAMERA_BY_INDEX,          "client_request_move_camera_by_index",          TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_SET_MOTION_PARAMETER,          "client_request_set_motion_parameter",          TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_AUTO_FOCUS,                    "client_request_auto_focus",                    TASK_TARGET_MISC,       TASK_PRIORITY_BULK,        false },
+        { OPCODE_ANOMALY_DETECTION,             "client_request_anomaly_detection",             TASK_TARGET_MISC,       TASK_PRIORITY_BULK,        false },
+        { OPCODE_AUTO_CALIBRATION,              "client_request_auto_calibration",              TASK_TARGET_MISC,       TASK_PRIORITY_BULK,        false },
+        { OPCODE_UPDATE_SERVER_PARAMETER,       "client_request_update_server_parameter",       TASK_TARGET_MISC,       TASK_PRIORITY_INTERACTIVE, false },
+        { OPCODE_ARCHIVE_QUERY,                 "client_request_archive_query",                 TASK_TARGET_QUERY,      TASK_PRIORITY_INTERACTIVE, true  },
+        { OPCODE_FOCUS_MAP,                     "client_request_focus_map",                     TASK_TARGET_QUERY,      TASK_PRIORITY_INTERACTIVE, true  },
+        { OPCODE_START_PROCESS,                 "client_request_start_process",                 TASK_TARGET_MISC,       TASK_PRIORITY_BULK,        false },
+        { OPCODE_STOP_PROCESS,                  "client_request_stop_process",                  TASK_TARGET_SERVER,     TASK_PRIORITY_CONTROL,     false },
+        { OPCODE_STOP_SERVER,                   "client_request_stop_server",                   TASK_TARGET_SERVER,     TASK_PRIORITY_CONTROL,     false },
+        { OPCODE_CANCEL_TASK,                   "client_request_cancel_task",                   TASK_TARGET_SERVER,     TASK_PRIORITY_CONTROL,     false },
+        { OPCODE_SERVER_STATS,                  "client_request_server_stats",                  TASK_TARGET_SERVER,     TASK_PRIORITY_INTERACTIVE, true  },
+        { OPCODE_HELLO,                         "client_request_hello",                         TASK_TARGET_SERVER,     TASK_PRIORITY_CONTROL,     true  },
+        { OPCODE_DEVICE_START_PROCESS,          "device_request_start_process",                 TASK_TARGET_NONE,       TASK_PRIORITY_BULK,        false },     //内部命令，不接受客户端下发
+    };
+    static_assert(sizeof(command_table) / sizeof(command_table[0]) == OPCODE_COUNT, "command table does not match TASK_OPCODE");
+
+    const QHash<QString, TASK_OPCODE>& command_map()
+    {
+        static const QHash<QString, TASK_OPCODE> map = []()
+        {
+            QHash<QString, TASK_OPCODE> result;
+            for (int i = 1; i < OPCODE_COUNT; i++)
+            {
+                result.insert(QString::fromLatin1(command_table[i].m_command), command_table[i].m_opcode);
+            }
+            return result;
+        }();
+        return map;
+    }
+}
+
+TASK_OPCODE opcode_from_command(const QString& command)
+{
+    return command_map().value(command, OPCODE_UNKNOWN);
+}
+
+QString command_from_opcode(TASK_OPCODE opcode)
+{
+    if (opcode <= OPCODE_UNKNOWN || opcode >= OPCODE_COUNT)
+    {
+        return QString("");
+    }
+    return QString::fromLatin1(command_table[opcode].m_command);
+}
+
+TASK_TARGET opcode_target(TASK_OPCODE opcode)
+{
+    if (opcode <= OPCODE_UNKNOWN || opcode >= OPCODE_COUNT)
+    {
+        return TASK_TARGET_NONE;
+    }
+    return command_table[opcode].m_target;
+}
+
+TASK_PRIORITY opcode_priority(TASK_OPCODE opcode)
+{
+    if (opcode <= OPCODE_UNKNOWN || opcode >= OPCODE_COUNT)
+    {
+        return TASK_PRIORITY_INTERACTIVE;
+    }
+    return command_table[opcode].m_priority;
+}
+
+bool opcode_is_read_only(TASK_OPCODE opcode)
+{
+    if (opcode <= OPCODE_UNKNOWN || opcode >= OPCODE_COUNT)
+    {
+        return false;
+    }
+    return command_table[opcode].m_read_only;
+}
+
+bool opcode_allowed_while_processing(TASK_OPCODE opcode)
+{
+    //只读命令不会修改设备和检测状态，主线程处理的控制命令不会等待设备操作线程，运行期间可以执行
+    return opcode_is_read_only(opcode) || opcode_target(opcode) == TASK_TARGET_SERVER;
+}
+
+QString coalesce_key(const st_task_message& message)
+{
+    //拖动曝光、增益等滑块时每个刻度都会下发一次，尚未执行的旧值没有意义
+    if (message.m_opcode == OPCODE_CHANGE_CAMERA_PARAMETER)
+    {
+        QString name = message.m_body.value("param").toObject().value("name").toString();
+        return name.isEmpty() ? QString() : QString("camera_parameter/%1").arg(name);
+    }
+    return QString();
+}
+
+st_task_message st_task_message::from_json(QJsonObject obj)
+{
+    st_task_message message;
+    message.m_opcode = opcode_from_command(obj.value("command").toString());
+    //开始运行和中断运行使用同一个命令，中断运行作为控制命令由主线程直接处理
+    if (message.m_opcode == OPCODE_START_PROCESS && !obj.value("param").toBool())
+    {
+        message.m_opcode = OPCODE_STOP_PROCESS;
+    }
+    message.m_request_id = obj.value("request_id").toString();
+    message.m_body = std::move(obj);
+    message.m_receive_time = std::chrono::steady_clock::now();
+    return message;
+}
+
+st_task_message st_task_message::from_variant(const QVariant& task_data)
+{
+    if (task_data.metaType() == QMetaType::fromType<st_task_message>())
+    {
+        return *static_cast<const st_task_message*>(task_data.constData());
+    }
+    return from_json(task_data.toJsonObject());
+}
+
+QString wire_encoding_name(WIRE_ENCODING encoding)
+{
+    return encoding == WIRE_ENCODING_CBOR ? QString("cbor") : QString("json");
+}
+
+WIRE_ENCODING wire_encoding_from_name(const QString& name, WIRE_ENCODING default_encoding)
+{
+    if (name == "cbor")
+    {
+        return WIRE_ENCODING_CBOR;
+    }
+    if (name == "json")
+    {
+        return WIRE_ENCODING_JSON;
+    }
+    return default_encoding;
+}
+
+QByteArray encode_frame(const QJsonObject& obj, WIRE_ENCODING encoding)
+{
+    QByteArray payload = encoding == WIRE_ENCODING_CBOR ?
+        QCborMap::fromJsonObject(obj).toCborValue().toCbor() : QJsonDocument(obj).toJson(QJsonDocument::Compact);
+    QByteArray block(4 + payload.size(), Qt::Uninitialized);
+    qToBigEndian<qint32>(static_cast<qint32>(payload.size()), block.data());       //网络字节序
+    memcpy(block.data() + 4, payload.constData(), payload.size());
+    return block;
+}
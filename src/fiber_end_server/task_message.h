@@ -0,0 +1,94 @@
+﻿/***************************************************************
+ * 线程间传递的任务消息
+ * (1) 客户端请求在主线程中只解析一次: 命令字符串通过哈希表转换为 TASK_OPCODE，请求 id 单独保存，
+ *     主线程和子线程按操作码分发，不再逐个比较命令字符串
+ * (2) st_task_message 以值类型放入 QVariant，QString/QJsonObject 隐式共享，入队和出队时只移动不深拷贝
+ * (3) 每个操作码有固定的执行线程和优先级. 只读命令(查询)由查询线程执行，运行期间也可以响应
+ * (4) 回复消息由 encode_frame 序列化为 4 字节长度前缀(网络字节序) + 紧凑 JSON 或 CBOR(客户端通过 hello 协商)，
+ *     广播消息每种编码只序列化一次，使用相同编码的客户端共用同一个数据块
+ ***************************************************************/
+#pragma once
+#include <QString>
+#include <QVariant>
+#include <QByteArray>
+#include <QJsonObject>
+#include <chrono>
+
+#include "work_threads.h"
+
+//任务操作码，新增命令时同时修改 task_message.cpp 中的命令表
+enum TASK_OPCODE
+{
+    OPCODE_UNKNOWN = 0,
+    OPCODE_SERVER_PARAMETER,                //client_request_server_parameter
+    OPCODE_CAMERA_LIST,                     //client_request_camera_list
+    OPCODE_OPEN_CAMERA,                     //client_request_open_camera
+    OPCODE_CLOSE_CAMERA,                    //client_request_close_camera
+    OPCODE_CHANGE_CAMERA_PARAMETER,         //client_request_change_camera_parameter
+    OPCODE_START_GRAB,                      //client_request_start_grab
+    OPCODE_TRIGGER_ONCE,                    //client_request_trigger_once
+    OPCODE_CHANGE_ALGORITHM_PARAMETER,      //client_request_change_algorithm_parameter
+    OPCODE_USER_CONFIG_SET,                 //client_request_user_config_set
+    OPCODE_MOVE_CAMERA,                     //client_request_move_camera
+    OPCODE_MOVE_CAMERA_BY_INDEX,            //client_request_move_camera_by_index
+    OPCODE_SET_MOTION_PARAMETER,            //client_request_set_motion_parameter
+    OPCODE_AUTO_FOCUS,                      //client_request_auto_focus
+    OPCODE_ANOMALY_DETECTION,               //client_request_anomaly_detection
+    OPCODE_AUTO_CALIBRATION,                //client_request_auto_calibration
+    OPCODE_UPDATE_SERVER_PARAMETER,         //client_request_update_server_parameter
+    OPCODE_ARCHIVE_QUERY,                   //client_request_archive_query
+    OPCODE_FOCUS_MAP,                       //client_request_focus_map
+    OPCODE_START_PROCESS,                   //client_request_start_process，param 为 true
+    OPCODE_STOP_PROCESS,                    //client_request_start_process 且 param 为 false，中断运行
+    OPCODE_STOP_SERVER,                     //client_request_stop_server
+    OPCODE_CANCEL_TASK,                     //client_request_cancel_task，取消设备操作线程当前正在执行的任务
+    OPCODE_SERVER_STATS,                    //client_request_server_stats，查询命令统计信息
+    OPCODE_HELLO,                           //client_request_hello，协商消息编码
+    OPCODE_DEVICE_START_PROCESS,            //device_request_start_process，运控模块按钮触发，不来自客户端
+    OPCODE_COUNT
+};
+
+//命令端口的消息编码，消息结构相同
+enum WIRE_ENCODING
+{
+    WIRE_ENCODING_JSON = 0,                 //紧凑 JSON 文本，默认编码
+    WIRE_ENCODING_CBOR,                     //CBOR 二进制(QCborValue)，数值不需要格式化为文本
+    WIRE_ENCODING_COUNT
+};
+
+//操作码由哪个线程执行
+enum TASK_TARGET
+{
+    TASK_TARGET_NONE = 0,                   //未知命令，丢弃
+    TASK_TARGET_SERVER,                     //主线程直接处理
+    TASK_TARGET_DEVICE_ENUM,                //设备枚举线程
+    TASK_TARGET_MISC,                       //设备操作线程
+    TASK_TARGET_QUERY,                      //查询线程，只读命令，运行期间也可以执行
+};
+
+struct st_task_message
+{
+    TASK_OPCODE m_opcode{ OPCODE_UNKNOWN };
+    QString m_request_id{ "" };
+    QJsonObject m_body;                     //原始请求，子线程从中读取 param 等参数
+    std::chrono::steady_clock::time_point m_receive_time;     //接收时间，用于统计排队时间. 内部产生的任务为默认值
+
+    static st_task_message from_json(QJsonObject obj);          //解析命令和请求 id
+    static st_task_message from_variant(const QVariant& task_data);    //兼容仍以 QJsonObject 入队的任务
+};
+Q_DECLARE_METATYPE(st_task_message)
+
+TASK_OPCODE opcode_from_command(const QString& command);
+QString command_from_opcode(TASK_OPCODE opcode);
+TASK_TARGET opcode_target(TASK_OPCODE opcode);
+TASK_PRIORITY opcode_priority(TASK_OPCODE opcode);
+bool opcode_is_read_only(TASK_OPCODE opcode);                 //只读命令(查询参数、相机列表、归档、统计等)
+bool opcode_allowed_while_processing(TASK_OPCODE opcode);     //运行期间是否接受该命令(只读命令和控制命令)
+//可合并的命令返回合并标识(同一参数的修改只保留最新的一个)，其他命令返回空字符串
+QString coalesce_key(const st_task_message& message);
+
+QString wire_encoding_name(WIRE_ENCODING encoding);
+WIRE_ENCODING wire_encoding_from_name(const QString& name, WIRE_ENCODING default_encoding = WIRE_ENCODING_JSON);
+
+//回复消息序列化为发送给客户端的数据块: 4 字节长度前缀(网络字节序) + 紧凑 JSON 或 CBOR
+QByteArray encode_frame(const QJsonObject& obj, WIRE_ENCODING encoding = WIRE_ENCODING_JSON);
@@ -1,4 +1,9 @@
 ﻿#include "thread_algorithm.h"
+#include <QCoreApplication>
+
+#include "../common/common.h"
+#include "../common/common_api.h"
+#include "../basic_algorithm/common_api.h"
 
 thread_algorithm::thread_algorithm(QString name, QObject* parent)
 	:thread_base(name, parent)
@@ -8,7 +13,158 @@ thread_algorithm::thread_algorithm(QString name, QObject* parent)
 
 void thread_algorithm::process_task(const QVariant& task_data)
 {
+	if (task_data.canConvert<st_detect_task>())
+	{
+		process_detect_task(task_data.value<st_detect_task>());
+		return;
+	}
 	QJsonObject task = task_data.toJsonObject();
-	qDebug() << "[算法线程] 处理任务:" << task["command"];
-	QThread::sleep(1); // 模拟耗时
-}
\ No newline at end of file
+	qDebug() << "[算法线程] 未知任务:" << task["command"];
+}
+
+void thread_algorithm::process_detect_task(const st_detect_task& task)
+{
+	//用户中断时，尚未检测的位置直接丢弃，由 server_process_status 通知客户端运行被中断
+	if (is_terminated())
+	{
+		return;
+	}
+	QJsonObject result_obj;     //返回的消息对象
+	result_obj["request_id"] = task.m_request_id;
+	result_obj["task_finish"] = task.m_is_task_finish;
+	result_obj["start_index"] = task.m_index * task.m_fiber_end_count;
+	result_obj["fiber_end_count"] = task.m_fiber_end_count;
+	result_obj["command"] = "server_anomaly_detection_finish";
+	if (task.m_has_capture_position)
+	{
+		QJsonObject capture_position;
+		capture_position["x"] = task.m_capture_x;
+		capture_position["y"] = task.m_capture_y;
+		capture_position["x_end"] = task.m_capture_x_end;
+		result_obj["capture_position"] = capture_position;
+	}
+	if (!task.m_error.isEmpty())
+	{
+		result_obj["param"] = task.m_error;
+		emit post_task_finished(QVariant::fromValue(result_obj));
+		return;
+	}
+	if (m_fiber_end_detector == nullptr)
+	{
+		result_obj["param"] = L("算法初始化失败!");
+		emit post_task_finished(QVariant::fromValue(result_obj));
+		return;
+	}
+	QString user_dir = task.m_save_dir;                               //外部指定的保存目录
+	bool is_archive = m_result_archive.is_open();                     //开启结果归档时不再逐张保存到该目录
+	if (!is_archive)
+	{
+		make_path(user_dir);
+	}
+	st_archive_index_record archive_entry;
+	archive_entry.m_timestamp = task.m_timestamp;
+	archive_entry.m_position_index = task.m_index;
+	/******************************
+	 * 执行流程:
+	 * (1) 精定位得到结果 box
+	 * (2) 定位失败，输出定位结果(原始数据)
+	 * (3) 定位成功
+	 *      3.1 如果开启了自动检测,自动检测，外扩之后输出定位结果 + 检测结果
+	 *      3.2 如果没有开启自动检测，外扩之后输出定位结果
+	 ******************************/
+	const std::vector<cv::Mat>& images = task.m_images;
+	QJsonArray result_images;		//每个端面的结果影像元数据，客户端据此从共享内存(或影像端口)读取影像
+	for (int i = 0; i < images.size(); i++)
+	{
+		if (is_terminated())
+		{
+			return;
+		}
+		int fiber_index = task.m_index * task.m_fiber_end_count + i;
+		archive_entry.m_fiber_index = fiber_index;
+		// 精定位
+		st_detect_box box = m_fiber_end_detector->get_shape_match_result(images[i]);
+		cv::Mat shape_image = images[i];    //原始数据
+		if (!box.is_valid())
+		{
+			// 定位失败，输出原始数据
+			QString dst_image_path = QString("%1/%2_%3_shape").arg(user_dir).arg(task.m_time_string).arg(fiber_index);
+			archive_entry.m_verdict = ARCHIVE_VERDICT_LOCATE_FAILED;
+			archive_entry.m_kind = ARCHIVE_KIND_SHAPE_IMAGE;
+			save_result_image(is_archive, archive_entry, dst_image_path, shape_image);
+			result_images.append(send_result_image(shape_image, fiber_index, "shape", false));
+		}
+		else
+		{
+			//定位成功，首先保存外扩之后的定位结果
+			cv::Rect buffer_roi;
+			st_detect_box buffer_box = box.buffer(task.m_field_of_view);  //首先进行外扩
+			cv::Mat buffer_shape_image = get_roi_image(images[i], buffer_box, 0, 1, buffer_roi);    //得到外扩影像及其在原始影像上的区域
+			QString dst_image_path = QString("%1/%2_%3_shape").arg(user_dir).arg(task.m_time_string).arg(fiber_index);
+			archive_entry.m_verdict = ARCHIVE_VERDICT_LOCATED;
+			archive_entry.m_kind = ARCHIVE_KIND_SHAPE_IMAGE;
+			save_result_image(is_archive, archive_entry, dst_image_path, buffer_shape_image);
+			cv::Mat enhance_shape_image = unsharp_masking(buffer_shape_image, 1.0, 7);
+			result_images.append(send_result_image(enhance_shape_image, fiber_index, "shape", true));
+			//如果开启了自动检测, 在原始定位结果的基础上执行自动检测，然后外扩保存
+			//if(m_config_data->m_auto_detect)
+			if (0)          //这里禁用自动检测功能
+			{
+				cv::Rect roi;
+				shape_image = get_roi_image(images[i], box, 0, 1, roi);
+				st_detect_result detect_result = m_fiber_end_detector->get_detect_result(shape_image);
+				//这里检测结果的坐标是相对于roi区域的，但我们保存的影像数据是buffer_roi区域，外扩之后需要对检测结果坐标进行偏移
+				double dx = roi.x - buffer_roi.x;
+				double dy = roi.y - buffer_roi.y;
+				detect_result = detect_result.translate(dx, dy);
+				//保存检测结果
+				QString dst_detect_path = QString("%1/%2_%3.det").arg(user_dir).arg(task.m_time_string).arg(fiber_index);
+				detect_result.save_to_file(dst_detect_path.toStdString());
+				//绘制结果并保存
+				std::vector<cv::Mat> channels(3, buffer_shape_image);
+				cv::Mat detect_image;
+				cv::merge(channels, detect_image);  // 三个通道都指向同一个数据
+				detect_image = detect_result.draw_to_image(detect_image);
+				dst_image_path = QString("%1/%2_%3_det").arg(user_dir).arg(task.m_time_string).arg(fiber_index);
+				archive_entry.m_kind = ARCHIVE_KIND_DETECT_IMAGE;
+				save_result_image(is_archive, archive_entry, dst_image_path, detect_image);
+				cv::Mat enhance_detect_image = unsharp_masking(detect_image, 1.0, 7);
+				result_images.append(send_result_image(enhance_detect_image, fiber_index, "det", true));
+			}
+		}
+	}
+	result_obj["images"] = result_images;
+	result_obj["param"] = "success";
+	emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
+QJsonObject thread_algorithm::send_result_image(const cv::Mat& image, int fiber_index, const QString& kind, bool is_located)
+{
+	QJsonObject obj;
+	obj["fiber_index"] = fiber_index;
+	obj["kind"] = kind;
+	obj["located"] = is_located;
+	//影像传输模块异步编码远程客户端的影像，这里转换为独立的 QImage(单通道保持灰度，不扩展为 RGB)
+	QImage img = convert_cvmat_to_qimage(image, image.channels() == 1 ? 1 : 3);
+	st_image_meta meta;
+	if (m_image_transport == nullptr || img.isNull() || !m_image_transport->send_image(img, "annotated", meta))
+	{
+		obj["image"] = "write image error";
+		return obj;
+	}
+	obj["image"] = "success";
+	obj["image_data"] = image_shared_memory::meta_to_json(meta);
+	return obj;
+}
+
+void thread_algorithm::save_result_image(bool is_archive, const st_archive_index_record& entry, const QString& base_path, const cv::Mat& image)
+{
+	if (is_archive)
+	{
+		m_image_writer.write_archive(&m_result_archive, entry, image);
+	}
+	else
+	{
+		m_image_writer.write(IMAGE_DESTINATION_ARCHIVE, base_path, image);
+	}
+}
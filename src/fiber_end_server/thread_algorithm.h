@@ -1,14 +1,62 @@
 ﻿/********************
  * 算法线程
+ * 检测流水线的第二级: thread_misc 完成运动和自动对焦之后，将对焦影像打包为 st_detect_task 交给该线程，
+ * 由该线程完成精定位、保存影像并回复 server_anomaly_detection_finish 消息(结果影像通过 detect_image 共享内存或者影像端口发送，元数据附在消息中). 这样相机在检测当前位置的同时可以移动到下一个拍照位置.
+ * 所有检测结果(包括失败消息)都经过该线程的任务队列回复，保证消息顺序与拍照位置顺序一致
+ * 影像编码和写盘交给 image_writer 异步执行，只用于归档，运行结束时统一等待(flush)
+ * 开启结果归档(result_archive)时保存目录中的影像追加到分段文件，否则逐张保存
  ********************/
 #pragma once
 
+#include <opencv2/opencv.hpp>
 #include "work_threads.h"
+#include "image_writer.h"
+#include "image_transport.h"
+#include "../basic_algorithm/fiber_end_algorithm.h"
+
+//检测任务，一个拍照位置对应一个任务
+struct st_detect_task
+{
+    QString m_request_id{ "" };             //客户端请求 id
+    bool m_is_task_finish{ true };          //回复消息时的 task_finish 标识
+    int m_index{ 0 };                       //拍照位置序号
+    int m_fiber_end_count{ 0 };             //每个拍照位置的端面数量
+    double m_field_of_view{ 0.0 };          //定位结果外扩尺寸
+    QString m_save_dir{ "" };               //外部指定的保存目录
+    QString m_time_string{ "" };            //时间戳，用于文件命名
+    qint64 m_timestamp{ 0 };                //毫秒时间戳，用于结果归档索引
+    QString m_error{ "" };                  //不为空时表示前一级处理失败，直接回复该错误信息
+    std::vector<cv::Mat> m_images;          //自动对焦得到的单通道端面影像，每张影像包含一个端面
+    bool m_has_capture_position{ false };   //飞拍影像，回复时附带拍摄时读取的位置
+    int m_capture_x{ 0 };                   //触发时读取的 x
+    int m_capture_y{ 0 };
+    int m_capture_x_end{ 0 };               //影像返回之后读取的 x，与 m_capture_x 的差值为曝光和传输期间的移动距离
+};
+Q_DECLARE_METATYPE(st_detect_task)
 
 class thread_algorithm : public thread_base
 {
+    Q_OBJECT
 public:
     thread_algorithm(QString name,QObject* parent = nullptr);
+    void set_fiber_end_detector(fiber_end_algorithm* detector) { m_fiber_end_detector = detector; }
+    void set_terminate_flag(const std::atomic<bool>* terminate) { m_terminate = terminate; }
+    image_writer* get_image_writer() { return &m_image_writer; }      //异步影像写入，其他线程也可以提交
+    result_archive* get_result_archive() { return &m_result_archive; }    //结果归档，由 thread_misc 根据配置打开或关闭
+    void set_image_transport(image_transport_mgr* transport) { m_image_transport = transport; }       //发送结果影像，不负责资源释放
 protected:
     void process_task(const QVariant& task_data) override;
+private:
+    void process_detect_task(const st_detect_task& task);
+    //保存结果影像: 开启归档时追加到归档文件，否则保存为 base_path + 扩展名
+    void save_result_image(bool is_archive, const st_archive_index_record& entry, const QString& base_path, const cv::Mat& image);
+    //通过影像传输模块发送结果影像，返回附在检测消息中的元数据
+    QJsonObject send_result_image(const cv::Mat& image, int fiber_index, const QString& kind, bool is_located);
+    bool is_terminated() const { return m_terminate != nullptr && m_terminate->load(); }
+
+    fiber_end_algorithm* m_fiber_end_detector{ nullptr };       //端面检测器，由 thread_misc 创建和释放
+    const std::atomic<bool>* m_terminate{ nullptr };            //中断标识，由 thread_misc 管理，中断时丢弃尚未处理的检测任务
+    image_transport_mgr* m_image_transport{ nullptr };          //影像传输模块，由 fiber_end_server 持有
+    result_archive m_result_archive;                            //结果归档，需要在 m_image_writer 之前声明(写入线程池先于归档销毁)
+    image_writer m_image_writer;                                //异步影像写入
 };
@@ -3,7 +3,8 @@
 thread_device_enum::thread_device_enum(QString name, QObject* parent)
     :thread_base(name , parent)
 {
-
+    m_dispatcher.register_handler(OPCODE_CAMERA_LIST, this, &thread_device_enum::handle_camera_list);
+    m_dispatcher.register_handler(OPCODE_SERVER_PARAMETER, this, &thread_device_enum::handle_server_parameter);
 }
 
 thread_device_enum::~thread_device_enum()
@@ -14,30 +15,31 @@ thread_device_enum::~thread_device_enum()
 
 void thread_device_enum::process_task(const QVariant& task_data)
 {
-    QJsonObject obj = task_data.toJsonObject();
-    QString command = obj["command"].toString();
-    if (command == "client_request_camera_list")
-    {
-        interface_device_enum* device_enum = device_enum_factory::create_device_enum(m_device_manager->sdk_type());
-        std::vector<st_device_info*> device_info_list = device_enum->enumerate_devices();   //枚举的设备信息由m_device_manager管理
-		m_device_manager->set_device_list(device_info_list);                                // 更新设备管理器中的设备列表
-        // 转换成 QJsonObject 对象，然后发送给前端
-		QJsonObject result_obj = device_list_to_json(device_info_list);
-		result_obj["command"] = "server_camera_list";
-        result_obj["request_id"] = obj["request_id"];
-		emit post_task_finished(QVariant::fromValue(result_obj));
-    }
-    else if(command == "client_request_server_parameter")
-    {
-        interface_device_enum* device_enum = device_enum_factory::create_device_enum(m_device_manager->sdk_type());
-        std::vector<st_device_info*> device_info_list = device_enum->enumerate_devices();   //枚举的设备信息由m_device_manager管理
-        m_device_manager->set_device_list(device_info_list);                                // 更新设备管理器中的设备列表
-        // 转换成 QJsonObject 对象，然后发送给前端
-        QJsonObject result_obj = device_list_to_json(device_info_list);
-        result_obj["command"] = command;                    //枚举之后需要继续检查相机状态，这里不修改命令
-        result_obj["request_id"] = obj["request_id"];
-        emit post_task_finished(QVariant::fromValue(result_obj));
-    }
+    m_dispatcher.dispatch(st_task_message::from_variant(task_data));
+}
+
+void thread_device_enum::handle_camera_list(const st_task_message& message, QJsonObject& result_obj)
+{
+    interface_device_enum* device_enum = device_enum_factory::create_device_enum(m_device_manager->sdk_type());
+    std::vector<st_device_info*> device_info_list = device_enum->enumerate_devices();   //枚举的设备信息由m_device_manager管理
+	m_device_manager->set_device_list(device_info_list);                                // 更新设备管理器中的设备列表
+    // 转换成 QJsonObject 对象，然后发送给前端
+	result_obj = device_list_to_json(device_info_list);
+	result_obj["command"] = "server_camera_list";
+    result_obj["request_id"] = message.m_request_id;
+	emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
+void thread_device_enum::handle_server_parameter(const st_task_message& message, QJsonObject& result_obj)
+{
+    interface_device_enum* device_enum = device_enum_factory::create_device_enum(m_device_manager->sdk_type());
+    std::vector<st_device_info*> device_info_list = device_enum->enumerate_devices();   //枚举的设备信息由m_device_manager管理
+    m_device_manager->set_device_list(device_info_list);                                // 更新设备管理器中的设备列表
+    // 转换成 QJsonObject 对象，然后发送给前端
+    result_obj = device_list_to_json(device_info_list);
+    result_obj["command"] = "client_request_server_parameter";     //枚举之后需要继续检查相机状态，这里不修改命令
+    result_obj["request_id"] = message.m_request_id;
+    emit post_task_finished(QVariant::fromValue(result_obj));
 }
 
 QJsonObject thread_device_enum::device_list_to_json(const std::vector<st_device_info*>& device_list)
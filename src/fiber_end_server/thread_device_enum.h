@@ -3,6 +3,8 @@
  ********************/
 #pragma once
 #include "work_threads.h"
+#include "task_message.h"
+#include "task_dispatcher.h"
 #include "device_manager.hpp"
 #include "../device_enum/device_enum_factory.h"
 
@@ -22,4 +24,8 @@ protected:
 
 private:
 	device_manager* m_device_manager{ nullptr }; //设备管理器，用于存储和管理设备信息
+	task_dispatcher m_dispatcher;
+
+	void handle_camera_list(const st_task_message& message, QJsonObject& result_obj);
+	void handle_server_parameter(const st_task_message& message, QJsonObject& result_obj);
 };
\ No newline at end of file
@@ -3,6 +3,10 @@
 #include <QSharedMemory>
 #include <QBuffer>
 #include <QDir>
+#include <QFileInfo>
+#include <climits>
+#include <cstdlib>
+#include <algorithm>
 #include <QImage>
 #include <pugixml.hpp>
 
@@ -12,13 +16,18 @@
 thread_misc::thread_misc(QString name, QObject* parent)
     :thread_base(name, parent)
 {
-
+    register_handlers();
+    set_idle_interval(200);
 }
 
 thread_misc::~thread_misc()
 {
+    //先等待线程退出，正在执行的任务不再使用下面释放的设备
+    stop();
+    wait();
 	if (m_camera != nullptr)
 	{
+		flush_camera_config();
 		m_camera->close();
 		delete m_camera;
 		m_camera = nullptr;
@@ -33,6 +42,11 @@ thread_misc::~thread_misc()
         delete m_auto_focus;
         m_auto_focus = nullptr;
     }
+    if (m_run_focus != nullptr)
+    {
+        delete m_run_focus;
+        m_run_focus = nullptr;
+    }
     if (m_fiber_end_detector != nullptr)
     {
         delete m_fiber_end_detector;
@@ -40,9 +54,21 @@ thread_misc::~thread_misc()
     }
 }
 
+void thread_misc::set_algorithm_thread(thread_algorithm* algorithm_thread)
+{
+    m_thread_algorithm = algorithm_thread;
+    if (m_thread_algorithm != nullptr)
+    {
+        m_thread_algorithm->set_max_task_count(m_detect_queue_size);
+        m_thread_algorithm->set_terminate_flag(cancel_flag());   //取消运行时检测线程丢弃尚未检测的位置
+        m_thread_algorithm->set_fiber_end_detector(m_fiber_end_detector);
+    }
+}
+
 bool thread_misc::initialize(st_config_data* config_data)
 {
     setup_camera_config_mgr();
+    setup_focus_map();
 	if(!setup_motion_control(config_data))
 	{
         write_log("setup_motion_control fail!");
@@ -52,6 +78,8 @@ bool thread_misc::initialize(st_config_data* config_data)
     {
         write_log("setup_fiber_end_detector fail!");
     }
+    setup_image_writer();
+    setup_result_archive();
     return true;
 }
 
@@ -62,6 +90,68 @@ void thread_misc::setup_camera_config_mgr()
     m_camera_config_mgr.load_from_file(camera_config_path);
 }
 
+void thread_misc::setup_focus_map()
+{
+    QString current_directory = QCoreApplication::applicationDirPath();
+    m_focus_map.load_from_file(current_directory + L("/focus_map.json"));
+}
+
+bool thread_misc::setup_run_focus()
+{
+    if (m_run_focus != nullptr)
+    {
+        return true;
+    }
+    if (m_camera == nullptr || m_fiber_end_detector == nullptr || m_fiber_end_detector->object_detector_ptr() == nullptr)
+    {
+        return false;
+    }
+    //端面粗定位使用检测器中的目标检测模型，不负责资源释放
+    m_run_focus = new auto_focus2(m_motion_control, std::vector<interface_camera*>{ m_camera });
+    m_run_focus->set_object_detector(m_fiber_end_detector->object_detector_ptr());
+    m_run_focus->set_cancel_flag(cancel_flag());
+    m_run_focus_calibrated = false;
+    return true;
+}
+
+void thread_misc::setup_image_writer()
+{
+    if (m_thread_algorithm == nullptr || m_config_data == nullptr)
+    {
+        return;
+    }
+    st_image_codec_config config;
+    config.m_codec = static_cast<image_codec>(std::clamp(m_config_data->m_image_codec, 0, static_cast<int>(IMAGE_CODEC_QOI)));
+    config.m_png_compression = m_config_data->m_png_compression;
+    m_thread_algorithm->get_image_writer()->set_codec(IMAGE_DESTINATION_ARCHIVE, config);
+    //调试影像只要求写入快
+    config.m_codec = IMAGE_CODEC_PNG;
+    config.m_png_compression = 1;
+    m_thread_algorithm->get_image_writer()->set_codec(IMAGE_DESTINATION_DEBUG, config);
+}
+
+void thread_misc::setup_result_archive()
+{
+    if (m_thread_algorithm == nullptr || m_config_data == nullptr)
+    {
+        return;
+    }
+    //已提交的归档影像写入完毕之后再切换
+    m_thread_algorithm->get_image_writer()->flush();
+    result_archive* archive = m_thread_algorithm->get_result_archive();
+    if (m_config_data->m_archive_mode != 1)
+    {
+        archive->close();
+        return;
+    }
+    QString archive_dir = L(m_config_data->m_save_path.c_str()) + "/archive";
+    if (!archive->open(archive_dir, static_cast<qint64>(m_config_data->m_archive_segment_size_mb) * 1024 * 1024,
+        static_cast<qint64>(m_config_data->m_archive_max_size_gb) * 1024 * 1024 * 1024, m_config_data->m_archive_retention_days))
+    {
+        write_log(l(QString("open result archive failed: %1, save result images as files").arg(archive_dir)).c_str());
+    }
+}
+
 bool thread_misc::setup_motion_control(st_config_data* config_data)
 {
     m_config_data = config_data;
@@ -78,7 +168,8 @@ bool thread_misc::setup_motion_control(st_config_data* config_data)
     std::string port_name = "COM1";  // 串口号
     unsigned int baud_rate = 115200;
     m_motion_control = new motion_control_port();
-    parameter = new motion_parameter_port(port_name, baud_rate);
+    //命令带序号需要运控固件支持，由配置文件开启
+    parameter = new motion_parameter_port(port_name, baud_rate, config_data->m_motion_tagged_commands != 0);
 #endif
     if (!m_motion_control->initialize(parameter))
     {
@@ -110,6 +201,10 @@ bool thread_misc::setup_fiber_end_detector()
         m_fiber_end_detector = nullptr;
         return false;
     }
+    if (m_thread_algorithm != nullptr)
+    {
+        m_thread_algorithm->set_fiber_end_detector(m_fiber_end_detector);
+    }
     return true;
 }
 
@@ -143,6 +238,7 @@ bool thread_misc::load_user_config_file(const QString& file_path)
         write_log("Load algorithm node failed....");
         return false;
     }
+    wait_algorithm_idle();
     m_fiber_end_detector->algorithm_parameter()->load_from_node(algorithm_node);
     //加载完成之后更新对应文件
     m_fiber_end_detector->algorithm_parameter()->save_to_xml();
@@ -154,6 +250,11 @@ bool thread_misc::load_user_config_file(const QString& file_path)
         return false;
     }
     m_config_data->load_from_node(server_node);
+    setup_image_writer();
+    setup_result_archive();
+    //对焦位置表按配方区分，配方名称使用用户配置文件名
+    m_focus_map.set_recipe(QFileInfo(file_path).completeBaseName());
+    m_focus_map.save_to_file();
     //通知自动对焦模块
     if(m_auto_focus != nullptr)
     {
@@ -186,783 +287,1018 @@ bool thread_misc::save_user_config_file(const QString& file_path)
 
 void thread_misc::process_task(const QVariant& task_data)
 {
-    QJsonObject obj = task_data.toJsonObject();
-    QString command = obj["command"].toString();
-	QJsonObject result_obj;     //返回的消息对象
-    result_obj["request_id"] = obj["request_id"];
-    if (command == "client_request_open_camera")
+    m_dispatcher.dispatch(st_task_message::from_variant(task_data));
+}
+
+void thread_misc::register_handlers()
+{
+    m_dispatcher.register_handler(OPCODE_OPEN_CAMERA, this, &thread_misc::handle_open_camera);
+    m_dispatcher.register_handler(OPCODE_CLOSE_CAMERA, this, &thread_misc::handle_close_camera);
+    m_dispatcher.register_handler(OPCODE_CHANGE_CAMERA_PARAMETER, this, &thread_misc::handle_change_camera_parameter);
+    m_dispatcher.register_handler(OPCODE_START_GRAB, this, &thread_misc::handle_start_grab);
+    m_dispatcher.register_handler(OPCODE_TRIGGER_ONCE, this, &thread_misc::handle_trigger_once);
+    m_dispatcher.register_handler(OPCODE_CHANGE_ALGORITHM_PARAMETER, this, &thread_misc::handle_change_algorithm_parameter);
+    m_dispatcher.register_handler(OPCODE_USER_CONFIG_SET, this, &thread_misc::handle_user_config_set);
+    m_dispatcher.register_handler(OPCODE_MOVE_CAMERA, this, &thread_misc::handle_move_camera);
+    m_dispatcher.register_handler(OPCODE_MOVE_CAMERA_BY_INDEX, this, &thread_misc::handle_move_camera_by_index);
+    m_dispatcher.register_handler(OPCODE_SET_MOTION_PARAMETER, this, &thread_misc::handle_set_motion_parameter);
+    m_dispatcher.register_handler(OPCODE_AUTO_FOCUS, this, &thread_misc::handle_auto_focus);
+    m_dispatcher.register_handler(OPCODE_ANOMALY_DETECTION, this, &thread_misc::handle_anomaly_detection);
+    m_dispatcher.register_handler(OPCODE_AUTO_CALIBRATION, this, &thread_misc::handle_auto_calibration);
+    m_dispatcher.register_handler(OPCODE_UPDATE_SERVER_PARAMETER, this, &thread_misc::handle_update_server_parameter);
+    m_dispatcher.register_handler(OPCODE_START_PROCESS, this, &thread_misc::handle_start_process);
+    m_dispatcher.register_handler(OPCODE_DEVICE_START_PROCESS, this, &thread_misc::handle_device_start_process);
+}
+
+void thread_misc::handle_open_camera(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+	QString unique_id = obj["param"].toString();
+	st_device_info* device_info = m_device_manager->get_device_info(unique_id);
+    if(device_info == nullptr)
+    {
+        result_obj["command"] = "server_report_info";
+        result_obj["param"] = QString("未找到相机设备: %1").arg(unique_id);
+	}
+    else
     {
-		QString unique_id = obj["param"].toString();
-		st_device_info* device_info = m_device_manager->get_device_info(unique_id);
-        if(device_info == nullptr)
+        flush_camera_config();          //打开其他相机之前保存当前相机尚未保存的参数
+        //运行时的对焦模块持有原相机指针，需要重新创建
+        if (m_run_focus != nullptr)
+        {
+            delete m_run_focus;
+            m_run_focus = nullptr;
+        }
+        m_camera = camera_factory::create_camera(device_info);
+        if(m_camera == nullptr)
         {
             result_obj["command"] = "server_report_info";
-            result_obj["param"] = QString("未找到相机设备: %1").arg(unique_id);
+            result_obj["param"] = QString("无法创建相机设备: %1").arg(unique_id);
 		}
         else
         {
-            m_camera = camera_factory::create_camera(device_info);
-            if(m_camera == nullptr)
+            if(m_camera->open() != STATUS_SUCCESS)
             {
                 result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("无法创建相机设备: %1").arg(unique_id);
-			}
+                result_obj["param"] = QString("无法打开相机设备: %1").arg(unique_id);
+            }
             else
             {
-                if(m_camera->open() != STATUS_SUCCESS)
+                //关联信号槽，获取相机取图成功的数据. 支持环形缓冲区的相机在回调中直接写入共享内存，只传递元数据
+                if (m_camera->supports_stream_ring())
                 {
-                    result_obj["command"] = "server_report_info";
-                    result_obj["param"] = QString("无法打开相机设备: %1").arg(unique_id);
+                    m_camera->set_stream_ring(m_image_transport->stream_ring());
+                    connect(m_camera, &interface_camera::post_stream_frame_ready, this, &thread_misc::on_stream_frame_ready);
                 }
                 else
                 {
-                    //关联信号槽，获取相机取图成功的数据
                     connect(m_camera, &interface_camera::post_stream_image_ready, this, &thread_misc::on_stream_image_ready);
-                    //根据 unique 获取相机参数，然后设置到相机
-                    st_camera_config camera_config = m_camera_config_mgr.get_camera_config(m_camera->m_unique_id);
-                    m_camera->import_config(camera_config);
-                	//无论是否设置成功，都需要设置成连续触发和软触发，并且在此之后开始采集
+                }
+                //根据 unique 获取相机参数，然后设置到相机
+                st_camera_config camera_config = m_camera_config_mgr.get_camera_config(m_camera->m_unique_id);
+                m_camera->import_config(camera_config);
+            	//无论是否设置成功，都需要设置成连续触发和软触发，并且在此之后开始采集
+                {
+                    m_camera->set_trigger_source(global_trigger_source_software);
+					//一部分相机存在bug，需要先将循环触发关闭再打开才有效
                     {
-                        m_camera->set_trigger_source(global_trigger_source_software);
-						//一部分相机存在bug，需要先将循环触发关闭再打开才有效
-                        {
-                            m_camera->set_trigger_mode(global_trigger_mode_continuous);
-                            m_camera->set_trigger_mode(global_trigger_mode_once);
-                        }
-						m_camera->set_trigger_mode(global_trigger_mode_continuous);
-						m_camera->start_grab();
+                        m_camera->set_trigger_mode(global_trigger_mode_continuous);
+                        m_camera->set_trigger_mode(global_trigger_mode_once);
                     }
-                    result_obj["command"] = "server_camera_opened_success";
-                    QJsonObject camera_obj = camera_parameter_to_json(m_camera);
-                    result_obj["camera"] = camera_obj;          // 将相机参数转换为 JSON 对象
-					result_obj["unique_id"] = unique_id;        // 返回相机的唯一标识符
+					m_camera->set_trigger_mode(global_trigger_mode_continuous);
+					m_camera->start_grab();
                 }
+                result_obj["command"] = "server_camera_opened_success";
+                QJsonObject camera_obj = camera_parameter_to_json(m_camera);
+                result_obj["camera"] = camera_obj;          // 将相机参数转换为 JSON 对象
+				result_obj["unique_id"] = unique_id;        // 返回相机的唯一标识符
             }
         }
-        emit post_task_finished(QVariant::fromValue(result_obj));
     }
-    else if(command == "client_request_close_camera")
+    emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
+void thread_misc::handle_close_camera(const st_task_message& message, QJsonObject& result_obj)
+{
+    if(m_camera != nullptr)
     {
-        if(m_camera != nullptr)
-        {
-            m_camera->close();
-        	disconnect(m_camera, &interface_camera::post_stream_image_ready, this, &thread_misc::on_stream_image_ready);
-        }
-        result_obj["command"] = "server_camera_closed_success";
-        emit post_task_finished(QVariant::fromValue(result_obj));
+        flush_camera_config();
+        m_camera->close();
+    	disconnect(m_camera, &interface_camera::post_stream_image_ready, this, &thread_misc::on_stream_image_ready);
+        disconnect(m_camera, &interface_camera::post_stream_frame_ready, this, &thread_misc::on_stream_frame_ready);
+        m_camera->set_stream_ring(nullptr);
     }
-    else if(command == "client_request_change_camera_parameter")
+    result_obj["command"] = "server_camera_closed_success";
+    emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
+void thread_misc::on_idle()
+{
+    if (!m_camera_config_dirty)
     {
-        if (m_camera != nullptr)
-        {
-            QJsonObject param_obj = obj["param"].toObject();
-            QString name = param_obj["name"].toString();
-            result_obj["name"] = name;
-			int ret = STATUS_SUCCESS;
-            if (name == "fps")
-            {
-                ret = m_camera->set_frame_rate(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_frame_rate();
-				result_obj["range"] = range_to_json(m_camera->get_frame_rate_range());
-            }
-            else if (name == "start_x")
-            {
-                ret = m_camera->set_start_x(param_obj["value"].toInt());
-                result_obj["value"] = m_camera->get_start_x();
-                result_obj["range"] = range_to_json(m_camera->get_width_range());
-            }
-            else if (name == "start_y")
-            {
-                ret = m_camera->set_start_y(param_obj["value"].toInt());
-                result_obj["value"] = m_camera->get_start_y();
-                result_obj["range"] = range_to_json(m_camera->get_height_range());
-            }
-            else if (name == "width")
-            {
-                ret = m_camera->set_width(param_obj["value"].toInt());
-                result_obj["value"] = m_camera->get_width();
-                result_obj["range"] = range_to_json(m_camera->get_start_x_range());
-            }
-            else if (name == "height")
-            {
-                ret = m_camera->set_height(param_obj["value"].toInt());
-                result_obj["value"] = m_camera->get_height();
-                result_obj["range"] = range_to_json(m_camera->get_start_y_range());
-            }
-            else if (name == "pixel_format")
-            {
-                ret = m_camera->set_pixel_format(param_obj["value"].toString());
-                result_obj["value"] = m_camera->get_pixel_format();
-            }
-            else if (name == "auto_exposure_mode")
-            {
-                ret = m_camera->set_auto_exposure_mode(param_obj["value"].toString());
-                result_obj["value"] = m_camera->get_auto_exposure_mode();
-            }
-            else if (name == "auto_exposure_time_floor")
-            {
-                ret = m_camera->set_auto_exposure_time_floor(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_auto_exposure_time_floor();
-                result_obj["range"] = range_to_json(m_camera->get_auto_exposure_time_upper_range());
-            }
-            else if (name == "auto_exposure_time_upper")
-            {
-                ret = m_camera->set_auto_exposure_time_upper(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_auto_exposure_time_upper();
-                result_obj["range"] = range_to_json(m_camera->get_auto_exposure_time_floor_range());
-            }
-            else if (name == "exposure_time")
-            {
-                ret = m_camera->set_exposure_time(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_exposure_time();
-                result_obj["range"] = range_to_json(m_camera->get_exposure_time_range());
-            }
-            else if (name == "auto_gain_mode")
-            {
-                ret = m_camera->set_auto_gain_mode(param_obj["value"].toString());
-                result_obj["value"] = m_camera->get_auto_gain_mode();
-            }
-            else if(name == "auto_gain_floor")
-            {
-                ret = m_camera->set_auto_gain_floor(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_auto_gain_floor();
-                result_obj["range"] = range_to_json(m_camera->get_auto_gain_upper_range());
-            }
-            else if (name == "auto_gain_upper")
-            {
-                ret = m_camera->set_auto_gain_upper(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_auto_gain_upper();
-                result_obj["range"] = range_to_json(m_camera->get_auto_gain_floor_range());
-            }
-            else if (name == "gain")
-            {
-                ret = m_camera->set_gain(param_obj["value"].toDouble());
-                result_obj["value"] = m_camera->get_gain();
-                result_obj["range"] = range_to_json(m_camera->get_gain_range());
-            }
-            else if (name == "trigger_mode")
-            {
-                ret = m_camera->set_trigger_mode(param_obj["value"].toString());
-                result_obj["value"] = m_camera->get_trigger_mode();
-            }
-            else if (name == "trigger_source")
-            {
-                ret = m_camera->set_trigger_source(param_obj["value"].toString());
-                result_obj["value"] = m_camera->get_trigger_source();
-            }
-            if(ret != STATUS_SUCCESS)
-            {
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("设置相机参数失败: %1").arg(m_camera->map_ret_status(ret));
-                emit post_task_finished(QVariant::fromValue(result_obj));
-            }
-            else
-            {
-                if(name != "trigger_mode" && name != "trigger_source")
-                {
-                    //对于非触发模式和触发源的参数修改，需要保存到相机配置文件中
-                    st_camera_config camera_config = m_camera->export_config();
-                    m_camera_config_mgr.update_camera_config(camera_config);
-                    m_camera_config_mgr.save_to_file();
-				}
-                // 成功后返回修改的参数
-                result_obj["command"] = "server_camera_parameter_changed_success";
-            	emit post_task_finished(QVariant::fromValue(result_obj));
-			}
-        }
-        else
-        {
-            result_obj["command"] = "server_report_info";
-            result_obj["param"] = QString("相机对象无效！");
-            result_obj["request_id"] = obj["request_id"];
-            emit post_task_finished(QVariant::fromValue(result_obj));
-        }
+        return;
     }
-    else if(command == "client_request_start_grab")
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    auto quiet_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_camera_config_last_change).count();
+    auto pending_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_camera_config_first_change).count();
+    if (quiet_ms >= m_camera_config_save_delay_ms || pending_ms >= m_camera_config_max_delay_ms)
     {
-        if(m_camera != nullptr)
-        {
-			bool start = obj["param"].toBool();
-            int ret = STATUS_SUCCESS;
-            QString report_info("");
-            if(start)
-            {
-                ret = m_camera->start_grab();
-                if(ret != STATUS_SUCCESS)
-                {
-                    result_obj["command"] = "server_report_info";
-                    report_info = QString("开始采集失败: %1").arg(m_camera->map_ret_status(ret));
-                    result_obj["param"] = report_info;
-                    emit post_task_finished(QVariant::fromValue(result_obj));
-                    return;
-				}
-                //如果是连续模式，记录 request_id
-                if(m_camera->get_trigger_mode() == global_trigger_mode_continuous)
-                {
-                    m_stream_request_id = obj["request_id"].toString();
-                    result_obj["task_finish"] = false;
-                }
-            }
-            else
-            {
-				ret = m_camera->stop_grab();
-                if (ret != STATUS_SUCCESS)
-                {
-                    result_obj["command"] = "server_report_info";
-                    report_info = QString("停止采集失败: %1").arg(m_camera->map_ret_status(ret));
-                    result_obj["param"] = report_info;
-                    emit post_task_finished(QVariant::fromValue(result_obj));
-                    return;
-                }
-            }
-            result_obj["command"] = "server_camera_grab_set_success";
-            result_obj["param"] = start;
-            emit post_task_finished(QVariant::fromValue(result_obj));
-        }
-        else
-        {
-            result_obj["command"] = "server_report_info";
-            result_obj["param"] = QString("相机对象无效！");
-            emit post_task_finished(QVariant::fromValue(result_obj));
-        }
-        
+        flush_camera_config();
+    }
+}
+
+void thread_misc::wait_algorithm_idle()
+{
+    if (m_thread_algorithm != nullptr)
+    {
+        m_thread_algorithm->wait_idle();
+    }
+}
+
+void thread_misc::flush_camera_config()
+{
+    if (!m_camera_config_dirty || m_camera == nullptr)
+    {
+        return;
     }
-    else if(command == "client_request_trigger_once")
+    m_camera_config_dirty = false;
+    m_camera_config_mgr.update_camera_config(m_camera->export_config());
+    m_camera_config_mgr.save_to_file();
+}
+
+void thread_misc::handle_change_camera_parameter(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    if (m_camera != nullptr)
     {
-        // 软触发模式下使用
-        if (m_camera != nullptr)
+        QJsonObject param_obj = obj["param"].toObject();
+        QString name = param_obj["name"].toString();
+        result_obj["name"] = name;
+		int ret = STATUS_SUCCESS;
+        if (name == "fps")
         {
-            QImage img = m_camera->trigger_once();
-            if(0 && !img.isNull())
-            {
-                QString path = QString("C:/Temp/server.png");
-                img.save(path);  // 保存为 PNG 文件
-            }
-            //触发失败,返回消息. 如果成功这里不处理，在相机发送信号的槽函数中处理
-            if (img.isNull())
-            {
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("触发采图失败");
-            }
-            else
-            {
-                st_image_meta meta;
-                if (!m_shared_memory_trigger_image.write_image(img, meta))
-                {
-                    result_obj["command"] = "server_report_info";
-                    result_obj["param"] = QString("写入图片数据失败");
-                }
-                else
-                {
-                    result_obj["command"] = "server_camera_trigger_once_success";
-                    QJsonObject json = image_shared_memory::meta_to_json(meta);
-                    result_obj["param"] = json;
-                }
-            }
-            emit post_task_finished(QVariant::fromValue(result_obj));
+            ret = m_camera->set_frame_rate(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_frame_rate();
+			result_obj["range"] = range_to_json(m_camera->get_frame_rate_range());
         }
-	}
-    else if(command == "client_request_change_algorithm_parameter")
-    {
-	    if(m_fiber_end_detector != nullptr)
-	    {
-            QJsonObject param_obj = obj["param"].toObject();
-            QString key = param_obj["key"].toString();
-            double value = param_obj["value"].toDouble();
-            m_fiber_end_detector->set_algorithm_parameter(key, value);
-            //回复消息
-            QJsonObject ret_obj = m_fiber_end_detector->algorithm_parameter()->save_to_json(key);
-            result_obj["command"] = "server_algorithm_parameter_changed_success";
-            result_obj["param"] = ret_obj;
-            emit post_task_finished(QVariant::fromValue(result_obj));
-	    }
-        else
+        else if (name == "start_x")
         {
-            result_obj["command"] = "server_report_info";
-            result_obj["param"] = QString("检测算法对象无效！");
-            result_obj["request_id"] = obj["request_id"];
-            emit post_task_finished(QVariant::fromValue(result_obj));
-        }
-    }
-    else if (command == "client_request_user_config_set")
-    {
-        QJsonObject param = obj["param"].toObject();
-		bool load_flag = param["load"].toBool();
-		QString file_path = param["path"].toString();
-		//load_flag: 加载(true)或保存(false)标识; file_path: 配置文件路径
-        if(load_flag)
-        {
-	        if(load_user_config_file(file_path))
-	        {
-		        //加载成功,回复所有参数
-				result_obj["command"] = "server_load_user_config_success";
-				result_obj["camera"] = camera_parameter_to_json(m_camera);
-				result_obj["algorithm_parameter"] = m_fiber_end_detector->algorithm_parameter()->save_to_json();
-				result_obj["fiber_end_parameter"] = m_config_data->save_to_json();
-	        }
-	        else
-	        {
-		        //加载失败,回复错误消息
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("加载配置文件失败: %1").arg(file_path);
-	        }
+            ret = m_camera->set_start_x(param_obj["value"].toInt());
+            result_obj["value"] = m_camera->get_start_x();
+            result_obj["range"] = range_to_json(m_camera->get_width_range());
         }
-        else
+        else if (name == "start_y")
         {
-            //保存成功或失败均回复提示信息
-	        if(save_user_config_file(file_path))
-            {
-                //保存成功,回复所有参数
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("保存成功!");
-            }
-            else
-            {
-                //保存失败,回复错误消息
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("保存配置文件失败: %1").arg(file_path);
-            }
+            ret = m_camera->set_start_y(param_obj["value"].toInt());
+            result_obj["value"] = m_camera->get_start_y();
+            result_obj["range"] = range_to_json(m_camera->get_height_range());
         }
-        emit post_task_finished(QVariant::fromValue(result_obj));
-    }
-    else if(command == "client_request_move_camera")
-    {
-        result_obj["command"] = "server_move_camera_success";   //使用统一回复命令，涉及到移动+取图两个步骤，在result_obj["image"]中存储取图状态
-        QJsonObject param = obj["param"].toObject();
-        int pos_x(0), pos_y(0);
-        if (param["name"] == "move_to_position")
+        else if (name == "width")
         {
-            //m_calc_image_clarity = true;
-            //m_clarity_images.clear();
-            if (m_motion_control != nullptr)
-            {
-                pos_x = param["x"].toInt();
-                pos_y = param["y"].toInt();
-                m_motion_control->move_position(0, pos_y, m_config_data->m_move_speed);
-                m_motion_control->move_position(1, pos_x, m_config_data->m_move_speed);
-                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-            }
-            //m_calc_image_clarity = false;
-            //std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-            //for (size_t i = 0;i < m_clarity_images.size();i++)
-            //{
-            //    QString path = QString("C:/Temp/frame_images_%1.png").arg(i, 2, 10, QChar('0'));
-            //    m_clarity_images[i].save(path);
-            //}
-            
+            ret = m_camera->set_width(param_obj["value"].toInt());
+            result_obj["value"] = m_camera->get_width();
+            result_obj["range"] = range_to_json(m_camera->get_start_x_range());
         }
-	    else if (param["name"] == "move_forward_y")
-	    {
-            //限制位判断，超出范围时返回提示信息
-            if(m_config_data->m_position_y + m_config_data->m_move_step_y > m_config_data->m_max_y)
-            {
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("Y 轴移动超出范围: 当前位置 %1, 最大位置 %2, 移动步长 %3")
-                                        .arg(m_config_data->m_position_y).arg(m_config_data->m_max_y).arg(m_config_data->m_move_step_y);
-                emit post_task_finished(QVariant::fromValue(result_obj));
-                return;
-			}
-            if(m_motion_control != nullptr)
-            {
-                m_motion_control->move_distance(0, m_config_data->m_move_step_y, m_config_data->m_move_speed);
-                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-            }
-	    }
-        else if (param["name"] == "move_back_x")
+        else if (name == "height")
         {
-        	if (m_motion_control != nullptr)
-            {
-                m_motion_control->move_distance(1, -m_config_data->m_move_step_x, m_config_data->m_move_speed);
-                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-            }
+            ret = m_camera->set_height(param_obj["value"].toInt());
+            result_obj["value"] = m_camera->get_height();
+            result_obj["range"] = range_to_json(m_camera->get_start_y_range());
         }
-        else if (param["name"] == "move_forward_x")
+        else if (name == "pixel_format")
         {
-			//限制位判断，超出范围时返回提示信息
-            if (m_config_data->m_position_x + m_config_data->m_move_step_x > m_config_data->m_max_x)
-            {
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("X 轴移动超出范围: 当前位置 %1, 最大位置 %2, 移动步长 %3")
-                    .arg(m_config_data->m_position_x).arg(m_config_data->m_max_x).arg(m_config_data->m_move_step_x);
-                emit post_task_finished(QVariant::fromValue(result_obj));
-                return;
-            }
-            if (m_motion_control != nullptr)
-            {
-                m_motion_control->move_distance(1, m_config_data->m_move_step_x, m_config_data->m_move_speed);
-                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-            }
+            ret = m_camera->set_pixel_format(param_obj["value"].toString());
+            result_obj["value"] = m_camera->get_pixel_format();
         }
-        else if (param["name"] == "move_back_y")
+        else if (name == "auto_exposure_mode")
         {
-            if (m_motion_control != nullptr)
-            {
-                m_motion_control->move_distance(0, -m_config_data->m_move_step_y, m_config_data->m_move_speed);
-                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-            }
+            ret = m_camera->set_auto_exposure_mode(param_obj["value"].toString());
+            result_obj["value"] = m_camera->get_auto_exposure_mode();
         }
-        result_obj["x"] = m_config_data->m_position_x;
-        result_obj["y"] = m_config_data->m_position_y;
-        //移动相机之后采图,触发模式下需要采图，连续模式下会自动采图
-        if (m_camera != nullptr)
+        else if (name == "auto_exposure_time_floor")
         {
-            m_camera->start_grab();     //可能没有开始采集
-            if(m_camera->get_trigger_mode() == global_trigger_mode_once)
-            {
-                QImage img = m_camera->trigger_once();
-                if (img.isNull())
-                {
-                    result_obj["image"] = "trigger error";
-                }
-                else
-                {
-                    st_image_meta meta;
-                    if (!m_shared_memory_trigger_image.write_image(img, meta))
-                    {
-                        result_obj["image"] = "write image error";
-                    }
-                    else
-                    {
-                        result_obj["image"] = "success";
-                        QJsonObject json = image_shared_memory::meta_to_json(meta);
-                        result_obj["image_data"] = json;
-                    }
-                }
-            }
-            emit post_task_finished(QVariant::fromValue(result_obj));
+            ret = m_camera->set_auto_exposure_time_floor(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_auto_exposure_time_floor();
+            result_obj["range"] = range_to_json(m_camera->get_auto_exposure_time_upper_range());
         }
-        else
+        else if (name == "auto_exposure_time_upper")
         {
-            emit post_task_finished(QVariant::fromValue(result_obj));
+            ret = m_camera->set_auto_exposure_time_upper(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_auto_exposure_time_upper();
+            result_obj["range"] = range_to_json(m_camera->get_auto_exposure_time_floor_range());
         }
-    }
-    else if(command == "client_request_move_camera_by_index")
-    {
-        int index = obj["param"].toInt();
-        if (index >= m_config_data->m_photo_location_list.size())
+        else if (name == "exposure_time")
         {
-            result_obj["command"] = "server_report_info";
-            result_obj["param"] = QString("找不到目标位置: 共有 %1 个拍照位，您选中第 %2 个!")
-        								.arg(m_config_data->m_photo_location_list.size()).arg(index + 1);
-            emit post_task_finished(QVariant::fromValue(result_obj));
+            ret = m_camera->set_exposure_time(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_exposure_time();
+            result_obj["range"] = range_to_json(m_camera->get_exposure_time_range());
         }
-        else
+        else if (name == "auto_gain_mode")
         {
-            int pos_x = m_config_data->m_photo_location_list[index].m_x;
-            int pos_y = m_config_data->m_photo_location_list[index].m_y;
-            move_to_position(pos_x, pos_y, obj["request_id"].toString(), true);
+            ret = m_camera->set_auto_gain_mode(param_obj["value"].toString());
+            result_obj["value"] = m_camera->get_auto_gain_mode();
         }
-    	
-    }
-    else if(command == "client_request_set_motion_parameter")
-    {
-        QJsonObject param = obj["param"].toObject();
-        
-    	if(param["name"] == "set_light_brightness")
+        else if(name == "auto_gain_floor")
         {
-            int light_brightness = param["value"].toInt();
-            bool ret = m_motion_control->set_light_source_param(1000000, light_brightness, 1);
-            if(ret)
-            {
-                m_config_data->m_light_brightness = light_brightness;
-                m_config_data->save();
-            }
-            else
-            {
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("设置光源亮度失败!");
-            }
+            ret = m_camera->set_auto_gain_floor(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_auto_gain_floor();
+            result_obj["range"] = range_to_json(m_camera->get_auto_gain_upper_range());
         }
-        else if(param["name"] == "set_move_speed")
+        else if (name == "auto_gain_upper")
         {
-            int move_speed = param["value"].toInt();
-            m_config_data->m_move_speed = move_speed;
-            m_config_data->save();
+            ret = m_camera->set_auto_gain_upper(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_auto_gain_upper();
+            result_obj["range"] = range_to_json(m_camera->get_auto_gain_floor_range());
         }
-        else if (param["name"] == "set_max_x")
+        else if (name == "gain")
         {
-            int max_x = param["value"].toInt();
-            m_config_data->m_max_x = max_x;
-            m_config_data->save();
+            ret = m_camera->set_gain(param_obj["value"].toDouble());
+            result_obj["value"] = m_camera->get_gain();
+            result_obj["range"] = range_to_json(m_camera->get_gain_range());
         }
-        else if (param["name"] == "set_max_y")
+        else if (name == "trigger_mode")
         {
-            int max_y = param["value"].toInt();
-            m_config_data->m_max_y = max_y;
-            m_config_data->save();
+            ret = m_camera->set_trigger_mode(param_obj["value"].toString());
+            result_obj["value"] = m_camera->get_trigger_mode();
         }
-        else if (param["name"] == "set_move_step_x")
+        else if (name == "trigger_source")
         {
-            int move_step_x = param["value"].toInt();
-            m_config_data->m_move_step_x = move_step_x;
-            m_config_data->save();
+            ret = m_camera->set_trigger_source(param_obj["value"].toString());
+            result_obj["value"] = m_camera->get_trigger_source();
         }
-        else if (param["name"] == "set_move_step_y")
+        if(ret != STATUS_SUCCESS)
         {
-            int move_step_y = param["value"].toInt();
-            m_config_data->m_move_step_y = move_step_y;
-            m_config_data->save();
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("设置相机参数失败: %1").arg(m_camera->map_ret_status(ret));
+            emit post_task_finished(QVariant::fromValue(result_obj));
         }
-        else if (param["name"] == "set_zero")
+        else
         {
-            bool ret = m_motion_control->set_current_position_zero(0);
-            if(ret)
+            if(name != "trigger_mode" && name != "trigger_source")
             {
-                ret = m_motion_control->set_current_position_zero(1);
-                if (ret)
-                {
-                    m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-                    result_obj["command"] = "server_set_motion_parameter_success";
-                    result_obj["name"] = param["name"];
-                    result_obj["x"] = m_config_data->m_position_x;
-                    result_obj["y"] = m_config_data->m_position_y;
-                }
-                else
+                //对于非触发模式和触发源的参数修改，需要保存到相机配置文件中. 拖动滑块时修改很频繁，空闲时再统一保存
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if (!m_camera_config_dirty)
                 {
-                    result_obj["command"] = "server_report_info";
-                    result_obj["param"] = QString("设置零点失败!");
+                    m_camera_config_first_change = now;
                 }
-            }
-            else
-            {
-                result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("设置零点失败!");
-            }
-        }
-        else if (param["name"] == "reset_position")
+                m_camera_config_last_change = now;
+                m_camera_config_dirty = true;
+			}
+            // 成功后返回修改的参数
+            result_obj["command"] = "server_camera_parameter_changed_success";
+        	emit post_task_finished(QVariant::fromValue(result_obj));
+		}
+    }
+    else
+    {
+        result_obj["command"] = "server_report_info";
+        result_obj["param"] = QString("相机对象无效！");
+        result_obj["request_id"] = message.m_request_id;
+        emit post_task_finished(QVariant::fromValue(result_obj));
+    }
+}
+
+void thread_misc::handle_start_grab(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    if(m_camera != nullptr)
+    {
+		bool start = obj["param"].toBool();
+        int ret = STATUS_SUCCESS;
+        QString report_info("");
+        if(start)
         {
-            bool ret = m_motion_control->reset(0);
-            if (ret)
+            ret = m_camera->start_grab();
+            if(ret != STATUS_SUCCESS)
             {
-                ret = m_motion_control->reset(1);
-                if (ret)
-                {
-                    m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
-                    result_obj["command"] = "server_set_motion_parameter_success";
-                    result_obj["name"] = param["name"];
-                    result_obj["x"] = m_config_data->m_position_x;
-                    result_obj["y"] = m_config_data->m_position_y;
-                }
-                else
-                {
-                    result_obj["command"] = "server_report_info";
-                    result_obj["param"] = QString("复位失败!");
-                }
+                result_obj["command"] = "server_report_info";
+                report_info = QString("开始采集失败: %1").arg(m_camera->map_ret_status(ret));
+                result_obj["param"] = report_info;
+                emit post_task_finished(QVariant::fromValue(result_obj));
+                return;
+			}
+            //如果是连续模式，记录 request_id
+            if(m_camera->get_trigger_mode() == global_trigger_mode_continuous)
+            {
+                m_stream_request_id = message.m_request_id;
+                result_obj["task_finish"] = false;
             }
-            else
+        }
+        else
+        {
+			ret = m_camera->stop_grab();
+            if (ret != STATUS_SUCCESS)
             {
                 result_obj["command"] = "server_report_info";
-                result_obj["param"] = QString("复位失败!");
+                report_info = QString("停止采集失败: %1").arg(m_camera->map_ret_status(ret));
+                result_obj["param"] = report_info;
+                emit post_task_finished(QVariant::fromValue(result_obj));
+                return;
             }
         }
+        result_obj["command"] = "server_camera_grab_set_success";
+        result_obj["param"] = start;
         emit post_task_finished(QVariant::fromValue(result_obj));
     }
-    else if(command == "client_request_auto_focus")
+    else
     {
-        if(m_auto_focus == nullptr)
+        result_obj["command"] = "server_report_info";
+        result_obj["param"] = QString("相机对象无效！");
+        emit post_task_finished(QVariant::fromValue(result_obj));
+    }
+    
+}
+
+void thread_misc::handle_trigger_once(const st_task_message& message, QJsonObject& result_obj)
+{
+    // 软触发模式下使用
+    if (m_camera != nullptr)
+    {
+        QImage img = m_camera->trigger_once();
+        if(0 && !img.isNull())
+        {
+            QString path = QString("C:/Temp/server.png");
+            img.save(path);  // 保存为 PNG 文件
+        }
+        //触发失败,返回消息. 如果成功这里不处理，在相机发送信号的槽函数中处理
+        if (img.isNull())
         {
-            QString current_directory = QCoreApplication::applicationDirPath();
-            std::string calibration_file_path = (current_directory + "/calibration.bin").toStdString();
-            m_auto_focus = new auto_focus(calibration_file_path, m_motion_control, m_camera, m_config_data->m_fiber_end_count);
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("触发采图失败");
         }
-        std::vector<cv::Mat> images = m_auto_focus->get_focus_images(m_config_data->m_position_y);
-        if(1)
+        else
         {
-            for (int i = 0; i < images.size();i++)
+            st_image_meta meta;
+            if (!m_image_transport->send_image(img, "trigger", meta))
             {
-                char szPath[256] = { 0 };
-                sprintf_s(szPath, "C:/Temp/focus_%d.png", i);
-                //QString file_path = QString("D:/Temp/focus_%1.png").arg(i);
-                cv::imwrite(szPath,images[i]);
+                result_obj["command"] = "server_report_info";
+                result_obj["param"] = QString("写入图片数据失败");
+            }
+            else
+            {
+                result_obj["command"] = "server_camera_trigger_once_success";
+                QJsonObject json = image_shared_memory::meta_to_json(meta);
+                result_obj["param"] = json;
             }
         }
+        emit post_task_finished(QVariant::fromValue(result_obj));
     }
-    else if(command == "client_request_anomaly_detection")
+}
+
+void thread_misc::handle_change_algorithm_parameter(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    if(m_fiber_end_detector != nullptr)
     {
-        anomaly_detection(result_obj["request_id"].toString(), 0, true);
+        QJsonObject param_obj = obj["param"].toObject();
+        QString key = param_obj["key"].toString();
+        double value = param_obj["value"].toDouble();
+        wait_algorithm_idle();
+        m_fiber_end_detector->set_algorithm_parameter(key, value);
+        //回复消息
+        QJsonObject ret_obj = m_fiber_end_detector->algorithm_parameter()->save_to_json(key);
+        result_obj["command"] = "server_algorithm_parameter_changed_success";
+        result_obj["param"] = ret_obj;
+        emit post_task_finished(QVariant::fromValue(result_obj));
     }
-    else if(command == "client_request_auto_calibration")
+    else
     {
-        result_obj["command"] = "server_auto_calibration_status";
-        m_is_processing.store(true);
-        //自动标定,切换到触发模式
-        if(m_camera->get_trigger_mode() != global_trigger_mode_once)
+        result_obj["command"] = "server_report_info";
+        result_obj["param"] = QString("检测算法对象无效！");
+        result_obj["request_id"] = message.m_request_id;
+        emit post_task_finished(QVariant::fromValue(result_obj));
+    }
+}
+
+void thread_misc::handle_user_config_set(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    QJsonObject param = obj["param"].toObject();
+	bool load_flag = param["load"].toBool();
+	QString file_path = param["path"].toString();
+	//load_flag: 加载(true)或保存(false)标识; file_path: 配置文件路径
+    if(load_flag)
+    {
+        if(load_user_config_file(file_path))
         {
-            m_camera->stop_grab();
-            m_camera->set_trigger_mode(global_trigger_mode_once);
-            m_camera->set_trigger_source(global_trigger_source_software);
+	        //加载成功,回复所有参数
+			result_obj["command"] = "server_load_user_config_success";
+			result_obj["camera"] = camera_parameter_to_json(m_camera);
+			result_obj["algorithm_parameter"] = m_fiber_end_detector->algorithm_parameter()->save_to_json();
+			result_obj["fiber_end_parameter"] = m_config_data->save_to_json();
+        }
+        else
+        {
+	        //加载失败,回复错误消息
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("加载配置文件失败: %1").arg(file_path);
+        }
+    }
+    else
+    {
+        //保存成功或失败均回复提示信息
+        if(save_user_config_file(file_path))
+        {
+            //保存成功,回复所有参数
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("保存成功!");
+        }
+        else
+        {
+            //保存失败,回复错误消息
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("保存配置文件失败: %1").arg(file_path);
+        }
+    }
+    emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
+void thread_misc::handle_move_camera(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    result_obj["command"] = "server_move_camera_success";   //使用统一回复命令，涉及到移动+取图两个步骤，在result_obj["image"]中存储取图状态
+    QJsonObject param = obj["param"].toObject();
+    QString name = param["name"].toString();          //子命令只取一次
+    int pos_x(0), pos_y(0);
+    if (name == "move_to_position")
+    {
+        //m_calc_image_clarity = true;
+        //m_clarity_images.clear();
+        if (m_motion_control != nullptr)
+        {
+            pos_x = param["x"].toInt();
+            pos_y = param["y"].toInt();
+            //两个轴同时运动
+            motion_control::wait_all({ m_motion_control->move_position_async(0, pos_y, m_config_data->m_move_speed),
+                m_motion_control->move_position_async(1, pos_x, m_config_data->m_move_speed) });
+            m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+        }
+        //m_calc_image_clarity = false;
+        //std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+        //for (size_t i = 0;i < m_clarity_images.size();i++)
+        //{
+        //    QString path = QString("C:/Temp/frame_images_%1.png").arg(i, 2, 10, QChar('0'));
+        //    m_clarity_images[i].save(path);
+        //}
+        
+    }
+    else if (name == "move_forward_y")
+    {
+        //限制位判断，超出范围时返回提示信息
+        if(m_config_data->m_position_y + m_config_data->m_move_step_y > m_config_data->m_max_y)
+        {
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("Y 轴移动超出范围: 当前位置 %1, 最大位置 %2, 移动步长 %3")
+                                    .arg(m_config_data->m_position_y).arg(m_config_data->m_max_y).arg(m_config_data->m_move_step_y);
+            emit post_task_finished(QVariant::fromValue(result_obj));
+            return;
+		}
+        if(m_motion_control != nullptr)
+        {
+            m_motion_control->move_distance(0, m_config_data->m_move_step_y, m_config_data->m_move_speed);
+            m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+        }
+    }
+    else if (name == "move_back_x")
+    {
+    	if (m_motion_control != nullptr)
+        {
+            m_motion_control->move_distance(1, -m_config_data->m_move_step_x, m_config_data->m_move_speed);
+            m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+        }
+    }
+    else if (name == "move_forward_x")
+    {
+		//限制位判断，超出范围时返回提示信息
+        if (m_config_data->m_position_x + m_config_data->m_move_step_x > m_config_data->m_max_x)
+        {
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("X 轴移动超出范围: 当前位置 %1, 最大位置 %2, 移动步长 %3")
+                .arg(m_config_data->m_position_x).arg(m_config_data->m_max_x).arg(m_config_data->m_move_step_x);
+            emit post_task_finished(QVariant::fromValue(result_obj));
+            return;
+        }
+        if (m_motion_control != nullptr)
+        {
+            m_motion_control->move_distance(1, m_config_data->m_move_step_x, m_config_data->m_move_speed);
+            m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+        }
+    }
+    else if (name == "move_back_y")
+    {
+        if (m_motion_control != nullptr)
+        {
+            m_motion_control->move_distance(0, -m_config_data->m_move_step_y, m_config_data->m_move_speed);
+            m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+        }
+    }
+    result_obj["x"] = m_config_data->m_position_x;
+    result_obj["y"] = m_config_data->m_position_y;
+    //移动相机之后采图,触发模式下需要采图，连续模式下会自动采图
+    if (m_camera != nullptr)
+    {
+        m_camera->start_grab();     //可能没有开始采集
+        if(m_camera->get_trigger_mode() == global_trigger_mode_once)
+        {
+            QImage img = m_camera->trigger_once();
+            if (img.isNull())
+            {
+                result_obj["image"] = "trigger error";
+            }
+            else
+            {
+                st_image_meta meta;
+                if (!m_image_transport->send_image(img, "trigger", meta))
+                {
+                    result_obj["image"] = "write image error";
+                }
+                else
+                {
+                    result_obj["image"] = "success";
+                    QJsonObject json = image_shared_memory::meta_to_json(meta);
+                    result_obj["image_data"] = json;
+                }
+            }
         }
-        m_camera->start_grab();
-        /*********************** 1.根据像素直径创建精匹配模型文件 **********************/
-        //返回消息-正在初始化匹配参数
-        result_obj["task_finish"] = false;
-        result_obj["process"] = 0;
-        result_obj["status"] = L("正在初始化匹配参数...");
         emit post_task_finished(QVariant::fromValue(result_obj));
-        double diameter = obj["diameter"].toDouble();
-        cv::Mat mask(static_cast<int>(diameter), static_cast<int>(diameter), CV_8UC1, cv::Scalar(0)); // 单通道、全黑
-        int radius = diameter / 2;
-        cv::Point center(diameter / 2, diameter / 2);
-        cv::circle(mask, center, radius, cv::Scalar(255), cv::FILLED, cv::LINE_AA); // 填充白色
-        QString current_directory = QCoreApplication::applicationDirPath();
-        QString shape_model_dir = current_directory + L("/shape_model");
-        make_path(shape_model_dir);
-    	std::string shape_model_path = (shape_model_dir + "/model.bin").toStdString();
-        m_fiber_end_detector->create_shape_model(mask, 0.0, 0.0, 1.0, 0.96, 1.04, 0.02,
-            0, 400, cv::Mat(), shape_model_path);
-        /*********************** 2.精匹配得到像素物理尺寸(um) **********************/
-        //返回消息-正在计算像素尺寸
-        result_obj["process"] = 33;
-        result_obj["status"] = L("正在计算像素尺寸...");
+    }
+    else
+    {
         emit post_task_finished(QVariant::fromValue(result_obj));
-        double center_distance = obj["center_distance"].toDouble();
-        
-        QImage img = m_camera->trigger_once();
-        cv::Mat image_gray = convert_qimage_to_cvmat(img, 1);
-        int step_width = image_gray.cols / m_config_data->m_fiber_end_count;
-        int start_x(0);
-        cv::Rect roi;
-        cv::Rect empty_rect = cv::Rect(0, 0, 0, 0);
-        std::vector<st_position> centers;
-        centers.resize(m_config_data->m_fiber_end_count);
-        for (int i = 0;i < m_config_data->m_fiber_end_count;i++)
-        {
-            start_x = i * step_width;
-            cv::Mat roi_image = get_roi_image(image_gray, st_detect_box(0.0, start_x, 0, start_x + step_width, image_gray.rows), 
-								0, 1, roi);
-            st_detect_box box = m_fiber_end_detector->get_shape_match_result(roi_image);
-            if(box.is_valid())
+    }
+}
+
+void thread_misc::handle_move_camera_by_index(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    int index = obj["param"].toInt();
+    if (index >= m_config_data->m_photo_location_list.size())
+    {
+        result_obj["command"] = "server_report_info";
+        result_obj["param"] = QString("找不到目标位置: 共有 %1 个拍照位，您选中第 %2 个!")
+    								.arg(m_config_data->m_photo_location_list.size()).arg(index + 1);
+        emit post_task_finished(QVariant::fromValue(result_obj));
+    }
+    else
+    {
+        int pos_x = m_config_data->m_photo_location_list[index].m_x;
+        int pos_y = m_config_data->m_photo_location_list[index].m_y;
+        move_to_position(pos_x, pos_y, message.m_request_id, true);
+    }
+	
+}
+
+void thread_misc::handle_set_motion_parameter(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    QJsonObject param = obj["param"].toObject();
+    QString name = param["name"].toString();          //子命令只取一次
+    
+	if(name == "set_light_brightness")
+    {
+        int light_brightness = param["value"].toInt();
+        bool ret = m_motion_control->set_light_source_param(1000000, light_brightness, 1);
+        if(ret)
+        {
+            m_config_data->m_light_brightness = light_brightness;
+            m_config_data->save();
+        }
+        else
+        {
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("设置光源亮度失败!");
+        }
+    }
+    else if(name == "set_move_speed")
+    {
+        int move_speed = param["value"].toInt();
+        m_config_data->m_move_speed = move_speed;
+        m_config_data->save();
+    }
+    else if (name == "set_max_x")
+    {
+        int max_x = param["value"].toInt();
+        m_config_data->m_max_x = max_x;
+        m_config_data->save();
+    }
+    else if (name == "set_max_y")
+    {
+        int max_y = param["value"].toInt();
+        m_config_data->m_max_y = max_y;
+        m_config_data->save();
+    }
+    else if (name == "set_move_step_x")
+    {
+        int move_step_x = param["value"].toInt();
+        m_config_data->m_move_step_x = move_step_x;
+        m_config_data->save();
+    }
+    else if (name == "set_move_step_y")
+    {
+        int move_step_y = param["value"].toInt();
+        m_config_data->m_move_step_y = move_step_y;
+        m_config_data->save();
+    }
+    else if (name == "set_zero")
+    {
+        bool ret = m_motion_control->set_current_position_zero(0);
+        if(ret)
+        {
+            ret = m_motion_control->set_current_position_zero(1);
+            if (ret)
+            {
+                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+                result_obj["command"] = "server_set_motion_parameter_success";
+                result_obj["name"] = param["name"];
+                result_obj["x"] = m_config_data->m_position_x;
+                result_obj["y"] = m_config_data->m_position_y;
+            }
+            else
             {
-                centers[i] = st_position((box.m_x0 + box.m_x1) / 2 + start_x, (box.m_y0 + box.m_y1) / 2);
+                result_obj["command"] = "server_report_info";
+                result_obj["param"] = QString("设置零点失败!");
             }
         }
-        //计算平均距离
-        double dist = 0.0;
-        for (int i = 0; i < m_config_data->m_fiber_end_count - 1; i++)
+        else
         {
-            int dx = centers[i + 1].m_x - centers[i].m_x;
-            int dy = centers[i + 1].m_y - centers[i].m_y;
-            dist += sqrt(dx * dx + dy * dy);
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("设置零点失败!");
         }
-        dist = dist / (m_config_data->m_fiber_end_count - 1) + 1e-9;
-        m_fiber_end_detector->set_algorithm_parameter("pixel_physical_size", center_distance / dist);
+    }
+    else if (name == "reset_position")
+    {
+        bool ret = m_motion_control->reset(0);
+        if (ret)
         {
-	        //这里也需要回复消息,更新界面参数
-            QJsonObject param_obj = m_fiber_end_detector->algorithm_parameter()->save_to_json("pixel_physical_size");
-            QJsonObject ret_obj;
-            ret_obj["command"] = "server_algorithm_parameter_changed_success";
-            ret_obj["request_id"] = obj["request_id"];
-            ret_obj["task_finish"] = false;
-            ret_obj["param"] = param_obj;
-            emit post_task_finished(QVariant::fromValue(ret_obj));
+            ret = m_motion_control->reset(1);
+            if (ret)
+            {
+                m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
+                result_obj["command"] = "server_set_motion_parameter_success";
+                result_obj["name"] = param["name"];
+                result_obj["x"] = m_config_data->m_position_x;
+                result_obj["y"] = m_config_data->m_position_y;
+            }
+            else
+            {
+                result_obj["command"] = "server_report_info";
+                result_obj["param"] = QString("复位失败!");
+            }
         }
-        /*********************** 3.清晰度标定 **********************/
-        //返回消息-正在进行清晰度标定
-        result_obj["process"] = 66;
-        result_obj["status"] = L("正在进行清晰度标定...");
-        emit post_task_finished(QVariant::fromValue(result_obj));
-        if (m_auto_focus == nullptr)
+        else
         {
-            std::string calibration_file_path = (current_directory + "/calibration.bin").toStdString();
-            m_auto_focus = new auto_focus(calibration_file_path, m_motion_control, m_camera, m_config_data->m_fiber_end_count);
+            result_obj["command"] = "server_report_info";
+            result_obj["param"] = QString("复位失败!");
         }
-        m_auto_focus->calibrate();
+    }
+    emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
+void thread_misc::handle_auto_focus(const st_task_message& message, QJsonObject& result_obj)
+{
+    if(m_auto_focus == nullptr)
+    {
+        QString current_directory = QCoreApplication::applicationDirPath();
         std::string calibration_file_path = (current_directory + "/calibration.bin").toStdString();
-        m_auto_focus->save(calibration_file_path);
+        m_auto_focus = new auto_focus(calibration_file_path, m_motion_control, m_camera, m_config_data->m_fiber_end_count);
+    }
+    std::vector<cv::Mat> images = m_auto_focus->get_focus_images(m_config_data->m_position_y);
+    if(1)
+    {
+        for (int i = 0; i < images.size();i++)
+        {
+            char szPath[256] = { 0 };
+            sprintf_s(szPath, "C:/Temp/focus_%d.png", i);
+            //QString file_path = QString("D:/Temp/focus_%1.png").arg(i);
+            cv::imwrite(szPath,images[i]);
+        }
+    }
+}
+
+void thread_misc::handle_anomaly_detection(const st_task_message& message, QJsonObject& result_obj)
+{
+    anomaly_detection(message.m_request_id, 0, true);
+    m_focus_map.save_to_file();
+}
+
+void thread_misc::handle_auto_calibration(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    result_obj["command"] = "server_auto_calibration_status";
+    m_is_processing.store(true);
+    wait_algorithm_idle();          //标定会重建匹配模型并修改像素尺寸
+    //标定结束(完成或者被取消)之后移动回当前位置并切换到连续模式
+    auto finish_calibration = [&](bool cancelled)
+    {
         m_is_processing.store(false);
-        //移动回当前位置
-    	move_to_position(m_config_data->m_position_x, m_config_data->m_position_y , result_obj["request_id"].toString());
-        //处理完毕，切换到连续模式
+        move_to_position(m_config_data->m_position_x, m_config_data->m_position_y, message.m_request_id);
         m_camera->stop_grab();
         m_camera->set_trigger_mode(global_trigger_mode_continuous);
         m_camera->set_trigger_source(global_trigger_source_software);
         m_camera->start_grab();
-
-        //返回消息-处理完毕
         result_obj["task_finish"] = true;
-        result_obj["process"] = 100;
-        result_obj["status"] = L("处理完毕!");
+        result_obj["cancelled"] = cancelled;
+        if (!cancelled)
+        {
+            result_obj["process"] = 100;
+        }
+        result_obj["status"] = cancelled ? L("已取消!") : L("处理完毕!");
         emit post_task_finished(QVariant::fromValue(result_obj));
+    };
+    //自动标定,切换到触发模式
+    if(m_camera->get_trigger_mode() != global_trigger_mode_once)
+    {
+        m_camera->stop_grab();
+        m_camera->set_trigger_mode(global_trigger_mode_once);
+        m_camera->set_trigger_source(global_trigger_source_software);
+    }
+    m_camera->start_grab();
+    /*********************** 1.根据像素直径创建精匹配模型文件 **********************/
+    //返回消息-正在初始化匹配参数
+    result_obj["task_finish"] = false;
+    result_obj["process"] = 0;
+    result_obj["status"] = L("正在初始化匹配参数...");
+    emit post_task_finished(QVariant::fromValue(result_obj));
+    double diameter = obj["diameter"].toDouble();
+    cv::Mat mask(static_cast<int>(diameter), static_cast<int>(diameter), CV_8UC1, cv::Scalar(0)); // 单通道、全黑
+    int radius = diameter / 2;
+    cv::Point center(diameter / 2, diameter / 2);
+    cv::circle(mask, center, radius, cv::Scalar(255), cv::FILLED, cv::LINE_AA); // 填充白色
+    QString current_directory = QCoreApplication::applicationDirPath();
+    QString shape_model_dir = current_directory + L("/shape_model");
+    make_path(shape_model_dir);
+	std::string shape_model_path = (shape_model_dir + "/model.bin").toStdString();
+    m_fiber_end_detector->create_shape_model(mask, 0.0, 0.0, 1.0, 0.96, 1.04, 0.02,
+        0, 400, cv::Mat(), shape_model_path);
+    if (is_cancelled())
+    {
+        finish_calibration(true);
+        return;
     }
-    else if(command == "client_request_update_server_parameter")
+    /*********************** 2.精匹配得到像素物理尺寸(um) **********************/
+    //返回消息-正在计算像素尺寸
+    result_obj["process"] = 33;
+    result_obj["status"] = L("正在计算像素尺寸...");
+    emit post_task_finished(QVariant::fromValue(result_obj));
+    double center_distance = obj["center_distance"].toDouble();
+    
+    QImage img = m_camera->trigger_once();
+    cv::Mat image_gray = qimage_to_gray_cvmat(img);         //相机输出灰度影像时不拷贝
+    int step_width = image_gray.cols / m_config_data->m_fiber_end_count;
+    int start_x(0);
+    cv::Rect roi;
+    cv::Rect empty_rect = cv::Rect(0, 0, 0, 0);
+    std::vector<st_position> centers;
+    centers.resize(m_config_data->m_fiber_end_count);
+    for (int i = 0;i < m_config_data->m_fiber_end_count;i++)
     {
-        QJsonObject param = obj["param"].toObject();
-        if (param["name"] == "update_photo_location_list")
+        start_x = i * step_width;
+        cv::Mat roi_image = get_roi_image(image_gray, st_detect_box(0.0, start_x, 0, start_x + step_width, image_gray.rows), 
+							0, 1, roi);
+        st_detect_box box = m_fiber_end_detector->get_shape_match_result(roi_image);
+        if(box.is_valid())
         {
-            std::vector<st_position> positions;
-            QJsonArray posArray = param["photo_location_list"].toArray();
-            for (int i = 0; i < posArray.size(); i++)
-            {
-                QJsonObject obj = posArray[i].toObject();
-                int  x = obj["x"].toInt();
-                int  y = obj["y"].toInt();
-                positions.emplace_back(st_position(x, y));
-            }
-            if(m_config_data->position_list_changed(positions))
-            {
-                m_config_data->m_photo_location_list = positions;
-                m_config_data->save();
-            }
+            centers[i] = st_position((box.m_x0 + box.m_x1) / 2 + start_x, (box.m_y0 + box.m_y1) / 2);
         }
-        else if (param["name"] == "update_fiber_end_count")
+    }
+    //计算平均距离
+    double dist = 0.0;
+    for (int i = 0; i < m_config_data->m_fiber_end_count - 1; i++)
+    {
+        int dx = centers[i + 1].m_x - centers[i].m_x;
+        int dy = centers[i + 1].m_y - centers[i].m_y;
+        dist += sqrt(dx * dx + dy * dy);
+    }
+    dist = dist / (m_config_data->m_fiber_end_count - 1) + 1e-9;
+    m_fiber_end_detector->set_algorithm_parameter("pixel_physical_size", center_distance / dist);
+    {
+        //这里也需要回复消息,更新界面参数
+        QJsonObject param_obj = m_fiber_end_detector->algorithm_parameter()->save_to_json("pixel_physical_size");
+        QJsonObject ret_obj;
+        ret_obj["command"] = "server_algorithm_parameter_changed_success";
+        ret_obj["request_id"] = message.m_request_id;
+        ret_obj["task_finish"] = false;
+        ret_obj["param"] = param_obj;
+        emit post_task_finished(QVariant::fromValue(ret_obj));
+    }
+    if (is_cancelled())
+    {
+        finish_calibration(true);
+        return;
+    }
+    /*********************** 3.清晰度标定 **********************/
+    //返回消息-正在进行清晰度标定
+    result_obj["process"] = 66;
+    result_obj["status"] = L("正在进行清晰度标定...");
+    emit post_task_finished(QVariant::fromValue(result_obj));
+    if (m_auto_focus == nullptr)
+    {
+        std::string calibration_file_path = (current_directory + "/calibration.bin").toStdString();
+        m_auto_focus = new auto_focus(calibration_file_path, m_motion_control, m_camera, m_config_data->m_fiber_end_count);
+    }
+    m_auto_focus->calibrate();
+    std::string calibration_file_path = (current_directory + "/calibration.bin").toStdString();
+    m_auto_focus->save(calibration_file_path);
+    m_run_focus_calibrated = false;         //下一次对焦之前重新标定运行时对焦模块的清晰度阈值
+    //返回消息-处理完毕
+    finish_calibration(false);
+}
+
+void thread_misc::handle_update_server_parameter(const st_task_message& message, QJsonObject& result_obj)
+{
+    const QJsonObject& obj = message.m_body;
+    QJsonObject param = obj["param"].toObject();
+    QString name = param["name"].toString();          //子命令只取一次
+    if (name == "update_photo_location_list")
+    {
+        std::vector<st_position> positions;
+        QJsonArray posArray = param["photo_location_list"].toArray();
+        for (int i = 0; i < posArray.size(); i++)
         {
-            int fiber_end_count = param["fiber_end_count"].toInt();
-            if (m_config_data->m_fiber_end_count != fiber_end_count)
-            {
-                m_config_data->m_fiber_end_count = fiber_end_count;
-                m_config_data->save();
-            }
-            //通知自动对焦模块
-            if(m_auto_focus != nullptr)
-            {
-                m_auto_focus->set_fiber_end_count(fiber_end_count);
-            }
+            QJsonObject obj = posArray[i].toObject();
+            int  x = obj["x"].toInt();
+            int  y = obj["y"].toInt();
+            positions.emplace_back(st_position(x, y));
         }
-        else if (param["name"] == "update_fiber_end_physical_size")
+        if(m_config_data->position_list_changed(positions))
         {
-            double fiber_end_physical_size = param["fiber_end_physical_size"].toDouble();
-            if (fabs(m_config_data->m_fiber_end_physical_size - fiber_end_physical_size) > 0.0001)
-            {
-                m_config_data->m_fiber_end_physical_size = fiber_end_physical_size;
-                m_config_data->save();
-            }
+            m_config_data->m_photo_location_list = positions;
+            m_config_data->save();
         }
-        else if (param["name"] == "update_field_of_view")
+    }
+    else if (name == "update_fiber_end_count")
+    {
+        int fiber_end_count = param["fiber_end_count"].toInt();
+        if (m_config_data->m_fiber_end_count != fiber_end_count)
         {
-            double field_of_view = param["field_of_view"].toDouble();
-            if (fabs(m_config_data->m_field_of_view - field_of_view) > 0.0001)
-            {
-                m_config_data->m_field_of_view = field_of_view;
-                m_config_data->save();
-            }
+            m_config_data->m_fiber_end_count = fiber_end_count;
+            m_config_data->save();
         }
-    	else if (param["name"] == "update_auto_detect")
+        //通知自动对焦模块
+        if(m_auto_focus != nullptr)
         {
-            int auto_detect = param["auto_detect"].toInt();
-            if (m_config_data->m_auto_detect != auto_detect)
-            {
-                m_config_data->m_auto_detect = auto_detect;
-                m_config_data->save();
-            }
+            m_auto_focus->set_fiber_end_count(fiber_end_count);
+        }
+    }
+    else if (name == "update_fiber_end_physical_size")
+    {
+        double fiber_end_physical_size = param["fiber_end_physical_size"].toDouble();
+        if (fabs(m_config_data->m_fiber_end_physical_size - fiber_end_physical_size) > 0.0001)
+        {
+            m_config_data->m_fiber_end_physical_size = fiber_end_physical_size;
+            m_config_data->save();
+        }
+    }
+    else if (name == "update_field_of_view")
+    {
+        double field_of_view = param["field_of_view"].toDouble();
+        if (fabs(m_config_data->m_field_of_view - field_of_view) > 0.0001)
+        {
+            m_config_data->m_field_of_view = field_of_view;
+            m_config_data->save();
+        }
+    }
+	else if (name == "update_auto_detect")
+    {
+        int auto_detect = param["auto_detect"].toInt();
+        if (m_config_data->m_auto_detect != auto_detect)
+        {
+            m_config_data->m_auto_detect = auto_detect;
+            m_config_data->save();
+        }
+    }
+    else if (name == "update_save_path")
+    {
+        QString save_path = param["save_path"].toString();
+        if (m_config_data->m_save_path != save_path.toStdString())
+        {
+            m_config_data->m_save_path = save_path.toStdString();
+            m_config_data->save();
+            setup_result_archive();
+        }
+    }
+    else if (name == "update_focus_parameter")
+    {
+        int focus_search_distance = param["focus_search_distance"].toInt(m_config_data->m_focus_search_distance);
+        int focus_move_speed = param["focus_move_speed"].toInt(m_config_data->m_focus_move_speed);
+        int focus_move_step = param["focus_move_step"].toInt(m_config_data->m_focus_move_step);
+        if (m_config_data->m_focus_search_distance != focus_search_distance || m_config_data->m_focus_move_speed != focus_move_speed ||
+            m_config_data->m_focus_move_step != focus_move_step)
+        {
+            m_config_data->m_focus_search_distance = focus_search_distance;
+            m_config_data->m_focus_move_speed = focus_move_speed;
+            m_config_data->m_focus_move_step = focus_move_step;
+            m_config_data->save();
         }
-        else if (param["name"] == "update_save_path")
+    }
+    else if (name == "update_focus_search_mode")
+    {
+        int focus_search_mode = param["focus_search_mode"].toInt();
+        int focus_coarse_factor = param["focus_coarse_factor"].toInt(m_config_data->m_focus_coarse_factor);
+        int focus_capture_at_peak = param["focus_capture_at_peak"].toInt(m_config_data->m_focus_capture_at_peak);
+        if (m_config_data->m_focus_search_mode != focus_search_mode || m_config_data->m_focus_coarse_factor != focus_coarse_factor
+            || m_config_data->m_focus_capture_at_peak != focus_capture_at_peak)
+        {
+            m_config_data->m_focus_search_mode = focus_search_mode;
+            m_config_data->m_focus_coarse_factor = focus_coarse_factor;
+            m_config_data->m_focus_capture_at_peak = focus_capture_at_peak;
+            m_config_data->save();
+        }
+    }
+    else if (name == "update_focus_predict_window")
+    {
+        int focus_predict_window = param["focus_predict_window"].toInt();
+        if (m_config_data->m_focus_predict_window != focus_predict_window)
+        {
+            m_config_data->m_focus_predict_window = focus_predict_window;
+            m_config_data->save();
+        }
+    }
+    else if (name == "update_image_codec")
+    {
+        int image_codec = param["image_codec"].toInt();
+        int png_compression = param["png_compression"].toInt(m_config_data->m_png_compression);
+        if (m_config_data->m_image_codec != image_codec || m_config_data->m_png_compression != png_compression)
+        {
+            m_config_data->m_image_codec = image_codec;
+            m_config_data->m_png_compression = png_compression;
+            m_config_data->save();
+            setup_image_writer();
+        }
+    }
+    else if (name == "update_result_archive")
+    {
+        int archive_mode = param["archive_mode"].toInt(m_config_data->m_archive_mode);
+        int segment_size_mb = param["archive_segment_size_mb"].toInt(m_config_data->m_archive_segment_size_mb);
+        int max_size_gb = param["archive_max_size_gb"].toInt(m_config_data->m_archive_max_size_gb);
+        int retention_days = param["archive_retention_days"].toInt(m_config_data->m_archive_retention_days);
+        if (m_config_data->m_archive_mode != archive_mode || m_config_data->m_archive_segment_size_mb != segment_size_mb ||
+            m_config_data->m_archive_max_size_gb != max_size_gb || m_config_data->m_archive_retention_days != retention_days)
+        {
+            m_config_data->m_archive_mode = archive_mode;
+            m_config_data->m_archive_segment_size_mb = segment_size_mb;
+            m_config_data->m_archive_max_size_gb = max_size_gb;
+            m_config_data->m_archive_retention_days = retention_days;
+            m_config_data->save();
+            setup_result_archive();
+        }
+    }
+    else if (name == "clear_focus_map")
+    {
+        //夹具调整之后历史对焦位置不再可信，清除指定配方(默认当前配方)的记录
+        m_focus_map.clear(param["recipe"].toString());
+        m_focus_map.save_to_file();
+    }
+}
+
+void thread_misc::handle_start_process(const st_task_message& message, QJsonObject& result_obj)
+{
+	start_process(message.m_request_id);
+}
+
+void thread_misc::handle_device_start_process(const st_task_message& message, QJsonObject& result_obj)
+{
+    start_process(message.m_request_id);
+}
+
+QJsonObject thread_misc::process_query(const st_task_message& message)
+{
+    //由查询线程调用，与 process_task 并发执行，只能访问自带互斥锁的数据
+    const QJsonObject& obj = message.m_body;
+    QJsonObject param = obj["param"].toObject();
+    QJsonObject result_obj;     //返回的消息对象
+    result_obj["request_id"] = message.m_request_id;
+    if (message.m_opcode == OPCODE_ARCHIVE_QUERY)
+    {
+        //按时间范围(毫秒时间戳)以及拍照位置/端面序号查询归档记录
+        result_obj["command"] = "server_archive_query";
+        QJsonArray records;
+        if (m_thread_algorithm != nullptr)
         {
-            QString save_path = param["save_path"].toString();
-            if (m_config_data->m_save_path != save_path.toStdString())
+            result_archive* archive = m_thread_algorithm->get_result_archive();
+            std::vector<st_archive_hit> hits = archive->find(param["from"].toInteger(0), param["to"].toInteger(LLONG_MAX),
+                param["position_index"].toInt(-1), param["fiber_index"].toInt(-1));
+            for (const st_archive_hit& hit : hits)
             {
-                m_config_data->m_save_path = save_path.toStdString();
-                m_config_data->save();
+                records.append(result_archive::hit_to_json(hit));
             }
+            result_obj["statistics"] = archive->statistics();
         }
+        result_obj["records"] = records;
     }
-    else if(command == "client_request_start_process")
+    else if (message.m_opcode == OPCODE_FOCUS_MAP)
     {
-    	start_process(obj["request_id"].toString());
+        //查询对焦位置表，默认当前配方
+        result_obj["command"] = "server_focus_map";
+        result_obj["focus_map"] = m_focus_map.to_json(param["recipe"].toString());
     }
-    else if(command == "device_request_start_process")
+    else
     {
-        start_process(obj["request_id"].toString());
+        result_obj["command"] = "server_report_info";
+        result_obj["param"] = QString("不支持的查询命令");
     }
+    return result_obj;
 }
 
 void thread_misc::on_stream_image_ready(const QString& camera_id, const QImage& img)
@@ -974,7 +1310,7 @@ void thread_misc::on_stream_image_ready(const QString& camera_id, const QImage&
         result_obj["request_id"] = m_stream_request_id;
         result_obj["task_finish"] = false;
         st_image_meta meta;
-        if (!m_shared_memory_trigger_image.write_image(img, meta))
+        if (!m_image_transport->send_image(img, "stream", meta))
         {
             result_obj["command"] = "server_report_info";
             result_obj["param"] = QString("写入图片数据失败");
@@ -993,12 +1329,25 @@ void thread_misc::on_stream_image_ready(const QString& camera_id, const QImage&
     }
 }
 
+void thread_misc::on_stream_frame_ready(const QString& camera_id, const st_image_meta& meta)
+{
+    //影像已由相机回调写入环形缓冲区，这里只分配帧编号并发送元数据
+    st_image_meta frame_meta = meta;
+    m_image_transport->publish_stream_frame(frame_meta);
+    QJsonObject result_obj;     //返回的消息对象
+    result_obj["request_id"] = m_stream_request_id;
+    result_obj["task_finish"] = false;
+    result_obj["command"] = "server_camera_stream_image_ready";
+    result_obj["param"] = image_shared_memory::meta_to_json(frame_meta);
+    emit post_task_finished(QVariant::fromValue(result_obj));
+}
+
 void thread_misc::on_device_request_start_process()
 {
-    QJsonObject obj;
-	obj["command"] = "device_request_start_process";
-	obj["request_id"] = "";     //所有界面响应
-    add_task(obj);
+    st_task_message message;
+    message.m_opcode = OPCODE_DEVICE_START_PROCESS;
+    message.m_request_id = "";      //所有界面响应
+    add_task(QVariant::fromValue(std::move(message)), TASK_PRIORITY_BULK);
     //start_process(L(""));
 }
 
@@ -1011,11 +1360,7 @@ int thread_misc::start_process(const QString& request_id)
     std::chrono::steady_clock::time_point start = std::chrono::high_resolution_clock::now();
     m_is_processing.store(true);
 	{
-        //首先删除内部目录中的数据，自动切换到触发模式，然后向客户端回复消息，通知正在运行，禁用界面上相关按钮
-        QString current_directory = QCoreApplication::applicationDirPath();
-        QString image_dir = current_directory + "/detect_images";
-        make_path(image_dir);
-        remove_files(image_dir, L("*.png"));        //移除目录中所有文件
+        //自动切换到触发模式，然后向客户端回复消息，通知正在运行，禁用界面上相关按钮. 检测结果影像通过共享内存发送，不再需要清空 detect_images 目录
 		if (m_camera->get_trigger_mode() != global_trigger_mode_once)
         {
             m_camera->stop_grab();
@@ -1031,11 +1376,23 @@ int thread_misc::start_process(const QString& request_id)
         ret_obj["param"] = -1;
         emit post_task_finished(QVariant::fromValue(ret_obj));
 	}
+    //飞拍影像按端面数量分割之后检测，见 fly_capture_frame
+    bool fly_capture = m_config_data->m_fly_capture != 0;
 	for (int i = 0;i < m_config_data->m_photo_location_list.size();i++)
     {
-        if(m_terminate.load())
+        if(is_cancelled())
         {
 	        break;
+        }
+        if (fly_capture)
+        {
+            int last = fly_capture_pass(request_id, i);
+            if (last < i)
+            {
+                break;
+            }
+            i = last;
+            continue;
         }
 	    /******************1.运动到拍照位*******************/
         int pos_x = m_config_data->m_photo_location_list[i].m_x;
@@ -1044,17 +1401,40 @@ int thread_misc::start_process(const QString& request_id)
         {
 	        continue;
         }
-        if (m_terminate.load())
+        if (is_cancelled())
         {
             break;
         }
         /******************2.异常检测*******************/
-        //检测失败的时候直接退出，不再进行下一步处理
+        //对焦影像交给检测线程之后立即进入下一个拍照位置; 对焦失败的时候直接退出，不再进行下一步处理
         if (!anomaly_detection(request_id, i, false))
         {
 	        break;
         }
     }
+    //等待检测线程处理完所有位置，保证最终的 server_process_status 在所有检测结果之后回复
+    if (m_thread_algorithm != nullptr)
+    {
+        if (is_cancelled())
+        {
+            m_thread_algorithm->clear_tasks();
+        }
+        m_thread_algorithm->wait_idle();
+        //写入屏障: 归档影像在运行期间异步写入，这里等待全部写入完毕之后再回复运行结束
+        std::chrono::steady_clock::time_point flush_start = std::chrono::high_resolution_clock::now();
+        image_writer* writer = m_thread_algorithm->get_image_writer();
+        writer->flush();
+        auto flush_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - flush_start);
+        QJsonObject statistics = writer->statistics();
+        write_log(l(QString("image writer: flush wait %1 ms, written %2 (%3 bytes, failed %4), average %5 ms per image, max queue depth %6 of %7, submit blocked %8 times (%9 ms)")
+            .arg(flush_ms.count()).arg(statistics["written_count"].toInteger()).arg(statistics["written_bytes"].toInteger())
+            .arg(statistics["failed_count"].toInteger()).arg(statistics["average_write_ms"].toDouble(), 0, 'f', 1)
+            .arg(statistics["max_pending"].toInt()).arg(statistics["max_queue_size"].toInt())
+            .arg(statistics["blocked_count"].toInteger()).arg(statistics["blocked_ms"].toDouble(), 0, 'f', 1)).c_str());
+        writer->reset_statistics();
+    }
+    //本次运行更新的对焦位置统一保存，不在对焦过程中写文件
+    m_focus_map.save_to_file();
     std::chrono::steady_clock::time_point end = std::chrono::high_resolution_clock::now();
     auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
     double use_time = duration_ms.count() / 1000.0;
@@ -1071,7 +1451,7 @@ int thread_misc::start_process(const QString& request_id)
 
     m_is_processing.store(false);
 	{
-        int ret = m_terminate.load();
+        int ret = is_cancelled();
         //回复消息，通知运行完毕，恢复界面上相关按钮状态
         QJsonObject ret_obj;                                        // 返回的消息对象
         ret_obj["request_id"] = request_id;
@@ -1081,7 +1461,6 @@ int thread_misc::start_process(const QString& request_id)
         ret_obj["use_time"] = use_time;                     // 如果是正常执行完毕，显示算法运行时间
         emit post_task_finished(QVariant::fromValue(ret_obj));
 	}
-    m_terminate.store(false);
     return 0;
 }
 
@@ -1091,8 +1470,14 @@ bool thread_misc::move_to_position(int pos_x, int pos_y, const QString& request_
     {
         return false;
     }
-    m_motion_control->move_position(0, pos_y, m_config_data->m_move_speed);
-    m_motion_control->move_position(1, pos_x, m_config_data->m_move_speed);
+    //两个轴同时运动，运动期间准备相机(可能没有开始采集)
+    motion_future move_y = m_motion_control->move_position_async(0, pos_y, m_config_data->m_move_speed);
+    motion_future move_x = m_motion_control->move_position_async(1, pos_x, m_config_data->m_move_speed);
+    if (m_camera != nullptr)
+    {
+        m_camera->start_grab();
+    }
+    motion_control::wait_all({ move_y, move_x });
     m_motion_control->get_position(m_config_data->m_position_y, m_config_data->m_position_x);
     bool ret(false);
     QJsonObject ret_obj;     //返回的消息对象
@@ -1105,7 +1490,6 @@ bool thread_misc::move_to_position(int pos_x, int pos_y, const QString& request_
     //该接口会在两种场景下使用: (1) 用户双击列表项时(不一定设置) (2) 用户开始检测时(已在外部设置触发模式且处于采集状态)
     if (m_camera != nullptr)
     {
-        m_camera->start_grab();     //可能没有开始采集
         if(m_camera->get_trigger_mode() == global_trigger_mode_once)
         {
             QImage img = m_camera->trigger_once();
@@ -1116,7 +1500,7 @@ bool thread_misc::move_to_position(int pos_x, int pos_y, const QString& request_
             else
             {
                 st_image_meta meta;
-                if (!m_shared_memory_trigger_image.write_image(img, meta))
+                if (!m_image_transport->send_image(img, "trigger", meta))
                 {
                     ret_obj["image"] = "write image error";
                 }
@@ -1134,126 +1518,223 @@ bool thread_misc::move_to_position(int pos_x, int pos_y, const QString& request_
     return ret;
 }
 
-bool thread_misc::anomaly_detection(const QString& request_id, int index, bool is_task_finish)
+int thread_misc::fly_capture_pass(const QString& request_id, int first)
 {
-    QJsonObject result_obj;     //返回的消息对象
-    result_obj["request_id"] = request_id;
-    result_obj["task_finish"] = is_task_finish;
-    result_obj["start_index"] = index * m_config_data->m_fiber_end_count;
-    result_obj["fiber_end_count"] = m_config_data->m_fiber_end_count;
-    QString current_directory = QCoreApplication::applicationDirPath();
-    if (m_fiber_end_detector == nullptr)
-    {
-        m_fiber_end_detector = new fiber_end_algorithm;
-        std::string shape_model_path = (current_directory + "/shape_model/model.bin").toStdString();
-        std::string algorithm_parameter_path = (current_directory + "/parameter.xml").toStdString();
-        if (!m_fiber_end_detector->initialize(m_config_data->m_fiber_end_pixel_size, algorithm_parameter_path))
-        {
-            delete m_fiber_end_detector;
-            m_fiber_end_detector = nullptr;
-            std::cerr << "fiber_end_algorithm initialize error!" << std::endl;
-            result_obj["command"] = "server_anomaly_detection_finish";
-            result_obj["param"] = QString::fromStdString("算法初始化失败!");
-            emit post_task_finished(QVariant::fromValue(result_obj));
-            return false;
+    const std::vector<st_position>& locations = m_config_data->m_photo_location_list;
+    int last = first;
+    int direction = 0;
+    while (last + 1 < static_cast<int>(locations.size()) && locations[last + 1].m_y == locations[first].m_y)
+    {
+        int step = locations[last + 1].m_x - locations[last].m_x;
+        if (step == 0 || (direction != 0 && (step > 0) != (direction > 0)))
+        {
+            break;
         }
+        direction = step;
+        last++;
     }
-    if (m_auto_focus == nullptr)
+    /******************1.在第一个位置停止拍照*******************/
+    //不调用 move_to_position: 触发模式下它会再拍一次并回复客户端，第一个位置只曝光一次
+    if (m_motion_control == nullptr)
     {
-        std::string calibration_file_path = (current_directory + "/calibration.bin").toStdString();
-        m_auto_focus = new auto_focus(calibration_file_path, m_motion_control, m_camera, m_config_data->m_fiber_end_count);
+        return first;       //与逐个位置运行时一致，跳过该位置
     }
-    QDateTime datetime = QDateTime::currentDateTime();      //时间戳, 用于临时文件命名
-    QString qCurrentTime = datetime.toString("yyyy-MM-dd-HH-mm-ss");
-    /*********************1.得到若干清晰的单通道端面影像，每张影像上包含一个端面********************/
-    std::vector<cv::Mat> images = m_auto_focus->get_focus_images(m_config_data->m_photo_location_list[index].m_y);
-    if (images.size() == 0)
+    motion_future move_y = m_motion_control->move_position_async(0, locations[first].m_y, m_config_data->m_move_speed);
+    motion_future move_first_x = m_motion_control->move_position_async(1, locations[first].m_x, m_config_data->m_move_speed);
+    if (!motion_control::wait_all({ move_y, move_first_x }))
+    {
+        return first;
+    }
+    int capture_x = locations[first].m_x;
+    m_motion_control->get_axis_position(1, capture_x);
+    if (!fly_capture_frame(request_id, first, capture_x))
+    {
+        return -1;
+    }
+    if (last == first)
+    {
+        return first;
+    }
+    /******************2.x 轴运动到最后一个位置，经过中间位置时拍照*******************/
+    std::chrono::steady_clock::time_point pass_start = std::chrono::steady_clock::now();
+    int speed = std::max(1, m_config_data->m_move_speed);
+    motion_future move_x = m_motion_control->move_position_async(1, locations[last].m_x, speed);
+    int captured = first;
+    for (int i = first + 1; i <= last; i++)
+    {
+        if (is_cancelled())
+        {
+            break;
+        }
+        //超时按匀速运动时间的两倍再加 1 秒估算，包括加速和减速
+        int distance = std::abs(locations[i].m_x - locations[i - 1].m_x);
+        int timeout_ms = static_cast<int>(2000LL * distance / speed) + 1000;
+        if (!m_motion_control->wait_axis_passing(1, locations[i].m_x, direction > 0, timeout_ms, capture_x))
+        {
+            write_log(l(QString("fly capture: axis did not pass photo location %1 (x = %2, read %3)")
+                .arg(i + 1).arg(locations[i].m_x).arg(capture_x)).c_str());
+            break;
+        }
+        if (!fly_capture_frame(request_id, i, capture_x))
+        {
+            break;
+        }
+        captured = i;
+    }
+    motion_control::wait_all({ move_x });
+    auto pass_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - pass_start);
+    write_log(l(QString("fly capture: photo locations %1-%2 captured in %3 ms")
+        .arg(first + 1).arg(captured + 1).arg(pass_ms.count())).c_str());
+    return is_cancelled() ? -1 : captured;
+}
+
+bool thread_misc::fly_capture_frame(const QString& request_id, int index, int capture_x)
+{
+    st_detect_task task;
+    task.m_request_id = request_id;
+    task.m_is_task_finish = false;
+    task.m_index = index;
+    task.m_fiber_end_count = m_config_data->m_fiber_end_count;
+    task.m_field_of_view = m_config_data->m_field_of_view;
+    task.m_save_dir = L(m_config_data->m_save_path.c_str());
+    QDateTime datetime = QDateTime::currentDateTime();
+    task.m_time_string = datetime.toString("yyyy-MM-dd-HH-mm-ss");
+    task.m_timestamp = datetime.toMSecsSinceEpoch();
+    task.m_has_capture_position = true;
+    task.m_capture_x = capture_x;
+    task.m_capture_y = m_config_data->m_photo_location_list[index].m_y;
+    //软触发，影像返回之后再读取一次位置，两次位置之差用于评估运动速度是否导致影像模糊
+    QImage img = m_camera->trigger_once();
+    task.m_capture_x_end = capture_x;
+    m_motion_control->get_axis_position(1, task.m_capture_x_end);
+    if (img.isNull())
+    {
+        task.m_error = L("飞拍触发失败!");
+    }
+    else
+    {
+        //与自动标定计算像素尺寸时相同，按端面数量将影像等分为竖条，每个竖条包含一个端面
+        cv::Mat image_gray = convert_qimage_to_cvmat(img, 1);
+        int fiber_end_count = std::max(1, m_config_data->m_fiber_end_count);
+        int step_width = image_gray.cols / fiber_end_count;
+        for (int i = 0; i < fiber_end_count && step_width > 0; i++)
+        {
+            task.m_images.push_back(image_gray(cv::Rect(i * step_width, 0, step_width, image_gray.rows)).clone());
+        }
+    }
+    if (m_thread_algorithm == nullptr)
     {
-        result_obj["command"] = "server_anomaly_detection_finish";
-        result_obj["param"] = L("自动对焦失败,请检查影像端面数量并进行自动标定!");
-        emit post_task_finished(QVariant::fromValue(result_obj));
         return false;
     }
-    if(save_focus_image)            //将自动对焦结果保存在指定位置，内部调试使用
-    {
-        QString focus_dir = current_directory + "/focus_images";        //内部自动对焦结果目录
-        make_path(focus_dir);
-        for (int i = 0; i < images.size(); i++)
-        {
-            QString path = QString("%1/%2_%3.jpg").arg(focus_dir).arg(qCurrentTime).arg(index * m_config_data->m_fiber_end_count + i);
-            cv::imwrite(l(path).c_str(), images[i]);
-        }
-    }
-    /*********************2.精定位，然后将结果显示在界面上********************/
-    QString image_dir = current_directory + "/detect_images";        //前后端影像传输目录,包含两张影像，index_shape.png:精定位结果 index_det.png:检测结果
-    make_path(image_dir);
-    QString user_dir = L(m_config_data->m_save_path.c_str());  //外部指定的保存目录
-    make_path(user_dir);
-    /******************************
-     * 执行流程:
-     * (1) 精定位得到结果 box
-     * (2) 定位失败，输出定位结果(原始数据)
-     * (3) 定位成功
-     *      3.1 如果开启了自动检测,自动检测，外扩之后输出定位结果 + 检测结果
-     *      3.2 如果没有开启自动检测，外扩之后输出定位结果
-     ******************************/
-    for (int i = 0; i < images.size(); i++)
-    {
-        // 精定位
-        st_detect_box box = m_fiber_end_detector->get_shape_match_result(images[i]);
-        cv::Mat shape_image = images[i];    //原始数据
-        if(!box.is_valid())
-        {
-	        // 定位失败，输出原始数据
-            QString dst_image_path = QString("%1/%2_%3_shape.png").arg(user_dir).arg(qCurrentTime).arg(index * m_config_data->m_fiber_end_count + i);
-            cv::imwrite(dst_image_path.toStdString(), shape_image);
-            dst_image_path = QString("%1/%2_shape.png").arg(image_dir).arg(index * m_config_data->m_fiber_end_count + i);
-        	cv::imwrite(dst_image_path.toStdString(), shape_image);
+    return m_thread_algorithm->add_task_wait(QVariant::fromValue(task), cancel_flag());
+}
+
+bool thread_misc::anomaly_detection(const QString& request_id, int index, bool is_task_finish)
+{
+    //检测任务，无论成功还是失败都交给检测线程回复，保证消息顺序与拍照位置顺序一致
+    st_detect_task task;
+    task.m_request_id = request_id;
+    task.m_is_task_finish = is_task_finish;
+    task.m_index = index;
+    task.m_fiber_end_count = m_config_data->m_fiber_end_count;
+    task.m_field_of_view = m_config_data->m_field_of_view;
+    task.m_save_dir = L(m_config_data->m_save_path.c_str());
+    QString current_directory = QCoreApplication::applicationDirPath();
+    bool ret(true);
+    if (m_fiber_end_detector == nullptr && !setup_fiber_end_detector())
+    {
+        std::cerr << "fiber_end_algorithm initialize error!" << std::endl;
+        task.m_error = L("算法初始化失败!");
+        ret = false;
+    }
+    if (ret)
+    {
+        QDateTime datetime = QDateTime::currentDateTime();      //时间戳, 用于临时文件命名
+        task.m_time_string = datetime.toString("yyyy-MM-dd-HH-mm-ss");
+        task.m_timestamp = datetime.toMSecsSinceEpoch();
+        /*********************1.得到若干清晰的单通道端面影像，每张影像上包含一个端面********************/
+        task.m_images = focus_at_location(index);
+        if (task.m_images.size() == 0)
+        {
+            task.m_error = L("自动对焦失败,请检查影像端面数量并进行自动标定!");
+            ret = false;
         }
-        else
+        else if (save_focus_image)            //将自动对焦结果保存在指定位置，内部调试使用
         {
-            //定位成功，首先保存外扩之后的定位结果
-            cv::Rect buffer_roi;
-            st_detect_box buffer_box = box.buffer(m_config_data->m_field_of_view);  //首先进行外扩
-            cv::Mat buffer_shape_image = get_roi_image(images[i], buffer_box, 0, 1, buffer_roi);    //得到外扩影像及其在原始影像上的区域
-            //cv::Mat buffer_shape_image = get_roi_image_padding(images[i], buffer_box, 1);    //得到外扩影像及其在原始影像上的区域
-        	QString dst_image_path = QString("%1/%2_%3_shape.png").arg(user_dir).arg(qCurrentTime).arg(index * m_config_data->m_fiber_end_count + i);
-            cv::imwrite(dst_image_path.toStdString(), buffer_shape_image);
-            dst_image_path = QString("%1/%2_shape.png").arg(image_dir).arg(index * m_config_data->m_fiber_end_count + i);
-            cv::Mat enhance_shape_image = unsharp_masking(buffer_shape_image, 1.0, 7);
-        	cv::imwrite(dst_image_path.toStdString(), enhance_shape_image);
-            //如果开启了自动检测, 在原始定位结果的基础上执行自动检测，然后外扩保存
-            //if(m_config_data->m_auto_detect)
-			if (0)          //这里禁用自动检测功能
+            QString focus_dir = current_directory + "/focus_images";        //内部自动对焦结果目录
+            make_path(focus_dir);
+            for (int i = 0; i < task.m_images.size(); i++)
             {
-                cv::Rect roi;
-                shape_image = get_roi_image(images[i], box, 0, 1, roi);
-                st_detect_result detect_result = m_fiber_end_detector->get_detect_result(shape_image);
-                //这里检测结果的坐标是相对于roi区域的，但我们保存的影像数据是buffer_roi区域，外扩之后需要对检测结果坐标进行偏移
-                double dx = roi.x - buffer_roi.x;
-                double dy = roi.y - buffer_roi.y;
-                detect_result = detect_result.translate(dx, dy);
-                //保存检测结果
-                QString dst_detect_path = QString("%1/%2_%3.det").arg(user_dir).arg(qCurrentTime).arg(index * m_config_data->m_fiber_end_count + i);
-                detect_result.save_to_file(dst_detect_path.toStdString());
-                //绘制结果并保存
-                std::vector<cv::Mat> channels(3, buffer_shape_image);
-                cv::Mat detect_image;
-                cv::merge(channels, detect_image);  // 三个通道都指向同一个数据
-                detect_image = detect_result.draw_to_image(detect_image);
-            	dst_image_path = QString("%1/%2_%3_det.png").arg(user_dir).arg(qCurrentTime).arg(index * m_config_data->m_fiber_end_count + i);
-                cv::imwrite(dst_image_path.toStdString(), detect_image);
-                dst_image_path = QString("%1/%2_det.png").arg(image_dir).arg(index * m_config_data->m_fiber_end_count + i);
-                cv::Mat enhance_detect_image = unsharp_masking(detect_image, 1.0, 7);
-            	cv::imwrite(dst_image_path.toStdString(), enhance_detect_image);
+                QString path = QString("%1/%2_%3").arg(focus_dir).arg(task.m_time_string).arg(index * m_config_data->m_fiber_end_count + i);
+                if (m_thread_algorithm != nullptr)
+                {
+                    m_thread_algorithm->get_image_writer()->write(IMAGE_DESTINATION_DEBUG, path, task.m_images[i]);
+                }
             }
         }
     }
-    result_obj["command"] = "server_anomaly_detection_finish";
-    result_obj["param"] = "success";
-    emit post_task_finished(QVariant::fromValue(result_obj));
-    
-    return true;
+    /*********************2.精定位、保存影像并回复消息，由检测线程执行********************/
+    if (m_thread_algorithm == nullptr)
+    {
+        return false;
+    }
+    //检测队列已满时在此等待(背压)，用户中断时放弃提交
+    if (!m_thread_algorithm->add_task_wait(QVariant::fromValue(task), cancel_flag()))
+    {
+        return false;
+    }
+    return ret;
+}
+
+std::vector<cv::Mat> thread_misc::focus_at_location(int index)
+{
+    std::vector<cv::Mat> images;
+    if (!setup_run_focus())
+    {
+        write_log("run focus needs an opened camera and an object detector");
+        return images;
+    }
+    //没有拍照位置列表时(单独检测)在当前位置对焦
+    st_position location(m_config_data->m_position_x, m_config_data->m_position_y);
+    if (index >= 0 && index < static_cast<int>(m_config_data->m_photo_location_list.size()))
+    {
+        location = m_config_data->m_photo_location_list[index];
+    }
+    //对焦参数每次对焦之前从配置读取，修改配置之后不需要重新创建对焦模块. set_photo_location 依赖扫描距离，最后设置
+    m_run_focus->set_motion_parameters(m_config_data->m_focus_search_distance, m_config_data->m_focus_move_speed, m_config_data->m_focus_move_step);
+    m_run_focus->set_search_mode(m_config_data->m_focus_search_mode == FOCUS_SEARCH_COARSE_FINE ? FOCUS_SEARCH_COARSE_FINE : FOCUS_SEARCH_SWEEP,
+        m_config_data->m_focus_coarse_factor);
+    m_run_focus->set_capture_at_peak(m_config_data->m_focus_capture_at_peak == 1);
+    m_run_focus->set_focus_map(&m_focus_map, m_config_data->m_focus_predict_window);
+    m_run_focus->set_photo_location(location.m_x, location.m_y);
+    //对焦模块切换为硬触发，结束时切换为连续采集，这里恢复对焦之前的触发方式
+    QString trigger_mode = m_camera->get_trigger_mode();
+    QString trigger_source = m_camera->get_trigger_source();
+    //硬触发影像只在对焦期间交给对焦模块，预览时相机不需要额外构造 QImage
+    QMetaObject::Connection connection = connect(m_camera, &interface_camera::post_stream_image_ready,
+        m_run_focus, &auto_focus2::add_image, Qt::DirectConnection);
+    if (!m_run_focus_calibrated && !is_cancelled())
+    {
+        write_log(l(QString("calibrate run focus clarity at location %1").arg(index)).c_str());
+        m_run_focus->clarity_calibration();
+        m_run_focus_calibrated = true;
+    }
+    std::vector<st_focus_image> focus_images;
+    if (!is_cancelled())
+    {
+        focus_images = m_run_focus->get_focus_images(QString(), index, m_config_data->m_fiber_end_count);
+    }
+    disconnect(connection);
+    m_camera->set_trigger_mode(trigger_mode);
+    m_camera->set_trigger_source(trigger_source);
+    for (size_t i = 0; i < focus_images.size(); i++)
+    {
+        if (!focus_images[i].m_focus_image.empty())
+        {
+            images.emplace_back(focus_images[i].m_focus_image);
+        }
+    }
+    return images;
 }
 
 QJsonObject thread_misc::camera_parameter_to_json(interface_camera* camera)
@@ -5,12 +5,18 @@
 #pragma once
 
 #include "work_threads.h"
+#include "task_message.h"
+#include "task_dispatcher.h"
+#include "thread_algorithm.h"
 #include "device_manager.hpp"
 #include "config.hpp"
 #include "../device_camera/camera_factory.h"
 #include "camera_config_mgr.hpp"
 #include "../common/image_shared_memory.h"
+#include "image_transport.h"
 #include "../auto_focus/auto_focus.h"
+#include "../auto_focus/auto_focus2.h"
+#include "../auto_focus/focus_map.h"
 #include "../basic_algorithm/fiber_end_algorithm.h"
 
 #ifdef MOTION_CONTROL_PLC
@@ -25,6 +31,8 @@ public:
     thread_misc(QString name, QObject* parent = nullptr);
 	virtual ~thread_misc() override;
 	void set_device_manager(device_manager* manager) { m_device_manager = manager; }
+	void set_algorithm_thread(thread_algorithm* algorithm_thread);		//设置检测线程(流水线第二级)
+	void set_image_transport(image_transport_mgr* transport) { m_image_transport = transport; }	//设置影像传输模块
 
 	interface_camera* camera() const { return m_camera; }						//获取相机对象)
 	st_config_data* config_data() const { return m_config_data; }				//获取配置参数
@@ -39,6 +47,10 @@ public:
 	void setup_camera_config_mgr();									//初始化相机参数管理器
 	bool setup_motion_control(st_config_data* config_data);			//初始化运控模块
 	bool setup_fiber_end_detector();								//初始化算法检测模块
+	void setup_focus_map();											//加载对焦位置表
+	bool setup_run_focus();											//创建运行时的自动对焦模块，需要相机和端面检测器
+	void setup_image_writer();										//根据配置设置检测结果影像的编码方式
+	void setup_result_archive();									//根据配置打开或关闭结果归档
 
 	bool load_user_config_file(const QString& file_path);			//加载用户配置文件
 	bool save_user_config_file(const QString& file_path);			//保存用户配置文件
@@ -49,36 +61,91 @@ public:
 
 	/**************************************
 	 * 开始运行. 相机依次移动到位置列表，执行拍照-自动对焦-异常检测任务.（在此之前需要执行一次复位操作）
+	 * 流水线执行: 本线程负责运动和自动对焦，对焦影像交给 m_thread_algorithm 检测和保存，
+	 * 检测当前位置的同时相机移动到下一个拍照位置. 所有位置检测完毕之后才回复最终的 server_process_status
 	 * 返回值: 0 -- 执行完毕 1 -- 重复下发返回值
 	 * const QString& request_id -- 客户端发送的消息唯一标识符, 这里需要多次阶段性回复消息，因此需要依据该变量回复消息
 	 **************************************/
 	int start_process(const QString& request_id);
 	bool move_to_position(int pos_x, int pos_y, const QString& request_id,bool task_finish = false);//移动相机位置，拍照并回复消息
-	bool anomaly_detection(const QString& request_id, int index, bool is_task_finish = true);		//异常检测，多次回复(每一张影像检测完毕的)消息
-	std::atomic<bool> m_is_processing{ false };		//运行标识，正在运行时为 true
-	std::atomic<bool> m_terminate{ false };			//中断标识,用户中断任务时该值置为true,任务函数(start_process)不断监视该变量以响应中断操作
+	//异常检测: 自动对焦之后将影像交给检测线程，由检测线程回复消息. 返回值表示对焦是否成功(检测任务是否已提交)
+	bool anomaly_detection(const QString& request_id, int index, bool is_task_finish = true);
+	/**************************************
+	 * 在第 index 个拍照位置自动对焦，返回每个端面最清晰的单通道影像，失败或者取消时返回空列表
+	 * 使用 m_run_focus: 扫描参数和对焦位置表从配置读取，用户中断时停止扫描
+	 **************************************/
+	std::vector<cv::Mat> focus_at_location(int index);
+	/**************************************
+	 * 飞拍(m_fly_capture): 从 first 开始，y 相同且 x 单调变化的连续拍照位置组成一次飞拍
+	 * 在第一个位置停止拍照，然后 x 轴一次运动到最后一个位置，经过每个位置时触发拍照，不执行自动对焦
+	 * 返回值: 已经拍照的最后一个位置序号，中途失败时由调用者从下一个位置重新开始
+	 **************************************/
+	int fly_capture_pass(const QString& request_id, int first);
+	//飞拍触发一次，影像按端面数量等分为竖条，连同触发时读取的位置交给检测线程. 检测任务提交失败(用户中断)时返回 false
+	bool fly_capture_frame(const QString& request_id, int index, int capture_x);
+	std::atomic<bool> m_is_processing{ false };		//运行标识，正在运行时为 true. 用户中断时调用 cancel_current_task，正在执行的任务检查 is_cancelled() 响应中断
+	//只读查询(归档记录、对焦位置表)，由查询线程调用，可以与 process_task 并发执行
+	QJsonObject process_query(const st_task_message& message);
 protected:
     void process_task(const QVariant& task_data) override;
+    void on_idle() override;										//相机参数修改停止一段时间之后保存相机配置文件
 
 public slots:
 	void on_stream_image_ready(const QString& camera_id, const QImage& img);	//连续模式下取图成功，写入共享内存然后发送给前端
+	void on_stream_frame_ready(const QString& camera_id, const st_image_meta& meta);	//连续模式下影像已写入环形缓冲区，发送元数据给前端
 	void on_device_request_start_process();										//接收设备开关发送的信号，开始检测任务
 private:
 	st_camera_config_mgr m_camera_config_mgr;				//相机配置管理器，用于保存和加载相机参数
 	interface_camera* m_camera{ nullptr };					//相机对象，用于执行打开相机、设置参数等操作
 	motion_control* m_motion_control{ nullptr };			//运控对象，用于移动相机
-	auto_focus* m_auto_focus{ nullptr };					//自动对焦模块
+	auto_focus* m_auto_focus{ nullptr };					//自动对焦模块，执行对焦命令和自动标定
+	auto_focus2* m_run_focus{ nullptr };					//运行时的自动对焦模块，持有当前相机指针，更换相机之后重新创建
+	bool m_run_focus_calibrated{ false };					//m_run_focus 的清晰度阈值只保存在内存中，创建或自动标定之后在下一次对焦之前标定一次
+	focus_map m_focus_map;									//对焦位置表，按配方(用户配置文件名)记录每个拍照位置的最佳对焦位置
 	device_manager* m_device_manager{ nullptr };			//设备管理器，用于存储和管理设备信息
 	st_config_data* m_config_data{ nullptr };				//服务配置参数,存储一些配置信息，例如拍照位置，保存路径，每张影像上的端面数量等
 	fiber_end_algorithm* m_fiber_end_detector{ nullptr };	//端面检测器，指定影像数据，输出检测结果
+	thread_algorithm* m_thread_algorithm{ nullptr };		//检测线程，执行精定位和影像保存，不负责资源释放
+	int m_detect_queue_size{ 2 };							//检测队列长度，检测落后于运动时阻塞运动，避免对焦影像无限堆积
 	
-	image_shared_memory m_shared_memory_trigger_image{ "trigger_image" };	// 共享内存对象，用于传输拍照得到的图像数据
-	image_shared_memory m_shared_memory_detect_image{ "detect_image" };		// 共享内存对象，用于传输检测的图像数据
+	image_transport_mgr* m_image_transport{ nullptr };		//影像传输模块，根据客户端地址选择共享内存或者 TCP 传输拍照得到的图像数据，不负责资源释放
 
 	int save_focus_image{ 0 };					//保存自动对焦的影像
 	//bool m_calc_image_clarity{ false };			//调试参数，在移动相机的同时计算影像清晰度
 	//double m_max_clarity{ 0.0 };				//调试参数，保存移动相机时清晰度最高的影像
 	//std::vector<QImage> m_clarity_images;		//调试参数，保存移动相机时拍摄的影像
 	QString m_stream_request_id{ "" };		//连续模式下采图之后需要持续发送给指定客户端，记录下发开始采集命令的客户端请求id
+	task_dispatcher m_dispatcher;			//操作码 -> 处理函数，构造时注册
+	/**************************************
+	 * 相机配置延迟保存: 拖动滑块时每次修改只标记为未保存，最后一次修改之后 m_camera_config_save_delay_ms 再保存，
+	 * 连续修改超过 m_camera_config_max_delay_ms 时也保存一次. 关闭相机、打开其他相机和线程退出之前立即保存
+	 **************************************/
+	bool m_camera_config_dirty{ false };
+	std::chrono::steady_clock::time_point m_camera_config_first_change;
+	std::chrono::steady_clock::time_point m_camera_config_last_change;
+	int m_camera_config_save_delay_ms{ 500 };
+	int m_camera_config_max_delay_ms{ 3000 };
+	void flush_camera_config();			//导出相机参数并写入配置文件
+	//等待检测线程处理完已提交的任务. 检测线程直接使用 m_fiber_end_detector，修改检测器(参数、模型)之前必须调用
+	void wait_algorithm_idle();
+
+	void register_handlers();
+	//命令处理函数，result_obj 中已经填写 request_id
+	void handle_open_camera(const st_task_message& message, QJsonObject& result_obj);
+	void handle_close_camera(const st_task_message& message, QJsonObject& result_obj);
+	void handle_change_camera_parameter(const st_task_message& message, QJsonObject& result_obj);
+	void handle_start_grab(const st_task_message& message, QJsonObject& result_obj);
+	void handle_trigger_once(const st_task_message& message, QJsonObject& result_obj);
+	void handle_change_algorithm_parameter(const st_task_message& message, QJsonObject& result_obj);
+	void handle_user_config_set(const st_task_message& message, QJsonObject& result_obj);
+	void handle_move_camera(const st_task_message& message, QJsonObject& result_obj);
+	void handle_move_camera_by_index(const st_task_message& message, QJsonObject& result_obj);
+	void handle_set_motion_parameter(const st_task_message& message, QJsonObject& result_obj);
+	void handle_auto_focus(const st_task_message& message, QJsonObject& result_obj);
+	void handle_anomaly_detection(const st_task_message& message, QJsonObject& result_obj);
+	void handle_auto_calibration(const st_task_message& message, QJsonObject& result_obj);
+	void handle_update_server_parameter(const st_task_message& message, QJsonObject& result_obj);
+	void handle_start_process(const st_task_message& message, QJsonObject& result_obj);
+	void handle_device_start_process(const st_task_message& message, QJsonObject& result_obj);
 
 };
\ No newline at end of file
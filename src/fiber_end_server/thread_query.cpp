@@ -0,0 +1,24 @@
+﻿#include "thread_query.h"
+#include "thread_misc.h"
+
+thread_query::thread_query(QString name, QObject* parent)
+    :thread_base(name, parent)
+{
+    m_dispatcher.register_handler(OPCODE_ARCHIVE_QUERY, this, &thread_query::handle_query);
+    m_dispatcher.register_handler(OPCODE_FOCUS_MAP, this, &thread_query::handle_query);
+}
+
+void thread_query::process_task(const QVariant& task_data)
+{
+    m_dispatcher.dispatch(st_task_message::from_variant(task_data));
+}
+
+void thread_query::handle_query(const st_task_message& message, QJsonObject& result_obj)
+{
+    if (m_thread_misc == nullptr)
+    {
+        return;
+    }
+    result_obj = m_thread_misc->process_query(message);
+    emit post_task_finished(QVariant::fromValue(result_obj));
+}
@@ -0,0 +1,28 @@
+﻿/********************
+ * 查询线程
+ * 执行只读命令(归档查询、对焦位置表等)，不经过设备操作线程的队列，运行和标定期间也可以响应
+ * 查询内容由 thread_misc::process_query 生成，涉及的数据由各自的互斥锁保护
+ ********************/
+#pragma once
+#include "work_threads.h"
+#include "task_message.h"
+#include "task_dispatcher.h"
+
+class thread_misc;
+
+class thread_query : public thread_base
+{
+    Q_OBJECT
+public:
+    thread_query(QString name, QObject* parent = nullptr);
+    void set_misc_thread(thread_misc* thread) { m_thread_misc = thread; }
+
+protected:
+    void process_task(const QVariant& task_data) override;
+
+private:
+    thread_misc* m_thread_misc{ nullptr };      //不负责资源管理
+    task_dispatcher m_dispatcher;
+
+    void handle_query(const st_task_message& message, QJsonObject& result_obj);
+};
@@ -15,18 +15,115 @@ thread_base::~thread_base()
     wait(); // 等待线程结束
 }
 
-void thread_base::add_task(const QVariant& task_data)
+void thread_base::add_task(const QVariant& task_data, TASK_PRIORITY priority)
 {
     QMutexLocker locker(&m_mutex);
-    m_task_queue.enqueue(task_data);
+    m_task_queues[priority].enqueue({ task_data, QString() });
     m_wait_condition.wakeOne();
 }
 
+void thread_base::add_task(QVariant&& task_data, TASK_PRIORITY priority)
+{
+    QMutexLocker locker(&m_mutex);
+    m_task_queues[priority].enqueue({ std::move(task_data), QString() });
+    m_wait_condition.wakeOne();
+}
+
+QVariant thread_base::add_task_coalesced(QVariant&& task_data, const QString& coalesce_key, TASK_PRIORITY priority)
+{
+    QMutexLocker locker(&m_mutex);
+    for (st_queued_task& task : m_task_queues[priority])
+    {
+        if (task.m_coalesce_key == coalesce_key)
+        {
+            //新任务替换旧任务，队列长度不变，不需要唤醒
+            std::swap(task.m_data, task_data);
+            return std::move(task_data);
+        }
+    }
+    m_task_queues[priority].enqueue({ std::move(task_data), coalesce_key });
+    m_wait_condition.wakeOne();
+    return QVariant();
+}
+
+bool thread_base::add_task_wait(const QVariant& task_data, const std::atomic<bool>* cancel_flag, TASK_PRIORITY priority)
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_max_task_count > 0 && pending_count() >= m_max_task_count)
+    {
+        if (!m_running || (cancel_flag != nullptr && cancel_flag->load()))
+        {
+            return false;
+        }
+        //定时唤醒，以便及时响应 cancel_flag
+        m_not_full_condition.wait(&m_mutex, 50);
+    }
+    if (!m_running || (cancel_flag != nullptr && cancel_flag->load()))
+    {
+        return false;
+    }
+    m_task_queues[priority].enqueue({ task_data, QString() });
+    m_wait_condition.wakeOne();
+    return true;
+}
+
+int thread_base::pending_count() const
+{
+    int count(0);
+    for (int i = 0; i < TASK_PRIORITY_COUNT; i++)
+    {
+        count += m_task_queues[i].size();
+    }
+    return count;
+}
+
+int thread_base::task_count()
+{
+    QMutexLocker locker(&m_mutex);
+    return pending_count();
+}
+
+void thread_base::clear_tasks()
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < TASK_PRIORITY_COUNT; i++)
+    {
+        m_task_queues[i].clear();
+    }
+    m_not_full_condition.wakeAll();
+    if (!m_busy)
+    {
+        m_idle_condition.wakeAll();
+    }
+}
+
+void thread_base::wait_idle()
+{
+    QMutexLocker locker(&m_mutex);
+    while ((pending_count() > 0 || m_busy) && isRunning())
+    {
+        m_idle_condition.wait(&m_mutex, 100);
+    }
+}
+
+bool thread_base::cancel_current_task()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_busy)
+    {
+        return false;
+    }
+    m_cancel_requested.store(true);
+    return true;
+}
+
 void thread_base::stop()
 {
     QMutexLocker locker(&m_mutex);
     m_running = false;
+    m_cancel_requested.store(true);         //正在处理的长时间任务尽快返回
     m_wait_condition.wakeAll();
+    m_not_full_condition.wakeAll();
 }
 
 void thread_base::run()
@@ -36,17 +133,47 @@ void thread_base::run()
         QVariant task_data;
         {
             QMutexLocker locker(&m_mutex);
-            if (!m_running && m_task_queue.isEmpty())
+            if (!m_running && pending_count() == 0)
                 break;
 
-            if (m_task_queue.isEmpty())
-                m_wait_condition.wait(&m_mutex);
+            if (pending_count() == 0)
+            {
+                if (m_idle_interval_ms <= 0)
+                {
+                    m_wait_condition.wait(&m_mutex);
+                }
+                else if (!m_wait_condition.wait(&m_mutex, m_idle_interval_ms))
+                {
+                    //空闲超时，在锁外执行后台工作
+                    locker.unlock();
+                    on_idle();
+                    continue;
+                }
+            }
 
-            if (!m_task_queue.isEmpty())
-                task_data = m_task_queue.dequeue();
+            //高优先级队列中的任务先处理
+            int priority = 0;
+            while (priority < TASK_PRIORITY_COUNT && m_task_queues[priority].isEmpty())
+                priority++;
+            if (priority < TASK_PRIORITY_COUNT)
+                task_data = m_task_queues[priority].dequeue().m_data;
             else
                 continue;
+            m_busy = true;
+            if (m_running)
+                m_cancel_requested.store(false);
+            m_not_full_condition.wakeOne();
         }
         process_task(task_data); // 子类具体处理
+        bool is_idle(false);
+        {
+            QMutexLocker locker(&m_mutex);
+            m_busy = false;
+            is_idle = pending_count() == 0;
+            if (is_idle)
+                m_idle_condition.wakeAll();
+        }
+        if (is_idle)
+            on_idle();
     }
-}
\ No newline at end of file
+}
@@ -14,6 +14,7 @@
 #include <QWaitCondition>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <atomic>
 
 #include "../device_enum/device_enum_factory.h"
 
@@ -22,6 +23,15 @@ enum TASK_TYPE
 	TASK_TYPE_ANY = 0,                  //任意不需要状态管理的任务
 };
 
+//任务优先级，每个优先级一个队列，线程总是先处理高优先级队列中的任务，同一优先级内先进先出
+enum TASK_PRIORITY
+{
+	TASK_PRIORITY_CONTROL = 0,          //控制类任务，例如关闭相机
+	TASK_PRIORITY_INTERACTIVE = 1,      //界面操作，处理时间短
+	TASK_PRIORITY_BULK = 2,             //长时间任务，例如运行、自动标定、对焦
+	TASK_PRIORITY_COUNT
+};
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
 //线程基类
@@ -32,20 +42,66 @@ public:
     thread_base(const QString& name, QObject* parent = nullptr);
     virtual ~thread_base() override;
 
-    void add_task(const QVariant& task_data);
+    void add_task(const QVariant& task_data, TASK_PRIORITY priority = TASK_PRIORITY_INTERACTIVE);
+    void add_task(QVariant&& task_data, TASK_PRIORITY priority = TASK_PRIORITY_INTERACTIVE);   //任务消息移动入队，不拷贝
+    /***************************************
+     * 向有界队列中添加任务. 队列已满时阻塞等待，直到队列有空位、线程停止或者 cancel_flag 被置为 true
+     * 返回值: true -- 任务已加入队列 false -- 等待被中断，任务没有加入队列
+     * 注意：add_task 不受队列长度限制，用于控制类消息; 流水线中的阶段间数据传递使用该接口实现背压
+     ***************************************/
+    bool add_task_wait(const QVariant& task_data, const std::atomic<bool>* cancel_flag = nullptr,
+        TASK_PRIORITY priority = TASK_PRIORITY_INTERACTIVE);
+    /***************************************
+     * 添加可合并的任务. 同一优先级队列中已有相同 coalesce_key 且尚未处理的任务时，用新任务替换旧任务(保留排队位置)
+     * 返回值: 被替换的旧任务，调用者负责回复; 没有被替换的任务时返回无效的 QVariant
+     * 用于滑块拖动等高频参数修改，队列中同一参数只保留最新的值
+     ***************************************/
+    QVariant add_task_coalesced(QVariant&& task_data, const QString& coalesce_key, TASK_PRIORITY priority = TASK_PRIORITY_INTERACTIVE);
+    void set_max_task_count(int count) { m_max_task_count = count; }	//队列最大长度(所有优先级之和)，<=0 表示不限制
+    int task_count();													//队列中尚未处理的任务数量
+    void clear_tasks();													//丢弃队列中尚未处理的任务(正在处理的任务不受影响)
+    void wait_idle();													//等待队列为空且当前任务处理完毕，用于流水线结束时的同步
     void stop();
+
+    /***************************************
+     * 协作式取消: 请求取消当前正在处理的任务，不影响队列中尚未处理的任务
+     * 长时间任务在各个步骤之间检查 is_cancelled()，或者将 cancel_flag() 传给子模块，检查到取消之后尽快返回
+     * 每个任务开始处理时取消标识自动复位，线程空闲时的取消请求被忽略
+     * 返回值: true -- 线程正在处理任务
+     ***************************************/
+    bool cancel_current_task();
+    bool is_cancelled() const { return m_cancel_requested.load(); }
+    const std::atomic<bool>* cancel_flag() const { return &m_cancel_requested; }
 signals:
     void post_task_finished(const QVariant& task_data);
 
 protected:
     void run() override;
     virtual void process_task(const QVariant& task_data) = 0;
+    /***************************************
+     * 队列为空时调用，用于延迟执行的后台工作(例如合并之后的配置保存)
+     * set_idle_interval 设置空闲时的唤醒间隔，<=0 时只在任务处理完毕且队列为空时调用
+     ***************************************/
+    virtual void on_idle() {}
+    void set_idle_interval(int interval_ms) { m_idle_interval_ms = interval_ms; }
 
 private:
 	TYPE_SDK m_sdk_type{ SDK_DVP2 };        //使用哪个 SDK 操作相机.设备操作线程和枚举线程需要使用相同的 SDK
     QString m_name;
-    QQueue<QVariant> m_task_queue;
+    struct st_queued_task
+    {
+        QVariant m_data;
+        QString m_coalesce_key;					//非空时相同 key 的任务只保留最新的一个
+    };
+    QQueue<st_queued_task> m_task_queues[TASK_PRIORITY_COUNT];	//按优先级分开的任务队列
     QMutex m_mutex;
     QWaitCondition m_wait_condition;
+    QWaitCondition m_not_full_condition;		//队列出现空位时唤醒 add_task_wait
+    QWaitCondition m_idle_condition;			//队列为空且任务处理完毕时唤醒 wait_idle
+    int m_max_task_count{ 0 };					//队列最大长度，<=0 表示不限制
+    int m_idle_interval_ms{ 0 };				//空闲时调用 on_idle 的间隔，<=0 表示不定时唤醒
+    bool m_busy{ false };						//是否正在处理任务
+    std::atomic<bool> m_cancel_requested{ false };	//当前任务的取消标识
+    int pending_count() const;					//所有队列中的任务数量，调用者持有 m_mutex
     bool m_running;
 };
\ No newline at end of file
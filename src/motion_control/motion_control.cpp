@@ -1 +1,69 @@
-﻿#include "motion_control.h"
\ No newline at end of file
+﻿#include "motion_control.h"
+#include <chrono>
+#include <thread>
+
+motion_future motion_control::move_distance_async(int axis, int distance, int speed, int interval)
+{
+	return std::async(std::launch::async, [this, axis, distance, speed, interval]()
+	{
+		return move_distance(axis, distance, speed, interval);
+	}).share();
+}
+
+motion_future motion_control::move_position_async(int axis, int position, int speed, int interval)
+{
+	return std::async(std::launch::async, [this, axis, position, speed, interval]()
+	{
+		return move_position(axis, position, speed, interval);
+	}).share();
+}
+
+bool motion_control::wait_all(const std::vector<motion_future>& futures)
+{
+	bool ret(true);
+	for (const motion_future& future : futures)
+	{
+		if (future.valid() && !future.get())
+		{
+			ret = false;
+		}
+	}
+	return ret;
+}
+
+bool motion_control::get_axis_position(int axis, int& position)
+{
+	int x(0), y(0), z(0);
+	if (axis < 0 || axis > 2 || !get_position(x, y, z))
+	{
+		return false;
+	}
+	//与 move_position 的轴编号一致(thread_misc 中 1 为 X 轴，0 为 Y 轴)
+	position = axis == 1 ? x : (axis == 0 ? y : z);
+	return true;
+}
+
+bool motion_control::wait_axis_passing(int axis, int position, bool increasing, int timeout_ms, int& reached_position)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		if (!get_axis_position(axis, reached_position))
+		{
+			return false;
+		}
+		if (increasing ? reached_position >= position : reached_position <= position)
+		{
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+motion_future motion_control::ready_future(bool value)
+{
+	std::promise<bool> promise;
+	promise.set_value(value);
+	return promise.get_future().share();
+}
@@ -3,6 +3,12 @@
 #include "motion_control_global.h"
 
 #include <QObject>
+#include <QJsonObject>
+#include <future>
+#include <vector>
+
+//异步运动的完成标识，运动停止(到位、超时或失败)之后 get() 返回运动是否成功. 可以复制，多处等待同一次运动
+using motion_future = std::shared_future<bool>;
 
 
 //初始化运控对象时使用的参数
@@ -47,11 +53,42 @@ public:
 	*************************************************/
 	virtual bool move_position(int axis, int position, int speed, int interval = 0) = 0;
 
+	/*************************************************
+	* 非阻塞运动，参数与 move_distance/move_position 相同
+	* 返回时运动已经下发，调用者可以在轴运动期间做其他准备(例如设置相机)，再通过 motion_future 或 wait_all 等待运动结束
+	* 不同轴的运动可以同时进行; 同一个轴在上一次运动结束之前不能再次下发
+	* 默认实现在后台线程中调用阻塞接口，子类可以重写为直接下发、后台等待
+	*************************************************/
+	virtual motion_future move_distance_async(int axis, int distance, int speed, int interval = 0);
+	virtual motion_future move_position_async(int axis, int position, int speed, int interval = 0);
+
+	//等待所有运动结束，全部成功时返回 true
+	static bool wait_all(const std::vector<motion_future>& futures);
+	static motion_future ready_future(bool value);		//已完成的运动，用于参数错误等直接返回的情况
+
+	//运动和通信统计(运动次数、每次运动的请求次数、往返耗时等)，不支持的控制器返回空对象
+	virtual QJsonObject statistics() { return QJsonObject(); }
+
 	/*************************************************
 	* 获取位置
 	*************************************************/
 	virtual bool get_position(int& x, int& y,int& z) = 0;
 
+	/*************************************************
+	* 获取单个轴的位置，axis 与 move_position 相同: 1 -- X 轴  0 -- Y 轴  2 -- Z 轴
+	* 默认实现从 get_position 中取值: 1 -- x  0 -- y  2 -- z
+	*************************************************/
+	virtual bool get_axis_position(int axis, int& position);
+
+	/*************************************************
+	* 等待运动中的轴经过指定位置，用于不停止运动的拍照(飞拍)
+	* increasing        -- 运动方向. true 时等待位置 >= position，false 时等待位置 <= position
+	* timeout_ms        -- 超时时间，超时或者读取位置失败返回 false
+	* reached_position  -- 返回时读取到的位置，与 position 的差值为触发时的位置偏差
+	* 默认实现轮询 get_axis_position，子类可以重写为等待状态更新
+	*************************************************/
+	virtual bool wait_axis_passing(int axis, int position, bool increasing, int timeout_ms, int& reached_position);
+
 	/*************************************************
    * 重置位置,沿指定轴移动到负限位并设置为零点
    * 首先往前移动一小段距离，然后往后移动到限制位，再将限制位设置为零点
@@ -1,6 +1,7 @@
 ﻿#include "motion_control_plc.h"
 #include "modbus/modbus-tcp.h"
 #include "../common/common.h"
+#include <algorithm>
 
 
 motion_control_plc::~motion_control_plc()
@@ -66,6 +67,7 @@ bool motion_control_plc::open()
         modbus_free(m_modbus_ctx);
         m_modbus_ctx = nullptr;
     }
+    m_register_cache.clear();       //重新连接之后 PLC 中的寄存器值未知
     m_modbus_ctx = modbus_new_tcp(m_ip_address.c_str(), m_port);
     if (!m_modbus_ctx) 
     {
@@ -98,56 +100,151 @@ bool motion_control_plc::move_distance(int axis, int distance, int speed, int in
     {
         return false;
     }
-    if(axis == 1)
-    {
-        HD(310, speed);     //先设置速度
-        HD(304, distance);
+    //1 -- X轴   0 -- Y轴
+    st_move_trace trace;
+    int motion_id = axis == 1 ? 610 : 611;
+    bool ret = axis == 1 ? start_motion(310, speed, 304, distance, motion_id, trace) : start_motion(320, speed, 314, distance, motion_id, trace);
+    return ret && finish_motion(motion_id, trace);
+}
 
-        M(610, true);
-    	M(610);
+bool motion_control_plc::move_position(int axis, int position, int speed, int interval)
+{
+    if (axis != 0 && axis != 1)
+    {
+        return false;
     }
-    else
+    //1 -- X轴   0 -- Y轴
+    st_move_trace trace;
+    int motion_id = axis == 1 ? 1000 : 1001;
+    bool ret = axis == 1 ? start_motion(310, speed, 1000, position, motion_id, trace) : start_motion(320, speed, 1010, position, motion_id, trace);
+    return ret && finish_motion(motion_id, trace);
+}
+
+motion_future motion_control_plc::move_distance_async(int axis, int distance, int speed, int interval)
+{
+    if (axis != 0 && axis != 1)
     {
-        HD(320, speed);     //先设置速度
-        HD(314, distance);
-        M(611, true);
-        M(611);
+        return ready_future(false);
     }
-    return true;
+    //寄存器与 move_distance 相同: 1 -- X轴   0 -- Y轴
+    return axis == 1 ? start_motion_async(310, speed, 304, distance, 610) : start_motion_async(320, speed, 314, distance, 611);
 }
 
-bool motion_control_plc::move_position(int axis, int position, int speed, int interval)
+motion_future motion_control_plc::move_position_async(int axis, int position, int speed, int interval)
 {
     if (axis != 0 && axis != 1)
     {
-        return false;
+        return ready_future(false);
     }
-    if (axis == 1)   //1 -- X轴   0 -- Y轴
+    return axis == 1 ? start_motion_async(310, speed, 1000, position, 1000) : start_motion_async(320, speed, 1010, position, 1001);
+}
+
+motion_future motion_control_plc::start_motion_async(int speed_id, int speed, int target_id, int target, int motion_id)
+{
+    st_move_trace trace;
+    if (!start_motion(speed_id, speed, target_id, target, motion_id, trace))
     {
-        HD(310, speed);     //先设置速度
-        HD(1000, position);
-        M(1000, true);
-        M(1000);
+        return ready_future(false);
     }
-    else
+    //运动已经启动，后台线程等待轴停止之后复位运动标识. 寄存器访问由 m_plc_register_mutex 保护，两个轴可以同时轮询
+    return std::async(std::launch::async, [this, motion_id, trace]() mutable
     {
-        HD(320, speed);     //先设置速度
-        HD(1010, position);
-        M(1001, true);
-        M(1001);
+        return finish_motion(motion_id, trace);
+    }).share();
+}
+
+bool motion_control_plc::start_motion(int speed_id, int speed, int target_id, int target, int motion_id, st_move_trace& trace)
+{
+    trace.m_start = std::chrono::steady_clock::now();
+    //速度和目标寄存器不相邻(310/1000, 320/1010)，不能合并为一次写入. 寄存器值没有变化时 HD 不再写入，速度不变时每次运动只写目标
+    if (!HD(speed_id, speed, &trace) || !HD(target_id, target, &trace))
+    {
+        return false;
     }
-    return true;
+    return set_coil(motion_id, true, &trace);
+}
+
+bool motion_control_plc::finish_motion(int motion_id, st_move_trace& trace)
+{
+    bool ret = wait_motion_stopped(motion_id, &trace);
+    //运动标识复位之后，下一次置位时 PLC 才会再次启动运动
+    if (!set_coil(motion_id, false, &trace))
+    {
+        ret = false;
+    }
+    double move_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - trace.m_start).count();
+    std::lock_guard<std::mutex> lock(m_statistics_mutex);
+    m_move_count++;
+    m_move_round_trips += trace.m_round_trips;
+    m_move_ms += move_ms;
+    m_max_move_ms = std::max(m_max_move_ms, move_ms);
+    return ret;
 }
 
 bool motion_control_plc::get_position(int& x, int& y, int& z)
 {
+    //扫描线程正常时直接读取镜像，不访问 PLC
+    if (is_mirror_fresh(m_mirror_max_age_ms))
+    {
+        x = m_mirror.m_position[0].load();
+        y = 0;
+        z = m_mirror.m_position[1].load();
+        return true;
+    }
     std::lock_guard<std::mutex> lock(m_plc_register_mutex);
-    x = HSD(0);
+    //两个轴的位置(偏移 0 和 4)在同一段输入寄存器中，一次读取
+    uint16_t regs[6] = { 0 };
+    int rc = modbus_request(nullptr, [&]() { return modbus_read_input_registers(m_modbus_ctx, 47232, 6, regs); });
+    if (rc == -1)
+    {
+        std::string sinfo = std::string("Read input registers failed: ") + std::string(modbus_strerror(errno));
+        write_log(sinfo.c_str());
+        return false;
+    }
+    x = convert_registers_to_int(regs);
     y = 0;
-	z = HSD(4);
+    z = convert_registers_to_int(regs + 4);
+    return true;
+}
+
+bool motion_control_plc::get_axis_position(int axis, int& position)
+{
+    if (axis != 0 && axis != 1)
+    {
+        return false;
+    }
+    int x(0), y(0), z(0);
+    if (!get_position(x, y, z))
+    {
+        return false;
+    }
+    position = axis == 1 ? x : z;
     return true;
 }
 
+bool motion_control_plc::wait_axis_passing(int axis, int position, bool increasing, int timeout_ms, int& reached_position)
+{
+    if (axis != 0 && axis != 1)
+    {
+        return false;
+    }
+    //镜像中 0 -- 第一个轴(axis 1)  1 -- 第二个轴(axis 0)
+    const std::atomic<int>& mirror_position = m_mirror.m_position[axis == 1 ? 0 : 1];
+    auto passed = [&]()
+    {
+        int current = mirror_position.load();
+        return increasing ? current >= position : current <= position;
+    };
+    if (!is_mirror_fresh(m_mirror_max_age_ms))
+    {
+        write_log("wait axis passing failed, plc mirror is stale");
+        return false;
+    }
+    bool ret = wait_mirror(passed, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms));
+    reached_position = mirror_position.load();
+    return ret;
+}
+
 bool motion_control_plc::reset(int axis)
 {
     if (axis != 0)
@@ -219,105 +316,123 @@ bool motion_control_plc::send_command_to_plc(const std::string& cmd, int timeout
 
 bool motion_control_plc::M(int id, bool o)
 {
+    if (!set_coil(id, o, nullptr))
     {
-        std::lock_guard<std::mutex> lock(m_plc_register_mutex);
-        int bit = o ? 1 : 0;
-        int rc = modbus_write_bit(m_modbus_ctx, id, bit);
-        if (rc == -1)
-        {
-            std::string sinfo = std::string("Write coil failed: ") + std::string(modbus_strerror(errno));
-            write_log(sinfo.c_str());
-            return false;
-        }
+        return false;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(5));
     //如果是移动，需要阻塞，等待移动完毕才返回
     if(o)
     {
-        int axis = 0;
-        if (id == 610 || id == 1000)
-        {
-            axis = 1000;
-        }
-        else if(id == 611 || id == 1001)
-        {
-            axis = 1020;
-        }
-        else if(id == 100)  //复位时需要等两个轴都停止
-        {
-            axis = 2020;
-        }
-        if(axis == 0)
+        wait_motion_stopped(id, nullptr);
+    }
+    return true;
+}
+
+bool motion_control_plc::set_coil(int id, bool o, st_move_trace* trace)
+{
+    std::lock_guard<std::mutex> lock(m_plc_register_mutex);
+    int bit = o ? 1 : 0;
+    //modbus_write_bit 在 PLC 应答之后才返回，不需要额外延时
+    int rc = modbus_request(trace, [&]() { return modbus_write_bit(m_modbus_ctx, id, bit); });
+    if (rc == -1)
+    {
+        std::string sinfo = std::string("Write coil failed: ") + std::string(modbus_strerror(errno));
+        write_log(sinfo.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool motion_control_plc::wait_motion_stopped(int id, st_move_trace* trace)
+{
+    //镜像中的运动状态: 0 -- 第一个轴(SM 1000)  1 -- 第二个轴(SM 1020)
+    bool check[2] = { false, false };
+    if (id == 610 || id == 1000)
+    {
+        check[0] = true;
+    }
+    else if(id == 611 || id == 1001)
+    {
+        check[1] = true;
+    }
+    else if(id == 100)  //复位时需要等两个轴都停止
+    {
+        check[0] = check[1] = true;
+    }
+    if(!check[0] && !check[1])
+    {
+        return true;
+    }
+    auto is_moving = [&]()
+    {
+        return (check[0] && m_mirror.m_busy[0].load()) || (check[1] && m_mirror.m_busy[1].load());
+    };
+    auto start = std::chrono::steady_clock::now();
+    //置位之后 PLC 在下一个扫描周期才开始运动，先等待镜像中出现运动状态.
+    //目标就是当前位置时不会出现运动状态，超过 m_motion_start_timeout_ms 认为运动已经完成
+    if (!wait_mirror(is_moving, start + std::chrono::milliseconds(m_motion_start_timeout_ms)))
+    {
+        //镜像必须是置位之后扫描得到的，否则扫描线程已经无法读取 PLC，不能确认运动状态
+        if (m_mirror.m_sample_time_ns.load() < start.time_since_epoch().count())
         {
-            return true;
+            write_log(("wait motion stopped failed, plc mirror is stale: " + std::to_string(id)).c_str());
+            return false;
         }
-        auto start = std::chrono::steady_clock::now();
-	    while (true)
-	    {
-            auto now = std::chrono::steady_clock::now();
-            if (std::chrono::duration_cast<std::chrono::seconds>(now - start).count() > 10)
-            {
-	            break;
-            }
-            if(axis == 2020)
-            {
-                if (SM(axis-1000) || SM(axis - 1020))
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                    continue;
-                }
-            }
-            else
-            {
-                if (SM(axis))
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                    continue;
-                }
-            }
-            break;
-	    }
+        return true;
+    }
+    if (!wait_mirror([&]() { return !is_moving(); }, start + std::chrono::seconds(10)))
+    {
+        write_log(("wait motion stopped timeout: " + std::to_string(id)).c_str());
+        return false;
     }
     return true;
 }
 
-bool motion_control_plc::HD(int id, int value)
+bool motion_control_plc::HD(int id, int value, st_move_trace* trace)
 {
     std::lock_guard<std::mutex> lk(m_plc_register_mutex);
+    //寄存器只由本对象写入，值没有变化时不再写入(例如速度)
+    std::unordered_map<int, int>::const_iterator iter = m_register_cache.find(id);
+    if (iter != m_register_cache.end() && iter->second == value)
+    {
+        std::lock_guard<std::mutex> lock(m_statistics_mutex);
+        m_skipped_write_count++;
+        return true;
+    }
     uint16_t regs[2];
     convert_int_to_registers(value, regs);
-    int rc = modbus_write_registers(m_modbus_ctx, 41088 + id, 2, regs);
+    //modbus_write_registers 在 PLC 应答之后才返回，不需要额外延时
+    int rc = modbus_request(trace, [&]() { return modbus_write_registers(m_modbus_ctx, 41088 + id, 2, regs); });
     if (rc == -1)
     {
         std::string info = std::string("Write registers failed: ") + std::string(modbus_strerror(errno));
         write_log(info.c_str());
         return false;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    m_register_cache[id] = value;
     return true;
 }
 
 int motion_control_plc::HSD(int id)
 {
     uint16_t regs[2] = { 0 };
-    int rc = modbus_read_input_registers(m_modbus_ctx, 47232+id, 2, regs);
+    int rc = modbus_request(nullptr, [&]() { return modbus_read_input_registers(m_modbus_ctx, 47232 + id, 2, regs); });
     if (rc == -1)
     {
         std::string sinfo = std::string("Read input registers failed: ") + std::string(modbus_strerror(errno));
         write_log(sinfo.c_str());
         return 0;
     }
-    int ret = (static_cast<int>(regs[1]) << 16) | regs[0];
-    return ret;
+    return convert_registers_to_int(regs);
 }
 
-bool motion_control_plc::SM(int id)
+bool motion_control_plc::SM(int id, st_move_trace* trace)
 {
     try
     {
         std::lock_guard<std::mutex> lock(m_plc_register_mutex);
         uint8_t coil_status = 0;                                 // 存储读取结果
-        int rc = modbus_read_bits(m_modbus_ctx, 36864 + id, 1, &coil_status);
+        int rc = modbus_request(trace, [&]() { return modbus_read_bits(m_modbus_ctx, 36864 + id, 1, &coil_status); });
         if (rc == -1)
         {
             std::string sinfo = std::string("Read coil failed: ") + std::string(modbus_strerror(errno));
@@ -338,14 +453,82 @@ void motion_control_plc::convert_int_to_registers(int value, uint16_t* regs)
     regs[0] = static_cast<uint16_t>(value & 0xFFFF);         // 低位
 }
 
+int motion_control_plc::convert_registers_to_int(const uint16_t* regs)
+{
+    return (static_cast<int>(regs[1]) << 16) | regs[0];
+}
+
+int motion_control_plc::modbus_request(st_move_trace* trace, const std::function<int()>& request)
+{
+    auto start = std::chrono::steady_clock::now();
+    int rc = request();
+    double round_trip_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (trace != nullptr)
+    {
+        trace->m_round_trips++;
+    }
+    if (rc == -1)
+    {
+        //连接异常时 PLC 可能已经重启，寄存器缓存不再可信
+        m_register_cache.clear();
+    }
+    std::lock_guard<std::mutex> lock(m_statistics_mutex);
+    m_request_count++;
+    m_request_ms += round_trip_ms;
+    m_max_request_ms = std::max(m_max_request_ms, round_trip_ms);
+    if (rc == -1)
+    {
+        m_failed_request_count++;
+    }
+    return rc;
+}
+
+QJsonObject motion_control_plc::statistics()
+{
+    std::lock_guard<std::mutex> lock(m_statistics_mutex);
+    QJsonObject obj;
+    obj["move_count"] = static_cast<qint64>(m_move_count);
+    obj["average_round_trips_per_move"] = m_move_count > 0 ? static_cast<double>(m_move_round_trips) / m_move_count : 0.0;
+    obj["average_move_ms"] = m_move_count > 0 ? m_move_ms / m_move_count : 0.0;
+    obj["max_move_ms"] = m_max_move_ms;
+    obj["request_count"] = static_cast<qint64>(m_request_count);
+    obj["average_round_trip_ms"] = m_request_count > 0 ? m_request_ms / m_request_count : 0.0;
+    obj["max_round_trip_ms"] = m_max_request_ms;
+    obj["failed_request_count"] = static_cast<qint64>(m_failed_request_count);
+    obj["skipped_write_count"] = static_cast<qint64>(m_skipped_write_count);
+    unsigned long long scan_count = m_mirror.m_scan_count.load();
+    obj["scan_count"] = static_cast<qint64>(scan_count);
+    obj["failed_scan_count"] = static_cast<qint64>(m_failed_scan_count);
+    obj["average_scan_ms"] = scan_count > 0 ? m_scan_ms / scan_count : 0.0;
+    obj["max_scan_ms"] = m_max_scan_ms;
+    long long sample_time_ns = m_mirror.m_sample_time_ns.load();
+    obj["mirror_age_ms"] = sample_time_ns > 0 ?
+        static_cast<double>(std::chrono::steady_clock::now().time_since_epoch().count() - sample_time_ns) / 1000000.0 : -1.0;
+    return obj;
+}
+
 void motion_control_plc::async_read_in_thread()
 {
+    bool scan_failed = false;
 	while (true)
 	{
 		if(m_stop_thread.load())
 		{
 			break;
 		}
+        if (!scan_once())
+        {
+            //连接断开时只记录一次，并降低重试频率
+            if (!scan_failed)
+            {
+                std::string sinfo = std::string("Scan plc failed: ") + std::string(modbus_strerror(errno));
+                write_log(sinfo.c_str());
+                scan_failed = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        scan_failed = false;
         if(read_status())
         {
             std::chrono::steady_clock::time_point now = std::chrono::high_resolution_clock::now();
@@ -356,12 +539,92 @@ void motion_control_plc::async_read_in_thread()
                 emit post_device_request_start_process();
             }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(m_scan_interval_ms));
 	}
 }
 
+bool motion_control_plc::scan_once()
+{
+    auto start = std::chrono::steady_clock::now();
+    //运动状态 SM1000~SM1020 在同一段线圈中，位置在同一段输入寄存器中，启动开关 X4 与运动状态地址相距太远，单独读取.
+    //每次请求单独加锁，运动命令最多等待一次请求
+    uint8_t busy_bits[21] = { 0 };
+    uint8_t start_switch = 0;
+    uint16_t regs[6] = { 0 };
+    bool ok = false;
+    {
+        std::lock_guard<std::mutex> lock(m_plc_register_mutex);
+        ok = modbus_request(nullptr, [&]() { return modbus_read_bits(m_modbus_ctx, 36864 + 1000, 21, busy_bits); }) != -1;
+    }
+    if (ok)
+    {
+        std::lock_guard<std::mutex> lock(m_plc_register_mutex);
+        ok = modbus_request(nullptr, [&]() { return modbus_read_bits(m_modbus_ctx, 20480 + 4, 1, &start_switch); }) != -1;
+    }
+    if (ok)
+    {
+        std::lock_guard<std::mutex> lock(m_plc_register_mutex);
+        ok = modbus_request(nullptr, [&]() { return modbus_read_input_registers(m_modbus_ctx, 47232, 6, regs); }) != -1;
+    }
+    if (!ok)
+    {
+        std::lock_guard<std::mutex> lock(m_statistics_mutex);
+        m_failed_scan_count++;
+        return false;
+    }
+    //运动状态在位置之前读取，先写入位置再写入运动状态: 等待者看到轴停止时，镜像中已经是停止之后的位置
+    int position[2] = { convert_registers_to_int(regs), convert_registers_to_int(regs + 4) };
+    bool busy[2] = { busy_bits[0] != 0, busy_bits[20] != 0 };
+    bool changed = false;
+    for (int i = 0; i < 2; i++)
+    {
+        changed |= m_mirror.m_position[i].exchange(position[i]) != position[i];
+    }
+    changed |= m_mirror.m_start_switch.exchange(start_switch != 0) != (start_switch != 0);
+    for (int i = 0; i < 2; i++)
+    {
+        changed |= m_mirror.m_busy[i].exchange(busy[i]) != busy[i];
+    }
+    m_mirror.m_sample_time_ns.store(start.time_since_epoch().count());
+    m_mirror.m_scan_count.fetch_add(1);
+    if (changed)
+    {
+        //加锁之后通知，避免等待者检查条件之后、进入等待之前的通知丢失
+        {
+            std::lock_guard<std::mutex> lock(m_mirror_mutex);
+        }
+        m_mirror_cv.notify_all();
+    }
+    double scan_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::lock_guard<std::mutex> lock(m_statistics_mutex);
+    m_scan_ms += scan_ms;
+    m_max_scan_ms = std::max(m_max_scan_ms, scan_ms);
+    return true;
+}
+
+bool motion_control_plc::wait_mirror(const std::function<bool()>& predicate, std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(m_mirror_mutex);
+    return m_mirror_cv.wait_until(lock, deadline, predicate);
+}
+
+bool motion_control_plc::is_mirror_fresh(int max_age_ms) const
+{
+    long long sample_time_ns = m_mirror.m_sample_time_ns.load();
+    if (sample_time_ns == 0)
+    {
+        return false;
+    }
+    long long age_ns = std::chrono::steady_clock::now().time_since_epoch().count() - sample_time_ns;
+    return age_ns <= static_cast<long long>(max_age_ms) * 1000000;
+}
+
 bool motion_control_plc::read_status(int x)
 {
+    if (x == 4)
+    {
+        return m_mirror.m_start_switch.load();
+    }
     std::lock_guard<std::mutex> lock(m_plc_register_mutex);
     try
     {
@@ -2,6 +2,10 @@
 
 #include <mutex>
 #include <queue>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
 
 #include <asio.hpp>
 #include <asio/serial_port.hpp>
@@ -9,6 +13,20 @@
 
 #include "motion_control.h"
 
+/*************************************************
+* PLC 状态镜像
+* 扫描线程周期读取运动状态、启动开关和位置，写入镜像后通知等待者;
+* 运动完成检测、位置查询和启动触发都读取镜像，不再各自访问 PLC
+*************************************************/
+struct st_plc_mirror
+{
+    std::atomic<int> m_position[2]{};                   //0 -- 第一个轴(HSD 0)  1 -- 第二个轴(HSD 4)
+    std::atomic<bool> m_busy[2]{};                      //0 -- 第一个轴(SM 1000)  1 -- 第二个轴(SM 1020)
+    std::atomic<bool> m_start_switch{ false };          //启动开关(X4)
+    std::atomic<long long> m_sample_time_ns{ 0 };       //最近一次成功扫描的开始时间(steady_clock)，镜像中的值不早于该时间
+    std::atomic<unsigned long long> m_scan_count{ 0 };  //成功扫描次数
+};
+
 struct MOTION_CONTROL_EXPORT motion_parameter_plc : public motion_parameter
 {
     motion_parameter_plc(const std::string& ip_address, int port, const std::string& port_name, unsigned int baud_rate) :
@@ -42,28 +60,46 @@ public:
 
     virtual bool move_position(int axis, int position, int speed, int interval = 0) override;
 
+    //在调用线程中写入参数并启动运动，后台线程轮询运动状态，两个轴可以同时运动
+    virtual motion_future move_distance_async(int axis, int distance, int speed, int interval = 0) override;
+    virtual motion_future move_position_async(int axis, int position, int speed, int interval = 0) override;
+
     virtual bool get_position(int& x, int& y, int& z) override;
+    //1 -- 第一个轴(HSD 0)  0 -- 第二个轴(HSD 4)，与 move_position 相同
+    virtual bool get_axis_position(int axis, int& position) override;
+    //等待镜像中的位置经过 position，扫描线程每次刷新位置时检查，不单独访问 PLC
+    virtual bool wait_axis_passing(int axis, int position, bool increasing, int timeout_ms, int& reached_position) override;
 
     virtual bool reset(int axis) override;
 
     virtual bool set_current_position_zero(int axis) override;
 
+    virtual QJsonObject statistics() override;
+
     //向串口发送命令，设置光源,不需要阻塞、超时机制，直接发送即可
     bool send_command_to_port(const std::string& cmd);
     //向 plc 发送命令，设置运动
     bool send_command_to_plc(const std::string& cmd, int timeout = 10, std::string* reply = nullptr);
 
-    //线程函数，监视开关状态并发送消息执行检测功能
+    //扫描线程函数，周期刷新状态镜像，开关闭合时发送消息执行检测功能
     void async_read_in_thread();
-    //监视开关状态，这里参数固定为 4. 线程中运行，当开关闭合时返回1，否则返回0
+    //监视开关状态，这里参数固定为 4(从镜像读取). 当开关闭合时返回1，否则返回0
     bool read_status(int x = 4);
 private:
+    //一次运动的 modbus 请求次数和开始时间，用于统计
+    struct st_move_trace
+    {
+        int m_round_trips{ 0 };
+        std::chrono::steady_clock::time_point m_start;
+    };
+
     //运动接口.该接口负责写入参数, 不负责执行实际运动
     //id:控制运动具体参数: 
     //304--沿X轴运动一段距离 1000--运动到X轴指定位置 310--沿X轴的运动速度
     //314--沿Y轴运动一段距离 1010--运动到Y轴指定位置 320--沿Y轴的运动速度
     //value:传入的参数值，可以是距离或者速度
-    bool HD(int id, int value);
+    //与上一次写入的值相同时不再写入
+    bool HD(int id, int value, st_move_trace* trace = nullptr);
 
     //执行实际运动操作(需要将第二个变量置为true)
     //id:控制运动具体参数: 
@@ -72,15 +108,37 @@ private:
     //o: 运动标识 true--执行运动 false--可以理解成复位
     //每次运动(调用M(id,true))之后需要调用M(id,false)复位
     bool M(int id, bool o = false);
+    //写入运动标识，不等待
+    bool set_coil(int id, bool o, st_move_trace* trace);
+
+    //启动运动之后等待轴停止，超时(10秒)返回 false. id 与 M 相同
+    bool wait_motion_stopped(int id, st_move_trace* trace);
+    //写入速度和目标之后启动运动，不等待
+    bool start_motion(int speed_id, int speed, int target_id, int target, int motion_id, st_move_trace& trace);
+    //等待运动结束，复位运动标识并记录统计
+    bool finish_motion(int motion_id, st_move_trace& trace);
+    //启动运动，返回后台等待运动结束并复位的 motion_future
+    motion_future start_motion_async(int speed_id, int speed, int target_id, int target, int motion_id);
 
     //检测轴是否在运动中. id: 1000 -- 第一个轴  1020 -- 第二个轴
     //如果在运动返回true,否则返回false
-    bool SM(int id);
+    bool SM(int id, st_move_trace* trace = nullptr);
 
     //获取位置 id: 0 -- 第一个轴  4 -- 第二个轴
     int HSD(int id);
 
 	static void convert_int_to_registers(int value, uint16_t* regs);
+    static int convert_registers_to_int(const uint16_t* regs);
+
+    //扫描一次并更新镜像，值有变化时通知等待者. 读取失败返回 false
+    bool scan_once();
+    //等待镜像满足条件，超过 deadline 时返回 false
+    bool wait_mirror(const std::function<bool()>& predicate, std::chrono::steady_clock::time_point deadline);
+    //镜像是否在 max_age_ms 之内刷新过
+    bool is_mirror_fresh(int max_age_ms) const;
+
+    //执行一次 modbus 请求并记录往返耗时，调用者持有 m_plc_register_mutex. 返回 request 的返回值
+    int modbus_request(st_move_trace* trace, const std::function<int()>& request);
 
     std::string m_ip_address{ "" };
 	int m_port{ 0 };
@@ -92,8 +150,30 @@ private:
     std::unique_ptr<asio::serial_port> m_serial;
     modbus_t* m_modbus_ctx{ nullptr };
     std::mutex m_plc_register_mutex;
-
-    std::thread m_async_thread;                          //子线程，实时检测外部(硬件)消息
+    std::unordered_map<int, int> m_register_cache;      //寄存器上一次写入的值，由 m_plc_register_mutex 保护
+    int m_motion_start_timeout_ms{ 20 };                //置位之后等待出现运动状态的最长时间
+
+    std::mutex m_statistics_mutex;
+    unsigned long long m_move_count{ 0 };
+    unsigned long long m_move_round_trips{ 0 };
+    double m_move_ms{ 0.0 };
+    double m_max_move_ms{ 0.0 };
+    unsigned long long m_request_count{ 0 };
+    unsigned long long m_failed_request_count{ 0 };
+    unsigned long long m_skipped_write_count{ 0 };
+    double m_request_ms{ 0.0 };
+    double m_max_request_ms{ 0.0 };
+    double m_scan_ms{ 0.0 };
+    double m_max_scan_ms{ 0.0 };
+    unsigned long long m_failed_scan_count{ 0 };
+
+    st_plc_mirror m_mirror;
+    std::mutex m_mirror_mutex;                          //与 m_mirror_cv 配合，镜像本身无锁读取
+    std::condition_variable m_mirror_cv;
+    int m_scan_interval_ms{ 2 };                        //两次扫描之间的间隔
+    int m_mirror_max_age_ms{ 200 };                     //超过该时间没有刷新时，位置查询直接读取 PLC
+
+    std::thread m_async_thread;                          //扫描线程，刷新状态镜像并检测外部(硬件)消息
     std::chrono::steady_clock::time_point m_last_time;   //上一次硬件触发的时间
     int m_interval_time_ms{ 1000 };                      //两次硬件触发之间的时间间隔,单位ms
     std::atomic<bool> m_stop_thread{ false };     //子线程停止标识
@@ -1,6 +1,8 @@
 ﻿#include "motion_control_port.h"
 #include <asio/steady_timer.hpp>
 #include "../common/common.h"
+#include <algorithm>
+#include <cstdlib>
 
 motion_control_port::~motion_control_port()
 {
@@ -29,6 +31,7 @@ bool motion_control_port::initialize(motion_parameter* parameter)
     m_serial = std::make_unique<asio::serial_port>(*m_io);
     m_port_name = parameter_port->m_port_name;
     m_baud_rate = parameter_port->m_baud_rate;
+    m_tagged_commands = parameter_port->m_tagged_commands;
     return true;
 }
 
@@ -103,11 +106,7 @@ void motion_control_port::handle_async_read(const asio::error_code& ec, std::siz
         }
         if (msg.rfind("device_", 0) != 0)       //msg 不是以 "device_" 开头
         {
-            {
-                std::lock_guard<std::mutex> lock(m_reply_mutex);
-                m_reply_queue.push(msg);
-            }
-            m_reply_cv.notify_one();
+            dispatch_reply(msg);
         }
         else
         {
@@ -163,15 +162,16 @@ bool motion_control_port::get_position(int& x, int& y, int& z)
 {
     std::string cmd = "GetPosition";
     std::string reply("");
-    if (send_command(cmd, 10, &reply))
+    if (!send_command(cmd, 10, &reply))
     {
-        size_t pos = reply.find_first_of(' ');
-        x = atoi(reply.substr(0, pos).c_str());
-        std::string sub = reply.substr(pos + 1);
-        pos = sub.find_first_of(' ');
-        y = atoi(sub.substr(0, pos).c_str());
-        z = atoi(sub.substr(pos + 1).c_str());
+        return false;
     }
+    size_t pos = reply.find_first_of(' ');
+    x = atoi(reply.substr(0, pos).c_str());
+    std::string sub = reply.substr(pos + 1);
+    pos = sub.find_first_of(' ');
+    y = atoi(sub.substr(0, pos).c_str());
+    z = atoi(sub.substr(pos + 1).c_str());
     return true;
 }
 
@@ -224,21 +224,117 @@ bool motion_control_port::send_command(const std::string& cmd, int timeout, std:
     {
         timeout = 100;
     }
-    // 发送命令
-    asio::write(*m_serial, asio::buffer(cmd));
+    std::shared_ptr<st_pending_command> pending = std::make_shared<st_pending_command>();
+    unsigned int sequence(0);
+    auto start = std::chrono::steady_clock::now();
+    // 发送命令，不等待其他命令的回复. 序号、登记和写入在同一个写锁内完成，表中的顺序与串口上的发送顺序一致，
+    // 不带序号时回复按最早登记的命令分配才不会错位
+    try
+    {
+        std::lock_guard<std::mutex> write_lock(m_write_mutex);
+        sequence = m_next_sequence.fetch_add(1);
+        if (sequence == 0)
+        {
+            sequence = m_next_sequence.fetch_add(1);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_reply_mutex);
+            m_pending_commands[sequence] = pending;
+            m_max_in_flight = std::max(m_max_in_flight, m_pending_commands.size());
+        }
+        std::string frame = m_tagged_commands ? "#" + std::to_string(sequence) + " " + cmd : cmd;
+        asio::write(*m_serial, asio::buffer(frame));
+    }
+    catch (const std::system_error& e)
+    {
+        std::string info = std::string("send command fail: ") + cmd + " " + std::string(e.what());
+        write_log(info.c_str());
+        std::lock_guard<std::mutex> lock(m_reply_mutex);
+        m_pending_commands.erase(sequence);
+        return false;
+    }
 
     std::unique_lock<std::mutex> lock(m_reply_mutex);
-    if (m_reply_cv.wait_for(lock, std::chrono::seconds(timeout),
-        [this]() { return !m_reply_queue.empty(); }))
+    bool done = m_reply_cv.wait_for(lock, std::chrono::seconds(timeout), [&pending]() { return pending->m_done; });
+    //超时的命令也从表中删除，之后到达的回复找不到对应命令，直接丢弃
+    m_pending_commands.erase(sequence);
+    double command_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    m_command_count++;
+    m_command_ms += command_ms;
+    m_max_command_ms = std::max(m_max_command_ms, command_ms);
+    if (!done)
+    {
+        m_timeout_count++;
+        lock.unlock();
+        write_log(("send command timeout: #" + std::to_string(sequence) + " " + cmd).c_str());
+        return false; // 超时
+    }
+    if (reply != nullptr)
+    {
+        *reply = pending->m_reply;
+    }
+    return true;
+}
+
+void motion_control_port::dispatch_reply(const std::string& msg)
+{
+    std::string content = msg;
+    unsigned int sequence = 0;
+    //带序号的回复: "#序号 内容"
+    if (!msg.empty() && msg[0] == '#')
+    {
+        size_t pos = msg.find(' ');
+        sequence = static_cast<unsigned int>(strtoul(msg.substr(1, pos == std::string::npos ? std::string::npos : pos - 1).c_str(), nullptr, 10));
+        content = pos == std::string::npos ? std::string("") : msg.substr(pos + 1);
+    }
     {
-        if (reply != nullptr)
+        std::lock_guard<std::mutex> lock(m_reply_mutex);
+        std::shared_ptr<st_pending_command> pending;
+        if (sequence != 0)
         {
-            *reply = m_reply_queue.front();
+            auto iter = m_pending_commands.find(sequence);
+            if (iter != m_pending_commands.end() && !iter->second->m_done)
+            {
+                pending = iter->second;
+            }
         }
-        m_reply_queue.pop();
-        return true;
+        else
+        {
+            //设备不支持序号时按发送顺序匹配
+            for (auto& item : m_pending_commands)
+            {
+                if (!item.second->m_done)
+                {
+                    pending = item.second;
+                    break;
+                }
+            }
+        }
+        if (!pending)
+        {
+            m_discarded_reply_count++;
+            return;
+        }
+        pending->m_reply = content;
+        pending->m_done = true;
     }
-    return false; // 超时
+    //多个命令可能同时等待，每个命令检查自己的 m_done
+    m_reply_cv.notify_all();
+}
+
+QJsonObject motion_control_port::statistics()
+{
+    std::lock_guard<std::mutex> lock(m_reply_mutex);
+    QJsonObject obj;
+    obj["tagged_commands"] = m_tagged_commands;
+    obj["command_count"] = static_cast<qint64>(m_command_count);
+    obj["timeout_count"] = static_cast<qint64>(m_timeout_count);
+    obj["discarded_reply_count"] = static_cast<qint64>(m_discarded_reply_count);
+    obj["in_flight"] = static_cast<qint64>(m_pending_commands.size());
+    obj["max_in_flight"] = static_cast<qint64>(m_max_in_flight);
+    obj["average_command_ms"] = m_command_count > 0 ? m_command_ms / m_command_count : 0.0;
+    obj["max_command_ms"] = m_max_command_ms;
+    return obj;
 }
 
 bool motion_control_port::read_reply(std::string& reply, char finish_ch)
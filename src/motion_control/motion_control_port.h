@@ -4,7 +4,11 @@
 #include <string>
 #include <thread>
 #include <chrono>
-#include <queue>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include <asio.hpp>
 #include <asio/serial_port.hpp>
@@ -13,8 +17,8 @@
 
 struct MOTION_CONTROL_EXPORT motion_parameter_port : public motion_parameter
 {
-    motion_parameter_port(const std::string& port_name, unsigned int baud_rate):
-        m_port_name(port_name), m_baud_rate(baud_rate)
+    motion_parameter_port(const std::string& port_name, unsigned int baud_rate, bool tagged_commands = false):
+        m_port_name(port_name), m_baud_rate(baud_rate), m_tagged_commands(tagged_commands)
     {
 	    
     }
@@ -23,6 +27,7 @@ struct MOTION_CONTROL_EXPORT motion_parameter_port : public motion_parameter
 
     std::string m_port_name{ "" };
     unsigned int m_baud_rate{ 0 };
+    bool m_tagged_commands{ false };    //命令前加 "#序号 "，设备在回复中原样带回; false 时使用旧协议，按到达顺序匹配回复
 };
 
 class MOTION_CONTROL_EXPORT motion_control_port :public motion_control
@@ -52,10 +57,14 @@ public:
 
     virtual bool set_current_position_zero(int axis) override;
 
+    virtual QJsonObject statistics() override;
+
     /*************************************************
     * 向串口发送命令,这里会阻塞当前线程，直到接收到设备返回的完整消息(设备执行完毕)或者超时
     * 如果用户没有设置超时时间，或者设置了无效的超时时间(<=0),超时时间默认为100秒
     * 正常时间内返回 true, 表示设备执行完毕;超时后返回 false, 表示设备可能出现异常
+    * 线程安全: 多个线程可以同时发送命令，每个命令单独计时. 命令带序号时回复按序号交给对应的命令，
+    * 超时之后才到达的回复直接丢弃，不会被后面的命令误认为自己的回复
     **************************************************/
     bool send_command(const std::string& cmd, int timeout = 100, std::string* reply = nullptr);
 
@@ -84,7 +93,28 @@ private:
     std::chrono::steady_clock::time_point m_last_time;   //上一次硬件触发的时间
     int m_interval_time_ms{ 1000 };                      //两次硬件触发之间的时间间隔,单位ms
 
-    std::mutex m_reply_mutex;                           // 命令回复
+    //等待回复的命令
+    struct st_pending_command
+    {
+        std::string m_reply{ "" };
+        bool m_done{ false };
+    };
+
+    //回复交给对应的命令: "#序号 内容" 按序号查找，不带序号的回复交给最早发送且尚未回复的命令
+    void dispatch_reply(const std::string& msg);
+
+    bool m_tagged_commands{ false };
+    std::atomic<unsigned int> m_next_sequence{ 1 };    //命令序号，0 保留
+
+    std::mutex m_write_mutex;                           // 多个线程同时发送命令时串行写入串口
+    std::mutex m_reply_mutex;                           // 保护 m_pending_commands 和统计
     std::condition_variable m_reply_cv;
-    std::queue<std::string> m_reply_queue;
+    std::map<unsigned int, std::shared_ptr<st_pending_command>> m_pending_commands;    //按序号排序，第一个为最早发送的命令
+
+    unsigned long long m_command_count{ 0 };
+    unsigned long long m_timeout_count{ 0 };
+    unsigned long long m_discarded_reply_count{ 0 };   //超时之后到达或者无法匹配的回复
+    size_t m_max_in_flight{ 0 };
+    double m_command_ms{ 0.0 };
+    double m_max_command_ms{ 0.0 };
 };
\ No newline at end of file